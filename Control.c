@@ -0,0 +1,659 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Control.c
+ * Abstract:
+ *      Control socket: attach key files to ports and detach them at
+ *      runtime, list ports, dump statistics.
+ * Notes:
+ *      Unix stream socket, one command per line, every reply ends with
+ *      "ok" or "error <reason>" line:
+ *
+ *          list                    ports with key, address and state
+ *          attach FILE [PORT]      attach key file to free port
+ *          detach PORT             disconnect port and unload its key
+ *          stats [PORT]            URB counters, enumeration times
+ *          latency                 latency percentiles per port and function
+ *          handoff                 pass controller to new emulator (see Handoff.c)
+ *          help
+ *
+ *      Commands are served by control thread. URB thread is never locked:
+ *      attached key image is published with the port pointer like key
+ *      reload does it (see KeyFile.c), detached port is disconnected and
+ *      its key image and session are freed only after URB thread passes
+ *      quiescent state. Port state and counters are read from statistics
+ *      page (see Stats.h).
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "USBKeyEmu.h"
+#include "KeyFile.h"
+#include "Journal.h"
+#include "Control.h"
+#include "Handoff.h"
+#include "Latency.h"
+#include "Stats.h"
+#include "Seats.h"
+#include "Rtc.h"
+#include "PortState.h"
+#include "Log.h"
+
+#define CONTROL_MAX_CLIENTS     4
+#define CONTROL_LINE            512
+
+typedef struct _CONTROL_CLIENT {
+    int         fd;
+    size_t      used;
+    char        line [CONTROL_LINE];
+} CONTROL_CLIENT, *PCONTROL_CLIENT;
+
+typedef struct _PORT_PREPARE {
+    bool        journal;
+    uint32_t    seed;
+} PORT_PREPARE, *PPORT_PREPARE;
+
+static int              controlFd = -1;
+static char             controlPath [sizeof(((struct sockaddr_un *)0)->sun_path)];
+static ino_t            controlIno;         // socket file is removed only if it is still ours
+static int              vhciFd = -1;
+static PUSBHASP         controlPorts;
+static int              controlNumPorts;
+static bool             controlJournal;
+static uint32_t         controlSeed;
+static sem_t            *controlMutex;
+static pthread_t        controlThread;
+static bool             controlStarted = false;
+static CONTROL_CLIENT   controlClients [CONTROL_MAX_CLIENTS];
+
+/**
+ * Set up session of port attached to key file before it is served:
+ * randomness, key clock and key memory restored from journal.
+ *
+ * @param pKey - port
+ * @param context - PORT_PREPARE
+ */
+static void PortPrepare (PUSBHASP pKey, void *context) {
+        PPORT_PREPARE pPrepare = context;
+
+    KeySessionSeed (&pKey->session, pPrepare->seed);
+    RtcOpen (pKey);
+    if ( pPrepare->journal ) {
+        PortJournalOpen (pKey);
+    }
+}
+
+/**
+ * Attach key file to port and restore key memory from its journal.
+ * Port must not be connected. Port is served by URB or gadget thread
+ * only after its session is complete.
+ *
+ * @param pKey - port
+ * @param file - key file name
+ * @param journal - journal key memory writes
+ * @param seed - seed of key responses randomness, 0 for clock
+ * @return - 0 in case of success or error code. Positive values - standard runtime errno codes.
+ * Negative values - file processing/parsing errors.
+ */
+int PortAttach (PUSBHASP pKey, char *file, bool journal, uint32_t seed) {
+        PORT_PREPARE prepare = { journal, seed };
+
+    memset (&pKey->session, 0, sizeof(pKey->session));
+    return KeyFileOpen (pKey, file, PortPrepare, &prepare);
+}
+
+/**
+ * Open journal of port and restore written key memory from it. Port must
+ * not be served by URB thread.
+ *
+ * @param pKey - port
+ */
+void PortJournalOpen (PUSBHASP pKey) {
+
+    if ( pKey->pKeyFile == NULL || pKey->pJournal != NULL ) {
+        return;
+    }
+    pKey->pJournal = JournalOpen (pKey);
+    if ( pKey->pJournal != NULL ) {
+        pKey->session.writeHook = JournalWrite;
+        pKey->session.writeContext = pKey->pJournal;
+    }
+}
+
+/**
+ * Commit and close journal of port. URB thread must not write into it.
+ *
+ * @param pKey - port
+ */
+void PortJournalClose (PUSBHASP pKey) {
+
+    JournalClose (pKey->pJournal);
+    pKey->pJournal = NULL;
+    pKey->session.writeHook = NULL;
+    pKey->session.writeContext = NULL;
+}
+
+/**
+ * Commit the rest of key memory writes of port dropped by URB thread.
+ * Key image port memory is based on is still loaded.
+ *
+ * @param pKey - port
+ * @param context - not used
+ */
+static void PortRelease (PUSBHASP pKey, void *context) {
+
+    PortJournalClose (pKey);
+}
+
+/**
+ * Detach key file from port. Waits for URB thread to drop the port.
+ *
+ * @param pKey - port
+ */
+void PortDetach (PUSBHASP pKey) {
+
+    if ( pKey->pKeyFile == NULL ) {
+        return;
+    }
+    KeyFileClose (pKey, PortRelease, NULL);
+    RtcClose (pKey);
+}
+
+/**
+ * Send reply line to client. Client which doesn't read replies is dropped.
+ *
+ * @param pClient - client
+ * @param fmt - printf format
+ */
+static void ControlReply (PCONTROL_CLIENT pClient, const char *fmt, ...) {
+        char    line [CONTROL_LINE];
+        va_list ap;
+
+    if ( pClient->fd < 0 ) {
+        return;
+    }
+    va_start (ap, fmt);
+    int len = vsnprintf (line, sizeof(line)-1, fmt, ap);
+    va_end (ap);
+    if ( len < 0 ) {
+        return;
+    }
+    if ( len > (int)sizeof(line)-2 ) {
+        len = sizeof(line)-2;
+    }
+    line [len++] = '\n';
+    if ( send (pClient->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len ) {
+        close (pClient->fd);
+        pClient->fd = -1;
+    }
+}
+
+/**
+ * Latency report output into control socket
+ *
+ * @param context - client
+ * @param line - report line
+ */
+static void ControlLatencyLine (void *context, const char *line) {
+
+    ControlReply ((PCONTROL_CLIENT)context, "%s", line);
+}
+
+/**
+ * Find port by number
+ *
+ * @param text - port number
+ * @return - port or NULL
+ */
+static PUSBHASP ControlPort (const char *text) {
+        char *end;
+
+    if ( text == NULL ) {
+        return NULL;
+    }
+    long port = strtol (text, &end, 10);
+    if ( *end || port < 1 || port > controlNumPorts ) {
+        return NULL;
+    }
+    return &controlPorts [port-1];
+}
+
+/**
+ * List ports
+ *
+ * @param pClient - client
+ */
+static void ControlList (PCONTROL_CLIENT pClient) {
+        char    name [sizeof(((PKEYDATA)0)->name)];
+
+    for ( int i = 0; i < controlNumPorts; i++ ) {
+        PUSBHASP pKey = &controlPorts [i];
+        PSTATS_PORT pStats = StatsPort (pKey->port);
+        unsigned status = atomic_load_explicit (&pStats->status, memory_order_relaxed);
+        int addr = atomic_load_explicit (&pStats->addr, memory_order_relaxed);
+        char state [64];
+        snprintf (state, sizeof(state), "%s%s%s%s",
+                  status & USB_VHCI_PORT_STAT_POWER ? "powered" : "off",
+                  status & USB_VHCI_PORT_STAT_CONNECTION ? ",connected" : "",
+                  status & USB_VHCI_PORT_STAT_ENABLE ? ",enabled" : "",
+                  status & USB_VHCI_PORT_STAT_SUSPEND ? ",suspended" : "");
+        if ( pKey->pKeyFile != NULL && KeyFileName (pKey, name, sizeof(name)) ) {
+            ControlReply (pClient, "port %d key '%s' file %s addr %d state %s urbs %llu opens %llu", pKey->port,
+                          name, pKey->keyfileName, addr == 0xff ? -1 : addr, state,
+                          atomic_load_explicit (&pStats->urbs, memory_order_relaxed),
+                          atomic_load_explicit (&pStats->keyOpens, memory_order_relaxed));
+        } else {
+            ControlReply (pClient, "port %d free addr %d state %s", pKey->port, addr == 0xff ? -1 : addr, state);
+        }
+    }
+    ControlReply (pClient, "ok");
+}
+
+/**
+ * Attach key file to port
+ *
+ * @param pClient - client
+ * @param file - key file name
+ * @param port - port number, NULL for the first free port
+ */
+static void ControlAttach (PCONTROL_CLIENT pClient, char *file, const char *port) {
+        PUSBHASP pKey = NULL;
+
+    if ( file == NULL ) {
+        ControlReply (pClient, "error usage: attach FILE [PORT]");
+        return;
+    }
+    if ( port != NULL ) {
+        if ( (pKey = ControlPort (port)) == NULL ) {
+            ControlReply (pClient, "error no port %s", port);
+            return;
+        }
+        if ( pKey->pKeyFile != NULL ) {
+            ControlReply (pClient, "error port %d is busy", pKey->port);
+            return;
+        }
+    } else {
+        for ( int i = 0; i < controlNumPorts && pKey == NULL; i++ ) {
+            if ( controlPorts [i].pKeyFile == NULL ) {
+                pKey = &controlPorts [i];
+            }
+        }
+        if ( pKey == NULL ) {
+            ControlReply (pClient, "error no free port");
+            return;
+        }
+    }
+    int result = PortAttach (pKey, file, controlJournal, controlSeed);
+    if ( result ) {
+        ControlReply (pClient, "error %s", result > 0 ? strerror(result) : "can't parse key file");
+        return;
+    }
+    KeyReloadWatch ();
+    Log (LOG_INFO, "Key file %s attached to port %d.\n", file, pKey->port);
+    unsigned status = atomic_load_explicit (&StatsPort (pKey->port)->status, memory_order_relaxed);
+    if ( vhciFd < 0 ) {                     // raw gadget stays connected, serves new key at once
+        ControlReply (pClient, "port %d connected", pKey->port);
+    } else if ( status & USB_VHCI_PORT_STAT_POWER ) {
+        if ( usb_vhci_port_connect (vhciFd, pKey->port, USB_VHCI_DATA_RATE_FULL) == -1 ) {
+            Log (LOG_WARNING, "USB (usb_vhci_port_connect), port %d failed: %s.\n", pKey->port, strerror(errno));
+        }
+        ControlReply (pClient, "port %d connected", pKey->port);
+    } else {                                // control plane connects it at power on
+        ControlReply (pClient, "port %d waits for power", pKey->port);
+    }
+    ControlReply (pClient, "ok");
+}
+
+/**
+ * Disconnect port and detach its key file
+ *
+ * @param pClient - client
+ * @param port - port number
+ */
+static void ControlDetach (PCONTROL_CLIENT pClient, const char *port) {
+
+    PUSBHASP pKey = ControlPort (port);
+    if ( pKey == NULL ) {
+        ControlReply (pClient, "error usage: detach PORT");
+        return;
+    }
+    if ( pKey->pKeyFile == NULL ) {
+        ControlReply (pClient, "error port %d is free", pKey->port);
+        return;
+    }
+    unsigned status = atomic_load_explicit (&StatsPort (pKey->port)->status, memory_order_relaxed);
+    if ( vhciFd >= 0 && status & USB_VHCI_PORT_STAT_CONNECTION && usb_vhci_port_disconnect (vhciFd, pKey->port) == -1 ) {
+        Log (LOG_WARNING, "USB (usb_vhci_port_disconnect), port %d failed: %s.\n", pKey->port, strerror(errno));
+    }
+    PortDetach (pKey);
+    Log (LOG_INFO, "Port %d detached.\n", pKey->port);
+    ControlReply (pClient, "ok");
+}
+
+/**
+ * Dump counters of one port
+ *
+ * @param pClient - client
+ * @param title - port title
+ * @param pStats - port counters
+ */
+static void ControlPortStats (PCONTROL_CLIENT pClient, const char *title, PSTATS_PORT pStats) {
+
+    ControlReply (pClient, "%s urbs %llu hasp %llu usb %llu cancels %llu stalls %llu fetchErrors %llu "
+                  "givebackErrors %llu portStats %llu resets %llu keyOpens %llu", title,
+                  atomic_load_explicit (&pStats->urbs, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->haspUrbs, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->usbUrbs, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->cancels, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->stalls, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->fetchErrors, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->givebackErrors, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->portStats, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->resets, memory_order_relaxed),
+                  atomic_load_explicit (&pStats->keyOpens, memory_order_relaxed));
+    unsigned seatsMax = atomic_load_explicit (&pStats->seatsMax, memory_order_relaxed);
+    if ( seatsMax ) {                       // net key served by network key server
+        char max [16] = "unlimited";
+        if ( seatsMax != SEATS_UNLIMITED ) {
+            snprintf (max, sizeof(max), "%u", seatsMax);
+        }
+        ControlReply (pClient, "%s seats %u of %s denials %llu expiries %llu", title,
+                      atomic_load_explicit (&pStats->seatsUsed, memory_order_relaxed), max,
+                      atomic_load_explicit (&pStats->seatDenials, memory_order_relaxed),
+                      atomic_load_explicit (&pStats->leaseExpiries, memory_order_relaxed));
+    }
+    unsigned long long enumerations = atomic_load_explicit (&pStats->enumerations, memory_order_relaxed);
+    if ( enumerations ) {                   // vhci port enumerated, times of the last enumeration
+        ControlReply (pClient, "%s state %s enumerations %llu connect %u reset %u address %u request %u us", title,
+                      PortStateName (atomic_load_explicit (&pStats->portState, memory_order_relaxed)), enumerations,
+                      atomic_load_explicit (&pStats->enumTimes [0], memory_order_relaxed),
+                      atomic_load_explicit (&pStats->enumTimes [1], memory_order_relaxed),
+                      atomic_load_explicit (&pStats->enumTimes [2], memory_order_relaxed),
+                      atomic_load_explicit (&pStats->enumTimes [3], memory_order_relaxed));
+    }
+    for ( int fn = 0; fn < 256; fn++ ) {
+        unsigned long long count = atomic_load_explicit (&pStats->fn [fn], memory_order_relaxed);
+        if ( count ) {
+            ControlReply (pClient, "%s fn 0x%02x %llu", title, fn, count);
+        }
+    }
+}
+
+/**
+ * Dump counters
+ *
+ * @param pClient - client
+ * @param port - port number, NULL for all ports
+ */
+static void ControlStats (PCONTROL_CLIENT pClient, const char *port) {
+        char    title [16];
+
+    if ( port != NULL ) {
+        PUSBHASP pKey = ControlPort (port);
+        if ( pKey == NULL ) {
+            ControlReply (pClient, "error no port %s", port);
+            return;
+        }
+        snprintf (title, sizeof(title), "port %d", pKey->port);
+        ControlPortStats (pClient, title, StatsPort (pKey->port));
+    } else {
+        for ( int i = 0; i < controlNumPorts; i++ ) {
+            snprintf (title, sizeof(title), "port %d", controlPorts [i].port);
+            ControlPortStats (pClient, title, StatsPort (controlPorts [i].port));
+        }
+        ControlPortStats (pClient, "unbound", StatsPort (0));
+        ControlReply (pClient, "log dropped %llu", (unsigned long long)LogDropped ());
+    }
+    ControlReply (pClient, "ok");
+}
+
+/**
+ * Pass controller to new emulator and stop
+ *
+ * @param pClient - client, the new emulator
+ */
+static void ControlHandoff (PCONTROL_CLIENT pClient) {
+
+    if ( vhciFd < 0 ) {
+        ControlReply (pClient, "error raw gadgets can't be handed over");
+        return;
+    }
+    int result = HandoffSend (pClient->fd, vhciFd, controlPorts, controlNumPorts);
+    if ( result ) {
+        Log (LOG_WARNING, "Controller is not handed over: %s.\n", strerror(result));
+        ControlReply (pClient, "error %s", strerror(result));
+        return;
+    }
+    Log (LOG_INFO, "Controller is handed over, stopping.\n");
+    sem_post (controlMutex);
+}
+
+/**
+ * Execute command line
+ *
+ * @param pClient - client
+ * @param line - command line
+ */
+static void ControlCommand (PCONTROL_CLIENT pClient, char *line) {
+        char    *save;
+
+    char *cmd = strtok_r (line, " \t\r", &save);
+    char *arg1 = strtok_r (NULL, " \t\r", &save);
+    char *arg2 = strtok_r (NULL, " \t\r", &save);
+    if ( cmd == NULL ) {
+        return;
+    } else if ( !strcmp (cmd, "list") ) {
+        ControlList (pClient);
+    } else if ( !strcmp (cmd, "attach") ) {
+        ControlAttach (pClient, arg1, arg2);
+    } else if ( !strcmp (cmd, "detach") ) {
+        ControlDetach (pClient, arg1);
+    } else if ( !strcmp (cmd, "stats") ) {
+        ControlStats (pClient, arg1);
+    } else if ( !strcmp (cmd, "latency") ) {
+        LatencyReport (ControlLatencyLine, pClient);
+        ControlReply (pClient, "ok");
+    } else if ( !strcmp (cmd, "handoff") ) {
+        ControlHandoff (pClient);
+    } else if ( !strcmp (cmd, "help") ) {
+        ControlReply (pClient, "list | attach FILE [PORT] | detach PORT | stats [PORT] | latency | handoff | help");
+        ControlReply (pClient, "ok");
+    } else {
+        ControlReply (pClient, "error unknown command %s", cmd);
+    }
+}
+
+/**
+ * Read commands of client
+ *
+ * @param pClient - client
+ */
+static void ControlRead (PCONTROL_CLIENT pClient) {
+
+    ssize_t len = recv (pClient->fd, pClient->line + pClient->used, sizeof(pClient->line) - pClient->used - 1, MSG_DONTWAIT);
+    if ( len <= 0 ) {
+        if ( len == 0 || (errno != EAGAIN && errno != EINTR) ) {
+            close (pClient->fd);
+            pClient->fd = -1;
+        }
+        return;
+    }
+    pClient->used += len;
+    pClient->line [pClient->used] = '\0';
+    char *start = pClient->line;
+    for ( char *end; pClient->fd >= 0 && (end = strchr (start, '\n')) != NULL; start = end+1 ) {
+        *end = '\0';
+        ControlCommand (pClient, start);
+    }
+    if ( pClient->fd < 0 ) {
+        return;
+    }
+    pClient->used -= start - pClient->line;
+    memmove (pClient->line, start, pClient->used);
+    if ( pClient->used == sizeof(pClient->line)-1 ) {
+        ControlReply (pClient, "error line too long");
+        if ( pClient->fd >= 0 ) {
+            close (pClient->fd);
+            pClient->fd = -1;
+        }
+    }
+}
+
+/**
+ * Accept new client
+ */
+static void ControlAccept (void) {
+
+    int fd = accept (controlFd, NULL, NULL);
+    if ( fd < 0 ) {
+        return;
+    }
+    for ( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+        if ( controlClients [i].fd < 0 ) {
+            controlClients [i].fd = fd;
+            controlClients [i].used = 0;
+            return;
+        }
+    }
+    CONTROL_CLIENT busy = { .fd = fd };
+    ControlReply (&busy, "error too many clients");
+    if ( busy.fd >= 0 ) {
+        close (busy.fd);
+    }
+}
+
+/**
+ * Control socket thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *ControlThread (void *arg) {
+        struct pollfd pfd [1+CONTROL_MAX_CLIENTS];
+        int     value = 0;
+
+    while ( !value ) {
+        pfd [0].fd = controlFd;
+        pfd [0].events = POLLIN;
+        for ( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+            pfd [1+i].fd = controlClients [i].fd;  // negative ones are ignored
+            pfd [1+i].events = POLLIN;
+        }
+        int res = poll (pfd, 1+CONTROL_MAX_CLIENTS, 100);
+        if ( res > 0 ) {
+            for ( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+                if ( controlClients [i].fd >= 0 && pfd [1+i].revents & (POLLIN | POLLHUP | POLLERR) ) {
+                    ControlRead (&controlClients [i]);
+                }
+            }
+            if ( pfd [0].revents & POLLIN ) {
+                ControlAccept ();
+            }
+        } else if ( res < 0 && errno != EINTR ) {
+            Log (LOG_ERR, "Control socket (poll) failed: %s.\n", strerror(errno));
+            break;
+        }
+        sem_getvalue (controlMutex, &value);
+    }
+    for ( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+        if ( controlClients [i].fd >= 0 ) {
+            close (controlClients [i].fd);
+            controlClients [i].fd = -1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create control socket and start serving it
+ *
+ * @param path - socket file name
+ * @param fd - vhci file descriptor, -1 for raw gadgets
+ * @param haspKeys - ports
+ * @param numPorts - number of ports
+ * @param journal - journal key memory writes of attached keys
+ * @param seed - seed of key responses randomness of attached keys
+ * @param pmutex - threads "stop" semaphore
+ * @return - 0 in case of success or errno code
+ */
+int StartControl (const char *path, int fd, USB_HASP haspKeys[], int numPorts, bool journal, uint32_t seed, sem_t *pmutex) {
+        struct sockaddr_un addr;
+        struct stat st;
+
+    if ( strlen (path) >= sizeof(addr.sun_path) ) {
+        return ENAMETOOLONG;
+    }
+    vhciFd = fd;
+    controlPorts = haspKeys;
+    controlNumPorts = numPorts;
+    controlJournal = journal;
+    controlSeed = seed;
+    controlMutex = pmutex;
+    for ( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+        controlClients [i].fd = -1;
+    }
+    if ( lstat (path, &st) == 0 && S_ISSOCK (st.st_mode) ) {
+        unlink (path);                      // left by killed emulator
+    }
+    controlFd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( controlFd < 0 ) {
+        return errno;
+    }
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path, sizeof(addr.sun_path)-1);
+    strncpy (controlPath, path, sizeof(controlPath)-1);
+    int result = 0;
+    if ( bind (controlFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ) {
+        result = errno;
+    } else if ( chmod (path, S_IRUSR | S_IWUSR) < 0 || listen (controlFd, CONTROL_MAX_CLIENTS) < 0 ) {
+        result = errno;
+        unlink (path);
+    } else if ( (result = pthread_create (&controlThread, NULL, ControlThread, NULL)) != 0 ) {
+        unlink (path);
+    } else if ( lstat (path, &st) == 0 ) {
+        controlIno = st.st_ino;
+    }
+    if ( result ) {
+        close (controlFd);
+        controlFd = -1;
+        return result;
+    }
+    controlStarted = true;
+    Log (LOG_INFO, "Control socket %s is ready.\n", path);
+    return 0;
+}
+
+/**
+ * Wait for control thread to finish and remove the socket unless the
+ * emulator which has taken over has created its own. "Stop" semaphore
+ * must be posted.
+ */
+void StopControl (void) {
+        struct stat st;
+
+    if ( controlStarted ) {
+        pthread_join (controlThread, NULL);
+        controlStarted = false;
+    }
+    if ( controlFd >= 0 ) {
+        close (controlFd);
+        controlFd = -1;
+        if ( lstat (controlPath, &st) == 0 && st.st_ino == controlIno ) {
+            unlink (controlPath);
+        }
+    }
+}
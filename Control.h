@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Control.h
+ * Abstract:
+ *      Control socket: attach key files to ports and detach them at
+ *      runtime, list ports, dump statistics.
+ * Notes:
+ * Revision History:
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include "USBKeyEmu.h"
+
+#define CONTROL_SOCKET      "/run/usbhasp.sock"
+
+int  PortAttach (PUSBHASP pKey, char *file, bool journal, uint32_t seed);
+void PortDetach (PUSBHASP pKey);
+void PortJournalOpen (PUSBHASP pKey);
+void PortJournalClose (PUSBHASP pKey);
+int  StartControl (const char *path, int fd, USB_HASP haspKeys[], int numPorts, bool journal, uint32_t seed, sem_t *pmutex);
+void StopControl (void);
+
+#endif  // CONTROL_H
@@ -16,10 +16,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/time.h>
-#include "libusb_vhci.h"
-#include "USBKeyEmu.h"
+#include <stdint.h>
+#include "EncDecSim.h"
 
-static uint32_t factLFSRArray[] = {
+static const uint32_t factLFSRArray[] = {
     0x480, // 10, 7         10010000000
     0x4A0, // 10, 7, 5      10010100000
     0x580, // 10, 8, 7      10110000000
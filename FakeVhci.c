@@ -0,0 +1,1272 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     FakeVhci.c
+ * Abstract:
+ *      User space stand-in of libusb_vhci and vhci_hcd. Runs the unmodified
+ *      emulator loop without the kernel module, driven by a work script.
+ * Notes:
+ *      Built as libfakevhci.so. Preload it into usbhasp linked with shared
+ *      libusb_vhci, or link usbhasp with it instead of -lusb_vhci:
+ *
+ *          USBHASP_FAKE_SCRIPT=bench.vhci LD_PRELOAD=libfakevhci.so usbhasp -d key.json
+ *
+ *      USBHASP_FAKE_SCRIPT names the script, USBHASP_FAKE_BUS the bus number
+ *      reported by usb_vhci_open. Without script every port is powered on and
+ *      enumerated with its number as address, then the bus idles.
+ *
+ *      Controller handed over by another emulator (usbhasp -U) is adopted
+ *      by the first call with its fd when USBHASP_FAKE_PORTS gives the
+ *      number of its ports. Script of the new emulator starts with plugged
+ *      commands for ports the old one has enumerated.
+ *
+ *      Script is read once at usb_vhci_open. One command per line, numbers
+ *      are C notation, # starts a comment:
+ *
+ *          power PORT on|off       port power switched by hub
+ *          reset PORT              hub resets port
+ *          suspend PORT            hub suspends port
+ *          resume PORT             hub resumes port
+ *          address PORT ADDR       SET_ADDRESS
+ *          descriptor PORT TYPE INDEX LENGTH
+ *                                  GET_DESCRIPTOR
+ *          configure PORT VALUE    SET_CONFIGURATION
+ *          hasp PORT FN VALUE INDEX LENGTH
+ *                                  HASP request (bmRequestType 0xc0)
+ *          urb PORT TYPE EPADR RT REQUEST VALUE INDEX LENGTH
+ *                                  any URB
+ *          cancel PORT             OUT URB canceled while data is fetched
+ *          unlink PORT FN VALUE INDEX LENGTH
+ *                                  HASP request canceled by host right after
+ *                                  it is fetched, giving it back is an error
+ *          flood PORT DEPTH FN VALUE INDEX LENGTH
+ *                                  another client keeps DEPTH HASP requests
+ *                                  in flight on port, DEPTH 0 stops it
+ *          enumerate PORT ADDR     reset, address, descriptors, configure
+ *          plugged PORT ADDR       port is enumerated already, no port stat work
+ *          expect ok|stall [LENGTH]
+ *                                  check status and length of the last URB
+ *          repeat COUNT ... end    repeat commands, may be nested
+ *          wait MS                 idle fetch for MS milliseconds, flood
+ *                                  goes on meanwhile
+ *          report                  print counters to stderr
+ *          stop                    stop the emulator with SIGINT
+ *
+ *      Work is generated by fetch_work as it's asked for, one URB of the
+ *      script at a time: the next command runs when the URB is given back
+ *      or the emulator waits for work again, which means it has dropped the
+ *      URB. fetch_work_timeout with timeout 0 is polling of the emulator
+ *      that has URBs queued, it never waits. Flood URBs are submitted as soon as one of them is
+ *      given back, in flight URBs are handed out oldest first like the
+ *      driver does, so requests of the script wait behind the flood unless
+ *      the emulator reorders them. Port stat work follows the driver:
+ *      port_connect, port_reset_done and port_resumed called by emulator
+ *      report connection, enable and resume changes back. Like the hub,
+ *      commands of a port wait up to FAKE_SETTLE_MS for the emulator to
+ *      connect the port powered on and to complete its reset and resume.
+ *      URBs are sent to the address the port has got with the last
+ *      successful SET_ADDRESS, default address 0 after reset.
+ *
+ *      Counters, URB rate and latency of every port from submit to giveback
+ *      are printed to stderr at usb_vhci_close, run the emulator in
+ *      foreground to see them. End of script is stop.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <libusb_vhci.h>
+
+#define FAKE_MAX_PORTS      32
+#define FAKE_MAX_COMMANDS   4096
+#define FAKE_MAX_NESTING    8
+#define FAKE_MAX_STATS      64
+#define FAKE_IDLE_MS        100         // fetch_work timeout of vhci_hcd
+#define FAKE_SETTLE_MS      100         // hub waits for connect, reset and resume of port
+#define FAKE_SETTLE_POLL    20000       // ns between checks of settling port
+#define FAKE_MAX_FLOOD      64          // flood URBs in flight
+#define FAKE_SUB_BITS       4           // latency histogram like Latency.c
+#define FAKE_MAX_BITS       31
+#define FAKE_BUCKETS        ((FAKE_MAX_BITS-FAKE_SUB_BITS+2) << FAKE_SUB_BITS)
+
+typedef enum _FAKE_OP {
+    FAKE_OP_POWER, FAKE_OP_RESET, FAKE_OP_SUSPEND, FAKE_OP_RESUME, FAKE_OP_URB,
+    FAKE_OP_CANCEL, FAKE_OP_EXPECT, FAKE_OP_REPEAT, FAKE_OP_END, FAKE_OP_WAIT,
+    FAKE_OP_REPORT, FAKE_OP_STOP, FAKE_OP_PLUGGED, FAKE_OP_FLOOD, FAKE_OP_UNLINK
+} FAKE_OP;
+
+typedef struct _FAKE_COMMAND {
+    FAKE_OP         op;
+    int             line;
+    uint8_t         port;
+    long            arg;            // power on, expected status, count, ms, end of repeat, depth
+    long            length;         // expected length, -1 if any
+    uint8_t         type;           // URB
+    uint8_t         epadr;
+    uint8_t         bmRequestType;
+    uint8_t         bRequest;
+    uint16_t        wValue;
+    uint16_t        wIndex;
+    uint16_t        wLength;
+} FAKE_COMMAND, *PFAKE_COMMAND;
+
+typedef struct _FAKE_PORT {
+    uint16_t        status;
+    uint8_t         flags;
+    uint8_t         addr;
+    uint8_t         pendingAddr;    // SET_ADDRESS in flight
+    uint64_t        settleUntil;    // hub gives up waiting for port
+    PFAKE_COMMAND   pFlood;         // flood command
+    int             floodDepth;
+    int             floodInFlight;
+    unsigned long   urbs;           // given back
+    uint64_t        latencyMax;
+    uint32_t        latency [FAKE_BUCKETS];     // submit to giveback
+} FAKE_PORT;
+
+typedef struct _FAKE_FLOOD {
+    struct usb_vhci_urb urb;        // handle 0 - free
+    uint8_t         port;
+    bool            fetched;
+    uint64_t        submitTime, fetchTime;
+} FAKE_FLOOD, *PFAKE_FLOOD;
+
+typedef struct _FAKE_LOOP {
+    int             start;          // first command of loop body
+    long            left;
+} FAKE_LOOP;
+
+static int              fakeFd = -1;
+static int              fakeNumPorts;
+static FAKE_PORT        fakePorts [FAKE_MAX_PORTS+1];
+static FAKE_COMMAND     fakeCommands [FAKE_MAX_COMMANDS];
+static int              fakeNumCommands;
+static int              fakePc;
+static FAKE_LOOP        fakeLoops [FAKE_MAX_NESTING];
+static int              fakeLoopDepth;
+static struct usb_vhci_port_stat fakeStats [FAKE_MAX_STATS];
+static int              fakeStatHead, fakeStatTail;
+static struct usb_vhci_urb fakeUrb;  // URB handed out and not given back yet
+static uint8_t          fakeUrbPort;
+static bool             fakeUrbOut;
+static bool             fakeUrbCanceled;
+static bool             fakeUrbUnlink;  // host cancels URB once it is fetched
+static bool             fakeUrbFetched;
+static uint64_t         fakeUrbSubmit;
+static FAKE_FLOOD       fakeFlood [FAKE_MAX_FLOOD];
+static int              fakeFloods;     // flood URBs in flight
+static uint64_t         fakeWaitUntil;  // script waits while flood goes on
+static bool             fakeCancelWork;
+static uint64_t         fakeHandle;
+static int32_t          fakeLastStatus = -1;
+static int32_t          fakeLastActual;
+static bool             fakeStopped;
+static uint64_t         fakeFetchTime, fakeFirstTime, fakeLastTime, fakeBusyTime;
+static unsigned long    fakeUrbs, fakeHaspUrbs, fakeStalls, fakeCanceled, fakeLost, fakePortStats,
+                        fakeErrors, fakeFailed;
+
+/**
+ * Monotonic time
+ *
+ * @return - time, ns
+ */
+static uint64_t FakeNow (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Record latency of URB given back
+ *
+ * @param port - port number
+ * @param ns - submit to giveback, ns
+ */
+static void FakeLatency (uint8_t port, uint64_t ns) {
+        int bucket;
+
+    if ( ns < (1 << FAKE_SUB_BITS) ) {
+        bucket = ns;
+    } else {
+        int msb = 63 - __builtin_clzll (ns);
+        bucket = msb > FAKE_MAX_BITS ? FAKE_BUCKETS-1 :
+                 (msb-FAKE_SUB_BITS+1) << FAKE_SUB_BITS | (int)((ns >> (msb-FAKE_SUB_BITS)) & ((1 << FAKE_SUB_BITS)-1));
+    }
+    fakePorts [port].latency [bucket]++;
+    fakePorts [port].urbs++;
+    if ( ns > fakePorts [port].latencyMax ) {
+        fakePorts [port].latencyMax = ns;
+    }
+}
+
+/**
+ * Latency of port at percentile
+ *
+ * @param port - port number
+ * @param percentile - percentile
+ * @return - upper bound of bucket, ns
+ */
+static uint64_t FakePercentile (uint8_t port, double percentile) {
+        unsigned long count = 0;
+
+    unsigned long rank = (unsigned long)(fakePorts [port].urbs * percentile / 100.0 + 0.5);
+    for ( int i = 0; i < FAKE_BUCKETS; i++ ) {
+        count += fakePorts [port].latency [i];
+        if ( count >= rank && count ) {
+            uint64_t value = i < (1 << FAKE_SUB_BITS) ? (uint64_t)i :
+                             ((uint64_t)((1 << FAKE_SUB_BITS) + (i & ((1 << FAKE_SUB_BITS)-1))) << ((i >> FAKE_SUB_BITS)-1));
+            return value < fakePorts [port].latencyMax ? value : fakePorts [port].latencyMax;
+        }
+    }
+    return fakePorts [port].latencyMax;
+}
+
+/**
+ * Print counters
+ *
+ * @param title - report title
+ */
+static void FakeReport (const char *title) {
+
+    double seconds = fakeLastTime > fakeFirstTime ? (fakeLastTime - fakeFirstTime) / 1e9 : 0;
+    fprintf (stderr, "fake vhci %s: %lu URBs (%lu HASP, %lu stalled, %lu canceled, %lu not given back), "
+                     "%lu port stats, %lu errors, %lu failed expectations\n",
+             title, fakeUrbs, fakeHaspUrbs, fakeStalls, fakeCanceled, fakeLost, fakePortStats, fakeErrors, fakeFailed);
+    if ( fakeUrbs && seconds > 0 ) {
+        fprintf (stderr, "fake vhci %s: %.3f s, %.0f URB/s, %.1f ns/URB in emulator\n",
+                 title, seconds, fakeUrbs / seconds, (double)fakeBusyTime / fakeUrbs);
+    }
+    for ( int port = 1; port <= fakeNumPorts; port++ ) {
+        if ( fakePorts [port].urbs ) {
+            fprintf (stderr, "fake vhci %s: port %d %lu URBs, submit to giveback p50 %.1f p99 %.1f p999 %.1f max %.1f us\n",
+                     title, port, fakePorts [port].urbs, FakePercentile (port, 50) / 1000.0, FakePercentile (port, 99) / 1000.0,
+                     FakePercentile (port, 99.9) / 1000.0, fakePorts [port].latencyMax / 1000.0);
+        }
+    }
+}
+
+/**
+ * Append command
+ *
+ * @param line - script line
+ * @return - new command or NULL if there are too many
+ */
+static PFAKE_COMMAND FakeAdd (int line) {
+
+    if ( fakeNumCommands >= FAKE_MAX_COMMANDS ) {
+        fprintf (stderr, "fake vhci: line %d: too many commands\n", line);
+        return NULL;
+    }
+    PFAKE_COMMAND pCmd = &fakeCommands [fakeNumCommands++];
+    memset (pCmd, 0, sizeof(*pCmd));
+    pCmd->line = line;
+    pCmd->length = -1;
+    return pCmd;
+}
+
+/**
+ * Append control URB
+ *
+ * @param line - script line
+ * @param port - port number
+ * @param rt, request, value, index, length - setup packet
+ * @return - 0 in case of success or EINVAL
+ */
+static int FakeAddUrb (int line, uint8_t port, uint8_t rt, uint8_t request, uint16_t value, uint16_t index, uint16_t length) {
+
+    PFAKE_COMMAND pCmd = FakeAdd (line);
+    if ( pCmd == NULL ) {
+        return EINVAL;
+    }
+    pCmd->op = FAKE_OP_URB;
+    pCmd->port = port;
+    pCmd->type = USB_VHCI_URB_TYPE_CONTROL;
+    pCmd->epadr = rt & 0x80;
+    pCmd->bmRequestType = rt;
+    pCmd->bRequest = request;
+    pCmd->wValue = value;
+    pCmd->wIndex = index;
+    pCmd->wLength = length;
+    return 0;
+}
+
+/**
+ * Append port command
+ *
+ * @param line - script line
+ * @param op - command
+ * @param port - port number
+ * @param arg - argument of command
+ * @return - 0 in case of success or EINVAL
+ */
+static int FakeAddPort (int line, FAKE_OP op, uint8_t port, long arg) {
+
+    PFAKE_COMMAND pCmd = FakeAdd (line);
+    if ( pCmd == NULL ) {
+        return EINVAL;
+    }
+    pCmd->op = op;
+    pCmd->port = port;
+    pCmd->arg = arg;
+    return 0;
+}
+
+/**
+ * Append enumeration of a port: the requests Linux sends to a new full
+ * speed device.
+ *
+ * @param line - script line
+ * @param port - port number
+ * @param addr - address to set
+ * @return - 0 in case of success or EINVAL
+ */
+static int FakeAddEnumerate (int line, uint8_t port, uint8_t addr) {
+
+    if ( FakeAddPort (line, FAKE_OP_RESET, port, 0) ||
+         FakeAddUrb (line, port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0100, 0, 64) ||
+         FakeAddPort (line, FAKE_OP_RESET, port, 0) ||
+         FakeAddUrb (line, port, 0x00, URB_RQ_SET_ADDRESS, addr, 0, 0) ||
+         FakeAddUrb (line, port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0100, 0, 18) ||
+         FakeAddUrb (line, port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0200, 0, 9) ||
+         FakeAddUrb (line, port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0200, 0, 255) ||
+         FakeAddUrb (line, port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0300, 0, 255) ||
+         FakeAddUrb (line, port, 0x80, URB_RQ_GET_DESCRIPTOR, 0x0301, 0x0409, 255) ||
+         FakeAddUrb (line, port, 0x00, URB_RQ_SET_CONFIGURATION, 1, 0, 0) ) {
+        return EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Parse number of a command
+ *
+ * @param text - token
+ * @param pValue - [out] value
+ * @return - true if token is a number
+ */
+static bool FakeNumber (const char *text, long *pValue) {
+        char *end;
+
+    if ( text == NULL ) {
+        return false;
+    }
+    *pValue = strtol (text, &end, 0);
+    return *text && !*end;
+}
+
+/**
+ * Parse script line
+ *
+ * @param line - line number
+ * @param text - line
+ * @return - 0 in case of success or EINVAL
+ */
+static int FakeParseLine (int line, char *text) {
+        char *tokens [10], *save;
+        long v [9];
+        int n = 0;
+
+    char *comment = strchr (text, '#');
+    if ( comment != NULL ) {
+        *comment = 0;
+    }
+    for ( char *token = strtok_r (text, " \t\r\n", &save); token != NULL && n < 10; token = strtok_r (NULL, " \t\r\n", &save) ) {
+        tokens [n++] = token;
+    }
+    if ( !n ) {
+        return 0;
+    }
+    for ( int i = 1; i < n; i++ ) {         // numbers where they are
+        if ( !FakeNumber (tokens [i], &v [i-1]) ) {
+            v [i-1] = -1;
+        }
+    }
+    const char *cmd = tokens [0];
+    bool portOk = n > 1 && v [0] >= 1 && v [0] <= fakeNumPorts;
+    if ( !strcmp (cmd, "power") && n == 3 && portOk && (!strcmp (tokens [2], "on") || !strcmp (tokens [2], "off")) ) {
+        return FakeAddPort (line, FAKE_OP_POWER, v [0], !strcmp (tokens [2], "on"));
+    } else if ( !strcmp (cmd, "reset") && n == 2 && portOk ) {
+        return FakeAddPort (line, FAKE_OP_RESET, v [0], 0);
+    } else if ( !strcmp (cmd, "suspend") && n == 2 && portOk ) {
+        return FakeAddPort (line, FAKE_OP_SUSPEND, v [0], 0);
+    } else if ( !strcmp (cmd, "resume") && n == 2 && portOk ) {
+        return FakeAddPort (line, FAKE_OP_RESUME, v [0], 0);
+    } else if ( !strcmp (cmd, "cancel") && n == 2 && portOk ) {
+        return FakeAddPort (line, FAKE_OP_CANCEL, v [0], 0);
+    } else if ( !strcmp (cmd, "address") && n == 3 && portOk && v [1] >= 0 && v [1] <= 0xffff ) {
+        return FakeAddUrb (line, v [0], 0x00, URB_RQ_SET_ADDRESS, v [1], 0, 0);
+    } else if ( !strcmp (cmd, "descriptor") && n == 5 && portOk && v [1] >= 0 && v [1] <= 0xff &&
+                v [2] >= 0 && v [2] <= 0xff && v [3] >= 0 && v [3] <= 0xffff ) {
+        return FakeAddUrb (line, v [0], 0x80, URB_RQ_GET_DESCRIPTOR, v [1] << 8 | v [2], 0, v [3]);
+    } else if ( !strcmp (cmd, "configure") && n == 3 && portOk && v [1] >= 0 && v [1] <= 0xff ) {
+        return FakeAddUrb (line, v [0], 0x00, URB_RQ_SET_CONFIGURATION, v [1], 0, 0);
+    } else if ( !strcmp (cmd, "hasp") && n == 6 && portOk && v [1] >= 0 && v [1] <= 0xff &&
+                v [2] >= 0 && v [2] <= 0xffff && v [3] >= 0 && v [3] <= 0xffff && v [4] >= 0 && v [4] <= 0xffff ) {
+        return FakeAddUrb (line, v [0], 0xc0, v [1], v [2], v [3], v [4]);
+    } else if ( !strcmp (cmd, "urb") && n == 9 && portOk && v [1] >= 0 && v [1] <= 3 &&
+                v [2] >= 0 && v [2] <= 0xff && v [3] >= 0 && v [3] <= 0xff && v [4] >= 0 && v [4] <= 0xff &&
+                v [5] >= 0 && v [5] <= 0xffff && v [6] >= 0 && v [6] <= 0xffff && v [7] >= 0 && v [7] <= 0xffff ) {
+        if ( FakeAddUrb (line, v [0], v [3], v [4], v [5], v [6], v [7]) ) {
+            return EINVAL;
+        }
+        fakeCommands [fakeNumCommands-1].type = v [1];
+        fakeCommands [fakeNumCommands-1].epadr = v [2];
+        return 0;
+    } else if ( !strcmp (cmd, "flood") && n == 7 && portOk && v [1] >= 0 && v [1] <= FAKE_MAX_FLOOD &&
+                v [2] >= 0 && v [2] <= 0xff && v [3] >= 0 && v [3] <= 0xffff && v [4] >= 0 && v [4] <= 0xffff &&
+                v [5] >= 0 && v [5] <= 0xffff ) {
+        if ( FakeAddUrb (line, v [0], 0xc0, v [2], v [3], v [4], v [5]) ) {
+            return EINVAL;
+        }
+        fakeCommands [fakeNumCommands-1].op = FAKE_OP_FLOOD;
+        fakeCommands [fakeNumCommands-1].arg = v [1];
+        return 0;
+    } else if ( !strcmp (cmd, "unlink") && n == 6 && portOk && v [1] >= 0 && v [1] <= 0xff &&
+                v [2] >= 0 && v [2] <= 0xffff && v [3] >= 0 && v [3] <= 0xffff && v [4] >= 0 && v [4] <= 0xffff ) {
+        if ( FakeAddUrb (line, v [0], 0xc0, v [1], v [2], v [3], v [4]) ) {
+            return EINVAL;
+        }
+        fakeCommands [fakeNumCommands-1].op = FAKE_OP_UNLINK;
+        return 0;
+    } else if ( !strcmp (cmd, "enumerate") && n == 3 && portOk && v [1] >= 1 && v [1] <= 0x7f ) {
+        return FakeAddEnumerate (line, v [0], v [1]);
+    } else if ( !strcmp (cmd, "plugged") && n == 3 && portOk && v [1] >= 0 && v [1] <= 0x7f ) {
+        return FakeAddPort (line, FAKE_OP_PLUGGED, v [0], v [1]);
+    } else if ( !strcmp (cmd, "expect") && (n == 2 || (n == 3 && v [1] >= 0)) &&
+                (!strcmp (tokens [1], "ok") || !strcmp (tokens [1], "stall")) ) {
+        if ( FakeAddPort (line, FAKE_OP_EXPECT, 0,
+                          !strcmp (tokens [1], "ok") ? USB_VHCI_STATUS_SUCCESS : USB_VHCI_STATUS_STALL) ) {
+            return EINVAL;
+        }
+        fakeCommands [fakeNumCommands-1].length = n == 3 ? v [1] : -1;
+        return 0;
+    } else if ( !strcmp (cmd, "repeat") && n == 2 && v [0] >= 0 ) {
+        return FakeAddPort (line, FAKE_OP_REPEAT, 0, v [0]);
+    } else if ( !strcmp (cmd, "end") && n == 1 ) {
+        return FakeAddPort (line, FAKE_OP_END, 0, 0);
+    } else if ( !strcmp (cmd, "wait") && n == 2 && v [0] >= 0 ) {
+        return FakeAddPort (line, FAKE_OP_WAIT, 0, v [0]);
+    } else if ( !strcmp (cmd, "report") && n == 1 ) {
+        return FakeAddPort (line, FAKE_OP_REPORT, 0, 0);
+    } else if ( !strcmp (cmd, "stop") && n == 1 ) {
+        return FakeAddPort (line, FAKE_OP_STOP, 0, 0);
+    }
+    fprintf (stderr, "fake vhci: line %d: bad command '%s'\n", line, cmd);
+    return EINVAL;
+}
+
+/**
+ * Load script or build the default one
+ *
+ * @param file - script file name or NULL
+ * @return - 0 in case of success or errno code
+ */
+static int FakeLoad (const char *file) {
+        char text [256];
+        int loops [FAKE_MAX_NESTING];
+        int depth = 0;
+        int line = 0;
+        int result = 0;
+
+    fakeNumCommands = 0;
+    if ( file == NULL ) {
+        for ( int port = 1; port <= fakeNumPorts && !result; port++ ) {
+            result = FakeAddPort (0, FAKE_OP_POWER, port, 1);
+        }
+        for ( int port = 1; port <= fakeNumPorts && !result; port++ ) {
+            result = FakeAddEnumerate (0, port, port);
+        }
+        return result;
+    }
+    FILE *f = fopen (file, "r");
+    if ( f == NULL ) {
+        result = errno;
+        fprintf (stderr, "fake vhci: can't open %s: %s\n", file, strerror(result));
+        return result;
+    }
+    while ( !result && fgets (text, sizeof(text), f) != NULL ) {
+        result = FakeParseLine (++line, text);
+        if ( result || !fakeNumCommands ) {
+            continue;
+        }
+        PFAKE_COMMAND pCmd = &fakeCommands [fakeNumCommands-1];
+        if ( pCmd->line != line ) {
+            continue;
+        }
+        if ( pCmd->op == FAKE_OP_REPEAT ) {
+            if ( depth == FAKE_MAX_NESTING ) {
+                fprintf (stderr, "fake vhci: line %d: repeat is nested too deep\n", line);
+                result = EINVAL;
+            } else {
+                loops [depth++] = fakeNumCommands-1;
+            }
+        } else if ( pCmd->op == FAKE_OP_END ) {
+            if ( !depth ) {
+                fprintf (stderr, "fake vhci: line %d: end without repeat\n", line);
+                result = EINVAL;
+            } else {
+                --depth;
+                pCmd->arg = loops [depth];              // end jumps back to repeat,
+                fakeCommands [loops [depth]].length = fakeNumCommands;    // repeat 0 jumps past end
+            }
+        }
+    }
+    fclose (f);
+    if ( !result && depth ) {
+        fprintf (stderr, "fake vhci: %s: repeat without end\n", file);
+        result = EINVAL;
+    }
+    return result;
+}
+
+/**
+ * Queue port stat work
+ *
+ * @param port - port number
+ * @param change - changed status bits
+ */
+static void FakePortStat (uint8_t port, uint16_t change) {
+
+    int next = (fakeStatTail + 1) % FAKE_MAX_STATS;
+    if ( next == fakeStatHead ) {           // driver merges changes, the emulator keeps up anyway
+        fakeErrors++;
+        return;
+    }
+    fakeStats [fakeStatTail].status = fakePorts [port].status;
+    fakeStats [fakeStatTail].change = change;
+    fakeStats [fakeStatTail].index = port;
+    fakeStats [fakeStatTail].flags = fakePorts [port].flags;
+    fakeStatTail = next;
+}
+
+/**
+ * Submit URB of a command
+ *
+ * @param pCmd - URB or cancel command
+ */
+static void FakeUrb (PFAKE_COMMAND pCmd) {
+
+    if ( fakeUrb.handle && fakeUrb.status == USB_VHCI_STATUS_PENDING ) {
+        fakeLost++;                         // dropped by emulator, e.g. unknown address
+    }
+    memset (&fakeUrb, 0, sizeof(fakeUrb));
+    fakeUrb.handle = ++fakeHandle;
+    fakeUrb.type = pCmd->type;
+    fakeUrb.epadr = pCmd->epadr;
+    fakeUrb.devadr = fakePorts [pCmd->port].addr;
+    fakeUrb.bmRequestType = pCmd->bmRequestType;
+    fakeUrb.bRequest = pCmd->bRequest;
+    fakeUrb.wValue = pCmd->wValue;
+    fakeUrb.wIndex = pCmd->wIndex;
+    fakeUrb.wLength = pCmd->wLength;
+    fakeUrb.buffer_length = pCmd->wLength;
+    fakeUrb.status = USB_VHCI_STATUS_PENDING;
+    fakeUrbPort = pCmd->port;
+    fakeUrbOut = usb_vhci_is_control (pCmd->type) ? !(pCmd->bmRequestType & 0x80) : usb_vhci_is_out (pCmd->epadr);
+    fakeUrbCanceled = pCmd->op == FAKE_OP_CANCEL;
+    fakeUrbUnlink = pCmd->op == FAKE_OP_UNLINK;
+    if ( fakeUrb.type == USB_VHCI_URB_TYPE_CONTROL && !fakeUrb.bmRequestType && fakeUrb.bRequest == URB_RQ_SET_ADDRESS ) {
+        fakePorts [pCmd->port].pendingAddr = (uint8_t)fakeUrb.wValue;
+    }
+    fakeUrbFetched = false;
+    fakeUrbSubmit = FakeNow ();
+}
+
+/**
+ * Submit flood URBs of port till its depth is in flight
+ *
+ * @param port - port number
+ */
+static void FakeFloodFill (uint8_t port) {
+        FAKE_PORT *pPort = &fakePorts [port];
+
+    for ( int i = 0; i < FAKE_MAX_FLOOD && pPort->floodInFlight < pPort->floodDepth; i++ ) {
+        PFAKE_FLOOD pFlood = &fakeFlood [i];
+        if ( pFlood->urb.handle ) {
+            continue;
+        }
+        memset (pFlood, 0, sizeof(*pFlood));
+        pFlood->urb.handle = ++fakeHandle;
+        pFlood->urb.type = pPort->pFlood->type;
+        pFlood->urb.epadr = pPort->pFlood->epadr;
+        pFlood->urb.devadr = pPort->addr;
+        pFlood->urb.bmRequestType = pPort->pFlood->bmRequestType;
+        pFlood->urb.bRequest = pPort->pFlood->bRequest;
+        pFlood->urb.wValue = pPort->pFlood->wValue;
+        pFlood->urb.wIndex = pPort->pFlood->wIndex;
+        pFlood->urb.wLength = pPort->pFlood->wLength;
+        pFlood->urb.buffer_length = pPort->pFlood->wLength;
+        pFlood->urb.status = USB_VHCI_STATUS_PENDING;
+        pFlood->port = port;
+        pFlood->submitTime = FakeNow ();
+        pPort->floodInFlight++;
+        fakeFloods++;
+    }
+}
+
+/**
+ * Forget flood URBs dropped by emulator
+ */
+static void FakeFloodDropped (void) {
+
+    for ( int i = 0; fakeFloods && i < FAKE_MAX_FLOOD; i++ ) {
+        if ( fakeFlood [i].urb.handle && fakeFlood [i].fetched ) {
+            fakeLost++;
+            fakeFlood [i].urb.handle = 0;
+            fakePorts [fakeFlood [i].port].floodInFlight--;
+            fakeFloods--;
+            FakeFloodFill (fakeFlood [i].port);
+        }
+    }
+}
+
+/**
+ * Hand out the oldest URB in flight which hasn't been fetched
+ *
+ * @param work - [out] work
+ * @param pResult - [out] 1 if URB data must be fetched, 0 otherwise
+ * @return - false if there is no such URB
+ */
+static bool FakeHandOut (struct usb_vhci_work *work, int *pResult) {
+        PFAKE_FLOOD pOldest = NULL;
+
+    for ( int i = 0; fakeFloods && i < FAKE_MAX_FLOOD; i++ ) {
+        if ( fakeFlood [i].urb.handle && !fakeFlood [i].fetched &&
+             (pOldest == NULL || fakeFlood [i].urb.handle < pOldest->urb.handle) ) {
+            pOldest = &fakeFlood [i];
+        }
+    }
+    bool script = fakeUrb.handle && fakeUrb.status == USB_VHCI_STATUS_PENDING && !fakeUrbFetched;
+    if ( script && (pOldest == NULL || fakeUrb.handle < pOldest->urb.handle) ) {
+        fakeUrbFetched = true;
+        work->type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+        memcpy (&work->work.urb, &fakeUrb, sizeof(fakeUrb));
+        fakeFetchTime = FakeNow ();
+        *pResult = fakeUrbOut && fakeUrb.buffer_length ? 1 : 0;
+        fakeCancelWork = fakeUrbUnlink;     // cancel work is next
+    } else if ( pOldest != NULL ) {
+        pOldest->fetched = true;
+        work->type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+        memcpy (&work->work.urb, &pOldest->urb, sizeof(pOldest->urb));
+        pOldest->fetchTime = FakeNow ();
+        *pResult = 0;
+    } else {
+        return false;
+    }
+    if ( !fakeFirstTime ) {
+        fakeFirstTime = FakeNow ();
+    }
+    return true;
+}
+
+/**
+ * Set state of port enumerated before the controller has been adopted
+ *
+ * @param pCmd - plugged command
+ */
+static void FakePlugged (PFAKE_COMMAND pCmd) {
+
+    fakePorts [pCmd->port].status = USB_VHCI_PORT_STAT_POWER | USB_VHCI_PORT_STAT_CONNECTION | USB_VHCI_PORT_STAT_ENABLE;
+    fakePorts [pCmd->port].flags = 0;
+    fakePorts [pCmd->port].addr = (uint8_t)pCmd->arg;
+}
+
+/**
+ * Check whether hub waits for emulator to complete port change
+ *
+ * @param port - port number
+ * @return - true if commands of port must wait
+ */
+static bool FakeSettling (uint8_t port) {
+        FAKE_PORT *pPort = &fakePorts [port];
+
+    if ( FakeNow () >= pPort->settleUntil ) {
+        return false;
+    }
+    if ( pPort->status & USB_VHCI_PORT_STAT_CONNECTION ) {
+        return pPort->status & USB_VHCI_PORT_STAT_RESET || pPort->flags & USB_VHCI_PORT_STAT_FLAG_RESUMING;
+    }
+    return pPort->status & USB_VHCI_PORT_STAT_POWER;
+}
+
+/**
+ * Run script commands till the next URB
+ *
+ * @return - 0 if URB is submitted, -2 if port stat work is queued, -3 if
+ *           script waits while flood goes on or -1 with errno ETIMEDOUT
+ */
+static int FakeStep (void) {
+        struct timespec ts;
+
+    while ( fakePc < fakeNumCommands ) {
+        PFAKE_COMMAND pCmd = &fakeCommands [fakePc++];
+        FAKE_PORT *pPort = &fakePorts [pCmd->port];
+        if ( pCmd->op != FAKE_OP_POWER && pCmd->port && FakeSettling (pCmd->port) ) {
+            fakePc--;                                           // port change isn't complete yet
+            fakeWaitUntil = FakeNow () + FAKE_SETTLE_POLL;
+            return -3;
+        }
+        switch (pCmd->op) {
+        case FAKE_OP_POWER:
+            if ( pCmd->arg ) {
+                pPort->status |= USB_VHCI_PORT_STAT_POWER;
+                pPort->settleUntil = FakeNow () + FAKE_SETTLE_MS * 1000000ull;
+                FakePortStat (pCmd->port, 0);
+            } else {
+                uint16_t change = pPort->status & USB_VHCI_PORT_STAT_CONNECTION ? USB_VHCI_PORT_STAT_C_CONNECTION : 0;
+                pPort->status = 0;
+                pPort->flags = 0;
+                pPort->addr = 0;
+                FakePortStat (pCmd->port, change);
+            }
+            break;
+        case FAKE_OP_RESET:
+            pPort->status |= USB_VHCI_PORT_STAT_RESET;
+            pPort->status &= ~(USB_VHCI_PORT_STAT_ENABLE | USB_VHCI_PORT_STAT_SUSPEND);
+            pPort->addr = 0;
+            pPort->settleUntil = FakeNow () + FAKE_SETTLE_MS * 1000000ull;
+            FakePortStat (pCmd->port, 0);
+            break;
+        case FAKE_OP_SUSPEND:
+            pPort->status |= USB_VHCI_PORT_STAT_SUSPEND;
+            FakePortStat (pCmd->port, 0);
+            break;
+        case FAKE_OP_RESUME:
+            if ( pPort->status & USB_VHCI_PORT_STAT_SUSPEND ) {
+                pPort->flags |= USB_VHCI_PORT_STAT_FLAG_RESUMING;
+                pPort->settleUntil = FakeNow () + FAKE_SETTLE_MS * 1000000ull;
+                FakePortStat (pCmd->port, 0);
+            }
+            break;
+        case FAKE_OP_URB:
+        case FAKE_OP_UNLINK:
+        case FAKE_OP_CANCEL:
+            if ( pCmd->op == FAKE_OP_CANCEL ) {
+                pCmd->type = USB_VHCI_URB_TYPE_CONTROL;
+                pCmd->bmRequestType = 0x40;                     // vendor OUT with data
+                pCmd->bRequest = 0xff;
+                pCmd->wLength = 8;
+            }
+            if ( fakeStatHead != fakeStatTail ) {               // port stats go first
+                fakePc--;
+                return -2;
+            }
+            FakeUrb (pCmd);
+            return 0;
+        case FAKE_OP_FLOOD:
+            pPort->pFlood = pCmd;
+            pPort->floodDepth = pCmd->arg;
+            FakeFloodFill (pCmd->port);
+            break;
+        case FAKE_OP_EXPECT:
+            if ( fakeLastStatus != pCmd->arg || (pCmd->length >= 0 && fakeLastActual != pCmd->length) ) {
+                fprintf (stderr, "fake vhci: line %d: expected %s length %ld, got status 0x%x length %d\n",
+                         pCmd->line, pCmd->arg == USB_VHCI_STATUS_SUCCESS ? "ok" : "stall", pCmd->length,
+                         fakeLastStatus, fakeLastActual);
+                fakeFailed++;
+            }
+            break;
+        case FAKE_OP_REPEAT:
+            if ( fakeLoopDepth < FAKE_MAX_NESTING && pCmd->arg > 0 ) {
+                fakeLoops [fakeLoopDepth].start = fakePc;
+                fakeLoops [fakeLoopDepth].left = pCmd->arg;
+                fakeLoopDepth++;
+            } else {
+                fakePc = pCmd->length;                          // skip body
+            }
+            break;
+        case FAKE_OP_END:
+            if ( fakeLoopDepth && --fakeLoops [fakeLoopDepth-1].left > 0 ) {
+                fakePc = fakeLoops [fakeLoopDepth-1].start;
+            } else if ( fakeLoopDepth ) {
+                fakeLoopDepth--;
+            }
+            break;
+        case FAKE_OP_WAIT:
+            if ( fakeFloods ) {
+                fakeWaitUntil = FakeNow () + pCmd->arg * 1000000ull;
+                return -3;
+            }
+            ts.tv_sec = pCmd->arg / 1000;
+            ts.tv_nsec = pCmd->arg % 1000 * 1000000;
+            nanosleep (&ts, NULL);
+            errno = ETIMEDOUT;
+            return -1;
+        case FAKE_OP_REPORT:
+            FakeReport ("report");
+            break;
+        case FAKE_OP_PLUGGED:
+            FakePlugged (pCmd);
+            break;
+        case FAKE_OP_STOP:
+            fakeStopped = true;
+            kill (getpid (), SIGINT);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if ( fakeStatHead != fakeStatTail ) {
+            return -2;
+        }
+    }
+    if ( !fakeStopped && getenv ("USBHASP_FAKE_SCRIPT") != NULL ) {
+        fakeStopped = true;                                     // end of script is stop
+        kill (getpid (), SIGINT);
+    } else {
+        ts.tv_sec = 0;
+        ts.tv_nsec = FAKE_IDLE_MS * 1000000;
+        nanosleep (&ts, NULL);
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/**
+ * Check controller, adopt the one handed over by another emulator
+ *
+ * @param fd - controller
+ * @return - true if fd is the controller
+ */
+static bool FakeValid (int fd) {
+
+    if ( fd >= 0 && fd == fakeFd ) {
+        return true;
+    }
+    const char *ports = getenv ("USBHASP_FAKE_PORTS");
+    if ( fd >= 0 && fakeFd < 0 && ports != NULL && atoi (ports) > 0 && atoi (ports) <= FAKE_MAX_PORTS ) {
+        fakeNumPorts = atoi (ports);
+        memset (fakePorts, 0, sizeof(fakePorts));
+        fakePc = fakeLoopDepth = fakeStatHead = fakeStatTail = 0;
+        memset (fakeFlood, 0, sizeof(fakeFlood));
+        fakeFloods = 0;
+        fakeWaitUntil = 0;
+        if ( FakeLoad (getenv ("USBHASP_FAKE_SCRIPT")) == 0 ) {
+            while ( fakePc < fakeNumCommands && fakeCommands [fakePc].op == FAKE_OP_PLUGGED ) {
+                FakePlugged (&fakeCommands [fakePc++]);     // state the emulator takes over
+            }
+            fakeFd = fd;
+            return true;
+        }
+    }
+    errno = EBADF;
+    return false;
+}
+
+/**
+ * Create virtual host controller
+ *
+ * @param port_count - number of ports
+ * @param id - [out] controller id
+ * @param usb_busnum - [out] bus number
+ * @param bus_id - [out] bus id
+ * @return - file descriptor or -1
+ */
+int usb_vhci_open (uint8_t port_count, int32_t *id, int32_t *usb_busnum, char **bus_id) {
+
+    if ( fakeFd >= 0 ) {
+        errno = EBUSY;
+        return -1;
+    }
+    if ( !port_count || port_count > FAKE_MAX_PORTS ) {
+        errno = EINVAL;
+        return -1;
+    }
+    fakeNumPorts = port_count;
+    memset (fakePorts, 0, sizeof(fakePorts));
+    fakePc = fakeLoopDepth = fakeStatHead = fakeStatTail = 0;
+    int result = FakeLoad (getenv ("USBHASP_FAKE_SCRIPT"));
+    if ( result ) {
+        errno = result;
+        return -1;
+    }
+    fakeFd = open ("/dev/null", O_RDWR | O_CLOEXEC);
+    if ( fakeFd < 0 ) {
+        return -1;
+    }
+    const char *bus = getenv ("USBHASP_FAKE_BUS");
+    *id = 0;
+    *usb_busnum = bus != NULL ? atoi (bus) : 0;
+    *bus_id = "fake_hcd.0";
+    return fakeFd;
+}
+
+/**
+ * Remove virtual host controller
+ *
+ * @param fd - controller
+ * @return - 0 or -1
+ */
+int usb_vhci_close (int fd) {
+
+    if ( !FakeValid (fd) ) {
+        return -1;
+    }
+    if ( fakeUrb.handle && fakeUrb.status == USB_VHCI_STATUS_PENDING ) {
+        fakeLost++;
+    }
+    FakeReport ("total");
+    close (fakeFd);
+    fakeFd = -1;
+    return 0;
+}
+
+/**
+ * Get next work
+ *
+ * @param work - [out] work
+ * @param wait - emulator has no URBs queued, it may be made to wait
+ * @return - 1 if URB data must be fetched, 0 if not or -1
+ */
+static int FakeFetch (struct usb_vhci_work *work, bool wait) {
+        struct timespec ts;
+        int result;
+
+    if ( wait ) {                           // URBs fetched and not given back are dropped
+        FakeFloodDropped ();
+    }
+    for (;;) {
+        if ( fakeCancelWork ) {
+            fakeCancelWork = false;
+            work->type = USB_VHCI_WORK_TYPE_CANCEL_URB;
+            work->work.handle = fakeUrb.handle;
+            if ( fakeUrbUnlink && fakeUrb.status == USB_VHCI_STATUS_PENDING ) {
+                fakeUrb.status = USB_VHCI_STATUS_ERROR;     // driver forgets it
+                fakeLastStatus = -1;
+                fakeCanceled++;
+            }
+            return 0;
+        }
+        if ( fakeStatHead != fakeStatTail ) {
+            work->type = USB_VHCI_WORK_TYPE_PORT_STAT;
+            memcpy (&work->work.port_stat, &fakeStats [fakeStatHead], sizeof(work->work.port_stat));
+            fakeStatHead = (fakeStatHead + 1) % FAKE_MAX_STATS;
+            fakePortStats++;
+            return 0;
+        }
+        bool blocked = fakeUrb.handle && fakeUrb.status == USB_VHCI_STATUS_PENDING && (!fakeUrbFetched || !wait);
+        if ( fakeWaitUntil && FakeNow () >= fakeWaitUntil ) {
+            fakeWaitUntil = 0;
+        }
+        if ( !blocked && !fakeWaitUntil ) {
+            result = FakeStep ();
+            if ( result == -2 ) {
+                continue;
+            } else if ( result == -1 ) {
+                return -1;
+            }
+        }
+        if ( FakeHandOut (work, &result) ) {
+            return result;
+        }
+        if ( !wait ) {
+            errno = ENODATA;
+            return -1;
+        }
+        if ( fakeWaitUntil ) {              // nothing in flight till the script goes on
+            uint64_t ns = fakeWaitUntil - FakeNow ();
+            ns = ns < FAKE_IDLE_MS * 1000000ull ? ns : FAKE_IDLE_MS * 1000000ull;
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            nanosleep (&ts, NULL);
+        }
+        errno = ETIMEDOUT;
+        return -1;
+    }
+}
+
+/**
+ * Get next work
+ *
+ * @param fd - controller
+ * @param work - [out] work
+ * @return - 1 if URB data must be fetched, 0 if not or -1
+ */
+int usb_vhci_fetch_work (int fd, struct usb_vhci_work *work) {
+
+    if ( !FakeValid (fd) ) {
+        return -1;
+    }
+    return FakeFetch (work, true);
+}
+
+/**
+ * Get next work, the fake one never blocks longer than a wait command
+ *
+ * @param fd - controller
+ * @param work - [out] work
+ * @param timeout - 0 to poll, any other is ignored
+ * @return - 1 if URB data must be fetched, 0 if not or -1
+ */
+int usb_vhci_fetch_work_timeout (int fd, struct usb_vhci_work *work, int16_t timeout) {
+
+    if ( !FakeValid (fd) ) {
+        return -1;
+    }
+    return FakeFetch (work, timeout != 0);
+}
+
+/**
+ * Get OUT data of URB
+ *
+ * @param fd - controller
+ * @param urb - URB with allocated buffer
+ * @return - 0 or -1
+ */
+int usb_vhci_fetch_data (int fd, const struct usb_vhci_urb *urb) {
+
+    if ( !FakeValid (fd) ) {
+        return -1;
+    }
+    if ( urb->handle != fakeUrb.handle ) {
+        fakeErrors++;
+        errno = ENOENT;
+        return -1;
+    }
+    if ( fakeUrbCanceled ) {
+        fakeCanceled++;
+        fakeCancelWork = true;
+        fakeLastStatus = -1;
+        errno = ECANCELED;
+        return -1;
+    }
+    if ( urb->buffer != NULL && fakeUrbOut ) {
+        memset (urb->buffer, 0, urb->buffer_length);
+    }
+    return 0;
+}
+
+/**
+ * Complete flood URB and submit the next one
+ *
+ * @param urb - processed URB
+ * @return - 0 or -1
+ */
+static int FakeFloodGiveback (const struct usb_vhci_urb *urb) {
+
+    for ( int i = 0; fakeFloods && i < FAKE_MAX_FLOOD; i++ ) {
+        PFAKE_FLOOD pFlood = &fakeFlood [i];
+        if ( pFlood->urb.handle == urb->handle && pFlood->fetched ) {
+            uint64_t start = pFlood->fetchTime > fakeLastTime ? pFlood->fetchTime : fakeLastTime;
+            fakeLastTime = FakeNow ();      // queued URBs are served one after another
+            fakeBusyTime += fakeLastTime - start;
+            fakeUrbs++;
+            fakeHaspUrbs++;
+            if ( urb->status == USB_VHCI_STATUS_STALL ) {
+                fakeStalls++;
+            }
+            FakeLatency (pFlood->port, fakeLastTime - pFlood->submitTime);
+            pFlood->urb.handle = 0;
+            fakePorts [pFlood->port].floodInFlight--;
+            fakeFloods--;
+            FakeFloodFill (pFlood->port);
+            return 0;
+        }
+    }
+    fakeErrors++;
+    errno = ENOENT;
+    return -1;
+}
+
+/**
+ * Complete URB
+ *
+ * @param fd - controller
+ * @param urb - processed URB
+ * @return - 0 or -1
+ */
+int usb_vhci_giveback (int fd, const struct usb_vhci_urb *urb) {
+
+    if ( !FakeValid (fd) ) {
+        return -1;
+    }
+    if ( urb->handle != fakeUrb.handle ) {
+        return FakeFloodGiveback (urb);
+    }
+    if ( fakeUrb.status != USB_VHCI_STATUS_PENDING ) {
+        fakeErrors++;
+        errno = ENOENT;
+        return -1;
+    }
+    fakeLastTime = FakeNow ();
+    fakeBusyTime += fakeLastTime - fakeFetchTime;
+    fakeUrb.status = urb->status;
+    fakeLastStatus = urb->status;
+    fakeLastActual = urb->buffer_actual;
+    fakeUrbs++;
+    if ( fakeUrbCanceled ) {                // driver has forgotten canceled URB
+        errno = ECANCELED;
+        return -1;
+    }
+    if ( urb->status == USB_VHCI_STATUS_STALL ) {
+        fakeStalls++;
+    }
+    if ( fakeUrb.bmRequestType == 0xc0 ) {
+        fakeHaspUrbs++;
+    }
+    FakeLatency (fakeUrbPort, fakeLastTime - fakeUrbSubmit);
+    if ( fakeUrb.type == USB_VHCI_URB_TYPE_CONTROL && !fakeUrb.bmRequestType && fakeUrb.bRequest == URB_RQ_SET_ADDRESS &&
+         urb->status == USB_VHCI_STATUS_SUCCESS ) {
+        fakePorts [fakeUrbPort].addr = fakePorts [fakeUrbPort].pendingAddr;
+    }
+    return 0;
+}
+
+/**
+ * Check controller and port number
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @return - true if fd and port are valid
+ */
+static bool FakePortValid (int fd, uint8_t port) {
+
+    if ( !FakeValid (fd) ) {
+        return false;
+    }
+    if ( port < 1 || port > fakeNumPorts ) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Connect device to port
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @param data_rate - USB_VHCI_DATA_RATE_*
+ * @return - 0 or -1
+ */
+int usb_vhci_port_connect (int fd, uint8_t port, uint8_t data_rate) {
+
+    if ( !FakePortValid (fd, port) ) {
+        return -1;
+    }
+    if ( ~fakePorts [port].status & USB_VHCI_PORT_STAT_POWER ) {
+        errno = EPROTO;
+        return -1;
+    }
+    fakePorts [port].status |= USB_VHCI_PORT_STAT_CONNECTION;
+    fakePorts [port].status &= ~(USB_VHCI_PORT_STAT_LOW_SPEED | USB_VHCI_PORT_STAT_HIGH_SPEED);
+    if ( data_rate == USB_VHCI_DATA_RATE_LOW ) {
+        fakePorts [port].status |= USB_VHCI_PORT_STAT_LOW_SPEED;
+    } else if ( data_rate == USB_VHCI_DATA_RATE_HIGH ) {
+        fakePorts [port].status |= USB_VHCI_PORT_STAT_HIGH_SPEED;
+    }
+    FakePortStat (port, USB_VHCI_PORT_STAT_C_CONNECTION);
+    return 0;
+}
+
+/**
+ * Disconnect device from port
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @return - 0 or -1
+ */
+int usb_vhci_port_disconnect (int fd, uint8_t port) {
+
+    if ( !FakePortValid (fd, port) ) {
+        return -1;
+    }
+    fakePorts [port].status &= ~(USB_VHCI_PORT_STAT_CONNECTION | USB_VHCI_PORT_STAT_ENABLE);
+    FakePortStat (port, USB_VHCI_PORT_STAT_C_CONNECTION);
+    return 0;
+}
+
+/**
+ * Disable port
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @return - 0 or -1
+ */
+int usb_vhci_port_disable (int fd, uint8_t port) {
+
+    if ( !FakePortValid (fd, port) ) {
+        return -1;
+    }
+    fakePorts [port].status &= ~USB_VHCI_PORT_STAT_ENABLE;
+    FakePortStat (port, USB_VHCI_PORT_STAT_C_ENABLE);
+    return 0;
+}
+
+/**
+ * Complete resume of port
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @return - 0 or -1
+ */
+int usb_vhci_port_resumed (int fd, uint8_t port) {
+
+    if ( !FakePortValid (fd, port) ) {
+        return -1;
+    }
+    if ( ~fakePorts [port].flags & USB_VHCI_PORT_STAT_FLAG_RESUMING ) {
+        errno = EPROTO;
+        return -1;
+    }
+    fakePorts [port].status &= ~USB_VHCI_PORT_STAT_SUSPEND;
+    fakePorts [port].flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+    FakePortStat (port, USB_VHCI_PORT_STAT_C_SUSPEND);
+    return 0;
+}
+
+/**
+ * Set or clear overcurrent of port
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @param set - overcurrent state
+ * @return - 0 or -1
+ */
+int usb_vhci_port_overcurrent (int fd, uint8_t port, uint8_t set) {
+
+    if ( !FakePortValid (fd, port) ) {
+        return -1;
+    }
+    if ( set ) {
+        fakePorts [port].status |= USB_VHCI_PORT_STAT_OVERCURRENT;
+    } else {
+        fakePorts [port].status &= ~USB_VHCI_PORT_STAT_OVERCURRENT;
+    }
+    FakePortStat (port, USB_VHCI_PORT_STAT_C_OVERCURRENT);
+    return 0;
+}
+
+/**
+ * Complete reset of port
+ *
+ * @param fd - controller
+ * @param port - port number
+ * @param enable - enable port after reset
+ * @return - 0 or -1
+ */
+int usb_vhci_port_reset_done (int fd, uint8_t port, uint8_t enable) {
+
+    if ( !FakePortValid (fd, port) ) {
+        return -1;
+    }
+    if ( ~fakePorts [port].status & USB_VHCI_PORT_STAT_RESET ) {
+        errno = EPROTO;
+        return -1;
+    }
+    fakePorts [port].status &= ~USB_VHCI_PORT_STAT_RESET;
+    uint16_t change = USB_VHCI_PORT_STAT_C_RESET;
+    if ( enable ) {
+        fakePorts [port].status |= USB_VHCI_PORT_STAT_ENABLE;
+    } else {
+        change |= USB_VHCI_PORT_STAT_C_ENABLE;
+    }
+    FakePortStat (port, change);
+    return 0;
+}
@@ -0,0 +1,557 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Handoff.c
+ * Abstract:
+ *      Restart without reenumeration: running emulator passes vhci
+ *      controller and state of its ports to the new one.
+ * Notes:
+ *      New emulator (usbhasp -U socket) loads its key files, connects to
+ *      control socket of the running one and sends "handoff". Control
+ *      thread of the running emulator parks its URB thread between two
+ *      URBs, commits and closes journals and sends the snapshot of ports
+ *      with vhci fd attached (SCM_RIGHTS). Snapshot has address, port
+ *      status, key file and client session of every port: chiper keys,
+ *      open state, encoded status, randomness, feature logins, SRM block
+ *      transfer, pending clock change and answer, written key memory.
+ *      New emulator restores ports and acknowledges, the old one confirms
+ *      and stops without removing the controller. New emulator goes on
+ *      serving the controller only after confirmation, URBs queued
+ *      meanwhile are fetched by it. So only one of them serves it: the
+ *      old one resumes unless it has confirmed, the new one closes the
+ *      controller unless confirmation comes.
+ *
+ *      Session of a port is restored only if the port emulates the same
+ *      key file with the same key identity, otherwise the port is
+ *      reconnected (or disconnected if it has no key) and client
+ *      reenumerates it.
+ *
+ *      Service gap is the time from parking of the old URB thread to the
+ *      start of the new one, both read from CLOCK_MONOTONIC.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "USBKeyEmu.h"
+#include "KeyFile.h"
+#include "Handoff.h"
+#include "Control.h"
+#include "Latency.h"
+#include "Stats.h"
+#include "Rcu.h"
+#include "Rtc.h"
+#include "Log.h"
+
+enum HANDOFF_STATE {
+    HANDOFF_IDLE,
+    HANDOFF_REQUESTED,                      // control thread waits for URB thread to park
+    HANDOFF_PARKED,                         // URB thread waits between URBs
+    HANDOFF_DONE                            // controller belongs to the new emulator
+};
+
+typedef struct _HANDOFF_HEADER {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    portSize;                   // sizeof(HANDOFF_PORT)
+    uint32_t    numPorts;
+    int32_t     pid;
+    int32_t     busNum;
+    uint64_t    pauseTime;                  // CLOCK_MONOTONIC, ns
+    char        busId [64];
+} HANDOFF_HEADER, *PHANDOFF_HEADER;
+
+typedef struct _HANDOFF_PORT {
+    int32_t     addr;
+    struct usb_vhci_port_stat stat;
+    uint8_t     hasKey;
+    uint8_t     hasMemory;                  // session has written key memory
+    uint8_t     isInitDone;
+    uint8_t     isKeyOpened;
+    uint8_t     encodedStatus;
+    uint16_t    chiperKey1, chiperKey2;
+    uint32_t    identity;                   // KeyIdentity of key image
+    uint32_t    memoryHash;
+    uint32_t    random;
+    uint32_t    randomSeed;
+    int64_t     timeOffset;                 // of key clock
+    uint8_t     timePrepared;               // PREPARE_CHANGE_TIME has been given
+    uint8_t     timeSet [4];
+    uint8_t     answerReady;                // answer to QUESTION is waiting
+    uint32_t    answer;
+    uint8_t     blockFn;                    // SRM block transfer, 0 - none
+    uint16_t    blockOffset, blockEnd;
+    uint8_t     numLogins;                  // SRM features logged in
+    uint32_t    logins [KEY_MAX_LOGINS];
+    uint8_t     memory [KEY_MEMORY_SIZE];
+    char        keyfileName [PATH_MAX];     // real path
+} HANDOFF_PORT, *PHANDOFF_PORT;
+
+static atomic_int   handoffState = HANDOFF_IDLE;
+static uint64_t     handoffPauseTime;
+static int32_t      handoffBusNum;
+static char         handoffBusId [sizeof(((PHANDOFF_HEADER)0)->busId)];
+static int32_t      handoffPid;                     // emulator taken over
+static bool         handoffReplug [MAX_HASPKEYS];   // ports to reconnect after takeover
+
+/**
+ * Hash of key identity and crypto material, sessions survive only if it
+ * is the same
+ *
+ * @param pKeyData - key image
+ * @return - hash
+ */
+static uint32_t KeyIdentity (PCKEYDATA pKeyData) {
+
+    uint32_t hash = HashBytes (HASH_INIT, &pKeyData->password, sizeof(pKeyData->password));
+    hash = HashBytes (hash, &pKeyData->keyType, sizeof(pKeyData->keyType));
+    hash = HashBytes (hash, &pKeyData->memoryType, sizeof(pKeyData->memoryType));
+    hash = HashBytes (hash, pKeyData->secTable, sizeof(pKeyData->secTable));
+    hash = HashBytes (hash, pKeyData->netMemory, sizeof(pKeyData->netMemory));
+    return HashBytes (hash, pKeyData->edStruct, sizeof(pKeyData->edStruct));
+}
+
+/**
+ * Remember controller to pass it on
+ *
+ * @param busNum - bus number
+ * @param busId - bus id
+ */
+void HandoffSetBus (int32_t busNum, const char *busId) {
+
+    handoffBusNum = busNum;
+    if ( busId == handoffBusId ) {          // taken over
+        return;
+    }
+    snprintf (handoffBusId, sizeof(handoffBusId), "%s", busId != NULL ? busId : "");
+}
+
+/**
+ * Called by URB thread between URBs. Parks the thread while control
+ * thread sends the snapshot.
+ *
+ * @param reader - RCU reader of URB thread
+ * @return - true if controller is handed over and URB thread must stop
+ */
+bool HandoffPark (int reader) {
+        struct timespec ts = { 0, 100000 };
+        int     state;
+
+    if ( atomic_load_explicit (&handoffState, memory_order_relaxed) != HANDOFF_REQUESTED ) {
+        return false;
+    }
+    handoffPauseTime = LatencyNow ();
+    RcuThreadOffline (reader);              // key files may be reloaded meanwhile
+    atomic_store_explicit (&handoffState, HANDOFF_PARKED, memory_order_release);
+    while ( (state = atomic_load_explicit (&handoffState, memory_order_acquire)) == HANDOFF_PARKED ) {
+        nanosleep (&ts, NULL);
+    }
+    RcuThreadOnline (reader);
+    return state == HANDOFF_DONE;
+}
+
+/**
+ * Has controller been handed over
+ *
+ * @return - true if it has
+ */
+bool HandoffDone (void) {
+
+    return atomic_load_explicit (&handoffState, memory_order_acquire) == HANDOFF_DONE;
+}
+
+/**
+ * Wait for URB thread to park
+ *
+ * @return - 0 or ETIMEDOUT
+ */
+static int HandoffWaitParked (void) {
+        struct timespec ts = { 0, 100000 };
+
+    for ( int i = 0; i < HANDOFF_TIMEOUT * 10; i++ ) {
+        if ( atomic_load_explicit (&handoffState, memory_order_acquire) == HANDOFF_PARKED ) {
+            return 0;
+        }
+        nanosleep (&ts, NULL);
+    }
+    int requested = HANDOFF_REQUESTED;
+    if ( atomic_compare_exchange_strong (&handoffState, &requested, HANDOFF_IDLE) ) {
+        return ETIMEDOUT;
+    }
+    return 0;                               // has just parked
+}
+
+/**
+ * Send all of buffer
+ *
+ * @param sock - socket
+ * @param buf - data
+ * @param size - data size
+ * @return - 0 or errno code
+ */
+static int HandoffWrite (int sock, const void *buf, size_t size) {
+        const uint8_t *p = (const uint8_t *)buf;
+
+    while ( size > 0 ) {
+        ssize_t len = send (sock, p, size, MSG_NOSIGNAL);
+        if ( len < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno;
+        }
+        p += len;
+        size -= len;
+    }
+    return 0;
+}
+
+/**
+ * Receive all of buffer
+ *
+ * @param sock - socket
+ * @param buf - [out] data
+ * @param size - data size
+ * @return - 0 or errno code
+ */
+static int HandoffRead (int sock, void *buf, size_t size) {
+        uint8_t *p = (uint8_t *)buf;
+
+    while ( size > 0 ) {
+        ssize_t len = recv (sock, p, size, 0);
+        if ( len < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno == EAGAIN ? ETIMEDOUT : errno;
+        }
+        if ( len == 0 ) {
+            return ECONNRESET;
+        }
+        p += len;
+        size -= len;
+    }
+    return 0;
+}
+
+/**
+ * Take snapshot of port. URB thread must be parked.
+ *
+ * @param pKey - port
+ * @param pPort - [out] snapshot
+ */
+static void HandoffSave (PUSBHASP pKey, PHANDOFF_PORT pPort) {
+
+    memset (pPort, 0, sizeof(HANDOFF_PORT));
+    pPort->addr = pKey->addr;
+    memcpy (&pPort->stat, &pKey->stat, sizeof(pPort->stat));
+    PKEYDATA pKeyData = atomic_load (&pKey->pKeyData);
+    if ( pKeyData == NULL || realpath ((char *)pKey->keyfileName, pPort->keyfileName) == NULL ) {
+        return;
+    }
+    pPort->hasKey = 1;
+    pPort->identity = KeyIdentity (pKeyData);
+    pPort->chiperKey1 = pKey->session.chiperKey1;
+    pPort->chiperKey2 = pKey->session.chiperKey2;
+    pPort->isInitDone = pKey->session.isInitDone;
+    pPort->encodedStatus = pKey->session.encodedStatus;
+    pPort->random = pKey->session.random;
+    pPort->randomSeed = pKey->session.randomSeed;
+    pPort->timeOffset = pKey->session.timeOffset;
+    if ( pKey->session.keyEpoch == pKeyData->sessionEpoch ) {
+                                        // otherwise closed by the next request
+        pPort->isKeyOpened = pKey->session.isKeyOpened;
+        pPort->timePrepared = pKey->session.timePrepared;
+        memcpy (pPort->timeSet, pKey->session.timeSet, sizeof(pPort->timeSet));
+        pPort->answerReady = pKey->session.answerReady;
+        pPort->answer = pKey->session.answer;
+        pPort->blockFn = pKey->session.blockFn;
+        pPort->blockOffset = pKey->session.blockOffset;
+        pPort->blockEnd = pKey->session.blockEnd;
+        pPort->numLogins = pKey->session.numLogins;
+        memcpy (pPort->logins, pKey->session.logins, sizeof(pPort->logins));
+    }
+    pPort->memoryHash = pKey->session.memoryHash;
+    for ( int i = 0; i < KEY_MEMORY_PAGES; i++ ) {
+        if ( pKey->session.pages [i] != NULL ) {
+            pPort->hasMemory = 1;
+        }
+    }
+    if ( pPort->hasMemory ) {
+        KeyMemoryRead (pKeyData, &pKey->session, 0, pPort->memory, sizeof(pPort->memory));
+    }
+}
+
+/**
+ * Pass controller and ports to the new emulator. Called by control thread,
+ * URB thread stops if it returns 0.
+ *
+ * @param sock - control socket client which has asked for it
+ * @param fd - vhci file descriptor
+ * @param haspKeys - ports
+ * @param numPorts - number of ports
+ * @return - 0 in case of success or errno code
+ */
+int HandoffSend (int sock, int fd, USB_HASP haspKeys[], int numPorts) {
+        HANDOFF_HEADER header;
+        PHANDOFF_PORT pPorts;
+        bool    journaled [MAX_HASPKEYS];
+        struct msghdr msg;
+        struct iovec iov;
+        struct timeval tv = { HANDOFF_TIMEOUT / 1000, HANDOFF_TIMEOUT % 1000 * 1000 };
+        char    cmsgBuf [CMSG_SPACE(sizeof(int))];
+        char    ack [4];
+        int     result;
+
+    pPorts = (PHANDOFF_PORT)calloc (numPorts, sizeof(HANDOFF_PORT));
+    if ( pPorts == NULL ) {
+        return ENOMEM;
+    }
+    int idle = HANDOFF_IDLE;
+    if ( !atomic_compare_exchange_strong (&handoffState, &idle, HANDOFF_REQUESTED) ) {
+        free (pPorts);
+        return EBUSY;
+    }
+    if ( (result = HandoffWaitParked ()) ) {
+        free (pPorts);
+        return result;
+    }
+    for ( int i = 0; i < numPorts; i++ ) {  // new emulator appends to journals
+        journaled [i] = haspKeys [i].pJournal != NULL;
+        PortJournalClose (&haspKeys [i]);
+        HandoffSave (&haspKeys [i], &pPorts [i]);
+    }
+    memset (&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.portSize = sizeof(HANDOFF_PORT);
+    header.numPorts = numPorts;
+    header.pid = getpid ();
+    header.busNum = handoffBusNum;
+    header.pauseTime = handoffPauseTime;
+    memcpy (header.busId, handoffBusId, sizeof(header.busId));
+
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof(int));
+    memcpy (CMSG_DATA (cmsg), &fd, sizeof(int));
+    setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ( sendmsg (sock, &msg, MSG_NOSIGNAL) != sizeof(header) ) {
+        result = errno ? errno : EIO;
+    } else if ( !(result = HandoffWrite (sock, pPorts, numPorts * sizeof(HANDOFF_PORT))) &&
+                !(result = HandoffRead (sock, ack, 3)) && memcmp (ack, "ok\n", 3) ) {
+        result = EPROTO;
+    }
+    if ( !result ) {                        // new one serves from here
+        result = HandoffWrite (sock, "go\n", 3);
+    }
+    free (pPorts);
+    if ( result ) {                         // the old one goes on
+        for ( int i = 0; i < numPorts; i++ ) {
+            if ( journaled [i] ) {
+                PortJournalOpen (&haspKeys [i]);
+            }
+        }
+        atomic_store_explicit (&handoffState, HANDOFF_IDLE, memory_order_release);
+        return result;
+    }
+    atomic_store_explicit (&handoffState, HANDOFF_DONE, memory_order_release);
+    return 0;
+}
+
+/**
+ * Restore port of the new emulator from snapshot
+ *
+ * @param pKey - port, key file is attached already if any
+ * @param pPort - snapshot
+ */
+static void HandoffRestore (PUSBHASP pKey, PHANDOFF_PORT pPort) {
+        char    path [PATH_MAX];
+
+    pKey->addr = pPort->addr;
+    memcpy (&pKey->stat, &pPort->stat, sizeof(pKey->stat));
+    PKEYDATA pKeyData = atomic_load (&pKey->pKeyData);
+    bool sameKey = pKeyData != NULL && pPort->hasKey &&
+                   realpath ((char *)pKey->keyfileName, path) != NULL && !strcmp (path, pPort->keyfileName) &&
+                   KeyIdentity (pKeyData) == pPort->identity;
+    handoffReplug [pKey->port-1] = (pKeyData != NULL || pPort->hasKey) && !sameKey;
+    if ( !sameKey ) {
+        return;
+    }
+    pKey->session.chiperKey1 = pPort->chiperKey1;
+    pKey->session.chiperKey2 = pPort->chiperKey2;
+    pKey->session.isInitDone = pPort->isInitDone;
+    pKey->session.isKeyOpened = pPort->isKeyOpened;
+    pKey->session.encodedStatus = pPort->encodedStatus;
+    pKey->session.random = pPort->random;
+    pKey->session.randomSeed = pPort->randomSeed;
+    pKey->session.timePrepared = pPort->timePrepared;
+    memcpy (pKey->session.timeSet, pPort->timeSet, sizeof(pKey->session.timeSet));
+    pKey->session.answerReady = pPort->answerReady;
+    pKey->session.answer = pPort->answer;
+    pKey->session.blockFn = pPort->blockFn;
+    pKey->session.blockOffset = pPort->blockOffset;
+    pKey->session.blockEnd = pPort->blockEnd;
+    pKey->session.numLogins = pPort->numLogins <= KEY_MAX_LOGINS ? pPort->numLogins : 0;
+    memcpy (pKey->session.logins, pPort->logins, sizeof(pKey->session.logins));
+    RtcRestore (pKey, pPort->timeOffset);
+    if ( pPort->hasMemory && pPort->memoryHash == pKeyData->memoryHash ) {
+        KeyMemoryWrite (pKeyData, &pKey->session, 0, pPort->memory, sizeof(pPort->memory));
+    } else if ( pPort->hasMemory ) {
+        Log (LOG_INFO, "Data of key file %s has been changed, written key memory of port %d is dropped.\n",
+             pKey->keyfileName, pKey->port);
+    }
+}
+
+/**
+ * Take over controller and ports of the running emulator. Key files must
+ * be attached to ports, journals are opened after.
+ *
+ * @param path - control socket of the running emulator
+ * @param haspKeys - ports
+ * @param pNumPorts - [in/out] number of ports, number of ports of controller on return
+ * @param pBusNum - [out] bus number
+ * @param pBusId - [out] bus id
+ * @return - vhci file descriptor or -1 with errno set
+ */
+int HandoffReceive (const char *path, USB_HASP haspKeys[], int *pNumPorts, int32_t *pBusNum, char **pBusId) {
+        HANDOFF_HEADER header;
+        PHANDOFF_PORT pPorts = NULL;
+        struct sockaddr_un addr;
+        struct msghdr msg;
+        struct iovec iov;
+        struct timeval tv = { 2 * HANDOFF_TIMEOUT / 1000, 0 };
+        char    cmsgBuf [CMSG_SPACE(sizeof(int))];
+        char    ack [4];
+        int     fd = -1, result = 0;
+
+    if ( strlen (path) >= sizeof(addr.sun_path) ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( sock < 0 ) {
+        return -1;
+    }
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path, sizeof(addr.sun_path)-1);
+    setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ( connect (sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         (result = HandoffWrite (sock, "handoff\n", 8)) ) {
+        result = result ? result : errno;
+        close (sock);
+        errno = result;
+        return -1;
+    }
+    memset (&header, 0, sizeof(header));
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    ssize_t len = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = len > 0 ? CMSG_FIRSTHDR (&msg) : NULL;
+    if ( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+        memcpy (&fd, CMSG_DATA (cmsg), sizeof(int));
+    }
+    if ( len <= 0 ) {
+        result = len < 0 ? (errno == EAGAIN ? ETIMEDOUT : errno) : ECONNRESET;
+    } else if ( fd < 0 ) {                  // error line of control socket
+        ((char *)&header) [len < (ssize_t)sizeof(header) ? len : (ssize_t)sizeof(header)-1] = '\0';
+        Log (LOG_ERR, "Emulator on %s refused handoff: %s", path, (char *)&header);
+        result = EPROTO;
+    } else if ( (size_t)len < sizeof(header) && (result = HandoffRead (sock, (uint8_t *)&header + len, sizeof(header) - len)) ) {
+        ;
+    } else if ( header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION ||
+                header.portSize != sizeof(HANDOFF_PORT) || header.numPorts < 1 || header.numPorts > MAX_HASPKEYS ) {
+        Log (LOG_ERR, "Emulator on %s sent unknown snapshot version %u.\n", path, header.version);
+        result = EPROTO;
+    } else if ( (pPorts = (PHANDOFF_PORT)calloc (header.numPorts, sizeof(HANDOFF_PORT))) == NULL ) {
+        result = ENOMEM;
+    } else if ( !(result = HandoffRead (sock, pPorts, header.numPorts * sizeof(HANDOFF_PORT))) ) {
+        for ( int i = 0; i < (int)header.numPorts; i++ ) {
+            HandoffRestore (&haspKeys [i], &pPorts [i]);
+        }
+        for ( int i = header.numPorts; i < *pNumPorts; i++ ) {
+            if ( haspKeys [i].pKeyFile != NULL ) {
+                Log (LOG_WARNING, "Controller has %u ports, key file %s is not emulated.\n", header.numPorts, haspKeys [i].keyfileName);
+                PortDetach (&haspKeys [i]);
+            }
+        }
+        result = HandoffWrite (sock, "ok\n", 3);
+    }
+    if ( !result && !(result = HandoffRead (sock, ack, 3)) && memcmp (ack, "go\n", 3) ) {
+        Log (LOG_ERR, "Emulator on %s has not confirmed handoff, it goes on serving.\n", path);
+        result = EPROTO;
+    }
+    free (pPorts);
+    close (sock);
+    if ( result ) {
+        if ( fd >= 0 ) {
+            close (fd);
+        }
+        errno = result;
+        return -1;
+    }
+    handoffPauseTime = header.pauseTime;
+    HandoffSetBus (header.busNum, header.busId);
+    *pBusId = handoffBusId;
+    *pBusNum = header.busNum;
+    *pNumPorts = header.numPorts;
+    handoffPid = header.pid;
+    return fd;
+}
+
+/**
+ * Start serving ports taken over: publish their state, reconnect ports
+ * which have another key and report service gap. Called right before URB
+ * thread starts, when logging is asynchronous.
+ *
+ * @param fd - vhci file descriptor
+ * @param haspKeys - ports
+ * @param numPorts - number of ports
+ */
+void HandoffResume (int fd, USB_HASP haspKeys[], int numPorts) {
+
+    for ( int i = 0; i < numPorts; i++ ) {
+        PUSBHASP pKey = &haspKeys [i];
+        PSTATS_PORT pStats = StatsPort (pKey->port);
+        atomic_store_explicit (&pStats->status, pKey->stat.status, memory_order_relaxed);
+        atomic_store_explicit (&pStats->addr, pKey->addr, memory_order_relaxed);
+        if ( !handoffReplug [i] ) {
+            continue;
+        }
+        if ( pKey->stat.status & USB_VHCI_PORT_STAT_CONNECTION && usb_vhci_port_disconnect (fd, pKey->port) == -1 ) {
+            Log (LOG_WARNING, "USB (usb_vhci_port_disconnect), port %d failed: %s.\n", pKey->port, strerror(errno));
+        }
+        if ( pKey->stat.status & USB_VHCI_PORT_STAT_POWER && atomic_load (&pKey->pKeyData) != NULL &&
+             usb_vhci_port_connect (fd, pKey->port, USB_VHCI_DATA_RATE_FULL) == -1 ) {
+            Log (LOG_WARNING, "USB (usb_vhci_port_connect), port %d failed: %s.\n", pKey->port, strerror(errno));
+        }
+        Log (LOG_INFO, "Port %d has %s key now, %s.\n", pKey->port, atomic_load (&pKey->pKeyData) != NULL ? "another" : "no",
+             atomic_load (&pKey->pKeyData) != NULL ? "reconnected" : "disconnected");
+    }
+    uint64_t gap = LatencyNow () - handoffPauseTime;
+    Log (LOG_INFO, "USB device taken over %s (bus# %d) from emulator %d, service gap %llu us.\n",
+         handoffBusId, handoffBusNum, handoffPid, (unsigned long long)gap / 1000);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Handoff.h
+ * Abstract:
+ *      Restart without reenumeration: running emulator passes vhci
+ *      controller and state of its ports to the new one.
+ * Notes:
+ * Revision History:
+ */
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "USBKeyEmu.h"
+
+#define HANDOFF_MAGIC       0x46464f48      // "HOFF"
+#define HANDOFF_VERSION     3
+#define HANDOFF_TIMEOUT     2000            // ms to park URB thread and to get acknowledge
+
+void HandoffSetBus (int32_t busNum, const char *busId);
+bool HandoffPark (int reader);
+int  HandoffSend (int sock, int fd, USB_HASP haspKeys[], int numPorts);
+bool HandoffDone (void);
+int  HandoffReceive (const char *path, USB_HASP haspKeys[], int *pNumPorts, int32_t *pBusNum, char **pBusId);
+void HandoffResume (int fd, USB_HASP haspKeys[], int numPorts);
+
+#endif  // HANDOFF_H
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2004 Chingachguk & Denger2k All Rights Reserved
+ * Copyright (C) 2017 Revisited by Sam88651 as Linux user space application
+ * 
+ * Module Name:
+ *     HaspEmu.h
+ * Abstract:
+ *     HASP key emulation engine (libhaspemu) public declarations
+ * Notes:
+ *     Engine is reentrant and keeps no global state. Key image is loaded
+ *     once and never written, all state of a client lives in KEY_SESSION.
+ *     Threads may emulate the same key image at once, each with its own
+ *     session. A session must be used by one thread at a time.
+ *     Engine messages go to logHook of key image, engine itself neither
+ *     logs nor starts threads.
+ * Revision History:
+ */
+#ifndef HASPEMU_H
+#define HASPEMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//
+// Key memory. Key image is shared by all ports emulating the same key file
+// and never written. Session gets private copy of memory page on write.
+//
+#define KEY_MEMORY_SIZE     0xFD0
+#define KEY_PAGE_SIZE       256
+#define KEY_MEMORY_PAGES    ((KEY_MEMORY_SIZE+KEY_PAGE_SIZE-1)/KEY_PAGE_SIZE)
+#define HASH_INIT           2166136261u     // HashBytes initial value
+
+#define CACHE_LINE          64
+
+//
+// SRM tables of key file: features a session logs in to and file allocation
+// table of key memory. Tables are sorted by id and searched by bisection, so
+// lookups cost the same few cache lines for keys with thousands of features.
+//
+#define KEY_SRM_STRUCTS     4               // READ_STRUCT tables given by key file
+#define KEY_SRM_STRUCT_SIZE 64
+#define KEY_MAX_LOGINS      8               // features logged in by session at once
+
+typedef struct _KEY_SRM_FILE {
+    uint16_t  id;
+    uint16_t  offset;         // in key memory
+    uint16_t  size;
+    uint32_t  feature;        // feature whose login opens the file
+} KEY_SRM_FILE, *PKEY_SRM_FILE;
+
+typedef struct _KEY_SRM {
+    uint32_t  numFeatures;
+    uint32_t  numFiles;
+    uint32_t  *features;      // feature ids, sorted
+    PKEY_SRM_FILE files;      // FAT sorted by file id
+    uint8_t   structSize[KEY_SRM_STRUCTS];  // 0 - built-in table
+    uint8_t   structs[KEY_SRM_STRUCTS][KEY_SRM_STRUCT_SIZE];
+} KEY_SRM, *PKEY_SRM;
+
+//
+// Engine messages, syslog priority and printf format. Format is a string
+// literal of the engine.
+//
+typedef void (*KEY_LOG_HOOK) (int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define KeyLog(pKeyData, priority, ...)  do { if ( (pKeyData)->logHook != NULL ) (pKeyData)->logHook (priority, __VA_ARGS__); } while (0)
+
+//
+// Description of key data. Fields used by every request come first and
+// fit into one cache line, memory starts on its own line, names are cold.
+//
+typedef struct _KEY_DATA {
+    //
+    // Image generation. Sessions opened with another sessionEpoch are closed
+    //
+    uint32_t  sessionEpoch;
+    uint32_t  memoryHash;     // hash of memory loaded from key file
+    //
+    // Static information about HASP key 
+    //
+    uint8_t   keyType;        // Type of key
+    uint8_t   memoryType;     // Memory size of key
+    uint32_t  password;       // Password for key
+    uint8_t   options[14];    // Options for key
+    uint8_t   secTable[8];    // ST for key
+    uint8_t   netMemory[16];  // NetMemory for key
+
+    uint8_t   memory[KEY_MEMORY_SIZE] __attribute__((aligned(CACHE_LINE)));  // Memory content
+    uint8_t   edStruct[256];  // EDStruct for key
+    char      name[128];      // key name
+    char      created[24];    // date of key creation
+    PKEY_SRM  pSrm;           // SRM tables, NULL - key has none
+    KEY_LOG_HOOK logHook;     // set by caller before LoadKey, NULL - engine is silent
+} __attribute__((aligned(CACHE_LINE))) KEY_DATA, *PKEYDATA;
+typedef const KEY_DATA *PCKEYDATA;      // key image is never written by emulation
+
+struct _KEY_SESSION;
+
+//
+// Key memory write notification. Written data can be read with KeyMemoryRead.
+//
+typedef void (*KEY_WRITE_HOOK) (void *context, PCKEYDATA pKeyData, struct _KEY_SESSION *pSession,
+                                 uint16_t offset, uint16_t length);
+
+//
+// Key clock set notification, new offset is pSession->timeOffset.
+//
+typedef void (*KEY_TIME_HOOK) (void *context, struct _KEY_SESSION *pSession);
+
+//
+// Current key state, kept apart from the key image so that the image
+// can be replaced while a client is talking to the key. Fields used by
+// every request come first, memory pages are touched by memory access only.
+//
+typedef struct _KEY_SESSION {
+    uint16_t  chiperKey1,     // Keys for chiper
+              chiperKey2;
+    uint8_t   isInitDone;     // Is chiperkeys given to key
+    uint8_t   isKeyOpened;    // Is valid password is given to key
+    uint8_t   encodedStatus;  // Last encoded status
+    uint32_t  keyEpoch;       // sessionEpoch of key image the session belongs to
+    uint32_t  memoryHash;     // memoryHash of key image private pages are based on
+    uint32_t  random;         // encodedStatus randomness, restarted by SET_CHIPER_KEYS
+    uint32_t  randomSeed;     // 0 - randomness is seeded by clock
+    uint16_t  blockOffset;    // next byte of SRM block transfer
+    uint16_t  blockEnd;       // end of block transfer
+    uint8_t   blockFn;        // KEY_FN_READ_26 or KEY_FN_WRITE_27 of block transfer, 0 - none
+    uint8_t   numLogins;      // features logged in
+    uint32_t  logins[KEY_MAX_LOGINS];       // ids of features logged in
+    KEY_WRITE_HOOK writeHook; // called after key memory is written, may be NULL
+    void      *writeContext;  // writeHook context
+    int64_t   timeOffset;     // seconds key clock is ahead of host clock
+    const _Atomic(int64_t) *hostClock;  // host time, s, cached by caller, NULL - engine reads clock
+    KEY_TIME_HOOK timeHook;   // called after key clock is set, may be NULL
+    void      *timeContext;   // timeHook context
+    uint8_t   timePrepared;   // PREPARE_CHANGE_TIME has been given
+    uint8_t   timeSet[4];     // second, minute, hour, day of PREPARE_CHANGE_TIME
+    uint8_t   answerReady;    // answer to QUESTION is waiting for ANSWER
+    uint32_t  answer;         // computed when QUESTION arrives
+    uint8_t   *pages[KEY_MEMORY_PAGES]; // private copies of written memory pages
+} KEY_SESSION, *PKEYSESSION;
+
+//
+// List of supported functions for HASP key
+//
+enum KEY_FN_LIST {
+    KEY_FN_SET_CHIPER_KEYS       	= 0x80,
+    KEY_FN_CHECK_PASS            	= 0x81,
+    KEY_FN_READ_3WORDS           	= 0x82,
+    KEY_FN_WRITE_WORD            	= 0x83,
+    KEY_FN_READ_ST               	= 0x84,
+    KEY_FN_READ_NETMEMORY_3WORDS 	= 0x8B,
+    KEY_FN_HASH_DWORD            	= 0x98,
+    KEY_FN_ECHO_REQUEST          	= 0xA0, // Echo request to key
+    KEY_FN_GET_TIME              	= 0x9C, // Get time (for HASP time) key: sec, min, hour, day, month, year
+    KEY_FN_PREPARE_CHANGE_TIME   	= 0x1D, // Prepare to change time (for HASP time): sec, min in param1, hour, day in param2
+    KEY_FN_COMPLETE_WRITE_TIME   	= 0x9D, // Write time (complete) (for HASP time): month, year in param1
+    KEY_FN_QUESTION         		= 0x1E, // Question dword in param1, param2, answer is prepared
+    KEY_FN_ANSWER                   = 0x9E, // Answer to the last QUESTION
+//-------- SRM Functions ----------------
+    KEY_FN_READ_STRUCT              = 0xA1,
+    KEY_FN_READ_FAT                 = 0xA2, // File of FAT: file id, feature must be logged in
+    KEY_FN_READ_26                  = 0x26, // Start block read: word offset, words
+    KEY_FN_READ_A6                  = 0xA6, // Next bytes of block, as many as wLength allows
+    KEY_FN_WRITE_27                 = 0x27, // Start block write: word offset, words
+    KEY_FN_WRITE_A7                 = 0xA7, // Next 4 bytes of block in param1, param2
+    KEY_FN_SIGNED_READ_28           = 0x28,
+    KEY_FN_SIGNED_READ_A8           = 0xA8,
+    KEY_FN_READ_DATE_TIME           = 0xAC, // Key clock, seconds since 1970
+    KEY_FN_AES_IN                   = 0x29,
+    KEY_FN_AES_OUT                  = 0xA9,
+    KEY_FN_LOGIN                    = 0xAA, // Log in to feature: feature id in param1, param2
+    KEY_FN_LOGOUT                   = 0xAB, // Log out of feature: feature id in param1, param2
+    KEY_FN_SRM_2F                   = 0x2F,
+    KEY_FN_SRM_AF                   = 0xAF
+};
+
+//
+// HASP key operation status
+//
+enum KEY_OPERATION_STATUS {
+    KEY_OPERATION_STATUS_OK                     = 0,
+    KEY_OPERATION_STATUS_ERROR                  = 1,
+    KEY_OPERATION_STATUS_INVALID_MEMORY_ADDRESS = 4,
+    KEY_OPERATION_STATUS_LAST                   = 0x1F
+};
+
+//
+// HASP key request structure
+//
+#pragma pack(1)
+typedef struct _KEY_REQUEST {
+    uint8_t   majorFnCode;    // Requested fn number (type of KEY_FN_LIST)
+    uint16_t  param1,         // Key parameters
+    param2, param3;           // param1 = Value param2 = Index
+} KEY_REQUEST, *PKEY_REQUEST;
+
+//
+// HASP key respond structure
+//
+typedef struct _KEY_RESPONSE {
+    uint8_t    status,         // Status of operation (type of KEY_OPERATION_STATUS)
+               encodedStatus;  // CRC of status and majorFnCode
+    uint8_t    data[4096];     // Output data
+} KEY_RESPONSE, *PKEY_RESPONSE;
+
+#pragma pack()
+
+//
+// Engine functions
+//
+void EmulateKey (PCKEYDATA pKeyData, PKEYSESSION pSession, PKEY_REQUEST request, uint32_t *outBufLen, PKEY_RESPONSE outBuf);
+void KeySessionInit (PKEYSESSION pSession, PCKEYDATA pKeyData);
+void KeySessionFree (PKEYSESSION pSession);
+void KeySessionSeed (PKEYSESSION pSession, uint32_t seed);
+void KeyMemoryRead (PCKEYDATA pKeyData, PKEYSESSION pSession, uint16_t offset, void *buf, uint16_t length);
+int  KeyMemoryWrite (PCKEYDATA pKeyData, PKEYSESSION pSession, uint16_t offset, const void *buf, uint16_t length);
+int32_t KeyLogin (PCKEYDATA pKeyData, PKEYSESSION pSession, uint32_t password);
+int32_t KeyMemorySize (PCKEYDATA pKeyData);
+void KeyHashDword (PCKEYDATA pKeyData, uint32_t *value);
+void KeyChiper (uint16_t *chiperKey1, uint16_t *chiperKey2, void *buf, uint32_t size);
+int  LoadKey (char file[], PKEYDATA pKeyData);
+void UnloadKey (PKEYDATA pKeyData);
+uint32_t HashBytes (uint32_t hash, const void *data, size_t size);
+
+#endif	// HASPEMU_H
@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     HaspNetClient.c
+ * Abstract:
+ *      usbhasp-netclient - client of network key server (see NetKey.h):
+ *      log in, read key memory, hash a dword and log out, or measure
+ *      requests per second of the server.
+ * Notes:
+ *      Benchmark threads have their own socket and session each and keep
+ *      one request in flight, so requests/s is the inverse of round trip
+ *      time times number of threads.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "NetKey.h"
+
+#define CLIENT_TIMEOUT      1000            // ms to wait for UDP reply
+
+typedef struct _CLIENT {
+    pthread_t       thread;
+    int             fd;
+    uint32_t        sequence;
+    uint32_t        handle;
+    uint64_t        requests;
+    int             status;                 // last failed status, -1 - transport error
+} CLIENT, *PCLIENT;
+
+static struct sockaddr_in   server;
+static bool                 tcp = false;
+static uint32_t             password;
+static uint16_t             readOffset = 0;
+static uint16_t             readLength = 16;
+static double               seconds = 0;
+
+static const char *statusNames [] = {
+    "ok", "no key", "no seat", "bad handle", "relogin", "bad request", "bad address", "no session"
+};
+
+static inline uint64_t ClientNow (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Connect client socket to server
+ *
+ * @param pClient - client
+ * @return - 0 in case of success or errno code
+ */
+static int ClientOpen (PCLIENT pClient) {
+        struct timeval tv = { CLIENT_TIMEOUT / 1000, CLIENT_TIMEOUT % 1000 * 1000 };
+        int     one = 1;
+
+    pClient->fd = socket (AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if ( pClient->fd < 0 ) {
+        return errno;
+    }
+    setsockopt (pClient->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ( tcp ) {
+        setsockopt (pClient->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if ( connect (pClient->fd, (struct sockaddr *)&server, sizeof(server)) < 0 ) {
+        int result = errno;
+        close (pClient->fd);
+        pClient->fd = -1;
+        return result;
+    }
+    return 0;
+}
+
+/**
+ * Send request and wait for its reply
+ *
+ * @param pClient - client
+ * @param command - command
+ * @param param1 - first parameter
+ * @param param2 - second parameter
+ * @param data - request data
+ * @param length - bytes of request data
+ * @param reply - reply
+ * @return - status of reply or -1 if there is no reply
+ */
+static int ClientRequest (PCLIENT pClient, uint8_t command, uint16_t param1, uint16_t param2,
+                          const void *data, uint16_t length, PNETKEY_MESSAGE reply) {
+        NETKEY_MESSAGE request;
+
+    request.magic = htole32 (NETKEY_MAGIC);
+    request.sequence = htole32 (++pClient->sequence);
+    request.handle = htole32 (pClient->handle);
+    request.command = command;
+    request.status = 0;
+    request.param1 = htole16 (param1);
+    request.param2 = htole16 (param2);
+    request.length = htole16 (length);
+    if ( length ) {
+        memcpy (request.data, data, length);
+    }
+    if ( send (pClient->fd, &request, NETKEY_HEADER + length, MSG_NOSIGNAL) != (ssize_t)(NETKEY_HEADER + length) ) {
+        return -1;
+    }
+    for ( ;; ) {
+        size_t got = 0;
+        do {                                // TCP may split reply
+            ssize_t len = recv (pClient->fd, (uint8_t *)reply + got, sizeof(*reply) - got, 0);
+            if ( len <= 0 ) {
+                return -1;
+            }
+            got += len;
+        } while ( tcp && (got < NETKEY_HEADER || got < NETKEY_HEADER + le16toh (reply->length)) );
+        if ( le32toh (reply->sequence) == pClient->sequence ) {
+            pClient->requests++;
+            return reply->status;
+        }                                   // late reply of timed out UDP request
+    }
+}
+
+/**
+ * Log in to net key
+ *
+ * @param pClient - client
+ * @param pSize - key memory size, may be NULL
+ * @param pPort - port of key, may be NULL
+ * @return - status
+ */
+static int ClientLogin (PCLIENT pClient, int *pSize, int *pPort) {
+        NETKEY_MESSAGE reply;
+
+    pClient->handle = 0;
+    int status = ClientRequest (pClient, NETKEY_LOGIN, (uint16_t)(password >> 16), (uint16_t)password, NULL, 0, &reply);
+    if ( status == NETKEY_STATUS_OK ) {
+        pClient->handle = le32toh (reply.handle);
+        if ( pSize != NULL ) {
+            *pSize = le16toh (reply.param1);
+        }
+        if ( pPort != NULL ) {
+            *pPort = le16toh (reply.param2);
+        }
+    }
+    return status;
+}
+
+/**
+ * Benchmark thread: READ and HASH in turn till time is over
+ *
+ * @param arg - client
+ * @return - NULL
+ */
+static void *ClientThread (void *arg) {
+        PCLIENT pClient = (PCLIENT)arg;
+        NETKEY_MESSAGE reply;
+        uint32_t value = 0;
+
+    if ( (pClient->status = ClientOpen (pClient)) ) {
+        pClient->status = -1;
+        return NULL;
+    }
+    if ( (pClient->status = ClientLogin (pClient, NULL, NULL)) ) {
+        close (pClient->fd);
+        return NULL;
+    }
+    uint64_t end = ClientNow () + (uint64_t)(seconds * 1e9);
+    while ( pClient->status == 0 && ClientNow () < end ) {
+        pClient->status = ClientRequest (pClient, NETKEY_READ, readOffset, readLength, NULL, 0, &reply);
+        if ( pClient->status == 0 ) {
+            value++;
+            pClient->status = ClientRequest (pClient, NETKEY_HASH, 0, 0, &value, sizeof(value), &reply);
+        }
+    }
+    ClientRequest (pClient, NETKEY_LOGOUT, 0, 0, NULL, 0, &reply);
+    close (pClient->fd);
+    return NULL;
+}
+
+/**
+ * Name of status
+ *
+ * @param status - status or -1
+ * @return - name
+ */
+static const char *ClientStatus (int status) {
+
+    if ( status < 0 ) {
+        return "no reply";
+    }
+    return status < (int)(sizeof(statusNames)/sizeof(statusNames [0])) ? statusNames [status] : "unknown";
+}
+
+int main (int argc, char *argv[]) {
+        CLIENT  client = { .fd = -1 };
+        NETKEY_MESSAGE reply;
+        char    *host = "127.0.0.1";
+        int     port = NETKEY_PORT;
+        int     threads = 1;
+        uint32_t value = 0x12345678;
+        int     opt;
+        char    *end;
+
+    while ( (opt = getopt (argc, argv, "?hTH:P:r:l:x:b:j:")) != -1 ) {
+        switch (opt) {
+        case 'T':
+            tcp = true;
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'P':
+            port = atoi (optarg);
+            break;
+        case 'r':
+            readOffset = (uint16_t)strtoul (optarg, NULL, 0);
+            break;
+        case 'l':
+            readLength = (uint16_t)strtoul (optarg, NULL, 0);
+            break;
+        case 'x':
+            value = strtoul (optarg, NULL, 0);
+            break;
+        case 'b':
+            seconds = atof (optarg);
+            break;
+        case 'j':
+            threads = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: #%s [-T] [-H host] [-P port] [-r offset] [-l bytes] [-x dword] [-b seconds [-j threads]] password\n", argv[0]);
+            fprintf (stderr, "  -T  TCP instead of UDP\n");
+            fprintf (stderr, "  -H  server address (default 127.0.0.1)\n");
+            fprintf (stderr, "  -P  server port (default %d)\n", NETKEY_PORT);
+            fprintf (stderr, "  -r  memory offset to read (default 0)\n");
+            fprintf (stderr, "  -l  bytes to read (default 16)\n");
+            fprintf (stderr, "  -x  dword to hash (default 0x12345678)\n");
+            fprintf (stderr, "  -b  benchmark READ and HASH requests for given seconds\n");
+            fprintf (stderr, "  -j  benchmark clients, each logs in (default 1)\n");
+            fprintf (stderr, "  password is Password of key file, e.g. 0x12345678\n");
+            return -1;
+        }
+    }
+    if ( optind >= argc ) {
+        fprintf (stderr, "Key password is expected, see %s -h.\n", argv[0]);
+        return -1;
+    }
+    password = strtoul (argv [optind], &end, 0);
+    memset (&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons ((uint16_t)port);
+    if ( *end != 0 || inet_pton (AF_INET, host, &server.sin_addr) != 1 ) {
+        fprintf (stderr, "Bad password %s or server address %s.\n", argv [optind], host);
+        return -1;
+    }
+    if ( seconds > 0 ) {
+        threads = threads < 1 ? 1 : threads;
+        PCLIENT clients = calloc (threads, sizeof(CLIENT));
+        if ( clients == NULL ) {
+            return -1;
+        }
+        uint64_t start = ClientNow ();
+        for ( int i = 0; i < threads; i++ ) {
+            if ( pthread_create (&clients [i].thread, NULL, ClientThread, &clients [i]) ) {
+                threads = i;
+                break;
+            }
+        }
+        uint64_t requests = 0;
+        int failed = 0;
+        for ( int i = 0; i < threads; i++ ) {
+            pthread_join (clients [i].thread, NULL);
+            requests += clients [i].requests;
+            if ( clients [i].status ) {
+                fprintf (stderr, "Client %d stopped: %s.\n", i, ClientStatus (clients [i].status));
+                failed++;
+            }
+        }
+        uint64_t wall = ClientNow () - start;
+        printf ("%s: %llu requests of %d clients in %.3f s: %.0f requests/s, %.1f us round trip\n",
+                tcp ? "TCP" : "UDP", (unsigned long long)requests, threads, wall / 1e9,
+                wall ? requests * 1e9 / wall : 0.0, requests ? (double)wall * threads / requests / 1e3 : 0.0);
+        free (clients);
+        return failed ? 1 : 0;
+    }
+    int size, keyPort;
+    int result = ClientOpen (&client);
+    if ( result ) {
+        fprintf (stderr, "Unable to connect to %s:%d: %s.\n", host, port, strerror(result));
+        return -1;
+    }
+    int status = ClientLogin (&client, &size, &keyPort);
+    printf ("LOGIN: %s", ClientStatus (status));
+    if ( status ) {
+        printf ("\n");
+        close (client.fd);
+        return 1;
+    }
+    printf (", handle 0x%08x, port %d, memory %d bytes\n", client.handle, keyPort, size);
+    status = ClientRequest (&client, NETKEY_READ, readOffset, readLength, NULL, 0, &reply);
+    printf ("READ 0x%x: %s", readOffset, ClientStatus (status));
+    for ( int i = 0; status == 0 && i < le16toh (reply.length); i++ ) {
+        printf ("%s%02x", i % 16 ? " " : "\n  ", reply.data [i]);
+    }
+    printf ("\n");
+    uint32_t hash = htole32 (value);
+    status = ClientRequest (&client, NETKEY_HASH, 0, 0, &hash, sizeof(hash), &reply);
+    memcpy (&hash, reply.data, sizeof(hash));
+    printf ("HASH 0x%08x: %s", value, ClientStatus (status));
+    if ( status == 0 ) {
+        printf (", 0x%08x", le32toh (hash));
+    }
+    printf ("\n");
+    status = ClientRequest (&client, NETKEY_LOGOUT, 0, 0, NULL, 0, &reply);
+    printf ("LOGOUT: %s\n", ClientStatus (status));
+    close (client.fd);
+    return status ? 1 : 0;
+}
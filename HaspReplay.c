@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     HaspReplay.c
+ * Abstract:
+ *      usbhasp-replay - replay URB traces (see Trace.c) through the key
+ *      emulation engine, check responses and measure time per URB.
+ * Notes:
+ *      Every device address of a trace is a stream of one port. Stream
+ *      is replayed from its first SET_CHIPER_KEYS with a new session, so
+ *      responses are bit-identical to the trace if emulator has been run
+ *      with the same key file and -r seed and the key memory had not been
+ *      written before the stream. Streams are replayed by several threads
+ *      at once, each replay with its own session on the shared key image.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "HaspEmu.h"
+
+#define PCAP_MAGIC_US               0xa1b2c3d4
+#define PCAP_MAGIC_NS               0xa1b23c4d
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+#define USBMON_HEADER_SIZE          64
+#define REPLAY_BUFFER_SIZE          0x10000
+#define REPLAY_MAX_STREAMS          256
+#define REPLAY_PAIR_WINDOW          64      // URBs searched back for completion of submit
+#define REPLAY_MAX_REPORTS          10      // mismatches reported
+
+typedef struct _REPLAY_URB {
+    uint64_t        id;
+    KEY_REQUEST     request;
+    uint32_t        bufferLength;           // response length asked
+    uint32_t        responseLength;         // response length recorded
+    const uint8_t   *response;              // recorded response, NULL if URB is not completed
+} REPLAY_URB;
+
+typedef struct _REPLAY_STREAM {
+    char            name [PATH_MAX+32];
+    const char      *file;
+    int             bus, dev;
+    bool            started;                // SET_CHIPER_KEYS seen
+    int             skipped;                // HASP URBs before SET_CHIPER_KEYS
+    int             numUrbs, maxUrbs;
+    REPLAY_URB      *urbs;
+    atomic_ullong   mismatches;
+} REPLAY_STREAM;
+
+typedef struct _REPLAY_WORKER {
+    pthread_t       thread;
+    uint64_t        urbs;
+    uint64_t        ns;                     // time spent in EmulateKey loop
+} REPLAY_WORKER;
+
+static REPLAY_STREAM    streams [REPLAY_MAX_STREAMS];
+static int              numStreams;
+static PKEYDATA         pKeyData;
+static uint32_t         seed;
+static bool             verify;
+static int              repeat = 1;
+static atomic_int       nextJob;
+static atomic_int       reports;
+
+static inline uint64_t ReplayNow (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Stream of device
+ *
+ * @param file - trace file name
+ * @param bus - USB bus number
+ * @param dev - device address
+ * @return - stream or NULL if there are too many streams
+ */
+static REPLAY_STREAM *ReplayStream (const char *file, int bus, int dev) {
+
+    for ( int i = 0; i < numStreams; i++ ) {
+        if ( streams [i].file == file && streams [i].bus == bus && streams [i].dev == dev ) {
+            return &streams [i];
+        }
+    }
+    if ( numStreams >= REPLAY_MAX_STREAMS ) {
+        return NULL;
+    }
+    REPLAY_STREAM *pStream = &streams [numStreams++];
+    snprintf (pStream->name, sizeof(pStream->name), "%s bus %d dev %d", file, bus, dev);
+    pStream->file = file;
+    pStream->bus = bus;
+    pStream->dev = dev;
+    return pStream;
+}
+
+/**
+ * Add submitted URB to stream
+ *
+ * @param pStream - stream
+ * @param id - URB id
+ * @param setup - setup packet
+ * @param length - response length asked
+ * @return - 0 in case of success or errno code
+ */
+static int ReplaySubmit (REPLAY_STREAM *pStream, uint64_t id, const uint8_t *setup, uint32_t length) {
+
+    if ( setup [0] != 0xc0 ) {              // standard requests are not emulated by engine
+        return 0;
+    }
+    if ( setup [1] == KEY_FN_SET_CHIPER_KEYS ) {
+        pStream->started = true;
+    }
+    if ( !pStream->started ) {
+        pStream->skipped++;
+        return 0;
+    }
+    if ( pStream->numUrbs == pStream->maxUrbs ) {
+        int maxUrbs = pStream->maxUrbs ? pStream->maxUrbs*2 : 1024;
+        REPLAY_URB *urbs = realloc (pStream->urbs, maxUrbs * sizeof(REPLAY_URB));
+        if ( urbs == NULL ) {
+            return ENOMEM;
+        }
+        pStream->urbs = urbs;
+        pStream->maxUrbs = maxUrbs;
+    }
+    REPLAY_URB *pUrb = &pStream->urbs [pStream->numUrbs++];
+    pUrb->id = id;
+    pUrb->request.majorFnCode = setup [1];
+    pUrb->request.param1 = setup [2] | setup [3] << 8;
+    pUrb->request.param2 = setup [4] | setup [5] << 8;
+    pUrb->request.param3 = setup [6] | setup [7] << 8;
+    pUrb->bufferLength = length < REPLAY_BUFFER_SIZE ? length : REPLAY_BUFFER_SIZE;
+    pUrb->responseLength = 0;
+    pUrb->response = NULL;
+    return 0;
+}
+
+/**
+ * Attach recorded response to submitted URB
+ *
+ * @param pStream - stream
+ * @param id - URB id
+ * @param data - response
+ * @param length - response length
+ */
+static void ReplayComplete (REPLAY_STREAM *pStream, uint64_t id, const uint8_t *data, uint32_t length) {
+
+    for ( int i = pStream->numUrbs-1; i >= 0 && i >= pStream->numUrbs-REPLAY_PAIR_WINDOW; i-- ) {
+        REPLAY_URB *pUrb = &pStream->urbs [i];
+        if ( pUrb->id == id && pUrb->response == NULL ) {
+            pUrb->response = data;
+            pUrb->responseLength = length;
+            return;
+        }
+    }
+}
+
+/**
+ * Load trace file. File stays mapped, responses are not copied.
+ *
+ * @param file - pcap file name
+ * @return - 0 in case of success or errno code
+ */
+static int ReplayLoad (const char *file) {
+        struct stat st;
+
+    int fd = open (file, O_RDONLY | O_CLOEXEC);
+    if ( fd < 0 ) {
+        return errno;
+    }
+    if ( fstat (fd, &st) < 0 ) {
+        close (fd);
+        return errno;
+    }
+    if ( (size_t)st.st_size < 24 ) {
+        close (fd);
+        return EPROTO;
+    }
+    const uint8_t *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if ( data == MAP_FAILED ) {
+        return errno;
+    }
+    uint32_t magic, linkType;
+    memcpy (&magic, data, 4);
+    memcpy (&linkType, data+20, 4);
+    if ( (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) || linkType != LINKTYPE_USB_LINUX_MMAPPED ) {
+        fprintf (stderr, "%s is not a usbmon (mmapped) pcap file in host byte order.\n", file);
+        munmap ((void *)data, st.st_size);
+        return EPROTO;
+    }
+    for ( size_t pos = 24; pos + 16 + USBMON_HEADER_SIZE <= (size_t)st.st_size; ) {
+        uint32_t inclLen, lenCap, length;
+        uint16_t bus;
+        uint64_t id;
+        memcpy (&inclLen, data+pos+8, 4);
+        const uint8_t *packet = data+pos+16;
+        pos += 16 + inclLen;
+        if ( inclLen < USBMON_HEADER_SIZE || pos > (size_t)st.st_size ) {
+            break;
+        }
+        if ( packet [9] != 2 ) {            // control transfers only
+            continue;
+        }
+        memcpy (&id, packet, 8);
+        memcpy (&bus, packet+12, 2);
+        memcpy (&length, packet+32, 4);
+        memcpy (&lenCap, packet+36, 4);
+        if ( lenCap > inclLen - USBMON_HEADER_SIZE ) {
+            lenCap = inclLen - USBMON_HEADER_SIZE;
+        }
+        REPLAY_STREAM *pStream = ReplayStream (file, bus, packet [11]);
+        if ( pStream == NULL ) {
+            fprintf (stderr, "Too many devices in traces, the rest is ignored.\n");
+            break;
+        }
+        if ( packet [8] == 'S' && packet [14] == 0 ) {
+            int result = ReplaySubmit (pStream, id, packet+40, length);
+            if ( result ) {
+                return result;
+            }
+        } else if ( packet [8] == 'C' ) {
+            ReplayComplete (pStream, id, packet + USBMON_HEADER_SIZE, lenCap);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Replay stream once with a new session
+ *
+ * @param pStream - stream
+ * @param pWorker - worker statistics
+ */
+static void ReplayRun (REPLAY_STREAM *pStream, REPLAY_WORKER *pWorker) {
+        KEY_SESSION session;
+        uint8_t     buffer [REPLAY_BUFFER_SIZE];
+        uint64_t    ns = 0;
+
+    memset (&session, 0, sizeof(session));
+    KeySessionInit (&session, pKeyData);
+    KeySessionSeed (&session, seed);
+    for ( int i = 0; i < pStream->numUrbs; i++ ) {
+        REPLAY_URB *pUrb = &pStream->urbs [i];
+        KEY_REQUEST request = pUrb->request;
+        uint32_t length = pUrb->bufferLength;
+        uint64_t start = ReplayNow ();
+        EmulateKey (pKeyData, &session, &request, &length, (PKEY_RESPONSE)buffer);
+        ns += ReplayNow () - start;
+        if ( verify && pUrb->response != NULL &&
+             (length != pUrb->responseLength || memcmp (buffer, pUrb->response, length)) ) {
+            atomic_fetch_add (&pStream->mismatches, 1);
+            if ( atomic_fetch_add (&reports, 1) < REPLAY_MAX_REPORTS ) {
+                fprintf (stderr, "%s: URB %d fn 0x%02X param 0x%04X 0x%04X 0x%04X: response differs\n",
+                         pStream->name, i, request.majorFnCode, request.param1, request.param2, request.param3);
+            }
+        }
+    }
+    KeySessionFree (&session);
+    pWorker->urbs += pStream->numUrbs;
+    pWorker->ns += ns;
+}
+
+/**
+ * Replay thread. Takes stream replays from common job counter.
+ *
+ * @param arg - worker
+ * @return - NULL
+ */
+static void *ReplayThread (void *arg) {
+        REPLAY_WORKER *pWorker = arg;
+
+    for ( int job; (job = atomic_fetch_add (&nextJob, 1)) < numStreams * repeat; ) {
+        ReplayRun (&streams [job % numStreams], pWorker);
+    }
+    return NULL;
+}
+
+/**
+ * Log hook of key image: errors and warnings of the key file go to stderr,
+ * engine debug messages would only disturb timing.
+ *
+ * @param priority - syslog priority
+ * @param fmt - printf format
+ */
+static void ReplayLog (int priority, const char *fmt, ...) {
+        va_list ap;
+
+    if ( priority <= LOG_WARNING ) {
+        va_start (ap, fmt);
+        vfprintf (stderr, fmt, ap);
+        va_end (ap);
+    }
+}
+
+int main (int argc, char *argv[]) {
+        int     threads = 1;
+        int     opt;
+
+    while ( (opt = getopt (argc, argv, "?hr:j:n:")) != -1 ) {
+        switch (opt) {
+        case 'r':
+            seed = strtoul (optarg, NULL, 0);
+            verify = seed != 0;
+            break;
+        case 'j':
+            threads = atoi (optarg);
+            break;
+        case 'n':
+            repeat = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: #%s [-r seed] [-j threads] [-n count] keyfile.json trace.pcap ...\n", argv[0]);
+            fprintf (stderr, "  -r  seed usbhasp has been run with, responses are checked then\n");
+            fprintf (stderr, "  -j  replay threads (default 1)\n");
+            fprintf (stderr, "  -n  replays of every stream (default 1)\n");
+            return -1;
+        }
+    }
+    if ( argc - optind < 2 ) {
+        fprintf (stderr, "Key file and trace files are expected, see %s -h.\n", argv[0]);
+        return -1;
+    }
+    threads = threads < 1 ? 1 : threads;
+    repeat = repeat < 1 ? 1 : repeat;
+    if ( posix_memalign ((void **)&pKeyData, CACHE_LINE, sizeof(KEY_DATA)) ) {
+        return -1;
+    }
+    memset (pKeyData, 0, sizeof(KEY_DATA));
+    pKeyData->logHook = ReplayLog;
+    int result = LoadKey (argv [optind], pKeyData);
+    if ( result ) {
+        fprintf (stderr, "Error %s loading keyfile %s.\n", result > 0 ? strerror(result) : "parsing", argv [optind]);
+        return -1;
+    }
+    for ( int i = optind+1; i < argc; i++ ) {
+        if ( (result = ReplayLoad (argv [i])) ) {
+            fprintf (stderr, "Error %s loading trace %s.\n", strerror(result), argv [i]);
+            return -1;
+        }
+    }
+    for ( int i = 0; i < numStreams; i++ ) {
+        if ( streams [i].numUrbs || streams [i].skipped ) {
+            printf ("%s: %d URBs, %d skipped before SET_CHIPER_KEYS\n", streams [i].name, streams [i].numUrbs, streams [i].skipped);
+        }
+    }
+    if ( !verify ) {
+        printf ("No seed is given, responses are not checked.\n");
+    }
+    REPLAY_WORKER *workers = calloc (threads, sizeof(REPLAY_WORKER));
+    if ( workers == NULL ) {
+        return -1;
+    }
+    uint64_t start = ReplayNow ();
+    for ( int i = 0; i < threads; i++ ) {
+        if ( (result = pthread_create (&workers [i].thread, NULL, ReplayThread, &workers [i])) ) {
+            fprintf (stderr, "Unable to start replay thread: %s.\n", strerror(result));
+            threads = i;
+            break;
+        }
+    }
+    uint64_t urbs = 0, ns = 0, mismatches = 0;
+    for ( int i = 0; i < threads; i++ ) {
+        pthread_join (workers [i].thread, NULL);
+        urbs += workers [i].urbs;
+        ns += workers [i].ns;
+    }
+    uint64_t wall = ReplayNow () - start;
+    for ( int i = 0; i < numStreams; i++ ) {
+        mismatches += atomic_load (&streams [i].mismatches);
+    }
+    printf ("Replayed %llu URBs of %d streams x %d on %d threads in %.3f s: %.1f ns/URB, %.0f URB/s",
+            (unsigned long long)urbs, numStreams, repeat, threads, wall / 1e9,
+            urbs ? (double)ns / urbs : 0.0, wall ? urbs * 1e9 / wall : 0.0);
+    if ( verify ) {
+        printf (", %llu mismatches", (unsigned long long)mismatches);
+    }
+    printf ("\n");
+    free (workers);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     HaspShmClient.c
+ * Abstract:
+ *      usbhasp-shmclient - client of shared memory key server (see
+ *      ShmKey.h): send HASP function requests to a key of the emulator
+ *      and print responses, or measure round trip time of requests and
+ *      time of reading whole key memory.
+ * Notes:
+ *      Client spins for given number of checks before it sleeps on done,
+ *      spinning is of use only if the server has a CPU of its own. Memory
+ *      is read through the chiper of the session, as HASP API does, so
+ *      client keeps copies of chiper keys (KeyChiper of libhaspemu).
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ShmKey.h"
+
+#define CLIENT_TIMEOUT      1000            // ms to wait for server
+#define CLIENT_SAMPLES      (1 << 20)       // round trips kept for percentiles
+
+static PSHMKEY_PAGE     pPage;
+static PSHMKEY_RING     pRing;
+static unsigned         head;               // requests submitted
+static long             spins = 0;
+static uint16_t         chiperKey1;         // mirror of session chiper keys
+static uint16_t         chiperKey2;
+
+static inline uint64_t ClientNow (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Map shared memory object of server and take a free ring
+ *
+ * @param name - shared memory object name
+ * @param port - port of key
+ * @return - 0 in case of success or errno code
+ */
+static int ClientOpen (const char *name, int port) {
+
+    int fd = shm_open (name, O_RDWR | O_CLOEXEC, 0);
+    if ( fd < 0 ) {
+        return errno;
+    }
+    pPage = mmap (NULL, sizeof(SHMKEY_PAGE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if ( pPage == MAP_FAILED ) {
+        return errno;
+    }
+    if ( pPage->magic != SHMKEY_MAGIC || pPage->version != SHMKEY_VERSION || pPage->size != sizeof(SHMKEY_PAGE) ) {
+        return EPROTO;
+    }
+    atomic_thread_fence (memory_order_acquire);
+    for ( unsigned i = 0; i < pPage->numRings && i < SHMKEY_RINGS; i++ ) {
+        int owner = 0;
+        if ( atomic_compare_exchange_strong (&pPage->rings [i].owner, &owner, getpid ()) ) {
+            pRing = &pPage->rings [i];
+            break;
+        }
+    }
+    if ( pRing == NULL ) {
+        return EBUSY;
+    }
+    uint64_t end = ClientNow () + CLIENT_TIMEOUT * 1000000ull;
+    head = atomic_load (&pRing->head);
+    while ( atomic_load (&pRing->done) != head ) {     // requests of exited owner are still answered
+        if ( ClientNow () > end ) {
+            return ETIMEDOUT;
+        }
+        usleep (1000);
+    }
+    atomic_store_explicit (&pRing->port, port, memory_order_relaxed);
+    atomic_fetch_add_explicit (&pRing->generation, 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Give the ring back
+ */
+static void ClientClose (void) {
+
+    if ( pRing != NULL ) {
+        atomic_store (&pRing->owner, 0);
+    }
+    if ( pPage != NULL && pPage != MAP_FAILED ) {
+        munmap (pPage, sizeof(SHMKEY_PAGE));
+    }
+}
+
+/**
+ * Put request into ring, server is woken by ClientRing
+ *
+ * @param fn - HASP function
+ * @param param1 - first parameter
+ * @param param2 - second parameter
+ * @param length - bytes of response expected
+ */
+static void ClientSubmit (uint8_t fn, uint16_t param1, uint16_t param2, uint16_t length) {
+
+    PSHMKEY_ENTRY pEntry = &pRing->entries [head & (SHMKEY_DEPTH-1)];
+    pEntry->request.majorFnCode = fn;
+    pEntry->request.param1 = param1;
+    pEntry->request.param2 = param2;
+    pEntry->request.param3 = length;
+    atomic_store_explicit (&pRing->head, ++head, memory_order_release);
+}
+
+/**
+ * Ring the doorbell of server
+ */
+static void ClientRing (void) {
+
+    atomic_fetch_add (&pPage->doorbell, 1);
+    if ( atomic_load (&pPage->sleeping) ) {
+        ShmKeyWake (&pPage->doorbell);
+    }
+}
+
+/**
+ * Wait till all submitted requests are answered
+ *
+ * @return - 0 in case of success or ETIMEDOUT
+ */
+static int ClientWait (void) {
+        uint64_t end = 0;
+
+    for ( long spin = 0; spin < spins; spin++ ) {
+        if ( atomic_load_explicit (&pRing->done, memory_order_acquire) == head ) {
+            return 0;
+        }
+    }
+    for ( ;; ) {
+        atomic_store (&pRing->waiting, 1);
+        unsigned done = atomic_load (&pRing->done);
+        if ( done == head ) {
+            atomic_store_explicit (&pRing->waiting, 0, memory_order_relaxed);
+            return 0;
+        }
+        if ( end == 0 ) {
+            end = ClientNow () + CLIENT_TIMEOUT * 1000000ull;
+        } else if ( ClientNow () > end ) {
+            atomic_store_explicit (&pRing->waiting, 0, memory_order_relaxed);
+            return ETIMEDOUT;
+        }
+        ShmKeyWait (&pRing->done, done, CLIENT_TIMEOUT);
+    }
+}
+
+/**
+ * Send one request and print its response
+ *
+ * @param title - request name
+ * @param fn - HASP function
+ * @param param1 - first parameter
+ * @param param2 - second parameter
+ * @param length - bytes of response expected
+ * @return - 0 in case of success or errno code
+ */
+static int ClientCall (const char *title, uint8_t fn, uint16_t param1, uint16_t param2, uint16_t length) {
+
+    ClientSubmit (fn, param1, param2, length);
+    ClientRing ();
+    int result = ClientWait ();
+    if ( result ) {
+        printf ("%s: no response\n", title);
+        return result;
+    }
+    PSHMKEY_ENTRY pEntry = &pRing->entries [(head-1) & (SHMKEY_DEPTH-1)];
+    if ( pEntry->length == 0 ) {
+        printf ("%s: STALL, no key on port\n", title);
+        return ENODEV;
+    }
+    printf ("%s:", title);
+    for ( uint32_t i = 0; i < pEntry->length; i++ ) {
+        printf (" %02x", ((uint8_t *)&pEntry->response) [i]);
+    }
+    printf ("\n");
+    return 0;
+}
+
+/**
+ * Call HASP function through the chiper of session
+ *
+ * @param fn - HASP function
+ * @param param1 - first parameter
+ * @param param2 - second parameter
+ * @param encoded - bytes of parameters the key decodes: 0, 2 or 4
+ * @param data - decoded response data, may be NULL if length is 0
+ * @param length - bytes of response data expected
+ * @return - key status, -1 if there is no response
+ */
+static int ClientKeyCall (uint8_t fn, uint16_t param1, uint16_t param2, int encoded, void *data, uint16_t length) {
+        uint16_t params [2] = { param1, param2 };
+        uint8_t status [2];
+
+    KeyChiper (&chiperKey1, &chiperKey2, params, encoded);
+    PSHMKEY_ENTRY pEntry = &pRing->entries [head & (SHMKEY_DEPTH-1)];
+    ClientSubmit (fn, params [0], params [1], sizeof(status) + length);
+    ClientRing ();
+    if ( ClientWait () || pEntry->length < sizeof(status) ) {
+        return -1;
+    }
+    memcpy (status, &pEntry->response, sizeof(status));
+    KeyChiper (&chiperKey1, &chiperKey2, status, sizeof(status));
+    if ( status [0] != KEY_OPERATION_STATUS_OK ) {
+        return status [0];
+    }
+    if ( length ) {
+        memcpy (data, pEntry->response.data, pEntry->length - sizeof(status));
+        KeyChiper (&chiperKey1, &chiperKey2, data, pEntry->length - sizeof(status));
+    }
+    chiperKey2 = (chiperKey2 & 0xFF) | status [1] << 8;
+    return 0;
+}
+
+/**
+ * Set chiper keys and open key with password
+ *
+ * @param password - Password of key file
+ * @return - memory size of key or 0 in case of failure
+ */
+static int ClientKeyOpen (uint32_t password) {
+        uint8_t data [5];
+
+    chiperKey1 = (uint16_t)ClientNow ();
+    ClientSubmit (KEY_FN_SET_CHIPER_KEYS, chiperKey1, 0, sizeof(uint16_t) + sizeof(data));
+    ClientRing ();
+    PSHMKEY_ENTRY pEntry = &pRing->entries [(head-1) & (SHMKEY_DEPTH-1)];
+    chiperKey2 = 0xA0CB;
+    if ( ClientWait () || pEntry->length != sizeof(uint16_t) + sizeof(data) ) {
+        return 0;
+    }
+    KeyChiper (&chiperKey1, &chiperKey2, &pEntry->response, pEntry->length);
+    if ( pEntry->response.status != KEY_OPERATION_STATUS_OK ) {
+        return 0;
+    }
+    chiperKey2 = (chiperKey2 & 0xFF) | pEntry->response.encodedStatus << 8;
+    if ( ClientKeyCall (KEY_FN_CHECK_PASS, (uint16_t)(password >> 16), (uint16_t)password, 4, data, 3) ) {
+        return 0;
+    }
+    return data [0] | data [1] << 8;
+}
+
+/**
+ * Read key memory with READ_3WORDS, 6 bytes per request
+ *
+ * @param buf - memory
+ * @param size - memory size
+ * @return - number of requests, 0 in case of failure
+ */
+static int ClientRead3Words (uint8_t *buf, int size) {
+        uint8_t data [6];
+        int     requests = 0;
+
+    for ( int offset = 0; offset < size; offset += sizeof(data), requests++ ) {
+        if ( ClientKeyCall (KEY_FN_READ_3WORDS, offset / 2, 0, 2, data, sizeof(data)) ) {
+            return 0;
+        }
+        memcpy (buf + offset, data, size - offset < (int)sizeof(data) ? size - offset : (int)sizeof(data));
+    }
+    return requests;
+}
+
+/**
+ * Read key memory with block read READ_26, READ_A6
+ *
+ * @param buf - memory
+ * @param size - memory size
+ * @param chunk - bytes per READ_A6
+ * @return - number of requests, 0 in case of failure
+ */
+static int ClientReadBlock (uint8_t *buf, int size, int chunk) {
+        int     requests = 1;
+
+    if ( ClientKeyCall (KEY_FN_READ_26, 0, size / 2, 4, NULL, 0) ) {
+        return 0;
+    }
+    for ( int offset = 0; offset < size; offset += chunk, requests++ ) {
+        int n = size - offset < chunk ? size - offset : chunk;
+        if ( ClientKeyCall (KEY_FN_READ_A6, 0, 0, 0, buf + offset, n) ) {
+            return 0;
+        }
+    }
+    return requests;
+}
+
+/**
+ * Measure time of reading whole key memory by 3 words and by blocks
+ *
+ * @param password - Password of key file
+ * @param count - reads of each kind
+ * @param chunk - bytes per READ_A6
+ * @return - 0 in case of success
+ */
+static int ClientMemory (uint32_t password, int count, int chunk) {
+        uint8_t words [KEY_MEMORY_SIZE], block [KEY_MEMORY_SIZE];
+        int     requests [2] = { 0, 0 };
+        uint64_t ns [2] = { 0, 0 };
+
+    int size = ClientKeyOpen (password);
+    if ( size <= 0 || size > KEY_MEMORY_SIZE ) {
+        fprintf (stderr, "Unable to open key, wrong password?\n");
+        return 1;
+    }
+    for ( int i = 0; i < count; i++ ) {
+        uint64_t start = ClientNow ();
+        requests [0] = ClientRead3Words (words, size);
+        uint64_t middle = ClientNow ();
+        requests [1] = ClientReadBlock (block, size, chunk);
+        ns [0] += middle - start;
+        ns [1] += ClientNow () - middle;
+        if ( !requests [0] || !requests [1] ) {
+            fprintf (stderr, "Memory read failed.\n");
+            return 1;
+        }
+    }
+    printf ("%d bytes of memory, %d reads of each kind\n", size, count);
+    printf ("READ_3WORDS:       %4d requests, %8.1f us per memory read\n", requests [0], ns [0] / 1e3 / count);
+    printf ("READ_26 + READ_A6: %4d requests, %8.1f us per memory read, %d bytes per READ_A6\n",
+            requests [1], ns [1] / 1e3 / count, chunk);
+    if ( memcmp (words, block, size) ) {
+        fprintf (stderr, "Memory read by blocks differs from memory read by 3 words.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int ClientCompare (const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main (int argc, char *argv[]) {
+        char    *name = SHMKEY_NAME;
+        int     port = 1;
+        int     fn = KEY_FN_SET_CHIPER_KEYS;
+        int     length = 16;
+        int     depth = 1;
+        double  seconds = 0;
+        char    *password = NULL;
+        int     count = 100;
+        int     opt;
+
+    while ( (opt = getopt (argc, argv, "?hp:f:l:b:q:s:m:n:")) != -1 ) {
+        switch (opt) {
+        case 'p':
+            port = atoi (optarg);
+            break;
+        case 'f':
+            fn = (int)strtoul (optarg, NULL, 0);
+            break;
+        case 'l':
+            length = (int)strtoul (optarg, NULL, 0);
+            break;
+        case 'b':
+            seconds = atof (optarg);
+            break;
+        case 'q':
+            depth = atoi (optarg);
+            break;
+        case 's':
+            spins = atol (optarg);
+            break;
+        case 'm':
+            password = optarg;
+            break;
+        case 'n':
+            count = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: #%s [-p port] [-f fn] [-l bytes] [-b seconds [-q depth] [-s spins]] [-m password [-n count]] [name]\n", argv[0]);
+            fprintf (stderr, "  -p  port of key (default 1)\n");
+            fprintf (stderr, "  -f  HASP function to benchmark (default 0x%02X SET_CHIPER_KEYS)\n", KEY_FN_SET_CHIPER_KEYS);
+            fprintf (stderr, "  -l  bytes of response (default 16)\n");
+            fprintf (stderr, "  -b  benchmark round trip of requests for given seconds\n");
+            fprintf (stderr, "  -q  requests in flight, max %d (default 1)\n", SHMKEY_DEPTH);
+            fprintf (stderr, "  -s  checks of response before sleeping on futex (default 0)\n");
+            fprintf (stderr, "  -m  open key with Password of key file and time reading whole memory\n");
+            fprintf (stderr, "      by READ_3WORDS and by READ_26/READ_A6 blocks of -l bytes (e.g. -l 4094)\n");
+            fprintf (stderr, "  -n  memory reads of each kind (default 100)\n");
+            fprintf (stderr, "  name  shared memory object of emulator -M option (default %s)\n", SHMKEY_NAME);
+            return -1;
+        }
+    }
+    if ( optind < argc ) {
+        name = argv [optind];
+    }
+    int result = ClientOpen (name, port);
+    if ( result ) {
+        fprintf (stderr, "Unable to take a ring of %s: %s. Is usbhasp running with -M?\n", name, strerror(result));
+        ClientClose ();
+        return -1;
+    }
+    if ( password != NULL ) {
+        int chunk = length < 2 ? 2 : length > (int)sizeof(((PKEY_RESPONSE)0)->data) ? (int)sizeof(((PKEY_RESPONSE)0)->data) : length;
+        result = ClientMemory (strtoul (password, NULL, 0), count < 1 ? 1 : count, chunk);
+        ClientClose ();
+        return result;
+    }
+    if ( seconds <= 0 ) {
+        result = ClientCall ("ECHO_REQUEST", KEY_FN_ECHO_REQUEST, 0, 0, 1);
+        if ( !result ) {
+            result = ClientCall ("SET_CHIPER_KEYS", KEY_FN_SET_CHIPER_KEYS, 0x1234, 0, 16);
+        }
+        if ( !result ) {
+            result = ClientCall ("READ_ST", KEY_FN_READ_ST, 0, 0, 16);
+        }
+        ClientClose ();
+        return result ? 1 : 0;
+    }
+    depth = depth < 1 ? 1 : depth > SHMKEY_DEPTH ? SHMKEY_DEPTH : depth;
+    uint32_t *samples = malloc (CLIENT_SAMPLES * sizeof(uint32_t));
+    if ( samples == NULL ) {
+        ClientClose ();
+        return -1;
+    }
+    size_t numSamples = 0;
+    uint64_t requests = 0;
+    uint64_t start = ClientNow ();
+    uint64_t end = start + (uint64_t)(seconds * 1e9);
+    uint64_t now = start;
+    while ( now < end && result == 0 ) {
+        for ( int i = 0; i < depth; i++ ) {
+            ClientSubmit ((uint8_t)fn, 0x1234 + (uint16_t)requests, 0, (uint16_t)length);
+        }
+        ClientRing ();
+        result = ClientWait ();
+        uint64_t then = now;
+        now = ClientNow ();
+        requests += depth;
+        if ( numSamples < CLIENT_SAMPLES ) {
+            samples [numSamples++] = (uint32_t)(now - then);
+        }
+    }
+    if ( result ) {
+        fprintf (stderr, "Server stopped answering: %s.\n", strerror(result));
+    }
+    qsort (samples, numSamples, sizeof(uint32_t), ClientCompare);
+    uint64_t wall = now - start;
+    printf ("%llu requests of fn 0x%02X, %d in flight, in %.3f s: %.0f requests/s\n",
+            (unsigned long long)requests, fn, depth, wall / 1e9, wall ? requests * 1e9 / wall : 0.0);
+    if ( numSamples ) {
+        printf ("round trip of %d: avg %.2f us, p50 %.2f us, p99 %.2f us, max %.2f us\n", depth,
+                (double)wall / (requests / depth) / 1e3, samples [numSamples / 2] / 1e3,
+                samples [numSamples * 99 / 100] / 1e3, samples [numSamples-1] / 1e3);
+    }
+    free (samples);
+    ClientClose ();
+    return result ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     HaspTop.c
+ * Abstract:
+ *      usbhasp-top - live view of emulator statistics page.
+ * Notes:
+ *      Statistics page is mapped read only, emulator is not disturbed
+ *      by viewers. Rates are computed from counters sampled every interval.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <libusb_vhci.h>
+#include "Stats.h"
+
+typedef struct _TOP_SAMPLE {
+    uint64_t        urbs, haspUrbs, usbUrbs, stalls, cancels;
+    uint64_t        fn [256];
+} TOP_SAMPLE;
+
+static TOP_SAMPLE   samples [2][STATS_MAX_PORTS+1];
+
+/**
+ * Map statistics page
+ *
+ * @param name - shared memory object name
+ * @return - statistics page or NULL
+ */
+static PSTATS_PAGE TopOpen (const char *name) {
+
+    int fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0);
+    if ( fd < 0 ) {
+        return NULL;
+    }
+    PSTATS_PAGE pPage = mmap (NULL, sizeof(STATS_PAGE), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if ( pPage == MAP_FAILED ) {
+        return NULL;
+    }
+    if ( pPage->magic != STATS_MAGIC || pPage->version != STATS_VERSION || pPage->size != sizeof(STATS_PAGE) ) {
+        munmap (pPage, sizeof(STATS_PAGE));
+        errno = EPROTO;
+        return NULL;
+    }
+    return pPage;
+}
+
+/**
+ * Take counters of port
+ *
+ * @param pSample - [out] sample
+ * @param pPort - port counters
+ */
+static void TopSample (TOP_SAMPLE *pSample, PSTATS_PORT pPort) {
+
+    pSample->urbs = atomic_load_explicit (&pPort->urbs, memory_order_relaxed);
+    pSample->haspUrbs = atomic_load_explicit (&pPort->haspUrbs, memory_order_relaxed);
+    pSample->usbUrbs = atomic_load_explicit (&pPort->usbUrbs, memory_order_relaxed);
+    pSample->stalls = atomic_load_explicit (&pPort->stalls, memory_order_relaxed);
+    pSample->cancels = atomic_load_explicit (&pPort->cancels, memory_order_relaxed);
+    for ( int i = 0; i < 256; i++ ) {
+        pSample->fn [i] = atomic_load_explicit (&pPort->fn [i], memory_order_relaxed);
+    }
+}
+
+/**
+ * Counter rate, counters restarted by emulator give 0
+ *
+ * @param now - current value
+ * @param prev - previous value
+ * @param interval - seconds between samples
+ * @return - events per second
+ */
+static double TopRate (uint64_t now, uint64_t prev, double interval) {
+
+    return now >= prev ? (now - prev) / interval : 0;
+}
+
+/**
+ * Port status name
+ *
+ * @param status - port status
+ * @return - name
+ */
+static const char *TopStatus (unsigned status) {
+
+    if ( ~status & USB_VHCI_PORT_STAT_POWER ) {
+        return "off";
+    } else if ( status & USB_VHCI_PORT_STAT_RESET ) {
+        return "reset";
+    } else if ( status & USB_VHCI_PORT_STAT_SUSPEND ) {
+        return "suspend";
+    } else if ( status & USB_VHCI_PORT_STAT_ENABLE ) {
+        return "enabled";
+    } else if ( status & USB_VHCI_PORT_STAT_CONNECTION ) {
+        return "connect";
+    }
+    return "power";
+}
+
+/**
+ * Print one port line
+ *
+ * @param name - port name
+ * @param pPort - port counters
+ * @param pNow - current sample
+ * @param pPrev - previous sample
+ * @param interval - seconds between samples
+ */
+static void TopPort (const char *name, PSTATS_PORT pPort, TOP_SAMPLE *pNow, TOP_SAMPLE *pPrev, double interval) {
+        char    top [16] = "-";
+        uint64_t topCount = 0;
+
+    for ( int i = 0; i < 256; i++ ) {
+        if ( pNow->fn [i] >= pPrev->fn [i] && pNow->fn [i] - pPrev->fn [i] > topCount ) {
+            topCount = pNow->fn [i] - pPrev->fn [i];
+            snprintf (top, sizeof(top), "0x%02X %.0f/s", i, topCount / interval);
+        }
+    }
+    printf ("%-5s %4d %-8s %8.0f %8.0f %7.0f %7.0f %7.0f %6llu %6llu %6llu %6llu %6llu  %s\n", name,
+            atomic_load_explicit (&pPort->addr, memory_order_relaxed),
+            TopStatus (atomic_load_explicit (&pPort->status, memory_order_relaxed)),
+            TopRate (pNow->urbs, pPrev->urbs, interval), TopRate (pNow->haspUrbs, pPrev->haspUrbs, interval),
+            TopRate (pNow->usbUrbs, pPrev->usbUrbs, interval), TopRate (pNow->stalls, pPrev->stalls, interval),
+            TopRate (pNow->cancels, pPrev->cancels, interval),
+            (unsigned long long)atomic_load_explicit (&pPort->fetchErrors, memory_order_relaxed) +
+            atomic_load_explicit (&pPort->givebackErrors, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit (&pPort->portStats, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit (&pPort->resets, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit (&pPort->keyOpens, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit (&pPort->urbs, memory_order_relaxed),
+            top);
+}
+
+int main (int argc, char *argv[]) {
+        double  interval = 1.0;
+        long    iterations = -1;
+        bool    batch = false;
+        char    *name = STATS_NAME;
+        int     opt;
+        int     cur = 0;
+
+    while ( (opt = getopt (argc, argv, "?hbi:n:")) != -1 ) {
+        switch (opt) {
+        case 'b':
+            batch = true;
+            break;
+        case 'i':
+            interval = atof (optarg);
+            break;
+        case 'n':
+            iterations = atol (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: #%s [-b] [-i seconds] [-n count] [name]\n", argv[0]);
+            fprintf (stderr, "  -b  batch mode, do not clear screen\n");
+            fprintf (stderr, "  -i  refresh interval, s (default 1)\n");
+            fprintf (stderr, "  -n  number of refreshes\n");
+            fprintf (stderr, "  name  statistics shared memory name (default %s)\n", STATS_NAME);
+            return -1;
+        }
+    }
+    if ( optind < argc ) {
+        name = argv [optind];
+    }
+    if ( interval < 0.1 ) {
+        interval = 0.1;
+    }
+    PSTATS_PAGE pPage = TopOpen (name);
+    if ( pPage == NULL ) {
+        fprintf (stderr, "Unable to open statistics %s: %s. Is usbhasp running?\n", name, strerror(errno));
+        return -1;
+    }
+    int pid = atomic_load_explicit (&pPage->pid, memory_order_relaxed);
+    for ( int i = 0; i <= STATS_MAX_PORTS; i++ ) {
+        TopSample (&samples [cur][i], i < STATS_MAX_PORTS ? &pPage->ports [i] : &pPage->unbound);
+    }
+    for ( long n = 0; iterations < 0 || n < iterations; n++ ) {
+        struct timespec ts = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+        while ( nanosleep (&ts, &ts) < 0 && errno == EINTR );
+        if ( kill (pid, 0) < 0 && errno == ESRCH ) {
+            PSTATS_PAGE pNew = TopOpen (name);      // emulator restarted?
+            if ( pNew == NULL ) {
+                fprintf (stderr, "usbhasp (pid %d) has exited.\n", pid);
+                break;
+            }
+            munmap (pPage, sizeof(STATS_PAGE));
+            pPage = pNew;
+            pid = atomic_load_explicit (&pPage->pid, memory_order_relaxed);
+            memset (samples, 0, sizeof(samples));
+        }
+        int prev = cur;
+        cur ^= 1;
+        for ( int i = 0; i <= STATS_MAX_PORTS; i++ ) {
+            TopSample (&samples [cur][i], i < STATS_MAX_PORTS ? &pPage->ports [i] : &pPage->unbound);
+        }
+        long long up = time (NULL) - atomic_load_explicit (&pPage->startTime, memory_order_relaxed);
+        if ( !batch ) {
+            printf ("\033[H\033[2J");
+        }
+        printf ("usbhasp pid %d, %s, up %lldd %02lld:%02lld:%02lld, interval %.1f s\n", pid, name,
+                up / 86400, up / 3600 % 24, up / 60 % 60, up % 60, interval);
+        printf ("PORT  ADDR STATUS      URB/s   HASP/s   USB/s STALL/s CNCL/s ERRORS  STATS RESETS  OPENS   URBS  TOP FN\n");
+        int numPorts = atomic_load_explicit (&pPage->numPorts, memory_order_relaxed);
+        for ( int i = 0; i < numPorts && i < STATS_MAX_PORTS; i++ ) {
+            char port [8];
+            snprintf (port, sizeof(port), "%d", i+1);
+            TopPort (port, &pPage->ports [i], &samples [cur][i], &samples [prev][i], interval);
+        }
+        TopPort ("?", &pPage->unbound, &samples [cur][STATS_MAX_PORTS], &samples [prev][STATS_MAX_PORTS], interval);
+        bool netHeader = false;
+        for ( int i = 0; i < numPorts && i < STATS_MAX_PORTS; i++ ) {
+            PSTATS_PORT pPort = &pPage->ports [i];
+            unsigned seatsMax = atomic_load_explicit (&pPort->seatsMax, memory_order_relaxed);
+            if ( seatsMax == 0 ) {          // not a net key
+                continue;
+            }
+            if ( !netHeader ) {
+                printf ("\nNET   SEATS    MAX  DENIALS EXPIRIES\n");
+                netHeader = true;
+            }
+            char max [16] = "-";
+            if ( seatsMax != UINT32_MAX ) {
+                snprintf (max, sizeof(max), "%u", seatsMax);
+            }
+            printf ("%-5d %5u %6s %8llu %8llu\n", i+1,
+                    atomic_load_explicit (&pPort->seatsUsed, memory_order_relaxed), max,
+                    (unsigned long long)atomic_load_explicit (&pPort->seatDenials, memory_order_relaxed),
+                    (unsigned long long)atomic_load_explicit (&pPort->leaseExpiries, memory_order_relaxed));
+        }
+        fflush (stdout);
+    }
+    munmap (pPage, sizeof(STATS_PAGE));
+    return 0;
+}
@@ -0,0 +1,678 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Journal.c
+ * Abstract:
+ *      Write-ahead journal of HASP key memory writes.
+ * Notes:
+ *      Journal is kept per port: ports emulating the same key file write
+ *      their own memory pages. Files are <keyfile>.journal and
+ *      <keyfile>.snapshot for the first port of key file and
+ *      <keyfile>.<n>.journal, <keyfile>.<n>.snapshot for others.
+ *      URB thread only puts written words into lock-free single producer
+ *      ring. Journal thread appends them to journal and fsyncs in groups:
+ *      every interval or when batch of records is collected. Journal thread
+ *      keeps shadow copy of port memory and periodically compacts journal
+ *      into snapshot of it, so it never touches key images.
+ *      Snapshot and journal are bound to key memory loaded from key file
+ *      by hash and dropped if Data of key file has been changed. Ring
+ *      records are tagged with the hash too, records written before Data
+ *      change are dropped.
+ *      If ring overflows URB thread copies whole port memory to resync
+ *      buffer, journal thread takes it as the new shadow and snapshots it.
+ *      Snapshot keeps generation of journal it includes. Journal with
+ *      same or older generation is ignored, so crash during compaction
+ *      never rolls memory back.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include "USBKeyEmu.h"
+#include "Journal.h"
+#include "KeyFile.h"
+#include "Log.h"
+
+#define JOURNAL_RING_SIZE       4096            // records, power of 2
+#define JOURNAL_COMPACT_RECORDS 16384           // journal records to start compaction
+#define JOURNAL_COMPACT_TIME    600             // seconds between compactions
+#define JOURNAL_MAGIC           0x4A505348      // "HSPJ"
+#define SNAPSHOT_MAGIC          0x53505348      // "HSPS"
+#define JOURNAL_VERSION         2
+#define JOURNAL_BYTE            0x8000          // record offset flag - single byte written
+#define JOURNAL_NAME_MAX        (PATH_MAX+24)   // key file name, instance and suffix
+
+#pragma pack(1)
+typedef struct _JOURNAL_HEADER {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    baseHash;       // hash of key memory loaded from key file
+    uint32_t    size;           // key memory size
+    uint32_t    generation;     // journal generation
+} JOURNAL_HEADER;
+
+typedef struct _JOURNAL_RECORD {
+    uint16_t    offset;         // memory offset
+    uint16_t    value;          // written word
+    uint32_t    check;          // hash of record, its number and generation
+} JOURNAL_RECORD;
+#pragma pack()
+
+struct _KEY_JOURNAL {
+    atomic_uint     head __attribute__((aligned(CACHE_LINE))); // written by URB thread only
+    bool            resyncPending;                      // URB thread only, records lost
+    atomic_uint     tail __attribute__((aligned(CACHE_LINE))); // written by journal thread only
+    uint64_t        ring [JOURNAL_RING_SIZE];           // hash << 32 | offset << 16 | value
+    atomic_int      resyncState;                        // 1 - resync buffer is filled
+    unsigned        resyncHead;                         // ring records included into resync buffer
+    uint32_t        resyncHash;                         // memoryHash resync buffer is based on
+    uint8_t         resync [KEY_MEMORY_SIZE];           // port memory copied by URB thread
+    pthread_mutex_t lock __attribute__((aligned(CACHE_LINE))); // journal thread vs key reload
+    PUSBHASP        pKey;
+    int             fd;
+    uint32_t        baseHash;
+    uint8_t         shadow [KEY_MEMORY_SIZE];           // port memory with all flushed records
+    uint32_t        generation;
+    uint32_t        records;                            // records in journal file
+    bool            torn;                               // failed records are not cut from journal file
+    time_t          compactTime;
+    char            journalName [JOURNAL_NAME_MAX];
+    char            snapshotName [JOURNAL_NAME_MAX];
+};
+
+static PKEYJOURNAL  journals [MAX_HASPKEYS];
+static int          numJournals;
+static pthread_mutex_t journalsLock = PTHREAD_MUTEX_INITIALIZER;    // journals of attached/detached ports
+static int          journalInterval = JOURNAL_INTERVAL;
+static unsigned     journalBatch = JOURNAL_BATCH;
+static int          journalEvent = -1;
+static sem_t        *journalMutex;
+static pthread_t    journalThread;
+static bool         journalStarted = false;
+
+/**
+ * Check value of journal record
+ *
+ * @param generation - journal generation
+ * @param index - record number
+ * @param offset - record offset
+ * @param value - record value
+ * @return - check value
+ */
+static uint32_t RecordCheck (uint32_t generation, uint32_t index, uint16_t offset, uint16_t value) {
+        uint32_t data [3] = { generation, index, ((uint32_t)offset << 16) | value };
+
+    return HashBytes (HASH_INIT, data, sizeof(data));
+}
+
+/**
+ * Write whole buffer
+ *
+ * @param fd - file
+ * @param buf - data
+ * @param size - data size
+ * @return - 0 or errno code
+ */
+static int WriteAll (int fd, const void *buf, size_t size) {
+
+    for ( const uint8_t *p = buf; size > 0; ) {
+        ssize_t n = write (fd, p, size);
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Sync directory of file, so that rename survives crash
+ *
+ * @param file - file name
+ */
+static void SyncDir (const char *file) {
+        char path [PATH_MAX];
+
+    strncpy (path, file, sizeof(path)-1);
+    path [sizeof(path)-1] = '\0';
+    int fd = open (dirname (path), O_RDONLY | O_DIRECTORY);
+    if ( fd >= 0 ) {
+        fsync (fd);
+        close (fd);
+    }
+}
+
+/**
+ * Apply snapshot and journal to key memory
+ *
+ * @param pJournal - journal
+ * @param memory - key memory
+ * @param baseHash - hash of key memory loaded from key file
+ * @param pGeneration - [out] generation of valid journal
+ * @param pRecords - [out] valid journal records
+ * @return - true if journal file is valid and can be appended
+ */
+static bool JournalLoad (PKEYJOURNAL pJournal, uint8_t *memory, uint32_t baseHash,
+                         uint32_t *pGeneration, uint32_t *pRecords) {
+        JOURNAL_HEADER  header;
+        JOURNAL_RECORD  record;
+        uint8_t         snapshot [KEY_MEMORY_SIZE];
+        uint32_t        hash, snapshotGeneration = 0;
+        bool            valid = false;
+        FILE            *fp;
+
+    *pGeneration = 0;
+    *pRecords = 0;
+    if ( (fp = fopen (pJournal->snapshotName, "r")) != NULL ) {
+        if ( fread (&header, sizeof(header), 1, fp) == 1 && header.magic == SNAPSHOT_MAGIC &&
+             header.version == JOURNAL_VERSION && header.size == sizeof(snapshot) ) {
+            if ( header.baseHash != baseHash ) {
+                Log (LOG_WARNING, "Data of keyfile %s changed, snapshot is dropped.\n", pJournal->pKey->keyfileName);
+            } else if ( fread (snapshot, sizeof(snapshot), 1, fp) == 1 && fread (&hash, sizeof(hash), 1, fp) == 1 &&
+                        hash == HashBytes (baseHash, snapshot, sizeof(snapshot)) ) {
+                memcpy (memory, snapshot, sizeof(snapshot));
+                snapshotGeneration = header.generation;
+            } else {
+                Log (LOG_ERR, "Snapshot %s is damaged.\n", pJournal->snapshotName);
+            }
+        }
+        fclose (fp);
+    }
+    *pGeneration = snapshotGeneration+1;
+    if ( (fp = fopen (pJournal->journalName, "r")) != NULL ) {
+        if ( fread (&header, sizeof(header), 1, fp) == 1 && header.magic == JOURNAL_MAGIC &&
+             header.version == JOURNAL_VERSION && header.size == sizeof(snapshot) ) {
+            if ( header.baseHash != baseHash ) {
+                Log (LOG_WARNING, "Data of keyfile %s changed, journal is dropped.\n", pJournal->pKey->keyfileName);
+            } else if ( header.generation > snapshotGeneration ) {
+                                    // replay till the first torn record
+                while ( fread (&record, sizeof(record), 1, fp) == 1 &&
+                        record.check == RecordCheck (header.generation, *pRecords, record.offset, record.value) ) {
+                    uint16_t offset = record.offset & ~JOURNAL_BYTE;
+                    if ( offset < sizeof(snapshot) ) {
+                        memory [offset] = (uint8_t)record.value;
+                    }
+                    if ( !(record.offset & JOURNAL_BYTE) && offset+1 < sizeof(snapshot) ) {
+                        memory [offset+1] = (uint8_t)(record.value >> 8);
+                    }
+                    ++*pRecords;
+                }
+                *pGeneration = header.generation;
+                valid = true;
+            }
+        }
+        fclose (fp);
+    }
+    return valid;
+}
+
+/**
+ * Start new journal file
+ *
+ * @param pJournal - journal
+ * @return - 0 or errno code
+ */
+static int JournalCreate (PKEYJOURNAL pJournal) {
+        JOURNAL_HEADER header = { JOURNAL_MAGIC, JOURNAL_VERSION, pJournal->baseHash,
+                                  KEY_MEMORY_SIZE, pJournal->generation };
+
+    if ( ftruncate (pJournal->fd, 0) < 0 ) {
+        return errno;
+    }
+    pJournal->torn = false;
+    int result = WriteAll (pJournal->fd, &header, sizeof(header));
+    if ( !result && fdatasync (pJournal->fd) < 0 ) {
+        result = errno;
+    }
+    pJournal->records = 0;
+    return result;
+}
+
+/**
+ * Write snapshot of key memory and start next journal generation.
+ * Caller holds journal lock.
+ *
+ * @param pJournal - journal
+ * @return - 0 or errno code
+ */
+static int JournalSnapshot (PKEYJOURNAL pJournal) {
+        JOURNAL_HEADER header = { SNAPSHOT_MAGIC, JOURNAL_VERSION, pJournal->baseHash,
+                                  KEY_MEMORY_SIZE, pJournal->generation };
+        const uint8_t *memory = pJournal->shadow;
+        char    tmpName [JOURNAL_NAME_MAX+8];
+        int     result;
+
+    snprintf (tmpName, sizeof(tmpName), "%s.tmp", pJournal->snapshotName);
+    int fd = open (tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( fd < 0 ) {
+        return errno;
+    }
+    uint32_t hash = HashBytes (pJournal->baseHash, memory, header.size);
+    result = WriteAll (fd, &header, sizeof(header));
+    if ( !result ) {
+        result = WriteAll (fd, memory, header.size);
+    }
+    if ( !result ) {
+        result = WriteAll (fd, &hash, sizeof(hash));
+    }
+    if ( !result && fsync (fd) < 0 ) {
+        result = errno;
+    }
+    close (fd);
+    if ( !result && rename (tmpName, pJournal->snapshotName) < 0 ) {
+        result = errno;
+    }
+    if ( result ) {
+        unlink (tmpName);
+        return result;
+    }
+    SyncDir (pJournal->snapshotName);
+    ++pJournal->generation;         // journal is included into snapshot now
+    pJournal->compactTime = time (NULL);
+    return JournalCreate (pJournal);
+}
+
+/**
+ * Write collected records into journal file and apply them to shadow memory.
+ * Stops at the first record written after Data of key file has been changed,
+ * such records wait for JournalRebase. Records which failed to be written
+ * are cut from journal file and stay in ring. Caller holds journal lock.
+ *
+ * @param pJournal - journal
+ * @param head - ring position to flush till
+ * @return - 0 or errno code
+ */
+static int JournalFlush (PKEYJOURNAL pJournal, unsigned head) {
+        JOURNAL_RECORD  records [JOURNAL_RING_SIZE];
+        uint32_t        n = 0;
+        int             result = 0;
+
+    unsigned tail = atomic_load_explicit (&pJournal->tail, memory_order_relaxed);
+    for ( ; tail != head; tail++, n++ ) {
+        uint64_t r = pJournal->ring [tail & (JOURNAL_RING_SIZE-1)];
+        if ( (uint32_t)(r >> 32) != pJournal->baseHash ) {
+            break;
+        }
+        records [n].offset = (uint16_t)(r >> 16);
+        records [n].value = (uint16_t)r;
+        records [n].check = RecordCheck (pJournal->generation, pJournal->records+n, records [n].offset, records [n].value);
+    }
+    if ( n > 0 && pJournal->fd >= 0 ) {
+        off_t size = sizeof(JOURNAL_HEADER) + (off_t)pJournal->records*sizeof(JOURNAL_RECORD);
+        if ( pJournal->torn && ftruncate (pJournal->fd, size) < 0 ) {
+            return errno;
+        }
+        pJournal->torn = false;
+        result = WriteAll (pJournal->fd, records, n*sizeof(JOURNAL_RECORD));
+        if ( !result && fdatasync (pJournal->fd) < 0 ) {
+            result = errno;
+        }
+        if ( result ) {             // replay stops at torn record
+            pJournal->torn = ftruncate (pJournal->fd, size) < 0;
+            return result;
+        }
+        pJournal->records += n;
+    }
+    for ( uint32_t i = 0; i < n; i++ ) {
+        uint16_t offset = records [i].offset & ~JOURNAL_BYTE;
+        if ( offset < KEY_MEMORY_SIZE ) {
+            pJournal->shadow [offset] = (uint8_t)records [i].value;
+        }
+        if ( !(records [i].offset & JOURNAL_BYTE) && offset+1 < KEY_MEMORY_SIZE ) {
+            pJournal->shadow [offset+1] = (uint8_t)(records [i].value >> 8);
+        }
+    }
+    atomic_store_explicit (&pJournal->tail, tail, memory_order_release);
+    return result;
+}
+
+/**
+ * Take port memory copied by URB thread after ring overflow as shadow memory.
+ * Ring records included into the copy are dropped. Caller holds journal lock.
+ *
+ * @param pJournal - journal
+ * @param pHead - [in,out] ring position to flush till
+ * @return - true if shadow memory is replaced
+ */
+static bool JournalResync (PKEYJOURNAL pJournal, unsigned *pHead) {
+
+    if ( !atomic_load_explicit (&pJournal->resyncState, memory_order_acquire) ||
+         pJournal->resyncHash != pJournal->baseHash ) {
+        return false;               // copy of replaced Data waits for JournalRebase
+    }
+    memcpy (pJournal->shadow, pJournal->resync, sizeof(pJournal->shadow));
+    atomic_store_explicit (&pJournal->tail, pJournal->resyncHead, memory_order_release);
+    atomic_store_explicit (&pJournal->resyncState, 0, memory_order_release);
+                                    // head is published before resync buffer
+    *pHead = atomic_load_explicit (&pJournal->head, memory_order_acquire);
+    return true;
+}
+
+/**
+ * Group commit of journal. Called by journal thread.
+ *
+ * @param pJournal - journal
+ */
+static void JournalCommit (PKEYJOURNAL pJournal) {
+        int     result;
+
+    pthread_mutex_lock (&pJournal->lock);
+                                    // load head before resync state, see JournalWrite
+    unsigned head = atomic_load_explicit (&pJournal->head, memory_order_acquire);
+    bool resync = JournalResync (pJournal, &head);
+    if ( resync || pJournal->records >= JOURNAL_COMPACT_RECORDS ||
+         (pJournal->records > 0 && time (NULL) - pJournal->compactTime >= JOURNAL_COMPACT_TIME) ) {
+        result = JournalSnapshot (pJournal);
+        if ( result ) {
+            Log (LOG_ERR, "Snapshot %s write failed: %s.\n", pJournal->snapshotName, strerror(result));
+        }
+    }
+    result = JournalFlush (pJournal, head);
+    if ( result ) {
+        Log (LOG_ERR, "Journal %s write failed: %s.\n", pJournal->journalName, strerror(result));
+    }
+    pthread_mutex_unlock (&pJournal->lock);
+}
+
+/**
+ * Copy port memory into resync buffer after ring overflow. Called by URB
+ * thread when resync buffer is free.
+ *
+ * @param pJournal - journal
+ * @param pKeyData - key image
+ * @param pSession - key session state
+ * @param head - ring records included into the copy
+ */
+static void JournalResyncCopy (PKEYJOURNAL pJournal, PCKEYDATA pKeyData, PKEYSESSION pSession, unsigned head) {
+
+    KeyMemoryRead (pKeyData, pSession, 0, pJournal->resync, sizeof(pJournal->resync));
+    pJournal->resyncHead = head;
+    pJournal->resyncHash = pSession->memoryHash;
+    atomic_store_explicit (&pJournal->resyncState, 1, memory_order_release);
+    pJournal->resyncPending = false;
+}
+
+/**
+ * Commit journal of port which URB thread doesn't write into any more.
+ * Port memory is copied here if ring has overflowed while journal thread
+ * had not taken previous copy yet, such writes are lost otherwise.
+ * Journal must not be committed by journal thread meanwhile.
+ *
+ * @param pJournal - journal
+ */
+static void JournalCommitLast (PKEYJOURNAL pJournal) {
+        PUSBHASP pKey = pJournal->pKey;
+
+    JournalCommit (pJournal);
+    if ( pJournal->resyncPending && pKey->pKeyFile != NULL ) {
+                                    // stale copy of replaced Data is dropped too
+        atomic_store_explicit (&pJournal->resyncState, 0, memory_order_release);
+        JournalResyncCopy (pJournal, pKey->pKeyFile->pKeyData, &pKey->session,
+                           atomic_load_explicit (&pJournal->head, memory_order_relaxed));
+        JournalCommit (pJournal);
+    }
+}
+
+/**
+ * Key memory write hook. Called by URB thread, never blocks.
+ *
+ * @param context - journal
+ * @param pKeyData - key image
+ * @param pSession - key session state
+ * @param offset - memory offset
+ * @param length - data length
+ */
+void JournalWrite (void *context, PCKEYDATA pKeyData, PKEYSESSION pSession, uint16_t offset, uint16_t length) {
+        PKEYJOURNAL pJournal = (PKEYJOURNAL)context;
+        uint8_t     p [2];
+
+    unsigned head = atomic_load_explicit (&pJournal->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit (&pJournal->tail, memory_order_acquire);
+    unsigned pending = head - tail;
+    uint64_t hash = (uint64_t)pSession->memoryHash << 32;
+    for ( uint16_t i = 0; i < length && !pJournal->resyncPending; i += 2, head++ ) {
+        if ( head - tail >= JOURNAL_RING_SIZE ) {
+            pJournal->resyncPending = true;
+            break;
+        }
+        KeyMemoryRead (pKeyData, pSession, offset+i, p, 2);
+        if ( i+1 < length ) {
+            pJournal->ring [head & (JOURNAL_RING_SIZE-1)] = hash | ((uint32_t)(offset+i) << 16) | p[0] | (p[1] << 8);
+        } else {
+            pJournal->ring [head & (JOURNAL_RING_SIZE-1)] = hash | ((uint32_t)((offset+i) | JOURNAL_BYTE) << 16) | p[0];
+        }
+    }
+    atomic_store_explicit (&pJournal->head, head, memory_order_release);
+    bool wake = pending < journalBatch && head - tail >= journalBatch;
+    if ( pJournal->resyncPending && !atomic_load_explicit (&pJournal->resyncState, memory_order_acquire) ) {
+                                    // records lost, journal thread will snapshot whole memory
+        JournalResyncCopy (pJournal, pKeyData, pSession, head);
+        wake = true;
+    }
+    if ( wake && journalEvent >= 0 ) {
+        uint64_t one = 1;
+        if ( write (journalEvent, &one, sizeof(one)) < 0 ) {
+            ;                       // journal thread wakes up by timeout anyway
+        }
+    }
+}
+
+/**
+ * Open journal of port and apply it to port memory. Port must not be
+ * served by URB thread yet, key image is that of its key file.
+ *
+ * @param pKey - port
+ * @return - journal or NULL in case of error
+ */
+PKEYJOURNAL JournalOpen (PUSBHASP pKey) {
+        PKEYJOURNAL pJournal;
+        uint32_t    generation, records;
+        int         result;
+
+    if ( posix_memalign ((void **)&pJournal, CACHE_LINE, sizeof(KEY_JOURNAL)) ) {
+        Log (LOG_ERR, "No memory for journal of keyfile %s.\n", pKey->keyfileName);
+        return NULL;
+    }
+    memset (pJournal, 0, sizeof(KEY_JOURNAL));
+    pthread_mutex_init (&pJournal->lock, NULL);
+    pJournal->pKey = pKey;
+    if ( pKey->keyInstance == 0 ) {
+        snprintf (pJournal->journalName, sizeof(pJournal->journalName), "%s.journal", pKey->keyfileName);
+        snprintf (pJournal->snapshotName, sizeof(pJournal->snapshotName), "%s.snapshot", pKey->keyfileName);
+    } else {
+        snprintf (pJournal->journalName, sizeof(pJournal->journalName), "%s.%d.journal", pKey->keyfileName, pKey->keyInstance);
+        snprintf (pJournal->snapshotName, sizeof(pJournal->snapshotName), "%s.%d.snapshot", pKey->keyfileName, pKey->keyInstance);
+    }
+    PKEYDATA pKeyData = pKey->pKeyFile->pKeyData;
+    pJournal->baseHash = pKeyData->memoryHash;
+    memcpy (pJournal->shadow, pKeyData->memory, sizeof(pJournal->shadow));
+    bool valid = JournalLoad (pJournal, pJournal->shadow, pJournal->baseHash, &generation, &records);
+    pJournal->generation = generation;
+    pJournal->compactTime = time (NULL);
+    pJournal->fd = open (pJournal->journalName, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if ( pJournal->fd < 0 ) {
+        result = errno;
+    } else if ( valid ) {           // cut torn tail
+        pJournal->records = records;
+        result = ftruncate (pJournal->fd, sizeof(JOURNAL_HEADER) + records*sizeof(JOURNAL_RECORD)) < 0 ? errno : 0;
+    } else {
+        result = JournalCreate (pJournal);
+    }
+    if ( !result ) {                // only pages which differ from key image are allocated
+        result = KeyMemoryWrite (pKeyData, &pKey->session, 0, pJournal->shadow, sizeof(pJournal->shadow));
+    }
+    if ( result ) {
+        Log (LOG_ERR, "Error %s opening journal %s.\n", strerror(result), pJournal->journalName);
+        JournalClose (pJournal);
+        return NULL;
+    }
+    if ( valid || generation > 1 ) {
+        Log (LOG_INFO, "Key memory restored from journal %s, %u records.\n", pJournal->journalName, records);
+    }
+    pthread_mutex_lock (&journalsLock);
+    if ( numJournals < MAX_HASPKEYS ) {
+        journals [numJournals++] = pJournal;
+    }
+    pthread_mutex_unlock (&journalsLock);
+    return pJournal;
+}
+
+/**
+ * Commit the rest of records and close journal. URB thread must not
+ * write into journal any more.
+ *
+ * @param pJournal - journal
+ */
+void JournalClose (PKEYJOURNAL pJournal) {
+        bool registered = false;
+
+    if ( pJournal != NULL ) {
+        pthread_mutex_lock (&journalsLock);
+        for ( int i = 0; i < numJournals; i++ ) {
+            if ( journals [i] == pJournal ) {
+                journals [i] = journals [--numJournals];
+                registered = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock (&journalsLock);
+        if ( registered ) {
+            JournalCommitLast (pJournal);
+        }
+        if ( pJournal->fd >= 0 ) {
+            close (pJournal->fd);
+        }
+        pthread_mutex_destroy (&pJournal->lock);
+        free (pJournal);
+    }
+}
+
+/**
+ * Bind journal to new Data of key file. Called by key reload thread after
+ * key image with new Data has been published and old one is not used.
+ *
+ * @param pJournal - journal
+ * @param pKeyData - reloaded key image
+ */
+void JournalRebase (PKEYJOURNAL pJournal, PKEYDATA pKeyData) {
+
+    pthread_mutex_lock (&pJournal->lock);
+    pJournal->baseHash = pKeyData->memoryHash;
+    memcpy (pJournal->shadow, pKeyData->memory, sizeof(pJournal->shadow));
+    unsigned head = atomic_load_explicit (&pJournal->head, memory_order_acquire);
+    if ( atomic_load_explicit (&pJournal->resyncState, memory_order_acquire) &&
+         pJournal->resyncHash != pJournal->baseHash ) {
+                                    // copy of replaced Data
+        atomic_store_explicit (&pJournal->resyncState, 0, memory_order_release);
+    }
+    JournalResync (pJournal, &head);
+                                    // drop records of replaced Data
+    unsigned tail = atomic_load_explicit (&pJournal->tail, memory_order_relaxed);
+    while ( tail != head && (uint32_t)(pJournal->ring [tail & (JOURNAL_RING_SIZE-1)] >> 32) != pJournal->baseHash ) {
+        tail++;
+    }
+    atomic_store_explicit (&pJournal->tail, tail, memory_order_release);
+    int result = JournalSnapshot (pJournal);
+    if ( result ) {
+        Log (LOG_ERR, "Snapshot %s write failed: %s.\n", pJournal->snapshotName, strerror(result));
+    }
+    JournalFlush (pJournal, head);
+    pthread_mutex_unlock (&pJournal->lock);
+}
+
+/**
+ * Journal writer thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *JournalThread (void *arg) {
+        struct pollfd pfd;
+        uint64_t count;
+        int     value = 0;
+
+    pfd.fd = journalEvent;
+    pfd.events = POLLIN;
+    while ( !value ) {
+        if ( poll (&pfd, 1, journalInterval) > 0 && pfd.revents & POLLIN ) {
+            if ( read (journalEvent, &count, sizeof(count)) < 0 ) {
+                ;
+            }
+        }
+        pthread_mutex_lock (&journalsLock);
+        for ( int i = 0; i < numJournals; i++ ) {
+            JournalCommit (journals [i]);
+        }
+        pthread_mutex_unlock (&journalsLock);
+        sem_getvalue (journalMutex, &value);
+    }
+    pthread_mutex_lock (&journalsLock);
+    for ( int i = 0; i < numJournals; i++ ) {
+        JournalCommit (journals [i]);
+    }
+    pthread_mutex_unlock (&journalsLock);
+    return NULL;
+}
+
+/**
+ * Start journal writer
+ *
+ * @param interval - group commit interval, ms
+ * @param batch - records to commit before interval expires
+ * @param pmutex - threads "stop" semaphore
+ * @return - 0 in case of success or errno code
+ */
+int StartJournal (int interval, int batch, sem_t *pmutex) {
+
+    journalInterval = interval > 0 ? interval : JOURNAL_INTERVAL;
+    journalBatch = batch > 0 && batch < JOURNAL_RING_SIZE ? batch : JOURNAL_BATCH;
+    journalMutex = pmutex;
+    journalEvent = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( journalEvent < 0 ) {
+        return errno;
+    }
+    int result = pthread_create (&journalThread, NULL, JournalThread, NULL);
+    if ( result ) {
+        close (journalEvent);
+        journalEvent = -1;
+        return result;
+    }
+    journalStarted = true;
+    return 0;
+}
+
+/**
+ * Commit all records and stop journal writer. "Stop" semaphore must be posted
+ * and ports must not be served any more.
+ */
+void StopJournal (void) {
+
+    if ( journalStarted ) {
+        pthread_join (journalThread, NULL);
+        journalStarted = false;
+    }
+    pthread_mutex_lock (&journalsLock);     // ports are not served any more
+    for ( int i = 0; i < numJournals; i++ ) {
+        JournalCommitLast (journals [i]);
+    }
+    pthread_mutex_unlock (&journalsLock);
+    if ( journalEvent >= 0 ) {
+        close (journalEvent);
+        journalEvent = -1;
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Journal.h
+ * Abstract:
+ *      Write-ahead journal of HASP key memory writes.
+ * Notes:
+ * Revision History:
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <semaphore.h>
+#include "USBKeyEmu.h"
+
+#define JOURNAL_INTERVAL        50      // default group commit interval, ms
+#define JOURNAL_BATCH           64      // default records to wake up journal writer
+
+typedef struct _KEY_JOURNAL KEY_JOURNAL, *PKEYJOURNAL;
+
+PKEYJOURNAL JournalOpen (PUSBHASP pKey);
+void JournalClose (PKEYJOURNAL pJournal);
+void JournalWrite (void *context, PCKEYDATA pKeyData, PKEYSESSION pSession, uint16_t offset, uint16_t length);
+void JournalRebase (PKEYJOURNAL pJournal, PKEYDATA pKeyData);
+int  StartJournal (int interval, int batch, sem_t *pmutex);
+void StopJournal (void);
+
+#endif  // JOURNAL_H
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     KeyFile.c
+ * Abstract:
+ *      Loaded key files. Key image is shared by all ports emulating
+ *      the same key file.
+ * Notes:
+ *      Key image is read only. Ports write into private memory pages of
+ *      their sessions, so several ports with the same key file take memory
+ *      of one key image plus written pages only.
+ *      Reloaded key image is published to all ports of key file with atomic
+ *      pointer store, old one is freed after URB thread passes quiescent
+ *      state (see Rcu.c).
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "USBKeyEmu.h"
+#include "KeyFile.h"
+#include "Journal.h"
+#include "Rcu.h"
+#include "Log.h"
+#include "Probe.h"
+
+static PKEYFILE         keyFiles [MAX_HASPKEYS];
+static int              numKeyFiles;
+static pthread_mutex_t  keyFilesLock = PTHREAD_MUTEX_INITIALIZER;   // never taken by URB thread
+
+/**
+ * Load key image
+ *
+ * @param file - key file name
+ * @param pResult - [out] 0 in case of success or LoadKey error code
+ * @return - key image or NULL
+ */
+static PKEYDATA LoadKeyImage (char *file, int *pResult) {
+        PKEYDATA pKeyData;
+
+    if ( posix_memalign ((void **)&pKeyData, CACHE_LINE, sizeof(KEY_DATA)) ) {
+        *pResult = ENOMEM;
+        return NULL;
+    }
+    memset (pKeyData, 0, sizeof(KEY_DATA));
+    pKeyData->logHook = LogWrite;
+    PROBE1 (key__load__entry, file);
+    *pResult = LoadKey (file, pKeyData);
+    PROBE2 (key__load__return, file, *pResult);
+    if ( *pResult ) {
+        UnloadKey (pKeyData);
+        free (pKeyData);
+        return NULL;
+    }
+    return pKeyData;
+}
+
+/**
+ * Can clients keep their sessions with the new key image.
+ *
+ * @param pOld - current key image
+ * @param pNew - loaded key image
+ * @return - true if key identity and crypto material have not been changed
+ */
+static bool IsKeyCompatible (PKEYDATA pOld, PKEYDATA pNew) {
+
+    return pOld->password == pNew->password && pOld->keyType == pNew->keyType &&
+           pOld->memoryType == pNew->memoryType &&
+           !memcmp (pOld->secTable, pNew->secTable, sizeof(pOld->secTable)) &&
+           !memcmp (pOld->netMemory, pNew->netMemory, sizeof(pOld->netMemory)) &&
+           !memcmp (pOld->edStruct, pNew->edStruct, sizeof(pOld->edStruct));
+}
+
+/**
+ * Lowest instance number no port of key file has. Journal of port is
+ * named by it, so ports of the same key file never share a journal.
+ * Caller holds key files lock.
+ *
+ * @param pKeyFile - key file
+ * @return - instance number
+ */
+static int KeyFileInstance (PKEYFILE pKeyFile) {
+        int instance = 0;
+
+    for ( int i = 0; i < pKeyFile->refCount; i++ ) {
+        if ( pKeyFile->ports [i]->keyInstance == instance ) {
+            instance++;                 // taken, check all ports again
+            i = -1;
+        }
+    }
+    return instance;
+}
+
+/**
+ * Attach port to key file. Key file is loaded unless some port emulates it already.
+ * Key image is published to the port after prepare has set up its session,
+ * key file is not reloaded meanwhile.
+ *
+ * @param pKey - port
+ * @param file - key file name
+ * @param prepare - called before port is served, may be NULL
+ * @param context - prepare context
+ * @return - 0 in case of success or error code. Positive values - standard runtime errno codes.
+ * Negative values - file processing/parsing errors.
+ */
+int KeyFileOpen (PUSBHASP pKey, char *file, void (*prepare) (PUSBHASP pKey, void *context), void *context) {
+        struct stat st;
+        PKEYFILE    pKeyFile = NULL;
+        int         result = 0;
+
+    if ( stat (file, &st) < 0 ) {
+        return errno;
+    }
+    pthread_mutex_lock (&keyFilesLock);
+    for ( int i = 0; i < numKeyFiles; i++ ) {
+        if ( keyFiles [i]->dev == st.st_dev && keyFiles [i]->ino == st.st_ino ) {
+            pKeyFile = keyFiles [i];
+            break;
+        }
+    }
+    if ( pKeyFile == NULL ) {
+        if ( numKeyFiles >= MAX_HASPKEYS ) {
+            result = ENOSPC;
+        } else if ( (pKeyFile = calloc (1, sizeof(KEY_FILE))) == NULL ) {
+            result = ENOMEM;
+        } else if ( (pKeyFile->pKeyData = LoadKeyImage (file, &result)) == NULL ) {
+            free (pKeyFile);
+            pKeyFile = NULL;
+        } else {
+            strncpy (pKeyFile->fileName, file, sizeof(pKeyFile->fileName)-1);
+            pKeyFile->dev = st.st_dev;
+            pKeyFile->ino = st.st_ino;
+            pKeyFile->watch = -1;
+            keyFiles [numKeyFiles++] = pKeyFile;
+        }
+    }
+    if ( pKeyFile != NULL ) {
+        pKey->pKeyFile = pKeyFile;
+        pKey->keyInstance = KeyFileInstance (pKeyFile);
+        strncpy ((char *)pKey->keyfileName, file, sizeof(pKey->keyfileName)-1);
+        pKey->keyfileName [sizeof(pKey->keyfileName)-1] = '\0';
+        KeySessionInit (&pKey->session, pKeyFile->pKeyData);
+        if ( prepare != NULL ) {
+            prepare (pKey, context);
+        }
+        pKeyFile->ports [pKeyFile->refCount++] = pKey;
+                                            // port is served from here
+        atomic_store_explicit (&pKey->pKeyData, pKeyFile->pKeyData, memory_order_release);
+    }
+    pthread_mutex_unlock (&keyFilesLock);
+    return result;
+}
+
+/**
+ * Detach port from key file. Key image is freed with the last port.
+ * Session of port and key image are freed after URB thread has dropped them,
+ * key file is not reloaded meanwhile.
+ *
+ * @param pKey - port
+ * @param release - called after URB thread has dropped port, may be NULL
+ * @param context - release context
+ */
+void KeyFileClose (PUSBHASP pKey, void (*release) (PUSBHASP pKey, void *context), void *context) {
+        PKEYFILE pKeyFile = pKey->pKeyFile;
+
+    if ( pKeyFile == NULL ) {
+        return;
+    }
+    pthread_mutex_lock (&keyFilesLock);
+    for ( int i = 0; i < pKeyFile->refCount; i++ ) {
+        if ( pKeyFile->ports [i] == pKey ) {
+            pKeyFile->ports [i] = pKeyFile->ports [--pKeyFile->refCount];
+            break;
+        }
+    }
+    atomic_store_explicit (&pKey->pKeyData, NULL, memory_order_release);
+    RcuSynchronize ();              // wait for URB thread to drop port
+    if ( release != NULL ) {
+        release (pKey, context);
+    }
+    pKey->pKeyFile = NULL;
+    bool last = pKeyFile->refCount == 0;
+    if ( last ) {
+        for ( int i = 0; i < numKeyFiles; i++ ) {
+            if ( keyFiles [i] == pKeyFile ) {
+                keyFiles [i] = keyFiles [--numKeyFiles];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock (&keyFilesLock);
+    KeySessionFree (&pKey->session);
+    if ( last ) {
+        UnloadKey (pKeyFile->pKeyData);
+        free (pKeyFile->pKeyData);
+        free (pKeyFile);
+    }
+}
+
+/**
+ * Name of key emulated by port
+ *
+ * @param pKey - port
+ * @param name - [out] key name
+ * @param size - name buffer size
+ * @return - false if port has no key
+ */
+bool KeyFileName (PUSBHASP pKey, char *name, size_t size) {
+        bool result = false;
+
+    pthread_mutex_lock (&keyFilesLock);
+    if ( pKey->pKeyFile != NULL ) {
+        strncpy (name, pKey->pKeyFile->pKeyData->name, size-1);
+        name [size-1] = '\0';
+        result = true;
+    }
+    pthread_mutex_unlock (&keyFilesLock);
+    return result;
+}
+
+/**
+ * Reload key file and publish new key image to all its ports.
+ * Private memory pages of ports are kept if Data of key file is the same.
+ * Caller holds key files lock.
+ *
+ * @param pKeyFile - key file
+ */
+static void KeyFileReload (PKEYFILE pKeyFile) {
+        int result;
+
+    PKEYDATA pNew = LoadKeyImage (pKeyFile->fileName, &result);
+    if ( result > 0 ) {
+        Log (LOG_ERR, "Error %s reloading keyfile %s. Keeping loaded key.\n", strerror(result), pKeyFile->fileName);
+        return;
+    } else if ( result < 0 ) {
+        Log (LOG_ERR, "Error parsing key file %s. Keeping loaded key.\n", pKeyFile->fileName);
+        return;
+    }
+    PKEYDATA pOld = pKeyFile->pKeyData;
+    bool compatible = IsKeyCompatible (pOld, pNew);
+    bool sameData = pOld->memoryHash == pNew->memoryHash;
+    pNew->sessionEpoch = compatible ? pOld->sessionEpoch : pOld->sessionEpoch+1;
+    PROBE3 (key__reload, pKeyFile->fileName, compatible, sameData);
+    pKeyFile->pKeyData = pNew;
+    for ( int i = 0; i < pKeyFile->refCount; i++ ) {
+        atomic_store_explicit (&pKeyFile->ports [i]->pKeyData, pNew, memory_order_release);
+    }
+    RcuSynchronize ();              // wait for URB thread to drop old image
+    UnloadKey (pOld);
+    free (pOld);
+    for ( int i = 0; !sameData && i < pKeyFile->refCount; i++ ) {
+        if ( pKeyFile->ports [i]->pJournal != NULL ) {
+            JournalRebase (pKeyFile->ports [i]->pJournal, pNew);
+        }
+    }
+    Log (LOG_INFO, "Reloaded keyfile %s: '%s', Created: %s. Sessions %s, written memory %s.\n", pKeyFile->fileName,
+            pNew->name, pNew->created, compatible ? "kept" : "closed", sameData ? "kept" : "dropped");
+}
+
+/**
+ * Key file has been changed. Called by key files watcher.
+ *
+ * @param watch - watch of key file directory
+ * @param name - changed file name within directory
+ */
+void KeyFileChanged (int watch, const char *name) {
+
+    pthread_mutex_lock (&keyFilesLock);
+    for ( int i = 0; i < numKeyFiles; i++ ) {
+        char *baseName = strrchr (keyFiles [i]->fileName, '/');
+        baseName = baseName != NULL ? baseName+1 : keyFiles [i]->fileName;
+        if ( keyFiles [i]->watch == watch && !strcmp (baseName, name) ) {
+            KeyFileReload (keyFiles [i]);
+        }
+    }
+    pthread_mutex_unlock (&keyFilesLock);
+}
+
+/**
+ * Call function for every loaded key file
+ *
+ * @param callback - function
+ * @param context - function context
+ */
+void KeyFileForEach (void (*callback) (PKEYFILE pKeyFile, void *context), void *context) {
+
+    pthread_mutex_lock (&keyFilesLock);
+    for ( int i = 0; i < numKeyFiles; i++ ) {
+        callback (keyFiles [i], context);
+    }
+    pthread_mutex_unlock (&keyFilesLock);
+}
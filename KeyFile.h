@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     KeyFile.h
+ * Abstract:
+ *      Loaded key files. Key image is shared by all ports emulating
+ *      the same key file.
+ * Notes:
+ * Revision History:
+ */
+#ifndef KEYFILE_H
+#define KEYFILE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "USBKeyEmu.h"
+
+typedef struct _KEY_FILE {
+    char        fileName [PATH_MAX];
+    dev_t       dev;                    // key file identity
+    ino_t       ino;
+    PKEYDATA    pKeyData;               // current key image
+    PUSBHASP    ports [MAX_HASPKEYS];   // ports emulating the key
+    int         refCount;               // number of ports
+    int         watch;                  // key files watcher data, see KeyReload.c
+} KEY_FILE, *PKEYFILE;
+
+int  KeyFileOpen (PUSBHASP pKey, char *file, void (*prepare) (PUSBHASP pKey, void *context), void *context);
+void KeyFileClose (PUSBHASP pKey, void (*release) (PUSBHASP pKey, void *context), void *context);
+bool KeyFileName (PUSBHASP pKey, char *name, size_t size);
+void KeyFileChanged (int watch, const char *name);
+void KeyFileForEach (void (*callback) (PKEYFILE pKeyFile, void *context), void *context);
+
+#endif  // KEYFILE_H
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     KeyReload.c
+ * Abstract:
+ *      Watch loaded key files and reload changed ones without
+ *      restarting emulator.
+ * Notes:
+ *      Directories of key files are watched rather than files themselves,
+ *      most editors replace file by rename and file watch is lost then.
+ *      Key images are replaced by KeyFile.c. Thread also saves key clocks
+ *      set by clients, see Rtc.c.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <syslog.h>
+#include <sys/inotify.h>
+#include "USBKeyEmu.h"
+#include "KeyFile.h"
+#include "Rtc.h"
+#include "Log.h"
+
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+static sem_t        *reloadMutex;
+static int          inotifyFd = -1;
+static pthread_t    reloadThread;
+static bool         reloadStarted = false;
+
+/**
+ * Key files watcher thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *KeyReloadThread (void *arg) {
+        char    buf [4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        struct  pollfd pfd;
+        int     value = 0;
+
+    pfd.fd = inotifyFd;
+    pfd.events = POLLIN;
+    while ( !value ) {
+        int res = poll (&pfd, 1, 100);
+        if ( res > 0 && pfd.revents & POLLIN ) {
+            ssize_t len = read (inotifyFd, buf, sizeof(buf));
+            for ( char *ptr = buf; len > 0 && ptr < buf+len; ) {
+                struct inotify_event *event = (struct inotify_event *)ptr;
+                if ( event->len > 0 ) {
+                    KeyFileChanged (event->wd, event->name);
+                }
+                ptr += sizeof(struct inotify_event) + event->len;
+            }
+        } else if ( res < 0 && errno != EINTR ) {
+            Log (LOG_ERR, "Key files watch (poll) failed: %s.\n", strerror(errno));
+            break;
+        }
+        RtcFlush ();                        // key clocks set by clients
+        sem_getvalue (reloadMutex, &value);
+    }
+    RtcFlush ();
+    return NULL;
+}
+
+/**
+ * Watch directory of key file unless it is watched already
+ *
+ * @param pKeyFile - key file
+ * @param context - not used
+ */
+static void WatchKeyFile (PKEYFILE pKeyFile, void *context) {
+        char    path [PATH_MAX];
+
+    if ( pKeyFile->watch >= 0 ) {
+        return;
+    }
+    strncpy (path, pKeyFile->fileName, sizeof(path)-1);
+    path [sizeof(path)-1] = '\0';
+    pKeyFile->watch = inotify_add_watch (inotifyFd, dirname (path), WATCH_EVENTS);
+    if ( pKeyFile->watch < 0 ) {
+        Log (LOG_WARNING, "Unable to watch keyfile %s: %s.\n", pKeyFile->fileName, strerror(errno));
+    }
+}
+
+/**
+ * Start watching loaded key files for changes
+ *
+ * @param pmutex - threads "stop" semaphore
+ * @return - 0 in case of success or errno code
+ */
+int StartKeyReload (sem_t *pmutex) {
+
+    reloadMutex = pmutex;
+    inotifyFd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if ( inotifyFd < 0 ) {
+        return errno;
+    }
+    KeyFileForEach (WatchKeyFile, NULL);
+    int result = pthread_create (&reloadThread, NULL, KeyReloadThread, NULL);
+    if ( result ) {
+        close (inotifyFd);
+        inotifyFd = -1;
+        return result;
+    }
+    reloadStarted = true;
+    return 0;
+}
+
+/**
+ * Watch key files loaded after start
+ */
+void KeyReloadWatch (void) {
+
+    if ( reloadStarted ) {
+        KeyFileForEach (WatchKeyFile, NULL);
+    }
+}
+
+/**
+ * Wait for key files watcher to finish. "Stop" semaphore must be posted.
+ */
+void StopKeyReload (void) {
+
+    if ( reloadStarted ) {
+        pthread_join (reloadThread, NULL);
+        reloadStarted = false;
+    }
+    if ( inotifyFd >= 0 ) {
+        close (inotifyFd);
+        inotifyFd = -1;
+    }
+}
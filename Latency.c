@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Latency.c
+ * Abstract:
+ *      Latency histograms of URB processing per port and HASP function.
+ * Notes:
+ *      Histograms are HDR-like: every power of 2 of nanoseconds is split
+ *      into 16 linear sub-buckets, so any recorded value is kept with 6%
+ *      precision from 16 ns up to 4 s. Port is served by one URB thread,
+ *      which is the only writer of its histograms, so counters are updated
+ *      with relaxed loads and stores, no locked instructions. Report may
+ *      be taken at any time from any thread, it can miss URBs being
+ *      recorded at the moment.
+ * Revision History:
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include "USBKeyEmu.h"
+#include "Latency.h"
+#include "Log.h"
+
+#define LATENCY_SUB_BITS    4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS    31                              // values up to 4 s
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS-LATENCY_SUB_BITS+2)*LATENCY_SUB_BUCKETS)
+#define LATENCY_FN_SLOTS    32                              // functions per port, the last one for the rest
+#define LATENCY_FN_OTHER    -1
+
+typedef struct _LATENCY_HISTOGRAM {
+    atomic_ullong   count;
+    atomic_ullong   total;                      // sum of values, ns
+    atomic_ullong   max;
+    atomic_uint     buckets [LATENCY_BUCKETS];
+} LATENCY_HISTOGRAM;
+
+typedef struct _LATENCY_PORT {
+    uint8_t         slotOf [LATENCY_FN_ANSWER+1];   // function -> slot+1, written by URB thread only
+    uint64_t        questionTime;   // fetch time of QUESTION waiting for ANSWER, written by URB thread only
+    atomic_int      slotFn [LATENCY_FN_SLOTS];  // slot -> function
+    atomic_int      numSlots;
+    LATENCY_HISTOGRAM slots [LATENCY_FN_SLOTS];
+} __attribute__((aligned(CACHE_LINE))) LATENCY_PORT;
+
+typedef struct _LATENCY_SNAPSHOT {
+    uint64_t        count;
+    uint64_t        total;
+    uint64_t        max;
+    uint32_t        buckets [LATENCY_BUCKETS];
+} LATENCY_SNAPSHOT;
+
+static LATENCY_PORT latencyPorts [MAX_HASPKEYS];
+static volatile sig_atomic_t reportRequested;
+
+/**
+ * Bucket of value
+ *
+ * @param ns - value
+ * @return - bucket index
+ */
+static inline int LatencyBucket (uint64_t ns) {
+
+    if ( ns < LATENCY_SUB_BUCKETS ) {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll (ns);
+    if ( msb > LATENCY_MAX_BITS ) {
+        return LATENCY_BUCKETS-1;
+    }
+    return (msb-LATENCY_SUB_BITS+1)*LATENCY_SUB_BUCKETS + (int)((ns >> (msb-LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS-1));
+}
+
+/**
+ * Highest value of bucket
+ *
+ * @param bucket - bucket index
+ * @return - value, ns
+ */
+static uint64_t LatencyBucketValue (int bucket) {
+
+    if ( bucket < LATENCY_SUB_BUCKETS ) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+    return ((sub+1) << shift) - 1;
+}
+
+/**
+ * Record URB processing time. Called by URB thread serving the port.
+ *
+ * @param port - port number, 1 based
+ * @param fn - HASP function (majorFnCode), LATENCY_FN_USB or LATENCY_FN_ANSWER
+ * @param ns - time from URB fetch to giveback
+ */
+void LatencyRecord (int port, int fn, uint64_t ns) {
+
+    if ( port < 1 || port > MAX_HASPKEYS || fn < 0 || fn > LATENCY_FN_ANSWER ) {
+        return;
+    }
+    LATENCY_PORT *pPort = &latencyPorts [port-1];
+    int slot = pPort->slotOf [fn]-1;
+    if ( slot < 0 ) {               // first URB of function
+        slot = atomic_load_explicit (&pPort->numSlots, memory_order_relaxed);
+        if ( slot < LATENCY_FN_SLOTS-1 ) {
+            atomic_store_explicit (&pPort->slotFn [slot], fn, memory_order_relaxed);
+            atomic_store_explicit (&pPort->numSlots, slot+1, memory_order_release);
+        } else if ( slot == LATENCY_FN_SLOTS-1 ) {
+            atomic_store_explicit (&pPort->slotFn [slot], LATENCY_FN_OTHER, memory_order_relaxed);
+            atomic_store_explicit (&pPort->numSlots, LATENCY_FN_SLOTS, memory_order_release);
+        } else {
+            slot = LATENCY_FN_SLOTS-1;
+        }
+        pPort->slotOf [fn] = slot+1;
+    }
+    LATENCY_HISTOGRAM *pHist = &pPort->slots [slot];
+    atomic_uint *pBucket = &pHist->buckets [LatencyBucket (ns)];
+    atomic_store_explicit (pBucket, atomic_load_explicit (pBucket, memory_order_relaxed)+1, memory_order_relaxed);
+    atomic_store_explicit (&pHist->count, atomic_load_explicit (&pHist->count, memory_order_relaxed)+1, memory_order_relaxed);
+    atomic_store_explicit (&pHist->total, atomic_load_explicit (&pHist->total, memory_order_relaxed)+ns, memory_order_relaxed);
+    if ( ns > atomic_load_explicit (&pHist->max, memory_order_relaxed) ) {
+        atomic_store_explicit (&pHist->max, ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * Record time to answer: from fetch of QUESTION to giveback of the ANSWER
+ * following it. Called by URB thread serving the port for every URB.
+ *
+ * @param port - port number, 1 based
+ * @param fn - HASP function (majorFnCode) or LATENCY_FN_USB
+ * @param fetchTime - URB fetch time, ns
+ * @param doneTime - URB giveback time, ns
+ */
+void LatencyExchange (int port, int fn, uint64_t fetchTime, uint64_t doneTime) {
+
+    if ( port < 1 || port > MAX_HASPKEYS ) {
+        return;
+    }
+    LATENCY_PORT *pPort = &latencyPorts [port-1];
+    if ( fn == KEY_FN_QUESTION ) {
+        pPort->questionTime = fetchTime;
+    } else if ( fn == KEY_FN_ANSWER && pPort->questionTime ) {
+        LatencyRecord (port, LATENCY_FN_ANSWER, doneTime - pPort->questionTime);
+        pPort->questionTime = 0;
+    }
+}
+
+/**
+ * Add histogram to snapshot
+ *
+ * @param pSnapshot - snapshot
+ * @param pHist - histogram
+ */
+static void LatencyAdd (LATENCY_SNAPSHOT *pSnapshot, LATENCY_HISTOGRAM *pHist) {
+
+    for ( int i = 0; i < LATENCY_BUCKETS; i++ ) {
+        pSnapshot->buckets [i] += atomic_load_explicit (&pHist->buckets [i], memory_order_relaxed);
+    }
+    pSnapshot->count += atomic_load_explicit (&pHist->count, memory_order_relaxed);
+    pSnapshot->total += atomic_load_explicit (&pHist->total, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit (&pHist->max, memory_order_relaxed);
+    if ( max > pSnapshot->max ) {
+        pSnapshot->max = max;
+    }
+}
+
+/**
+ * Value at percentile
+ *
+ * @param pSnapshot - snapshot
+ * @param percentile - percentile
+ * @return - value, ns
+ */
+static uint64_t LatencyPercentile (LATENCY_SNAPSHOT *pSnapshot, double percentile) {
+        uint64_t count = 0, total = 0;
+
+    for ( int i = 0; i < LATENCY_BUCKETS; i++ ) {
+        total += pSnapshot->buckets [i];
+    }
+    uint64_t rank = (uint64_t)(total * percentile / 100.0 + 0.5);
+    if ( rank < 1 ) {
+        rank = 1;
+    }
+    for ( int i = 0; i < LATENCY_BUCKETS; i++ ) {
+        count += pSnapshot->buckets [i];
+        if ( count >= rank ) {
+            uint64_t value = LatencyBucketValue (i);
+            return value < pSnapshot->max ? value : pSnapshot->max;
+        }
+    }
+    return pSnapshot->max;
+}
+
+/**
+ * Format one report line
+ *
+ * @param output - line output function
+ * @param context - output context
+ * @param port - port number
+ * @param name - function name
+ * @param pSnapshot - histogram snapshot
+ */
+static void LatencyLine (void (*output) (void *context, const char *line), void *context,
+                         int port, const char *name, LATENCY_SNAPSHOT *pSnapshot) {
+        char line [256];
+
+    if ( pSnapshot->count == 0 ) {
+        return;
+    }
+    snprintf (line, sizeof(line), "port %d %-5s count %llu mean %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f us",
+              port, name, (unsigned long long)pSnapshot->count, pSnapshot->total / 1000.0 / pSnapshot->count,
+              LatencyPercentile (pSnapshot, 50) / 1000.0, LatencyPercentile (pSnapshot, 90) / 1000.0,
+              LatencyPercentile (pSnapshot, 99) / 1000.0, LatencyPercentile (pSnapshot, 99.9) / 1000.0,
+              pSnapshot->max / 1000.0);
+    output (context, line);
+}
+
+/**
+ * Report latency of every port and function, the whole port first
+ *
+ * @param output - line output function
+ * @param context - output context
+ */
+void LatencyReport (void (*output) (void *context, const char *line), void *context) {
+        LATENCY_SNAPSHOT all, one;
+        char name [8];
+
+    for ( int port = 0; port < MAX_HASPKEYS; port++ ) {
+        LATENCY_PORT *pPort = &latencyPorts [port];
+        int numSlots = atomic_load_explicit (&pPort->numSlots, memory_order_acquire);
+        memset (&all, 0, sizeof(all));
+        for ( int slot = 0; slot < numSlots; slot++ ) {
+            if ( atomic_load_explicit (&pPort->slotFn [slot], memory_order_relaxed) != LATENCY_FN_ANSWER ) {
+                LatencyAdd (&all, &pPort->slots [slot]);    // time to answer spans two URBs
+            }
+        }
+        LatencyLine (output, context, port+1, "all", &all);
+        for ( int slot = 0; slot < numSlots; slot++ ) {
+            int fn = atomic_load_explicit (&pPort->slotFn [slot], memory_order_relaxed);
+            if ( fn == LATENCY_FN_USB ) {
+                strcpy (name, "usb");
+            } else if ( fn == LATENCY_FN_ANSWER ) {
+                strcpy (name, "q-a");
+            } else if ( fn == LATENCY_FN_OTHER ) {
+                strcpy (name, "other");
+            } else {
+                snprintf (name, sizeof(name), "0x%02X", fn);
+            }
+            memset (&one, 0, sizeof(one));
+            LatencyAdd (&one, &pPort->slots [slot]);
+            LatencyLine (output, context, port+1, name, &one);
+        }
+    }
+}
+
+/**
+ * Clear all histograms. URBs recorded at the moment may survive.
+ */
+void LatencyReset (void) {
+
+    for ( int port = 0; port < MAX_HASPKEYS; port++ ) {
+        for ( int slot = 0; slot < LATENCY_FN_SLOTS; slot++ ) {
+            LATENCY_HISTOGRAM *pHist = &latencyPorts [port].slots [slot];
+            for ( int i = 0; i < LATENCY_BUCKETS; i++ ) {
+                atomic_store_explicit (&pHist->buckets [i], 0, memory_order_relaxed);
+            }
+            atomic_store_explicit (&pHist->count, 0, memory_order_relaxed);
+            atomic_store_explicit (&pHist->total, 0, memory_order_relaxed);
+            atomic_store_explicit (&pHist->max, 0, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Ask for latency report into log. Safe to call from signal handler.
+ */
+void LatencyRequestReport (void) {
+
+    reportRequested = 1;
+}
+
+/**
+ * Log output of report
+ *
+ * @param context - not used
+ * @param line - report line
+ */
+static void LatencyLog (void *context, const char *line) {
+
+    Log (LOG_INFO, "%s\n", line);
+}
+
+/**
+ * Write requested report into log. Called by URB thread between URBs.
+ */
+void LatencyPoll (void) {
+
+    if ( reportRequested ) {
+        reportRequested = 0;
+        LatencyReport (LatencyLog, NULL);
+    }
+}
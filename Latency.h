@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Latency.h
+ * Abstract:
+ *      Latency histograms of URB processing per port and HASP function.
+ * Notes:
+ * Revision History:
+ */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define LATENCY_FN_USB      0x100   // standard USB requests: descriptors, address, configuration
+#define LATENCY_FN_ANSWER   0x101   // QUESTION fetched to its ANSWER done
+
+/**
+ * Monotonic time for latency measurement
+ *
+ * @return - time, ns
+ */
+static inline uint64_t LatencyNow (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void LatencyRecord (int port, int fn, uint64_t ns);
+void LatencyExchange (int port, int fn, uint64_t fetchTime, uint64_t doneTime);
+void LatencyReport (void (*output) (void *context, const char *line), void *context);
+void LatencyReset (void);
+void LatencyRequestReport (void);
+void LatencyPoll (void);
+
+#endif  // LATENCY_H
@@ -18,10 +18,17 @@
 #include <wchar.h>
 #include <sys/stat.h>
 #include <string.h>
-#include <libusb_vhci.h>
 #include <jansson.h>
 #include <syslog.h>
-#include "USBKeyEmu.h"
+#include "HaspEmu.h"
+
+//
+// Array with a length
+//
+typedef struct _BYTE_ARRAY {
+    int size;
+    uint8_t *bytes;
+} BYTE_ARRAY, *PBYTE_ARRAY;
 
 #define min(a,b)    ((a)<(b)?(a):(b))
 
@@ -53,8 +60,10 @@ static unsigned long GetLongHexValue (json_t *jval) {
         char    *ptr;
         unsigned long val = 0;
         
-    if ( jval != NULL ) {
+    if ( json_is_string(jval) ) {
         val = strtoul(json_string_value(jval), &ptr, 16);
+    } else if ( json_is_integer(jval) ) {   // ids of SRM tables may be plain numbers
+        val = (unsigned long)json_integer_value(jval);
     }
     return val;
 }
@@ -173,12 +182,41 @@ static PBYTE_ARRAY GetHexByteArray (json_t *jval) {
     return val;
 }
 
+/**
+ * FNV-1a hash
+ *
+ * @param hash - initial value, HASH_INIT or previous hash
+ * @param data - data
+ * @param size - data size
+ * @return - hash
+ */
+uint32_t HashBytes (uint32_t hash, const void *data, size_t size) {
+
+    for ( const uint8_t *p = data; size; size--, p++ ) {
+        hash = (hash ^ *p) * 16777619;
+    }
+    return hash;
+}
+
+/**
+ * Free array returned by GetHexByteArray
+ * 
+ * @param val - array
+ */
+static void FreeByteArray (PBYTE_ARRAY val) {
+    
+    if ( val != NULL ) {
+        free (val->bytes);
+        free (val);
+    }
+}
+
 /**
  * "Classified" vectors table for old HASPs SecTable
  */
 #define HASP_ROWS   8
 #define HASP_COLS   8
-static uint8_t HASP_rows [HASP_ROWS] [HASP_COLS] = {
+static const uint8_t HASP_rows [HASP_ROWS] [HASP_COLS] = {
     { 0, 0, 0, 0, 0, 0, 0, 0 },
     { 0, 1, 0, 1, 0, 1, 0, 1 },
     { 1, 0, 1, 0, 1, 0, 1, 0 },
@@ -192,17 +230,20 @@ static uint8_t HASP_rows [HASP_ROWS] [HASP_COLS] = {
 #ifdef DEBUG
 /**
  * 
+ * @param pKeyData
  * @param p
  * @param size
  */
-static void dumpArray(uint8_t *p, int size) {
+static void dumpArray(PCKEYDATA pKeyData, uint8_t *p, int size) {
+        char line [16*6+1];                 // one message per 16 bytes
     
-    for ( int ii = 0; ii < size; ii++) {
-        if ( ii%16 == 0 && ii )
-            syslog (LOG_DEBUG, "\n");                        
-        syslog (LOG_DEBUG, "0x%02hx, ", p[ii]);
+    for ( int ii = 0; ii < size; ii += 16) {
+        int pos = 0;
+        for ( int jj = ii; jj < size && jj < ii+16; jj++ ) {
+            pos += snprintf (line+pos, sizeof(line)-pos, "0x%02hhx, ", p[jj]);
+        }
+        KeyLog (pKeyData, LOG_DEBUG, "%s\n", line);
     }
-    syslog (LOG_DEBUG, "\n");
 }
 #endif
 
@@ -230,6 +271,125 @@ static void BuildStandardSecTable (PKEYDATA pKeyData) {
     }
 }                        
 
+static int CompareFeatures (const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int CompareFiles (const void *a, const void *b) {
+
+    return (int)((const KEY_SRM_FILE *)a)->id - (int)((const KEY_SRM_FILE *)b)->id;
+}
+
+/**
+ * Load SRM tables of key: features with their files and READ_STRUCT tables.
+ *
+ *      "Features": [ { "Id": "0x2A", "Files": [ { "Id": "0x10", "Offset": "0x0", "Size": "0x40" } ] } ],
+ *      "Struct": [ "0x01,0x00,0x00", ... ]
+ *
+ * Tables and their arrays are one allocation freed by UnloadKey.
+ *
+ * @param key - "HASP Key" object
+ * @param pKeyData - key image
+ * @return - 0 in case of success, ENOMEM or -1 if tables are malformed
+ */
+static int LoadSrm (json_t *key, PKEYDATA pKeyData) {
+        size_t  numFeatures, numFiles = 0, n = 0;
+        unsigned long memorySize = (unsigned long)KeyMemorySize (pKeyData);
+
+    json_t *jfeatures = json_object_get (key, "Features");
+    json_t *jstructs = json_object_get (key, "Struct");
+    if ( jfeatures == NULL && jstructs == NULL ) {
+        return 0;                           // not an SRM key
+    }
+    if ( (jfeatures != NULL && !json_is_array (jfeatures)) || (jstructs != NULL && !json_is_array (jstructs)) ) {
+        return -1;
+    }
+    numFeatures = json_array_size (jfeatures);
+    for ( size_t i = 0; i < numFeatures; i++ ) {
+        json_t *jfiles = json_object_get (json_array_get (jfeatures, i), "Files");
+        numFiles += json_array_size (jfiles);
+    }
+    PKEY_SRM pSrm = calloc (1, sizeof(KEY_SRM) + numFeatures*sizeof(uint32_t) + numFiles*sizeof(KEY_SRM_FILE));
+    if ( pSrm == NULL ) {
+        return ENOMEM;
+    }
+    pSrm->files = (PKEY_SRM_FILE)(pSrm+1);
+    pSrm->features = (uint32_t *)(pSrm->files+numFiles);
+    for ( size_t i = 0; i < numFeatures; i++ ) {
+        json_t *jfeature = json_array_get (jfeatures, i);
+        unsigned long id = GetLongHexValue (json_object_get (jfeature, "Id"));
+        if ( id > UINT32_MAX ) {
+            KeyLog (pKeyData, LOG_ERR, "Feature 0x%lx is out of range.\n", id);
+            free (pSrm);
+            return -1;
+        }
+        pSrm->features [i] = (uint32_t)id;
+        json_t *jfiles = json_object_get (jfeature, "Files");
+        for ( size_t j = 0; j < json_array_size (jfiles); j++, n++ ) {
+            json_t *jfile = json_array_get (jfiles, j);
+            unsigned long offset = GetLongHexValue (json_object_get (jfile, "Offset"));
+            unsigned long size = GetLongHexValue (json_object_get (jfile, "Size"));
+            unsigned long fileId = GetLongHexValue (json_object_get (jfile, "Id"));
+            if ( fileId > UINT16_MAX ) {
+                KeyLog (pKeyData, LOG_ERR, "File 0x%lx of feature 0x%lx is out of range.\n", fileId, id);
+                free (pSrm);
+                return -1;
+            }
+            if ( offset > memorySize || size > memorySize - offset ) {
+                KeyLog (pKeyData, LOG_ERR, "File 0x%lx of feature 0x%lx is out of key memory.\n", fileId, id);
+                free (pSrm);
+                return -1;
+            }
+            pSrm->files [n].id = (uint16_t)fileId;
+            pSrm->files [n].offset = (uint16_t)offset;
+            pSrm->files [n].size = (uint16_t)size;
+            pSrm->files [n].feature = (uint32_t)id;
+        }
+    }
+    qsort (pSrm->features, numFeatures, sizeof(uint32_t), CompareFeatures);
+    qsort (pSrm->files, numFiles, sizeof(KEY_SRM_FILE), CompareFiles);
+    for ( size_t i = 1; i < numFeatures; i++ ) {
+        if ( pSrm->features [i] == pSrm->features [i-1] ) {
+            KeyLog (pKeyData, LOG_ERR, "Feature 0x%x is given twice.\n", pSrm->features [i]);
+            free (pSrm);
+            return -1;
+        }
+    }
+    for ( size_t i = 1; i < numFiles; i++ ) {
+        if ( pSrm->files [i].id == pSrm->files [i-1].id ) {
+            KeyLog (pKeyData, LOG_ERR, "File 0x%hx is given twice.\n", pSrm->files [i].id);
+            free (pSrm);
+            return -1;
+        }
+    }
+    pSrm->numFeatures = (uint32_t)numFeatures;
+    pSrm->numFiles = (uint32_t)numFiles;
+    for ( size_t i = 0; i < json_array_size (jstructs) && i < KEY_SRM_STRUCTS; i++ ) {
+        PBYTE_ARRAY table = GetHexByteArray (json_array_get (jstructs, i));
+        pSrm->structSize [i] = (uint8_t)min(table->size, KEY_SRM_STRUCT_SIZE);
+        memcpy (pSrm->structs [i], table->bytes, pSrm->structSize [i]);
+        FreeByteArray (table);
+    }
+    pKeyData->pSrm = pSrm;
+    return 0;
+}
+
+/**
+ * Free what LoadKey has allocated for key image. Image itself is freed
+ * by caller.
+ *
+ * @param pKeyData - key image
+ */
+void UnloadKey (PKEYDATA pKeyData) {
+
+    if ( pKeyData != NULL ) {
+        free (pKeyData->pSrm);
+        pKeyData->pSrm = NULL;
+    }
+}
+
 /**
  * Load HASP key description into memory from file.
  * 
@@ -318,22 +478,29 @@ int LoadKey (char file[], PKEYDATA pKeyData) {
                         memcpy(pKeyData->memory,memory->bytes,min(memory->size,sizeof(pKeyData->memory)));
                         json_t *jedStruct = json_object_get(key,"EDStruct");
                         PBYTE_ARRAY edStruct = GetHexByteArray (jedStruct);
-                        memcpy(pKeyData->edStruct,edStruct->bytes,min(edStruct->size,sizeof(pKeyData->memory)));
+                        memcpy(pKeyData->edStruct,edStruct->bytes,min(edStruct->size,sizeof(pKeyData->edStruct)));
+                        pKeyData->memoryHash = HashBytes (HASH_INIT, pKeyData->memory, sizeof(pKeyData->memory));
+                        result = LoadSrm (key, pKeyData);
 #ifdef DEBUG
-                        syslog (LOG_DEBUG, "Password 0x%x\n", pKeyData->password);
-                        syslog (LOG_DEBUG, "keyType 0x%hhx\n", pKeyData->keyType);
-                        syslog (LOG_DEBUG, "MemoryType 0x%hhx\n", pKeyData->memoryType);
-                        syslog (LOG_DEBUG, "Option %d bytes\n", option->size);
-                        dumpArray(pKeyData->options,sizeof(pKeyData->options));
-                        syslog (LOG_DEBUG, "NetMemory %d bytes\n", netMemory->size);
-                        dumpArray(pKeyData->netMemory,sizeof(pKeyData->netMemory));
-                        syslog (LOG_DEBUG, "SecTable %d bytes\n", secTable->size);
-                        dumpArray(pKeyData->secTable,sizeof(pKeyData->secTable));
-                        syslog (LOG_DEBUG, "Data %d bytes\n", memory->size);
-                        dumpArray(pKeyData->memory,sizeof(pKeyData->memory));
-                        syslog (LOG_DEBUG, "EDStruct %d bytes\n", edStruct->size);
-                        dumpArray(pKeyData->edStruct,sizeof(pKeyData->edStruct));
+                        KeyLog (pKeyData, LOG_DEBUG, "Password 0x%x\n", pKeyData->password);
+                        KeyLog (pKeyData, LOG_DEBUG, "keyType 0x%hhx\n", pKeyData->keyType);
+                        KeyLog (pKeyData, LOG_DEBUG, "MemoryType 0x%hhx\n", pKeyData->memoryType);
+                        KeyLog (pKeyData, LOG_DEBUG, "Option %d bytes\n", option->size);
+                        dumpArray(pKeyData, pKeyData->options,sizeof(pKeyData->options));
+                        KeyLog (pKeyData, LOG_DEBUG, "NetMemory %d bytes\n", netMemory->size);
+                        dumpArray(pKeyData, pKeyData->netMemory,sizeof(pKeyData->netMemory));
+                        KeyLog (pKeyData, LOG_DEBUG, "SecTable %d bytes\n", secTable->size);
+                        dumpArray(pKeyData, pKeyData->secTable,sizeof(pKeyData->secTable));
+                        KeyLog (pKeyData, LOG_DEBUG, "Data %d bytes\n", memory->size);
+                        dumpArray(pKeyData, pKeyData->memory,sizeof(pKeyData->memory));
+                        KeyLog (pKeyData, LOG_DEBUG, "EDStruct %d bytes\n", edStruct->size);
+                        dumpArray(pKeyData, pKeyData->edStruct,sizeof(pKeyData->edStruct));
 #endif
+                        FreeByteArray (option);
+                        FreeByteArray (secTable);
+                        FreeByteArray (netMemory);
+                        FreeByteArray (memory);
+                        FreeByteArray (edStruct);
                         json_decref(root);
                     } else {
                         result = -1;
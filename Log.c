@@ -0,0 +1,535 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Log.c
+ * Abstract:
+ *      Asynchronous logging. Messages are queued as binary records into
+ *      per-thread rings and written to syslog or file by logger thread.
+ * Notes:
+ *      Every thread gets its own single producer / single consumer ring
+ *      with the first message, so writing a message takes no locks and
+ *      no syscalls: record keeps the format pointer and raw arguments,
+ *      formatting is done by logger thread. Messages of full ring are
+ *      dropped and counted, logging thread never waits for the logger.
+ *      Until logger is started messages are written to syslog directly.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "Log.h"
+
+#define LOG_RING_SIZE       1024            // records per thread, power of 2
+#define LOG_RECORD_SIZE     256
+#define LOG_ARGS_SIZE       (LOG_RECORD_SIZE-20)
+#define LOG_LINE_SIZE       1024
+#define LOG_IDLE_NS         10000000        // logger sleep when rings are empty
+
+typedef struct _LOG_RECORD {
+    uint64_t        time;                   // CLOCK_REALTIME, ns
+    const char      *fmt;
+    uint8_t         priority;
+    uint8_t         count;                  // arguments stored
+    uint16_t        size;                   // bytes of arguments
+    uint8_t         args [LOG_ARGS_SIZE];   // 8 bytes per number, strings with '\0'
+} LOG_RECORD;
+
+typedef struct _LOG_RING {
+    atomic_uint     head __attribute__((aligned(64)));  // written by owner thread
+    atomic_ullong   dropped;
+    atomic_uint     tail __attribute__((aligned(64)));  // written by logger
+    atomic_bool     dead;                   // owner thread has exited
+    pid_t           tid;
+    struct _LOG_RING *next;
+    LOG_RECORD      records [LOG_RING_SIZE];
+} LOG_RING;
+
+atomic_int              logLevel =
+#ifdef DEBUG
+                                    LOG_DEBUG;
+#else
+                                    LOG_INFO;
+#endif
+static atomic_bool      logStarted;
+static atomic_bool      logRunning;
+static atomic_ullong    logLost;            // messages of threads without ring
+static LOG_RING         *logRings;
+static pthread_mutex_t  logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t   logOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t    logKey;
+static pthread_t        logThread;
+static FILE             *logFile;
+static uint64_t         logReported;      // dropped messages reported
+static uint64_t         logFreedDropped;  // dropped messages of freed rings
+static __thread LOG_RING *logRing;
+
+/**
+ * Thread exit, its ring is freed by logger when empty
+ *
+ * @param arg - ring
+ */
+static void LogThreadExit (void *arg) {
+
+    atomic_store_explicit (&((LOG_RING *)arg)->dead, true, memory_order_release);
+}
+
+static void LogInit (void) {
+
+    pthread_key_create (&logKey, LogThreadExit);
+}
+
+/**
+ * Create ring of calling thread
+ *
+ * @return - ring or NULL
+ */
+static LOG_RING *LogRingCreate (void) {
+        LOG_RING *ring;
+
+    pthread_once (&logOnce, LogInit);
+    if ( posix_memalign ((void **)&ring, 64, sizeof(LOG_RING)) ) {
+        return NULL;
+    }
+    memset (ring, 0, offsetof(LOG_RING, records));
+    ring->tid = (pid_t)syscall (SYS_gettid);
+    pthread_setspecific (logKey, ring);
+    pthread_mutex_lock (&logLock);
+    ring->next = logRings;
+    logRings = ring;
+    pthread_mutex_unlock (&logLock);
+    logRing = ring;
+    return ring;
+}
+
+/**
+ * Parse conversion specification
+ *
+ * @param f - specification after '%'
+ * @param pLength - [out] length modifier: 'H' hh, 'h', 'l', 'q' ll, 'L', 'j', 'z', 't' or 0
+ * @param pStars - [out] number of '*' width and precision arguments
+ * @return - conversion character position
+ */
+static const char *LogParseSpec (const char *f, char *pLength, int *pStars) {
+
+    *pStars = 0;
+    f += strspn (f, "-+ #0'");
+    if ( *f == '*' ) {
+        ++*pStars;
+        f++;
+    }
+    f += strspn (f, "0123456789");
+    if ( *f == '.' ) {
+        f++;
+        if ( *f == '*' ) {
+            ++*pStars;
+            f++;
+        }
+        f += strspn (f, "0123456789");
+    }
+    *pLength = 0;
+    if ( f[0] == 'h' && f[1] == 'h' ) {
+        *pLength = 'H';
+        f += 2;
+    } else if ( f[0] == 'l' && f[1] == 'l' ) {
+        *pLength = 'q';
+        f += 2;
+    } else if ( *f && strchr ("hlLjzt", *f) ) {
+        *pLength = *f++;
+    }
+    return f;
+}
+
+/**
+ * Store message arguments. Arguments which don't fit are not stored.
+ *
+ * @param pRecord - record
+ * @param fmt - format
+ * @param ap - arguments
+ */
+static void LogPack (LOG_RECORD *pRecord, const char *fmt, va_list ap) {
+        uint8_t *p = pRecord->args, *end = pRecord->args + LOG_ARGS_SIZE;
+        char    length;
+        int     stars;
+        int64_t value = 0;
+        double  real;
+
+    pRecord->count = 0;
+    for ( const char *f = strchr (fmt, '%'); f != NULL; f = strchr (f+1, '%') ) {
+        if ( f[1] == '%' ) {
+            f++;
+            continue;
+        }
+        f = LogParseSpec (f+1, &length, &stars);
+        for ( ; stars > 0 && p+8 <= end; stars-- ) {
+            value = va_arg (ap, int);
+            memcpy (p, &value, 8);
+            p += 8;
+            pRecord->count++;
+        }
+        if ( stars > 0 || *f == '\0' ) {
+            break;
+        }
+        switch (*f) {
+        case 's':
+            if ( length == 'l' ) {
+                (void)va_arg (ap, void *);  // wide strings are not supported
+                continue;
+            }
+            const char *s = va_arg (ap, const char *);
+            if ( s == NULL ) {
+                s = "(null)";
+            }
+            if ( p >= end ) {
+                break;
+            }
+            size_t len = strnlen (s, end-p-1);
+            memcpy (p, s, len);
+            p [len] = '\0';
+            p += len+1;
+            pRecord->count++;
+            continue;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            real = length == 'L' ? (double)va_arg (ap, long double) : va_arg (ap, double);
+            if ( p+8 > end ) {
+                break;
+            }
+            memcpy (p, &real, 8);
+            p += 8;
+            pRecord->count++;
+            continue;
+        case 'p':
+            value = (int64_t)(intptr_t)va_arg (ap, void *);
+            break;
+        case 'n':
+            (void)va_arg (ap, void *);      // nothing is written back
+            continue;
+        default:
+            switch (length) {
+            case 'l': value = va_arg (ap, long); break;
+            case 'q': value = va_arg (ap, long long); break;
+            case 'j': value = va_arg (ap, intmax_t); break;
+            case 'z': value = va_arg (ap, ssize_t); break;
+            case 't': value = va_arg (ap, ptrdiff_t); break;
+            default:  value = va_arg (ap, int); break;
+            }
+            break;
+        }
+        if ( *f == 's' || p+8 > end ) {
+            break;
+        }
+        memcpy (p, &value, 8);
+        p += 8;
+        pRecord->count++;
+    }
+    pRecord->size = (uint16_t)(p - pRecord->args);
+}
+
+/**
+ * Queue message. Used by Log () macro and as log hook of key images, so
+ * priority is checked here too.
+ *
+ * @param priority - syslog priority
+ * @param fmt - printf format, string literal
+ */
+void LogWrite (int priority, const char *fmt, ...) {
+        va_list ap;
+        struct timespec ts;
+
+    if ( !LogEnabled (priority) ) {
+        return;
+    }
+    va_start (ap, fmt);
+    if ( !atomic_load_explicit (&logStarted, memory_order_acquire) ) {
+        vsyslog (priority, fmt, ap);
+        va_end (ap);
+        return;
+    }
+    LOG_RING *ring = logRing != NULL ? logRing : LogRingCreate ();
+    if ( ring == NULL ) {
+        atomic_fetch_add_explicit (&logLost, 1, memory_order_relaxed);
+        va_end (ap);
+        return;
+    }
+    unsigned head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    if ( head - atomic_load_explicit (&ring->tail, memory_order_acquire) >= LOG_RING_SIZE ) {
+        atomic_store_explicit (&ring->dropped, atomic_load_explicit (&ring->dropped, memory_order_relaxed)+1, memory_order_relaxed);
+        va_end (ap);
+        return;
+    }
+    LOG_RECORD *pRecord = &ring->records [head & (LOG_RING_SIZE-1)];
+    clock_gettime (CLOCK_REALTIME, &ts);
+    pRecord->time = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+    pRecord->fmt = fmt;
+    pRecord->priority = (uint8_t)priority;
+    LogPack (pRecord, fmt, ap);
+    va_end (ap);
+    atomic_store_explicit (&ring->head, head+1, memory_order_release);
+}
+
+/**
+ * Format message of record. Arguments which haven't been stored are shown as '?'.
+ *
+ * @param line - [out] message
+ * @param size - size of line
+ * @param pRecord - record
+ */
+static void LogFormat (char *line, size_t size, LOG_RECORD *pRecord) {
+        const uint8_t *p = pRecord->args;
+        char    spec [32];
+        char    length;
+        int     stars, count = pRecord->count;
+        size_t  pos = 0;
+        int64_t value;
+        double  real;
+
+    for ( const char *f = pRecord->fmt; *f && pos+1 < size; f++ ) {
+        if ( *f != '%' ) {
+            line [pos++] = *f;
+            continue;
+        }
+        if ( f[1] == '%' ) {
+            line [pos++] = '%';
+            f++;
+            continue;
+        }
+        const char *conv = LogParseSpec (f+1, &length, &stars);
+        if ( *conv == '\0' ) {
+            break;
+        }
+        size_t specLen = 0;                 // spec with '*' replaced by stored values and no 'L'
+        for ( const char *s = f; s <= conv && specLen+12 < sizeof(spec); s++ ) {
+            if ( *s == '*' ) {
+                if ( count > 0 ) {
+                    memcpy (&value, p, 8);
+                    p += 8;
+                    count--;
+                } else {
+                    value = 0;
+                }
+                specLen += snprintf (spec+specLen, sizeof(spec)-specLen, "%d", (int)value);
+            } else if ( *s != 'L' ) {
+                spec [specLen++] = *s;
+            }
+        }
+        spec [specLen] = '\0';
+        f = conv;
+        if ( *conv == 'n' ) {
+            continue;
+        }
+        int n;
+        if ( *conv == 's' && length == 'l' ) {
+            n = snprintf (line+pos, size-pos, "?");
+        } else if ( count <= 0 ) {
+            n = snprintf (line+pos, size-pos, "?");
+        } else if ( *conv == 's' ) {
+            n = snprintf (line+pos, size-pos, spec, (const char *)p);
+            p += strlen ((const char *)p)+1;
+            count--;
+        } else if ( strchr ("eEfFgGaA", *conv) ) {
+            memcpy (&real, p, 8);
+            n = snprintf (line+pos, size-pos, spec, real);
+            p += 8;
+            count--;
+        } else {
+            memcpy (&value, p, 8);
+            p += 8;
+            count--;
+            switch (*conv == 'p' ? 'p' : length) {
+            case 'p': n = snprintf (line+pos, size-pos, spec, (void *)(intptr_t)value); break;
+            case 'l': n = snprintf (line+pos, size-pos, spec, (long)value); break;
+            case 'q': n = snprintf (line+pos, size-pos, spec, (long long)value); break;
+            case 'j': n = snprintf (line+pos, size-pos, spec, (intmax_t)value); break;
+            case 'z': n = snprintf (line+pos, size-pos, spec, (ssize_t)value); break;
+            case 't': n = snprintf (line+pos, size-pos, spec, (ptrdiff_t)value); break;
+            default:  n = snprintf (line+pos, size-pos, spec, (int)value); break;
+            }
+        }
+        if ( n > 0 ) {
+            pos += (size_t)n < size-pos ? (size_t)n : size-pos-1;
+        }
+    }
+    while ( pos > 0 && line [pos-1] == '\n' ) {
+        pos--;
+    }
+    line [pos] = '\0';
+}
+
+/**
+ * Write message to syslog or log file
+ *
+ * @param priority - syslog priority
+ * @param time - message time, ns
+ * @param tid - thread of message
+ * @param line - message
+ */
+static void LogOutput (int priority, uint64_t time, pid_t tid, const char *line) {
+        static const char *names [] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+        char    stamp [32];
+        struct tm tm;
+
+    if ( logFile == NULL ) {
+        syslog (priority, "%s\n", line);
+        return;
+    }
+    time_t sec = (time_t)(time / 1000000000u);
+    localtime_r (&sec, &tm);
+    strftime (stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf (logFile, "%s.%06u [%d] %s: %s\n", stamp, (unsigned)(time % 1000000000u / 1000), (int)tid,
+             names [priority & 7], line);
+}
+
+/**
+ * Write records of all rings in time order, free rings of exited threads
+ *
+ * @return - number of records written
+ */
+static int LogDrain (void) {
+        char    line [LOG_LINE_SIZE];
+        int     written = 0;
+        uint64_t dropped = 0;
+
+    pthread_mutex_lock (&logLock);
+    for ( ;; ) {
+        LOG_RING *oldest = NULL;
+        LOG_RECORD *pOldest = NULL;
+        for ( LOG_RING *ring = logRings; ring != NULL; ring = ring->next ) {
+            unsigned tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+            if ( tail != atomic_load_explicit (&ring->head, memory_order_acquire) ) {
+                LOG_RECORD *pRecord = &ring->records [tail & (LOG_RING_SIZE-1)];
+                if ( pOldest == NULL || pRecord->time < pOldest->time ) {
+                    oldest = ring;
+                    pOldest = pRecord;
+                }
+            }
+        }
+        if ( oldest == NULL ) {
+            break;
+        }
+        LogFormat (line, sizeof(line), pOldest);
+        LogOutput (pOldest->priority, pOldest->time, oldest->tid, line);
+        atomic_store_explicit (&oldest->tail, atomic_load_explicit (&oldest->tail, memory_order_relaxed)+1, memory_order_release);
+        written++;
+    }
+    for ( LOG_RING **pRing = &logRings; *pRing != NULL; ) {
+        LOG_RING *ring = *pRing;
+        if ( atomic_load_explicit (&ring->dead, memory_order_acquire) &&
+             atomic_load_explicit (&ring->tail, memory_order_relaxed) == atomic_load_explicit (&ring->head, memory_order_acquire) ) {
+            *pRing = ring->next;
+            logFreedDropped += atomic_load_explicit (&ring->dropped, memory_order_relaxed);
+            free (ring);
+        } else {
+            dropped += atomic_load_explicit (&ring->dropped, memory_order_relaxed);
+            pRing = &ring->next;
+        }
+    }
+    dropped += atomic_load_explicit (&logLost, memory_order_relaxed) + logFreedDropped;
+    if ( dropped > logReported ) {
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        snprintf (line, sizeof(line), "%llu log messages dropped.", (unsigned long long)(dropped - logReported));
+        LogOutput (LOG_WARNING, (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec, (pid_t)syscall (SYS_gettid), line);
+        logReported = dropped;
+    }
+    pthread_mutex_unlock (&logLock);
+    if ( logFile != NULL && written ) {
+        fflush (logFile);
+    }
+    return written;
+}
+
+/**
+ * Logger thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *LogThread (void *arg) {
+        struct timespec ts = { 0, LOG_IDLE_NS };
+
+    while ( atomic_load_explicit (&logRunning, memory_order_acquire) ) {
+        if ( !LogDrain () ) {
+            nanosleep (&ts, NULL);
+        }
+    }
+    LogDrain ();
+    return NULL;
+}
+
+/**
+ * Set the lowest priority logged
+ *
+ * @param priority - syslog priority, LOG_DEBUG logs everything
+ */
+void LogSetLevel (int priority) {
+
+    atomic_store_explicit (&logLevel, priority, memory_order_relaxed);
+}
+
+/**
+ * Number of messages dropped because logger has not kept up
+ *
+ * @return - number of messages
+ */
+uint64_t LogDropped (void) {
+        uint64_t dropped;
+
+    pthread_mutex_lock (&logLock);
+    dropped = atomic_load_explicit (&logLost, memory_order_relaxed) + logFreedDropped;
+    for ( LOG_RING *ring = logRings; ring != NULL; ring = ring->next ) {
+        dropped += atomic_load_explicit (&ring->dropped, memory_order_relaxed);
+    }
+    pthread_mutex_unlock (&logLock);
+    return dropped;
+}
+
+/**
+ * Start logger thread. Messages are written to syslog directly till then.
+ *
+ * @param file - log file name, NULL to log to syslog
+ * @return - 0 in case of success or errno code
+ */
+int LogStart (const char *file) {
+
+    if ( file != NULL && (logFile = fopen (file, "ae")) == NULL ) {
+        return errno;
+    }
+    atomic_store_explicit (&logRunning, true, memory_order_relaxed);
+    int result = pthread_create (&logThread, NULL, LogThread, NULL);
+    if ( result ) {
+        atomic_store_explicit (&logRunning, false, memory_order_relaxed);
+        if ( logFile != NULL ) {
+            fclose (logFile);
+            logFile = NULL;
+        }
+        return result;
+    }
+    atomic_store_explicit (&logStarted, true, memory_order_release);
+    return 0;
+}
+
+/**
+ * Write queued messages and stop logger thread. Further messages are written
+ * to syslog directly. Must be called when other logging threads are stopped.
+ */
+void LogStop (void) {
+
+    if ( !atomic_load_explicit (&logStarted, memory_order_relaxed) ) {
+        return;
+    }
+    atomic_store_explicit (&logStarted, false, memory_order_release);
+    atomic_store_explicit (&logRunning, false, memory_order_release);
+    pthread_join (logThread, NULL);
+    if ( logFile != NULL ) {
+        fclose (logFile);
+        logFile = NULL;
+    }
+}
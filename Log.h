@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Log.h
+ * Abstract:
+ *      Asynchronous logging. Messages are queued as binary records into
+ *      per-thread rings and written to syslog or file by logger thread.
+ * Notes:
+ *      Log () takes syslog priorities and printf formats. Format must be
+ *      a string literal, it is kept by pointer till the record is written.
+ * Revision History:
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+extern atomic_int logLevel;
+
+/**
+ * Is priority logged
+ *
+ * @param priority - syslog priority
+ * @return - true if messages of priority are written
+ */
+static inline bool LogEnabled (int priority) {
+
+    return priority <= atomic_load_explicit (&logLevel, memory_order_relaxed);
+}
+
+#define Log(priority, ...)  do { if ( LogEnabled (priority) ) LogWrite (priority, __VA_ARGS__); } while (0)
+
+void LogWrite (int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void LogSetLevel (int priority);
+uint64_t LogDropped (void);
+int LogStart (const char *file);
+void LogStop (void);
+
+#endif  // LOG_H
@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     NetKey.c
+ * Abstract:
+ *      Network key server: net keys (HASP4 Net) served to remote clients
+ *      over UDP and TCP straight from loaded key images, without USB
+ *      and a separate license manager.
+ * Notes:
+ *      One thread serves UDP socket, TCP listener and TCP clients with
+ *      epoll. Key images are read the way URB thread reads them: the thread
+ *      is RCU reader, offline while it waits for requests. Net key is a key
+ *      of memory type 4 or with net key type in NetMemory, number of its
+ *      users is the user count of NetMemory. Sessions don't write key
+ *      memory, so they read the key image only.
+ *      Session holds a seat of its key (see Seats.c) and a lease renewed
+ *      by every request; idle session is logged out when its lease expires,
+ *      so clients gone without LOGOUT don't keep seats. Free sessions are
+ *      kept in a stack and sessions of TCP client in a list, no operation
+ *      scans the session table.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "USBKeyEmu.h"
+#include "NetKey.h"
+#include "Rcu.h"
+#include "Seats.h"
+#include "Stats.h"
+#include "Log.h"
+
+#define NETKEY_TAG_UDP      0               // epoll tags, clients follow
+#define NETKEY_TAG_LISTEN   1
+#define NETKEY_TAG_CLIENT   2
+#define NETKEY_EVENTS       64
+
+typedef struct _NETKEY_SESSION {
+    uint32_t    handle;             // 0 - free
+    PUSBHASP    pKey;               // port of logged in key
+    uint32_t    password;           // key must still have it
+    int32_t     memorySize;         // bytes, as LOGIN replied
+    int         client;             // TCP client owning session, -1 for UDP
+    struct _NETKEY_SESSION *clientNext;     // sessions of TCP client
+    struct _NETKEY_SESSION *clientPrev;
+    LEASE       lease;
+    KEY_SESSION session;
+} NETKEY_SESSION, *PNETKEY_SESSION;
+
+typedef struct _NETKEY_CLIENT {
+    int         fd;
+    size_t      used;
+    PNETKEY_SESSION pSessions;      // logged in through this connection
+    NETKEY_MESSAGE request;
+} NETKEY_CLIENT, *PNETKEY_CLIENT;
+
+static int              netUdpFd = -1;
+static int              netListenFd = -1;
+static int              netEpollFd = -1;
+static PUSBHASP         netPorts;
+static int              netNumPorts;
+static sem_t            *netMutex;
+static pthread_t        netThread;
+static bool             netStarted = false;
+static uint16_t         netGeneration = 1;  // upper half of handles
+static unsigned long long netRequests = 0;
+static NETKEY_CLIENT    netClients [NETKEY_MAX_CLIENTS];
+static PNETKEY_SESSION  netSessions;        // NETKEY_MAX_SESSIONS
+static int              *netFree;           // stack of free sessions
+static int              netNumFree;
+static LEASE_WHEEL      netWheel;
+static uint64_t         netTick;            // tick of current requests
+
+/**
+ * Number of users of net key
+ *
+ * @param pKeyData - key image
+ * @return - 0 if key is not a net key, SEATS_UNLIMITED if it is unlimited
+ */
+static uint32_t NetKeyUsers (PCKEYDATA pKeyData) {
+
+    if ( pKeyData->memoryType != 4 && pKeyData->netMemory [14] != 0xFE ) {
+        return 0;
+    }
+    uint32_t users = pKeyData->netMemory [10] | pKeyData->netMemory [11] << 8;
+    return users == NETKEY_UNLIMITED ? SEATS_UNLIMITED : users;
+}
+
+/**
+ * Find session of handle
+ *
+ * @param handle - handle
+ * @return - session or NULL
+ */
+static PNETKEY_SESSION NetKeySession (uint32_t handle) {
+
+    uint32_t index = handle & 0xffff;
+    if ( handle == 0 || index >= NETKEY_MAX_SESSIONS || netSessions [index].handle != handle ) {
+        return NULL;
+    }
+    return &netSessions [index];
+}
+
+/**
+ * Close session and free its seat
+ *
+ * @param pSession - session
+ */
+static void NetKeyLogout (PNETKEY_SESSION pSession) {
+
+    if ( pSession->client >= 0 ) {          // unlink from TCP client
+        if ( pSession->clientPrev != NULL ) {
+            pSession->clientPrev->clientNext = pSession->clientNext;
+        } else {
+            netClients [pSession->client].pSessions = pSession->clientNext;
+        }
+        if ( pSession->clientNext != NULL ) {
+            pSession->clientNext->clientPrev = pSession->clientPrev;
+        }
+    }
+    LeaseCancel (&netWheel, &pSession->lease);
+    SeatRelease (&StatsPort (pSession->pKey->port)->seatsUsed);
+    KeySessionFree (&pSession->session);
+    pSession->handle = 0;
+    pSession->pKey = NULL;
+    netFree [netNumFree++] = pSession - netSessions;
+}
+
+/**
+ * Lease of idle session has expired
+ *
+ * @param pLease - lease of session
+ * @param context - not used
+ */
+static void NetKeyExpired (PLEASE pLease, void *context) {
+
+    PNETKEY_SESSION pSession = (PNETKEY_SESSION)((uint8_t *)pLease - offsetof(NETKEY_SESSION, lease));
+    StatsInc (&StatsPort (pSession->pKey->port)->leaseExpiries);
+    Log (LOG_INFO, "Net key of port %d: idle user logged out.\n", pSession->pKey->port);
+    NetKeyLogout (pSession);
+}
+
+/**
+ * Log in to the first net key with the password and a free seat
+ *
+ * @param request - LOGIN request
+ * @param reply - reply
+ * @param client - TCP client, -1 for UDP
+ */
+static void NetKeyLogin (PNETKEY_MESSAGE request, PNETKEY_MESSAGE reply, int client) {
+
+    uint32_t password = le16toh (request->param1) | (uint32_t)le16toh (request->param2) << 16;
+    reply->status = NETKEY_STATUS_NO_KEY;
+    for ( int i = 0; i < netNumPorts; i++ ) {
+        PKEYDATA pKeyData = atomic_load_explicit (&netPorts [i].pKeyData, memory_order_acquire);
+        if ( pKeyData == NULL || pKeyData->password != password || NetKeyUsers (pKeyData) == 0 ) {
+            continue;
+        }
+        if ( netNumFree == 0 ) {
+            reply->status = NETKEY_STATUS_NO_SESSION;
+            return;
+        }
+        PSTATS_PORT pStats = StatsPort (netPorts [i].port);
+        atomic_store_explicit (&pStats->seatsMax, NetKeyUsers (pKeyData), memory_order_relaxed);
+        if ( !SeatAcquire (&pStats->seatsUsed, NetKeyUsers (pKeyData)) ) {
+            StatsInc (&pStats->seatDenials);
+            reply->status = NETKEY_STATUS_NO_SEAT;
+            continue;
+        }
+        int unused = netFree [--netNumFree];
+        PNETKEY_SESSION pSession = &netSessions [unused];
+        memset (&pSession->session, 0, sizeof(pSession->session));
+        int32_t size = KeyLogin (pKeyData, &pSession->session, password);
+        if ( netGeneration == 0 ) {
+            netGeneration = 1;              // handle is never 0
+        }
+        pSession->handle = (uint32_t)netGeneration++ << 16 | unused;
+        pSession->pKey = &netPorts [i];
+        pSession->password = password;
+        pSession->memorySize = size;
+        pSession->client = client;
+        pSession->clientPrev = NULL;
+        pSession->clientNext = NULL;
+        if ( client >= 0 ) {                // logged out when connection is closed
+            pSession->clientNext = netClients [client].pSessions;
+            if ( pSession->clientNext != NULL ) {
+                pSession->clientNext->clientPrev = pSession;
+            }
+            netClients [client].pSessions = pSession;
+        }
+        LeaseArm (&netWheel, &pSession->lease, netTick + SEATS_LEASE / SEATS_TICK);
+        reply->handle = htole32 (pSession->handle);
+        reply->param1 = htole16 ((uint16_t)size);
+        reply->param2 = htole16 ((uint16_t)netPorts [i].port);
+        reply->status = NETKEY_STATUS_OK;
+        Log (LOG_INFO, "Net key of port %d: user %u of %u logged in.\n", netPorts [i].port,
+             atomic_load_explicit (&pStats->seatsUsed, memory_order_relaxed), NetKeyUsers (pKeyData));
+        return;
+    }
+}
+
+/**
+ * Serve request
+ *
+ * @param request - request, length is checked
+ * @param reply - reply
+ * @param client - TCP client, -1 for UDP
+ * @return - bytes of reply
+ */
+static size_t NetKeyRequest (PNETKEY_MESSAGE request, PNETKEY_MESSAGE reply, int client) {
+
+    memcpy (reply, request, NETKEY_HEADER);
+    reply->length = 0;
+    reply->status = NETKEY_STATUS_OK;
+    netRequests++;
+    if ( request->command == NETKEY_LOGIN ) {
+        NetKeyLogin (request, reply, client);
+        return NETKEY_HEADER;
+    }
+    PNETKEY_SESSION pSession = NetKeySession (le32toh (request->handle));
+    if ( pSession == NULL ) {
+        reply->status = NETKEY_STATUS_BAD_HANDLE;
+        return NETKEY_HEADER;
+    }
+    if ( request->command == NETKEY_LOGOUT ) {
+        Log (LOG_INFO, "Net key of port %d: user logged out.\n", pSession->pKey->port);
+        NetKeyLogout (pSession);
+        return NETKEY_HEADER;
+    }
+                                            // Key image is valid till next quiescent state
+    PKEYDATA pKeyData = atomic_load_explicit (&pSession->pKey->pKeyData, memory_order_acquire);
+    if ( pKeyData == NULL || pKeyData->password != pSession->password ||
+         pSession->session.keyEpoch != pKeyData->sessionEpoch ) {
+        reply->status = NETKEY_STATUS_RELOGIN;
+        NetKeyLogout (pSession);
+        return NETKEY_HEADER;
+    }
+    LeaseArm (&netWheel, &pSession->lease, netTick + SEATS_LEASE / SEATS_TICK);
+    uint16_t offset = le16toh (request->param1);
+    uint16_t length = le16toh (request->param2);
+    uint32_t value;
+    switch ( request->command ) {
+    case NETKEY_READ:
+        if ( length > NETKEY_MAX_DATA ) {
+            reply->status = NETKEY_STATUS_BAD_REQUEST;
+        } else if ( offset+length > pSession->memorySize ) {
+            reply->status = NETKEY_STATUS_BAD_ADDRESS;
+        } else {
+            KeyMemoryRead (pKeyData, &pSession->session, offset, reply->data, length);
+            reply->length = htole16 (length);
+        }
+        break;
+    case NETKEY_HASH:
+        if ( le16toh (request->length) != sizeof(value) ) {
+            reply->status = NETKEY_STATUS_BAD_REQUEST;
+            break;
+        }
+        memcpy (&value, request->data, sizeof(value));
+        value = le32toh (value);
+        KeyHashDword (pKeyData, &value);
+        value = htole32 (value);
+        memcpy (reply->data, &value, sizeof(value));
+        reply->length = htole16 (sizeof(value));
+        break;
+    default:
+        reply->status = NETKEY_STATUS_BAD_REQUEST;
+        break;
+    }
+    return NETKEY_HEADER + le16toh (reply->length);
+}
+
+/**
+ * Serve UDP datagrams waiting in socket
+ */
+static void NetKeyUdp (void) {
+        NETKEY_MESSAGE request, reply;
+        struct sockaddr_in from;
+
+    for ( ;; ) {
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom (netUdpFd, &request, sizeof(request), 0, (struct sockaddr *)&from, &fromLen);
+        if ( len < 0 ) {
+            return;
+        }
+        if ( (size_t)len < NETKEY_HEADER || le32toh (request.magic) != NETKEY_MAGIC ||
+             (size_t)len != NETKEY_HEADER + le16toh (request.length) ) {
+            continue;                       // not ours, no reply
+        }
+        size_t size = NetKeyRequest (&request, &reply, -1);
+        sendto (netUdpFd, &reply, size, 0, (struct sockaddr *)&from, fromLen);
+    }
+}
+
+/**
+ * Close TCP client and log out its sessions
+ *
+ * @param client - client number
+ */
+static void NetKeyClose (int client) {
+
+    while ( netClients [client].pSessions != NULL ) {
+        Log (LOG_INFO, "Net key of port %d: user disconnected.\n", netClients [client].pSessions->pKey->port);
+        NetKeyLogout (netClients [client].pSessions);
+    }
+    close (netClients [client].fd);         // removed from epoll set too
+    netClients [client].fd = -1;
+}
+
+/**
+ * Serve requests of TCP client
+ *
+ * @param client - client number
+ */
+static void NetKeyTcp (int client) {
+        PNETKEY_CLIENT pClient = &netClients [client];
+        NETKEY_MESSAGE reply;
+
+    for ( ;; ) {
+        ssize_t len = recv (pClient->fd, (uint8_t *)&pClient->request + pClient->used, sizeof(pClient->request) - pClient->used, 0);
+        if ( len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+            NetKeyClose (client);
+            return;
+        }
+        if ( len < 0 ) {
+            return;
+        }
+        pClient->used += len;
+        while ( pClient->used >= NETKEY_HEADER ) {
+            size_t size = NETKEY_HEADER + le16toh (pClient->request.length);
+            if ( le32toh (pClient->request.magic) != NETKEY_MAGIC || size > sizeof(pClient->request) ) {
+                NetKeyClose (client);       // stream is out of sync
+                return;
+            }
+            if ( pClient->used < size ) {
+                break;
+            }
+            size_t replySize = NetKeyRequest (&pClient->request, &reply, client);
+            if ( send (pClient->fd, &reply, replySize, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)replySize ) {
+                NetKeyClose (client);       // client doesn't read its replies
+                return;
+            }
+            pClient->used -= size;
+            memmove (&pClient->request, (uint8_t *)&pClient->request + size, pClient->used);
+        }
+    }
+}
+
+/**
+ * Accept TCP clients
+ */
+static void NetKeyAccept (void) {
+        struct epoll_event ev;
+
+    for ( ;; ) {
+        int fd = accept (netListenFd, NULL, NULL);
+        if ( fd < 0 ) {
+            return;
+        }
+        int client = -1;
+        for ( int i = 0; i < NETKEY_MAX_CLIENTS; i++ ) {
+            if ( netClients [i].fd < 0 ) {
+                client = i;
+                break;
+            }
+        }
+        if ( client < 0 ) {
+            close (fd);                     // client sees connection reset
+            continue;
+        }
+        int one = 1;
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl (fd, F_SETFL, O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.u32 = NETKEY_TAG_CLIENT + client;
+        if ( epoll_ctl (netEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+            close (fd);
+            continue;
+        }
+        netClients [client].fd = fd;
+        netClients [client].used = 0;
+        netClients [client].pSessions = NULL;
+    }
+}
+
+/**
+ * Network key server thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *NetKeyThread (void *arg) {
+        struct epoll_event events [NETKEY_EVENTS];
+        int     value = 0;
+        int     reader;
+
+    reader = RcuRegisterThread ();          // key images are read without locks
+    while ( !value ) {
+        RcuThreadOffline (reader);          // no key image references while waiting
+        int res = epoll_wait (netEpollFd, events, NETKEY_EVENTS, 100);
+        RcuThreadOnline (reader);
+        netTick = SeatsTick ();
+        if ( res < 0 && errno != EINTR ) {
+            Log (LOG_ERR, "Network key server (epoll_wait) failed: %s.\n", strerror(errno));
+            break;
+        }
+        for ( int i = 0; i < res; i++ ) {
+            uint32_t tag = events [i].data.u32;
+            if ( tag == NETKEY_TAG_UDP ) {
+                NetKeyUdp ();
+            } else if ( tag == NETKEY_TAG_LISTEN ) {
+                NetKeyAccept ();
+            } else if ( netClients [tag-NETKEY_TAG_CLIENT].fd >= 0 ) {
+                NetKeyTcp (tag-NETKEY_TAG_CLIENT);
+            }
+            RcuQuiescentState (reader);     // no key image references are held here
+        }
+        LeaseAdvance (&netWheel, netTick, NetKeyExpired, NULL);
+        sem_getvalue (netMutex, &value);
+    }
+    for ( int i = 0; i < NETKEY_MAX_CLIENTS; i++ ) {
+        if ( netClients [i].fd >= 0 ) {
+            NetKeyClose (i);
+        }
+    }
+    for ( int i = 0; i < NETKEY_MAX_SESSIONS; i++ ) {
+        if ( netSessions [i].handle ) {
+            NetKeyLogout (&netSessions [i]);
+        }
+    }
+    RcuUnregisterThread (reader);
+    return NULL;
+}
+
+/**
+ * Parse listen address
+ *
+ * @param address - [address:]port
+ * @param addr - parsed address
+ * @return - 0 in case of success or errno code
+ */
+static int NetKeyAddress (const char *address, struct sockaddr_in *addr) {
+        char    host [INET_ADDRSTRLEN];
+        char    *end;
+
+    memset (addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl (INADDR_ANY);
+    const char *port = strrchr (address, ':');
+    if ( port != NULL ) {
+        if ( (size_t)(port-address) >= sizeof(host) ) {
+            return EINVAL;
+        }
+        memcpy (host, address, port-address);
+        host [port-address] = 0;
+        if ( inet_pton (AF_INET, host, &addr->sin_addr) != 1 ) {
+            return EINVAL;
+        }
+        port++;
+    } else {
+        port = address;
+    }
+    unsigned long n = strtoul (port, &end, 10);
+    if ( *port == 0 || *end != 0 || n == 0 || n > 0xffff ) {
+        return EINVAL;
+    }
+    addr->sin_port = htons ((uint16_t)n);
+    return 0;
+}
+
+/**
+ * Open UDP and TCP sockets of network key server and start serving them
+ *
+ * @param address - [address:]port
+ * @param haspKeys - ports
+ * @param numPorts - number of ports
+ * @param pmutex - threads "stop" semaphore
+ * @return - 0 in case of success or errno code
+ */
+int StartNetKey (const char *address, struct _USB_HASP *haspKeys, int numPorts, sem_t *pmutex) {
+        struct sockaddr_in addr;
+        struct epoll_event ev;
+        int     one = 1;
+        int     result;
+
+    if ( (result = NetKeyAddress (address, &addr)) ) {
+        return result;
+    }
+    netPorts = haspKeys;
+    netNumPorts = numPorts;
+    netMutex = pmutex;
+    for ( int i = 0; i < NETKEY_MAX_CLIENTS; i++ ) {
+        netClients [i].fd = -1;
+    }
+    netSessions = calloc (NETKEY_MAX_SESSIONS, sizeof(NETKEY_SESSION));
+    netFree = calloc (NETKEY_MAX_SESSIONS, sizeof(int));
+    if ( netSessions == NULL || netFree == NULL ) {
+        StopNetKey ();
+        return ENOMEM;
+    }
+    for ( netNumFree = 0; netNumFree < NETKEY_MAX_SESSIONS; netNumFree++ ) {
+        netFree [netNumFree] = NETKEY_MAX_SESSIONS-1 - netNumFree;     // low sessions go first
+    }
+    netTick = SeatsTick ();
+    LeaseWheelInit (&netWheel, netTick);
+    netUdpFd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    netListenFd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    netEpollFd = epoll_create1 (EPOLL_CLOEXEC);
+    if ( netUdpFd < 0 || netListenFd < 0 || netEpollFd < 0 ) {
+        result = errno;
+    } else {
+        setsockopt (netListenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt (netListenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));   // emulator taking over binds it too
+        setsockopt (netUdpFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if ( bind (netUdpFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+             bind (netListenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+             listen (netListenFd, NETKEY_MAX_CLIENTS) < 0 ) {
+            result = errno;
+        } else {
+            ev.events = EPOLLIN;
+            ev.data.u32 = NETKEY_TAG_UDP;
+            if ( epoll_ctl (netEpollFd, EPOLL_CTL_ADD, netUdpFd, &ev) < 0 ) {
+                result = errno;
+            }
+            ev.data.u32 = NETKEY_TAG_LISTEN;
+            if ( !result && epoll_ctl (netEpollFd, EPOLL_CTL_ADD, netListenFd, &ev) < 0 ) {
+                result = errno;
+            }
+        }
+    }
+    if ( !result ) {
+        result = pthread_create (&netThread, NULL, NetKeyThread, NULL);
+    }
+    if ( result ) {
+        StopNetKey ();
+        return result;
+    }
+    netStarted = true;
+    Log (LOG_INFO, "Network key server listens on %s:%hu.\n", inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
+    return 0;
+}
+
+/**
+ * Wait for network key server thread to finish and close its sockets.
+ * "Stop" semaphore must be posted.
+ */
+void StopNetKey (void) {
+
+    if ( netStarted ) {
+        pthread_join (netThread, NULL);
+        netStarted = false;
+        Log (LOG_INFO, "Network key server served %llu requests.\n", netRequests);
+    }
+    if ( netEpollFd >= 0 ) {
+        close (netEpollFd);
+        netEpollFd = -1;
+    }
+    if ( netListenFd >= 0 ) {
+        close (netListenFd);
+        netListenFd = -1;
+    }
+    if ( netUdpFd >= 0 ) {
+        close (netUdpFd);
+        netUdpFd = -1;
+    }
+    free (netSessions);
+    netSessions = NULL;
+    free (netFree);
+    netFree = NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     NetKey.h
+ * Abstract:
+ *      Network key server: net keys (HASP4 Net) served to remote clients
+ *      over UDP and TCP straight from loaded key images, without USB
+ *      and a separate license manager.
+ * Notes:
+ *      Every message is a header followed by length bytes of data, all
+ *      fields little endian. UDP datagram carries one message, TCP stream
+ *      carries messages back to back. Reply echoes command and sequence.
+ *
+ *          LOGIN   param1:param2 - PASS1:PASS2 of key, reply: handle,
+ *                  param1 - memory size, param2 - port of key
+ *          LOGOUT  handle
+ *          READ    handle, param1 - memory offset, param2 - bytes within
+ *                  memory size of LOGIN,
+ *                  reply: data
+ *          HASH    handle, data - dword, reply: data - hashed dword
+ *
+ *      Sessions of TCP clients are logged out when connection is closed,
+ *      sessions idle for SEATS_LEASE are logged out by the server.
+ * Revision History:
+ */
+#ifndef NETKEY_H
+#define NETKEY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <semaphore.h>
+
+#define NETKEY_PORT         475             // port of HASP license manager
+#define NETKEY_MAGIC        0x314d4c48      // "HLM1"
+#define NETKEY_MAX_DATA     1024            // longest READ
+#define NETKEY_MAX_SESSIONS 32768           // index is the lower half of handle
+#define NETKEY_MAX_CLIENTS  64              // TCP connections
+#define NETKEY_UNLIMITED    0xFFFF          // NetMemory user count of unlimited key
+
+enum NETKEY_COMMAND {
+    NETKEY_LOGIN            = 1,
+    NETKEY_LOGOUT           = 2,
+    NETKEY_READ             = 3,
+    NETKEY_HASH             = 4
+};
+
+enum NETKEY_STATUS {
+    NETKEY_STATUS_OK            = 0,
+    NETKEY_STATUS_NO_KEY        = 1,        // no net key with the password
+    NETKEY_STATUS_NO_SEAT       = 2,        // all users of key are logged in
+    NETKEY_STATUS_BAD_HANDLE    = 3,
+    NETKEY_STATUS_RELOGIN       = 4,        // key has been replaced or detached
+    NETKEY_STATUS_BAD_REQUEST   = 5,
+    NETKEY_STATUS_BAD_ADDRESS   = 6,        // read out of key memory
+    NETKEY_STATUS_NO_SESSION    = 7         // server has no free sessions
+};
+
+#pragma pack(1)
+typedef struct _NETKEY_MESSAGE {
+    uint32_t    magic;
+    uint32_t    sequence;           // chosen by client, echoed
+    uint32_t    handle;             // session, returned by LOGIN
+    uint8_t     command;
+    uint8_t     status;
+    uint16_t    param1;
+    uint16_t    param2;
+    uint16_t    length;             // bytes of data
+    uint8_t     data [NETKEY_MAX_DATA];
+} NETKEY_MESSAGE, *PNETKEY_MESSAGE;
+#pragma pack()
+
+#define NETKEY_HEADER       offsetof(NETKEY_MESSAGE, data)
+
+struct _USB_HASP;
+
+int  StartNetKey (const char *address, struct _USB_HASP *haspKeys, int numPorts, sem_t *pmutex);
+void StopNetKey (void);
+
+#endif  // NETKEY_H
@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     PortState.c
+ * Abstract:
+ *      Control plane of vhci ports: port power, connect, reset, suspend and
+ *      resume are handled by a thread of its own following a table driven
+ *      state machine, URB thread only answers requests.
+ * Notes:
+ *      Port stat work is turned into events by comparing it with the last
+ *      one of the port, every event is looked up in the transition table by
+ *      port state. Transition gives the next state and an action: driver
+ *      calls completing connect, reset and resume, logging and timing of
+ *      enumeration. Events not in the table are ignored.
+ *      Enumeration times are kept from power on (or connect of key attached
+ *      to powered port) to the first HASP request, logged and published in
+ *      statistics page when the port becomes active.
+ *      Without the thread (it couldn't be started) events are handled by
+ *      URB thread as they come, like before.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include "USBKeyEmu.h"
+#include "PortState.h"
+#include "Stats.h"
+#include "Log.h"
+
+#define PORT_EV_STAT        (-1)            // work item is port stat work
+
+typedef struct _PORT_WORK {
+    int         pindex;
+    int         event;                      // PORT_EV_* of URB thread or PORT_EV_STAT
+    struct usb_vhci_port_stat stat;
+    uint64_t    time;                       // LatencyNow of fetch
+} PORT_WORK, *PPORT_WORK;
+
+typedef struct _PORT_CONTROL {
+    atomic_int  state;                      // PORT_STATE, written by control thread only
+    uint64_t    times [PORT_STEPS];         // LatencyNow of enumeration steps, 0 - not seen
+    struct usb_vhci_port_stat stat;         // last port stat work handled
+} PORT_CONTROL, *PPORT_CONTROL;
+
+typedef void (*PORT_ACTION) (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork);
+
+typedef struct _PORT_TRANSITION {
+    bool        valid;
+    PORT_STATE  next;
+    PORT_ACTION action;                     // may be NULL
+} PORT_TRANSITION;
+
+static PORT_CONTROL     portControl [MAX_HASPKEYS];
+static PORT_WORK        portRing [PORTSTATE_RING];
+static atomic_uint      portHead __attribute__((aligned(CACHE_LINE)));    // written by URB thread only
+static atomic_uint      portDone __attribute__((aligned(CACHE_LINE)));    // written by control thread only
+static bool             portRequested [MAX_HASPKEYS];   // URB thread: first HASP request is posted
+static PUSBHASP         portKeys;
+static int              portNumPorts;
+static int              portFd = -1;
+static sem_t            *portMutex;
+static int              portEvent = -1;
+static pthread_t        portThread;
+static bool             portStarted = false;
+
+static const char       *portStateNames [PORT_STATES] = {
+    "off", "powered", "connected", "resetting", "default", "addressed", "active"
+};
+static const char       *portStepNames [PORT_STEPS] = {
+    "power", "connect", "reset", "address", "request"
+};
+
+/**
+ * Forget enumeration steps from step on
+ *
+ * @param pPort - port state
+ * @param step - first step to forget
+ */
+static void PortForget (PPORT_CONTROL pPort, PORT_STEP step) {
+
+    for ( int i = step; i < PORT_STEPS; i++ ) {
+        pPort->times [i] = 0;
+    }
+}
+
+/**
+ * Port powered on: connect device if port has a key
+ */
+static void PortPowerOn (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    PortForget (pPort, PORT_STEP_POWER);
+    if ( atomic_load_explicit (&pKey->pKeyData, memory_order_relaxed) == NULL ) {
+        Log (LOG_INFO, "Port %d is powered on, no key attached.\n", pKey->port);
+        return;
+    }
+    Log (LOG_INFO, "Port %d is powered on -> connecting device.\n", pKey->port);
+    pPort->times [PORT_STEP_POWER] = pWork->time;
+    if ( usb_vhci_port_connect (portFd, pKey->port, USB_VHCI_DATA_RATE_FULL) == -1 ) {
+        Log (LOG_ERR, "USB (usb_vhci_port_connect), port %d failed: %s.\n", pKey->port, strerror(errno));
+    }
+}
+
+/**
+ * Port powered off
+ */
+static void PortPowerOff (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    PortForget (pPort, PORT_STEP_POWER);
+    Log (LOG_INFO, "Port %d is powered off.\n", pKey->port);
+}
+
+/**
+ * Device connected
+ */
+static void PortConnect (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    PortForget (pPort, PORT_STEP_CONNECT);
+    pPort->times [PORT_STEP_CONNECT] = pWork->time;
+    Log (LOG_INFO, "Port %d connected.\n", pKey->port);
+}
+
+/**
+ * Device disconnected, e.g. key detached
+ */
+static void PortDisconnect (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    PortForget (pPort, PORT_STEP_POWER);
+}
+
+/**
+ * Hub resets port: complete reset of connected device
+ */
+static void PortReset (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    StatsInc (&StatsPort (pKey->port)->resets);
+    PortForget (pPort, PORT_STEP_RESET);
+    pPort->times [PORT_STEP_RESET] = pWork->time;
+    if ( pWork->stat.status & USB_VHCI_PORT_STAT_CONNECTION &&
+         usb_vhci_port_reset_done (portFd, pKey->port, 1) == -1 ) {
+        Log (LOG_ERR, "USB (usb_vhci_port_reset_done) port %d failed: %s.\n", pKey->port, strerror(errno));
+    }
+}
+
+/**
+ * Hub resets active port: device is enumerated again, earlier steps are
+ * not its steps
+ */
+static void PortReenumerate (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    PortForget (pPort, PORT_STEP_POWER);
+    PortReset (pKey, pPort, pWork);
+}
+
+/**
+ * Port disabled
+ */
+static void PortDisable (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    Log (LOG_INFO, "Port %d is disabled.\n", pKey->port);
+}
+
+/**
+ * Port suspended
+ */
+static void PortSuspend (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    Log (LOG_INFO, "Port %d is suspended.\n", pKey->port);
+}
+
+/**
+ * Port resuming: complete resume of connected device
+ */
+static void PortResume (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    if ( pWork->stat.status & USB_VHCI_PORT_STAT_CONNECTION && usb_vhci_port_resumed (portFd, pKey->port) == -1 ) {
+        Log (LOG_ERR, "USB (usb_vhci_port_resumed), port %d failed: %s.\n", pKey->port, strerror(errno));
+    }
+}
+
+/**
+ * Device got its address
+ */
+static void PortAddress (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+
+    PortForget (pPort, PORT_STEP_ADDRESS);
+    pPort->times [PORT_STEP_ADDRESS] = pWork->time;
+}
+
+/**
+ * First HASP request served: enumeration is complete, log and publish its
+ * steps
+ */
+static void PortRequest (PUSBHASP pKey, PPORT_CONTROL pPort, PPORT_WORK pWork) {
+        PSTATS_PORT pStats = StatsPort (pKey->port);
+        char    steps [128];
+        int     length = 0;
+        uint64_t first = 0, last = 0;
+
+    pPort->times [PORT_STEP_REQUEST] = pWork->time;
+    steps [0] = 0;
+    for ( int i = 0; i < PORT_STEPS; i++ ) {
+        uint64_t time = pPort->times [i];
+        if ( i > 0 ) {                      // time from the previous step seen, us
+            atomic_store_explicit (&pStats->enumTimes [i-1], time && last ? (time - last) / 1000 : 0, memory_order_relaxed);
+        }
+        if ( !time ) {
+            continue;
+        }
+        if ( last && length < (int)sizeof(steps) ) {
+            length += snprintf (steps + length, sizeof(steps) - length, "%s %s +%.1f", first == last ? "" : ",",
+                                portStepNames [i], (time - last) / 1e6);
+        }
+        first = first ? first : time;
+        last = time;
+    }
+    StatsInc (&pStats->enumerations);
+    Log (LOG_INFO, "Port %d enumerated in %.1f ms:%s ms.\n", pKey->port, (last - first) / 1e6, steps);
+}
+
+#define GO(state, action)   { true, state, action }
+
+static const PORT_TRANSITION portTable [PORT_STATES][PORT_EVENTS] = {
+    [PORT_OFF] = {
+        [PORT_EV_POWER_ON]      = GO (PORT_POWERED, PortPowerOn),
+    },
+    [PORT_POWERED] = {
+        [PORT_EV_POWER_OFF]     = GO (PORT_OFF, PortPowerOff),
+        [PORT_EV_CONNECT]       = GO (PORT_CONNECTED, PortConnect),
+        [PORT_EV_RESET]         = GO (PORT_POWERED, PortReset),
+        [PORT_EV_SUSPEND]       = GO (PORT_POWERED, PortSuspend),
+        [PORT_EV_RESUME]        = GO (PORT_POWERED, PortResume),
+    },
+    [PORT_CONNECTED] = {
+        [PORT_EV_POWER_OFF]     = GO (PORT_OFF, PortPowerOff),
+        [PORT_EV_DISCONNECT]    = GO (PORT_POWERED, PortDisconnect),
+        [PORT_EV_RESET]         = GO (PORT_RESETTING, PortReset),
+        [PORT_EV_SUSPEND]       = GO (PORT_CONNECTED, PortSuspend),
+        [PORT_EV_RESUME]        = GO (PORT_CONNECTED, PortResume),
+    },
+    [PORT_RESETTING] = {
+        [PORT_EV_POWER_OFF]     = GO (PORT_OFF, PortPowerOff),
+        [PORT_EV_DISCONNECT]    = GO (PORT_POWERED, PortDisconnect),
+        [PORT_EV_RESET]         = GO (PORT_RESETTING, PortReset),
+        [PORT_EV_ENABLE]        = GO (PORT_DEFAULT, NULL),
+    },
+    [PORT_DEFAULT] = {
+        [PORT_EV_POWER_OFF]     = GO (PORT_OFF, PortPowerOff),
+        [PORT_EV_DISCONNECT]    = GO (PORT_POWERED, PortDisconnect),
+        [PORT_EV_DISABLE]       = GO (PORT_CONNECTED, PortDisable),
+        [PORT_EV_RESET]         = GO (PORT_RESETTING, PortReset),
+        [PORT_EV_SUSPEND]       = GO (PORT_DEFAULT, PortSuspend),
+        [PORT_EV_RESUME]        = GO (PORT_DEFAULT, PortResume),
+        [PORT_EV_ADDRESS]       = GO (PORT_ADDRESSED, PortAddress),
+    },
+    [PORT_ADDRESSED] = {
+        [PORT_EV_POWER_OFF]     = GO (PORT_OFF, PortPowerOff),
+        [PORT_EV_DISCONNECT]    = GO (PORT_POWERED, PortDisconnect),
+        [PORT_EV_DISABLE]       = GO (PORT_CONNECTED, PortDisable),
+        [PORT_EV_RESET]         = GO (PORT_RESETTING, PortReset),
+        [PORT_EV_SUSPEND]       = GO (PORT_ADDRESSED, PortSuspend),
+        [PORT_EV_RESUME]        = GO (PORT_ADDRESSED, PortResume),
+        [PORT_EV_ADDRESS]       = GO (PORT_ADDRESSED, PortAddress),
+        [PORT_EV_REQUEST]       = GO (PORT_ACTIVE, PortRequest),
+    },
+    [PORT_ACTIVE] = {
+        [PORT_EV_POWER_OFF]     = GO (PORT_OFF, PortPowerOff),
+        [PORT_EV_DISCONNECT]    = GO (PORT_POWERED, PortDisconnect),
+        [PORT_EV_DISABLE]       = GO (PORT_CONNECTED, PortDisable),
+        [PORT_EV_RESET]         = GO (PORT_RESETTING, PortReenumerate),
+        [PORT_EV_SUSPEND]       = GO (PORT_ACTIVE, PortSuspend),
+        [PORT_EV_RESUME]        = GO (PORT_ACTIVE, PortResume),
+        [PORT_EV_ADDRESS]       = GO (PORT_ADDRESSED, PortAddress),
+    },
+};
+
+/**
+ * Run event of port through the state machine
+ *
+ * @param pWork - work the event comes from
+ * @param event - event
+ */
+static void PortRun (PPORT_WORK pWork, PORT_EVENT event) {
+        PUSBHASP pKey = &portKeys [pWork->pindex];
+        PPORT_CONTROL pPort = &portControl [pWork->pindex];
+
+    PORT_STATE state = atomic_load_explicit (&pPort->state, memory_order_relaxed);
+    const PORT_TRANSITION *pTransition = &portTable [state][event];
+    if ( !pTransition->valid ) {
+        return;
+    }
+    if ( pTransition->action != NULL ) {
+        pTransition->action (pKey, pPort, pWork);
+    }
+    atomic_store_explicit (&pPort->state, pTransition->next, memory_order_release);
+    atomic_store_explicit (&StatsPort (pKey->port)->portState, pTransition->next, memory_order_relaxed);
+}
+
+/**
+ * Handle work item: turn port stat work into events in the order hub
+ * makes them, events of URB thread are taken as they are
+ *
+ * @param pWork - work
+ */
+static void PortHandle (PPORT_WORK pWork) {
+        PPORT_CONTROL pPort = &portControl [pWork->pindex];
+        struct usb_vhci_port_stat *pPrev = &pPort->stat;
+
+    if ( pWork->event != PORT_EV_STAT ) {
+        PortRun (pWork, pWork->event);
+        return;
+    }
+    uint16_t status = pWork->stat.status;
+    uint16_t change = pWork->stat.change;
+    uint8_t flags = pWork->stat.flags;
+#if DEBUG > 2
+    Log (LOG_DEBUG, "Got port %hhu stat work. Status: 0x%04hx, change: 0x%04hx, flags: 0x%02hhx\n", pWork->stat.index, status, change, flags);
+#endif
+    if ( pPrev->status & USB_VHCI_PORT_STAT_POWER && ~status & USB_VHCI_PORT_STAT_POWER ) {
+        PortRun (pWork, PORT_EV_POWER_OFF);
+    }
+    if ( ~pPrev->status & USB_VHCI_PORT_STAT_POWER && status & USB_VHCI_PORT_STAT_POWER ) {
+        PortRun (pWork, PORT_EV_POWER_ON);
+    }
+    if ( change & USB_VHCI_PORT_STAT_C_CONNECTION ) {
+        PortRun (pWork, status & USB_VHCI_PORT_STAT_CONNECTION ? PORT_EV_CONNECT : PORT_EV_DISCONNECT);
+    }
+    if ( pPrev->status & USB_VHCI_PORT_STAT_ENABLE && ~status & USB_VHCI_PORT_STAT_ENABLE ) {
+        PortRun (pWork, PORT_EV_DISABLE);
+    }
+    if ( ~pPrev->status & USB_VHCI_PORT_STAT_RESET && status & USB_VHCI_PORT_STAT_RESET ) {
+        PortRun (pWork, PORT_EV_RESET);
+    }
+    if ( change & USB_VHCI_PORT_STAT_C_RESET && ~status & USB_VHCI_PORT_STAT_RESET && status & USB_VHCI_PORT_STAT_ENABLE ) {
+        PortRun (pWork, PORT_EV_ENABLE);
+    }
+    if ( ~pPrev->status & USB_VHCI_PORT_STAT_SUSPEND && status & USB_VHCI_PORT_STAT_SUSPEND ) {
+        PortRun (pWork, PORT_EV_SUSPEND);
+    }
+    if ( ~pPrev->flags & USB_VHCI_PORT_STAT_FLAG_RESUMING && flags & USB_VHCI_PORT_STAT_FLAG_RESUMING ) {
+        PortRun (pWork, PORT_EV_RESUME);
+    }
+    memcpy (pPrev, &pWork->stat, sizeof(*pPrev));
+}
+
+/**
+ * Hand work item over to control thread
+ *
+ * @param pWork - work
+ */
+static void PortPut (PPORT_WORK pWork) {
+        struct timespec ts = { 0, 1000000 };
+
+    if ( !portStarted ) {                   // URB thread handles it itself
+        PortHandle (pWork);
+        return;
+    }
+    unsigned head = atomic_load_explicit (&portHead, memory_order_relaxed);
+    while ( head - atomic_load_explicit (&portDone, memory_order_acquire) == PORTSTATE_RING ) {
+        nanosleep (&ts, NULL);              // hub waits for the port anyway
+    }
+    memcpy (&portRing [head & (PORTSTATE_RING-1)], pWork, sizeof(*pWork));
+    atomic_store_explicit (&portHead, head+1, memory_order_release);
+    uint64_t one = 1;
+    if ( write (portEvent, &one, sizeof(one)) < 0 ) {
+        ;                                   // control thread wakes up by timeout anyway
+    }
+}
+
+/**
+ * Hand port stat work over to control thread. Called by URB thread only.
+ *
+ * @param pindex - port index
+ * @param pStat - port stat work
+ * @param time - LatencyNow of fetch
+ */
+void PortStatePost (int pindex, const struct usb_vhci_port_stat *pStat, uint64_t time) {
+        PORT_WORK work;
+
+    work.pindex = pindex;
+    work.event = PORT_EV_STAT;
+    memcpy (&work.stat, pStat, sizeof(work.stat));
+    work.time = time;
+    PortPut (&work);
+}
+
+/**
+ * Hand event of URB thread over to control thread: SET_ADDRESS served or
+ * HASP request served, only the first one after SET_ADDRESS is passed on.
+ * Called by URB thread only.
+ *
+ * @param pindex - port index
+ * @param event - PORT_EV_ADDRESS or PORT_EV_REQUEST
+ * @param time - LatencyNow of fetch
+ */
+void PortStateEvent (int pindex, PORT_EVENT event, uint64_t time) {
+        PORT_WORK work;
+
+    if ( event == PORT_EV_REQUEST && portRequested [pindex] ) {
+        return;
+    }
+    portRequested [pindex] = event == PORT_EV_REQUEST;
+    memset (&work, 0, sizeof(work));
+    work.pindex = pindex;
+    work.event = event;
+    work.time = time;
+    PortPut (&work);
+}
+
+/**
+ * Check whether control thread has handled all work
+ *
+ * @return - true if nothing is queued or being handled
+ */
+bool PortStateIdle (void) {
+
+    return atomic_load_explicit (&portDone, memory_order_acquire) == atomic_load_explicit (&portHead, memory_order_relaxed);
+}
+
+/**
+ * State of port
+ *
+ * @param pindex - port index
+ * @return - PORT_STATE
+ */
+PORT_STATE PortStateGet (int pindex) {
+
+    return atomic_load_explicit (&portControl [pindex].state, memory_order_acquire);
+}
+
+/**
+ * Name of port state
+ *
+ * @param state - PORT_STATE
+ * @return - name
+ */
+const char *PortStateName (PORT_STATE state) {
+
+    return state < PORT_STATES ? portStateNames [state] : "?";
+}
+
+/**
+ * Handle work queued by URB thread
+ */
+static void PortDrain (void) {
+
+    unsigned done = atomic_load_explicit (&portDone, memory_order_relaxed);
+    unsigned head = atomic_load_explicit (&portHead, memory_order_acquire);
+    while ( done != head ) {
+        PortHandle (&portRing [done & (PORTSTATE_RING-1)]);
+        atomic_store_explicit (&portDone, ++done, memory_order_release);
+    }
+}
+
+/**
+ * Control plane thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *PortStateThread (void *arg) {
+        struct pollfd pfd;
+        uint64_t count;
+        int     value = 0;
+
+    pfd.fd = portEvent;
+    pfd.events = POLLIN;
+    while ( !value ) {
+        if ( poll (&pfd, 1, PORTSTATE_IDLE) > 0 && pfd.revents & POLLIN ) {
+            if ( read (portEvent, &count, sizeof(count)) < 0 ) {
+                ;
+            }
+        }
+        PortDrain ();
+        sem_getvalue (portMutex, &value);
+    }
+    PortDrain ();
+    return NULL;
+}
+
+/**
+ * Take state of port the emulator starts with: idle port of new controller
+ * or port of controller taken over
+ *
+ * @param pKey - port
+ * @param pPort - [out] port state
+ */
+static void PortInit (PUSBHASP pKey, PPORT_CONTROL pPort) {
+        uint16_t status = pKey->stat.status;
+        PORT_STATE state;
+
+    memset (pPort, 0, sizeof(*pPort));
+    memcpy (&pPort->stat, &pKey->stat, sizeof(pPort->stat));
+    if ( ~status & USB_VHCI_PORT_STAT_POWER ) {
+        state = PORT_OFF;
+    } else if ( ~status & USB_VHCI_PORT_STAT_CONNECTION ) {
+        state = PORT_POWERED;
+    } else if ( status & USB_VHCI_PORT_STAT_RESET ) {
+        state = PORT_RESETTING;
+    } else if ( ~status & USB_VHCI_PORT_STAT_ENABLE || pKey->addr == 0xff ) {
+        state = PORT_CONNECTED;
+    } else if ( pKey->addr == 0 ) {
+        state = PORT_DEFAULT;
+    } else {                                // serving requests already, not timed
+        state = PORT_ACTIVE;
+    }
+    atomic_store_explicit (&pPort->state, state, memory_order_relaxed);
+    atomic_store_explicit (&StatsPort (pKey->port)->portState, state, memory_order_relaxed);
+    portRequested [pKey->port-1] = state == PORT_ACTIVE;
+}
+
+/**
+ * Start control plane of vhci ports. Called before URB thread starts.
+ *
+ * @param fd - vhci file descriptor
+ * @param haspKeys - ports
+ * @param numPorts - number of ports
+ * @param pmutex - threads "stop" semaphore
+ * @return - 0 in case of success or errno code, ports are controlled by
+ *           URB thread then
+ */
+int StartPortState (int fd, USB_HASP haspKeys[], int numPorts, sem_t *pmutex) {
+
+    portFd = fd;
+    portKeys = haspKeys;
+    portNumPorts = numPorts;
+    portMutex = pmutex;
+    for ( int i = 0; i < portNumPorts; i++ ) {
+        PortInit (&portKeys [i], &portControl [i]);
+    }
+    atomic_store (&portHead, 0);
+    atomic_store (&portDone, 0);
+    portEvent = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( portEvent < 0 ) {
+        return errno;
+    }
+    int result = pthread_create (&portThread, NULL, PortStateThread, NULL);
+    if ( result ) {
+        close (portEvent);
+        portEvent = -1;
+        return result;
+    }
+    portStarted = true;
+    return 0;
+}
+
+/**
+ * Handle queued work and stop control plane. "Stop" semaphore must be
+ * posted and URB thread must be finished.
+ */
+void StopPortState (void) {
+
+    if ( portStarted ) {
+        pthread_join (portThread, NULL);
+        portStarted = false;
+    }
+    if ( portEvent >= 0 ) {
+        close (portEvent);
+        portEvent = -1;
+    }
+}
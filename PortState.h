@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     PortState.h
+ * Abstract:
+ *      Control plane of vhci ports: port power, connect, reset, suspend and
+ *      resume are handled by a thread of its own following a table driven
+ *      state machine, URB thread only answers requests.
+ * Notes:
+ *      URB thread keeps device addresses, they must change in order with
+ *      the URBs it fetches, and hands port stat work, SET_ADDRESS and the
+ *      first HASP request of every port over to the control thread through
+ *      a lock-free single producer ring. Control thread is the only writer
+ *      of port states and enumeration times, everyone else reads them.
+ * Revision History:
+ */
+#ifndef PORTSTATE_H
+#define PORTSTATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <libusb_vhci.h>
+
+#define PORTSTATE_RING      64              // events queued, power of 2
+#define PORTSTATE_IDLE      100             // ms to wait for events, "stop" semaphore is checked
+
+typedef enum _PORT_STATE {
+    PORT_OFF,                       // not powered
+    PORT_POWERED,                   // powered, no device connected
+    PORT_CONNECTED,                 // device connected, not enabled
+    PORT_RESETTING,
+    PORT_DEFAULT,                   // enabled, default address 0
+    PORT_ADDRESSED,                 // SET_ADDRESS done
+    PORT_ACTIVE,                    // HASP request served
+    PORT_STATES
+} PORT_STATE;
+
+typedef enum _PORT_EVENT {
+    PORT_EV_POWER_ON,
+    PORT_EV_POWER_OFF,
+    PORT_EV_CONNECT,
+    PORT_EV_DISCONNECT,
+    PORT_EV_RESET,                  // reset started by hub
+    PORT_EV_ENABLE,                 // reset done, port enabled
+    PORT_EV_DISABLE,
+    PORT_EV_SUSPEND,
+    PORT_EV_RESUME,
+    PORT_EV_ADDRESS,                // SET_ADDRESS served by URB thread
+    PORT_EV_REQUEST,                // first HASP request served by URB thread
+    PORT_EVENTS
+} PORT_EVENT;
+
+typedef enum _PORT_STEP {           // enumeration steps timed
+    PORT_STEP_POWER,
+    PORT_STEP_CONNECT,
+    PORT_STEP_RESET,
+    PORT_STEP_ADDRESS,
+    PORT_STEP_REQUEST,
+    PORT_STEPS
+} PORT_STEP;
+
+struct _USB_HASP;
+
+int        StartPortState (int fd, struct _USB_HASP haspKeys[], int numPorts, sem_t *pmutex);
+void       StopPortState (void);
+void       PortStatePost (int pindex, const struct usb_vhci_port_stat *pStat, uint64_t time);
+void       PortStateEvent (int pindex, PORT_EVENT event, uint64_t time);
+bool       PortStateIdle (void);
+PORT_STATE PortStateGet (int pindex);
+const char *PortStateName (PORT_STATE state);
+
+#endif  // PORTSTATE_H
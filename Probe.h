@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Probe.h
+ * Abstract:
+ *      USDT static tracepoints of provider "usbhasp" for bpftrace, perf
+ *      and systemtap.
+ * Notes:
+ *      Probes are nops in the code and notes in .note.stapsdt section,
+ *      tracer patches them only when attached. Arguments are what's at
+ *      hand in registers, don't pass anything that must be computed.
+ *      Probes are compiled in when <sys/sdt.h> (systemtap-sdt-dev) is
+ *      found, -DNO_PROBES switches them off.
+ *
+ *      urb__fetch      devadr, bmRequestType, bRequest, wLength, handle
+ *      urb__route      port, devadr, bRequest          port 0 if no key has devadr
+ *      urb__done       port, devadr, fn, status, buffer_actual, ns
+ *                      fn is bRequest of HASP requests or 0x100, ns since fetch
+ *      process__entry  port, devadr, bmRequestType, bRequest, wLength
+ *      process__return port, devadr, bRequest, status, buffer_actual
+ *      hasp__request   port, fn, param1, param2, param3
+ *      hasp__response  port, fn, status, length        status is raw response byte
+ *      chiper__entry   size, chiperKey1, chiperKey2
+ *      chiper__return  size, chiperKey1, chiperKey2
+ *      transform__entry / transform__return            KEY_FN_HASH_DWORD transform
+ *      port__stat      port, prevStatus, status, change, flags
+ *      key__load__entry  file
+ *      key__load__return file, result
+ *      key__reload     file, compatible, sameData
+ * Revision History:
+ */
+#ifndef PROBE_H
+#define PROBE_H
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE0(name)                            DTRACE_PROBE (usbhasp, name)
+#define PROBE1(name, a1)                        DTRACE_PROBE1 (usbhasp, name, a1)
+#define PROBE2(name, a1, a2)                    DTRACE_PROBE2 (usbhasp, name, a1, a2)
+#define PROBE3(name, a1, a2, a3)                DTRACE_PROBE3 (usbhasp, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4)            DTRACE_PROBE4 (usbhasp, name, a1, a2, a3, a4)
+#define PROBE5(name, a1, a2, a3, a4, a5)        DTRACE_PROBE5 (usbhasp, name, a1, a2, a3, a4, a5)
+#define PROBE6(name, a1, a2, a3, a4, a5, a6)    DTRACE_PROBE6 (usbhasp, name, a1, a2, a3, a4, a5, a6)
+#else
+#define PROBE0(name)                            do { } while (0)
+#define PROBE1(name, a1)                        do { } while (0)
+#define PROBE2(name, a1, a2)                    do { } while (0)
+#define PROBE3(name, a1, a2, a3)                do { } while (0)
+#define PROBE4(name, a1, a2, a3, a4)            do { } while (0)
+#define PROBE5(name, a1, a2, a3, a4, a5)        do { } while (0)
+#define PROBE6(name, a1, a2, a3, a4, a5, a6)    do { } while (0)
+#endif
+
+#endif  // PROBE_H
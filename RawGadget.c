@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     RawGadget.c
+ * Abstract:
+ *      Keys emulated as USB gadgets of raw_gadget driver bound to UDCs
+ *      like dummy_hcd instead of devices of vhci_hcd ports.
+ * Notes:
+ *      Every port is a gadget with its own /dev/raw-gadget instance and its
+ *      own event thread, gadgets don't share any queue. UDC enumerates the
+ *      gadget itself (reset, SET_ADDRESS), the thread gets ep0 control
+ *      requests only. They are served by ProcessUrb of vhci backend, so
+ *      descriptors and HASP functions are answered exactly the same way.
+ *      EVENT_FETCH and ep0 transfers block in kernel, threads are woken up
+ *      for stop by SIGURG.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include <libusb_vhci.h>
+#include "USBKeyEmu.h"
+#include "RawGadget.h"
+#include "Rcu.h"
+#include "Latency.h"
+#include "Stats.h"
+#include "Rtc.h"
+#include "Log.h"
+#include "Probe.h"
+
+//
+// Gadget of one port, AKA thread data
+//
+typedef struct _RAW_GADGET {
+    int         fd;                 // raw_gadget instance
+    PUSBHASP    pKey;
+    pthread_t   thread;
+    bool        started;
+    atomic_bool done;               // thread has exited
+} RAW_GADGET, *PRAW_GADGET;
+
+//
+// ep0 transfer buffer, usb_raw_ep_io ends with flexible data array
+//
+typedef struct _RAW_GADGET_IO {
+    struct usb_raw_ep_io io;
+    uint8_t     data [RAW_GADGET_EP0_MAX];
+} RAW_GADGET_IO;
+
+//
+// Fetched event with control request
+//
+typedef struct _RAW_GADGET_EVENT {
+    struct usb_raw_event event;
+    struct usb_ctrlrequest ctrl;
+} RAW_GADGET_EVENT;
+
+static RAW_GADGET   gadgets [MAX_HASPKEYS];
+static int          gadgetsNum = 0;
+static sem_t        *gadgetMutex;
+
+/**
+ * SIGURG handler, the signal only interrupts blocking ioctls
+ *
+ * @param sig - not used
+ */
+static void RawGadgetWakeup (int sig) {
+}
+
+/**
+ * Complete ep0 control request as ProcessUrb has decided
+ *
+ * @param pGadget - gadget
+ * @param ctrl - control request
+ * @param urb - processed request
+ * @param pIo - transfer buffer, contains IN data
+ * @return - 0 or errno
+ */
+static int RawGadgetComplete (PRAW_GADGET pGadget, struct usb_ctrlrequest *ctrl, struct usb_vhci_urb *urb, RAW_GADGET_IO *pIo) {
+
+    if ( urb->status == USB_VHCI_STATUS_STALL ) {
+        return ioctl (pGadget->fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0 ? errno : 0;
+    }
+    if ( ctrl->bRequestType & USB_DIR_IN ) {
+        pIo->io.ep = 0;
+        pIo->io.flags = 0;
+        pIo->io.length = urb->buffer_actual;
+        return ioctl (pGadget->fd, USB_RAW_IOCTL_EP0_WRITE, &pIo->io) < 0 ? errno : 0;
+    }
+    if ( urb->bmRequestType == 0x00 && urb->bRequest == URB_RQ_SET_CONFIGURATION && urb->wValue ) {
+        int power = pGadget->pKey->confDesc [8] ? pGadget->pKey->confDesc [8] : RAW_GADGET_POWER;
+        if ( ioctl (pGadget->fd, USB_RAW_IOCTL_VBUS_DRAW, power) < 0 ) {
+            Log (LOG_WARNING, "Gadget (VBUS_DRAW) port %d failed: %s.\n", pGadget->pKey->port, strerror(errno));
+        }
+        if ( ioctl (pGadget->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0 ) {
+            return errno;
+        }
+    }
+    pIo->io.ep = 0;                         // acknowledge, data of OUT requests is dropped
+    pIo->io.flags = 0;
+    pIo->io.length = urb->wLength < RAW_GADGET_EP0_MAX ? urb->wLength : RAW_GADGET_EP0_MAX;
+    return ioctl (pGadget->fd, USB_RAW_IOCTL_EP0_READ, &pIo->io) < 0 ? errno : 0;
+}
+
+/**
+ * Gadget events thread
+ *
+ * @param arg - gadget
+ * @return - NULL
+ */
+static void *RawGadgetThread (void *arg) {
+        PRAW_GADGET pGadget = (PRAW_GADGET)arg;
+        PUSBHASP pKey = pGadget->pKey;
+        PSTATS_PORT pStats = StatsPort (pKey->port);
+        RAW_GADGET_EVENT e;
+        RAW_GADGET_IO io;
+        struct usb_vhci_urb urb;
+        int     value = 0;
+        int     reader;
+
+    reader = RcuRegisterThread ();          // key images are read without locks
+    while ( !value ) {
+        RcuQuiescentState (reader);         // no key image references are held here
+        e.event.type = 0;
+        e.event.length = sizeof(e.ctrl);
+        RcuThreadOffline (reader);          // host may not talk to the gadget for hours
+        int res = ioctl (pGadget->fd, USB_RAW_IOCTL_EVENT_FETCH, &e.event);
+        RcuThreadOnline (reader);
+        uint64_t fetchTime = LatencyNow ();
+        RtcTick ();
+        if ( res < 0 ) {
+            if ( errno != EINTR ) {
+                Log (LOG_ERR, "Gadget (EVENT_FETCH) port %d failed: %s.\n", pKey->port, strerror(errno));
+                StatsInc (&pStats->fetchErrors);
+                break;
+            }
+        } else if ( e.event.type == USB_RAW_EVENT_CONNECT ) {
+            unsigned status = USB_VHCI_PORT_STAT_POWER | USB_VHCI_PORT_STAT_CONNECTION | USB_VHCI_PORT_STAT_ENABLE;
+            StatsInc (&pStats->portStats);
+            StatsInc (&pStats->resets);
+            atomic_store_explicit (&pStats->status, status, memory_order_relaxed);
+            Log (LOG_INFO, "Gadget of port %d connected%s.\n", pKey->port,
+                 atomic_load_explicit (&pKey->pKeyData, memory_order_relaxed) == NULL ? ", no key attached" : "");
+        } else if ( e.event.type == USB_RAW_EVENT_CONTROL ) {
+            memset (&urb, 0, sizeof(urb));
+            urb.type = USB_VHCI_URB_TYPE_CONTROL;
+            urb.devadr = pKey->addr;
+            urb.bmRequestType = e.ctrl.bRequestType;
+            urb.bRequest = e.ctrl.bRequest;
+            urb.wValue = le16toh (e.ctrl.wValue);
+            urb.wIndex = le16toh (e.ctrl.wIndex);
+            urb.wLength = le16toh (e.ctrl.wLength);
+            urb.buffer = io.data;
+            urb.buffer_length = urb.wLength < RAW_GADGET_EP0_MAX ? urb.wLength : RAW_GADGET_EP0_MAX;
+            urb.status = USB_VHCI_STATUS_STALL;
+            PROBE5 (process__entry, pKey->port, urb.devadr, urb.bmRequestType, urb.bRequest, urb.wLength);
+            ProcessUrb (pKey, &urb);
+            PROBE5 (process__return, pKey->port, urb.devadr, urb.bRequest, urb.status, urb.buffer_actual);
+            if ( (res = RawGadgetComplete (pGadget, &e.ctrl, &urb, &io)) && res != EINTR ) {
+                Log (LOG_ERR, "Gadget (ep0) port %d request 0x%02hhx failed: %s.\n", pKey->port, urb.bRequest, strerror(res));
+                StatsInc (&pStats->givebackErrors);
+            }
+            StatsInc (&pStats->urbs);
+            if ( urb.status == USB_VHCI_STATUS_STALL ) {
+                StatsInc (&pStats->stalls);
+            }
+            if ( urb.bmRequestType == 0xc0 ) {
+                StatsInc (&pStats->haspUrbs);
+                StatsInc (&pStats->fn [urb.bRequest]);
+            } else {
+                StatsInc (&pStats->usbUrbs);
+            }
+            uint64_t doneTime = LatencyNow ();
+            int fn = urb.bmRequestType == 0xc0 ? urb.bRequest : LATENCY_FN_USB;
+            LatencyRecord (pKey->port, fn, doneTime - fetchTime);
+            LatencyExchange (pKey->port, fn, fetchTime, doneTime);
+            PROBE6 (urb__done, pKey->port, urb.devadr, fn, urb.status, urb.buffer_actual, doneTime - fetchTime);
+        }                                   // suspend, resume, reset and disconnect are served by UDC
+        sem_getvalue (gadgetMutex, &value);
+    }
+    RcuUnregisterThread (reader);
+    atomic_store (&pGadget->done, true);
+    return NULL;
+}
+
+/**
+ * Create gadgets, one per port. Called before daemonizing to report
+ * missing raw_gadget or UDC on console.
+ *
+ * @param udc - UDC driver name. dummy_udc gadget of port N is bound to
+ *              dummy_udc.N-1, a name with a dot is the only UDC device name
+ * @param numPorts - number of ports
+ * @return - 0 or errno
+ */
+int RawGadgetOpen (const char *udc, int numPorts) {
+        struct usb_raw_init init;
+        int     result = 0;
+
+    if ( strlen (udc) >= UDC_NAME_LENGTH_MAX-4 ) {
+        return ENAMETOOLONG;
+    }
+    if ( strchr (udc, '.') != NULL && numPorts > 1 ) {
+        Log (LOG_ERR, "UDC %s is a single device, it can't serve %d ports.\n", udc, numPorts);
+        return EINVAL;
+    }
+    for ( gadgetsNum = 0; gadgetsNum < numPorts; gadgetsNum++ ) {
+        PRAW_GADGET pGadget = &gadgets [gadgetsNum];
+        pGadget->fd = open (RAW_GADGET_DEVICE, O_RDWR);
+        if ( pGadget->fd < 0 ) {
+            result = errno;
+            break;
+        }
+        memset (&init, 0, sizeof(init));
+        snprintf ((char *)init.driver_name, sizeof(init.driver_name), "%s", udc);
+        if ( strchr (udc, '.') != NULL ) {
+            snprintf ((char *)init.device_name, sizeof(init.device_name), "%s", udc);
+        } else {
+            snprintf ((char *)init.device_name, sizeof(init.device_name), "%s.%d", udc, gadgetsNum);
+        }
+        init.speed = USB_SPEED_FULL;
+        if ( ioctl (pGadget->fd, USB_RAW_IOCTL_INIT, &init) < 0 ) {
+            result = errno;
+            close (pGadget->fd);
+            break;
+        }
+    }
+    if ( result ) {
+        RawGadgetClose ();
+    }
+    return result;
+}
+
+/**
+ * Bind gadgets to UDCs and serve them till stop. Called after realtime
+ * mode is set, event threads inherit CPU affinity and scheduling.
+ *
+ * @param haspKeys - ports
+ * @param numPorts - number of ports, gadgets have been created for
+ * @param pmutex - stop semaphore
+ */
+void RawGadget (USB_HASP haspKeys[], int numPorts, sem_t *pmutex) {
+        struct sigaction sa;
+        int     value = 0;
+        int     i;
+
+    gadgetMutex = pmutex;
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_handler = RawGadgetWakeup;        // no SA_RESTART, blocking ioctls return EINTR
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGURG, &sa, NULL);
+    for ( i = 0; i < gadgetsNum && i < numPorts; i++ ) {
+        PRAW_GADGET pGadget = &gadgets [i];
+        pGadget->pKey = &haspKeys [i];
+        pGadget->pKey->addr = 0;            // address is known to UDC only
+        atomic_store (&pGadget->done, false);
+        if ( ioctl (pGadget->fd, USB_RAW_IOCTL_RUN, 0) < 0 ) {
+            Log (LOG_ERR, "Gadget (RUN) port %d failed: %s.\n", haspKeys [i].port, strerror(errno));
+            continue;
+        }
+        int result = pthread_create (&pGadget->thread, NULL, RawGadgetThread, pGadget);
+        if ( result ) {
+            Log (LOG_ERR, "Gadget of port %d is not served: %s.\n", haspKeys [i].port, strerror(result));
+            continue;
+        }
+        pGadget->started = true;
+    }
+    while ( !value ) {
+        LatencyPoll ();
+        usleep (100000);
+        sem_getvalue (pmutex, &value);
+    }
+    for ( i = 0; i < gadgetsNum; i++ ) {
+        PRAW_GADGET pGadget = &gadgets [i];
+        if ( !pGadget->started ) {
+            continue;
+        }
+        while ( !atomic_load (&pGadget->done) ) {
+            pthread_kill (pGadget->thread, SIGURG);   // repeated, signal may come before ioctl
+            usleep (10000);
+        }
+        pthread_join (pGadget->thread, NULL);
+        pGadget->started = false;
+    }
+}
+
+/**
+ * Unbind gadgets, hosts see devices disconnected
+ */
+void RawGadgetClose (void) {
+
+    for ( int i = 0; i < gadgetsNum; i++ ) {
+        close (gadgets [i].fd);
+        gadgets [i].fd = -1;
+    }
+    gadgetsNum = 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     RawGadget.h
+ * Abstract:
+ *      Keys emulated as USB gadgets of raw_gadget driver bound to UDCs
+ *      like dummy_hcd instead of devices of vhci_hcd ports.
+ * Notes:
+ * Revision History:
+ */
+#ifndef RAWGADGET_H
+#define RAWGADGET_H
+
+#include <semaphore.h>
+#include "USBKeyEmu.h"
+
+#define RAW_GADGET_DEVICE   "/dev/raw-gadget"
+#define RAW_GADGET_UDC      "dummy_udc"     // UDC driver of dummy_hcd
+#define RAW_GADGET_EP0_MAX  4096            // longest ep0 data stage served
+#define RAW_GADGET_POWER    50              // VBUS draw when configuration has none, 2 mA units
+
+int  RawGadgetOpen (const char *udc, int numPorts);
+void RawGadget (USB_HASP haspKeys[], int numPorts, sem_t *pmutex);
+void RawGadgetClose (void);
+
+#endif  // RAWGADGET_H
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ * 
+ * Module Name:
+ *     Rcu.c
+ * Abstract:
+ *      Quiescent state based reclamation of shared data (RCU flavour).
+ * Notes:
+ *      Each reader owns a slot with the last global epoch it has seen.
+ *      Zero in the slot means the reader is offline (holds no references).
+ * Revision History:
+ */
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "Rcu.h"
+
+typedef struct _RCU_READER {
+    atomic_int      used;           // slot is taken by a thread
+    atomic_ulong    epoch;          // last seen global epoch, 0 - offline
+    uint8_t         pad [64-sizeof(atomic_int)-sizeof(atomic_ulong)];
+} RCU_READER;
+
+static atomic_ulong rcuEpoch = 1;
+static RCU_READER   rcuReaders [RCU_MAX_READERS] __attribute__((aligned(64)));
+
+/**
+ * Register calling thread as a reader of RCU protected data
+ * 
+ * @return - reader number or -1 if there are no free slots
+ */
+int RcuRegisterThread (void) {
+    
+    for ( int i = 0; i < RCU_MAX_READERS; i++ ) {
+        int unused = 0;
+        if ( atomic_compare_exchange_strong (&rcuReaders [i].used, &unused, 1) ) {
+            atomic_store_explicit (&rcuReaders [i].epoch, 
+                    atomic_load_explicit (&rcuEpoch, memory_order_acquire), memory_order_release);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Unregister reader. It must not hold any RCU protected references.
+ * 
+ * @param reader - reader number
+ */
+void RcuUnregisterThread (int reader) {
+    
+    if ( reader >= 0 && reader < RCU_MAX_READERS ) {
+        atomic_store_explicit (&rcuReaders [reader].epoch, 0, memory_order_release);
+        atomic_store_explicit (&rcuReaders [reader].used, 0, memory_order_release);
+    }
+}
+
+/**
+ * Reader announces that it holds no references to RCU protected data.
+ * Cheap enough to be called for every processed request.
+ * 
+ * @param reader - reader number
+ */
+void RcuQuiescentState (int reader) {
+    
+    if ( reader >= 0 && reader < RCU_MAX_READERS ) {
+        atomic_store_explicit (&rcuReaders [reader].epoch, 
+                atomic_load_explicit (&rcuEpoch, memory_order_acquire), memory_order_release);
+    }
+}
+
+/**
+ * Reader goes to a long wait (blocking I/O) without references.
+ * 
+ * @param reader - reader number
+ */
+void RcuThreadOffline (int reader) {
+    
+    if ( reader >= 0 && reader < RCU_MAX_READERS ) {
+        atomic_store_explicit (&rcuReaders [reader].epoch, 0, memory_order_release);
+    }
+}
+
+/**
+ * Reader is back from a long wait.
+ * 
+ * @param reader - reader number
+ */
+void RcuThreadOnline (int reader) {
+    
+    RcuQuiescentState (reader);
+}
+
+/**
+ * Wait for all readers to pass quiescent state. After return data 
+ * unpublished before the call can be freed. Must not be called by reader.
+ */
+void RcuSynchronize (void) {
+        struct timespec ts = { 0, 1000000 };    // 1ms
+        
+    unsigned long target = atomic_fetch_add (&rcuEpoch, 1) + 1;
+    for ( int i = 0; i < RCU_MAX_READERS; i++ ) {
+        if ( !atomic_load_explicit (&rcuReaders [i].used, memory_order_acquire) ) {
+            continue;
+        }
+        for ( ;; ) {
+            unsigned long epoch = atomic_load_explicit (&rcuReaders [i].epoch, memory_order_acquire);
+            if ( epoch == 0 || epoch >= target || 
+                 !atomic_load_explicit (&rcuReaders [i].used, memory_order_acquire) ) {
+                break;
+            }
+            nanosleep (&ts, NULL);
+        }
+    }
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ * 
+ * Module Name:
+ *     Rcu.h
+ * Abstract:
+ *      Quiescent state based reclamation of shared data (RCU flavour).
+ * Notes:
+ *      Readers never lock. They only announce periodically that they
+ *      hold no references to shared data. Writer publishes a new pointer,
+ *      waits for all registered readers to pass quiescent state and only
+ *      then frees the old data.
+ * Revision History:
+ */
+#ifndef RCU_H
+#define RCU_H
+
+#define RCU_MAX_READERS     32
+
+int  RcuRegisterThread (void);
+void RcuUnregisterThread (int reader);
+void RcuQuiescentState (int reader);
+void RcuThreadOffline (int reader);
+void RcuThreadOnline (int reader);
+void RcuSynchronize (void);
+
+#endif  // RCU_H
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Realtime.c
+ * Abstract:
+ *      Low latency mode of URB thread: CPU affinity, SCHED_FIFO, locked
+ *      and prefaulted memory.
+ * Notes:
+ *      Called by URB thread when all other threads have been started, so
+ *      only URB thread is pinned and runs SCHED_FIFO, logger, journal,
+ *      reload and control threads stay SCHED_OTHER on any CPU. Memory of
+ *      the whole process is locked (key images, sessions, statistics and
+ *      trace mappings included), future mappings are locked and faulted
+ *      in when created. Heap is never trimmed and large blocks are not
+ *      mmap'ed, so URB buffers malloc'ed per URB and key images of reload
+ *      and attach come from prefaulted pages.
+ *
+ *      Every step is best effort: what is not permitted (no CAP_SYS_NICE,
+ *      RLIMIT_MEMLOCK too low) is logged and the rest is still done.
+ * Revision History:
+ */
+#define _GNU_SOURCE                         // CPU_SET, pthread_setaffinity_np
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include "Realtime.h"
+#include "Log.h"
+
+/**
+ * Parse CPU list like "2", "2,3" or "0-1,4"
+ * 
+ * @param cpus - CPU list
+ * @param set - CPU set
+ * @return - 0 or EINVAL
+ */
+static int RealtimeParseCpus (const char *cpus, cpu_set_t *set) {
+        char    *end;
+
+    CPU_ZERO (set);
+    while ( *cpus ) {
+        long first = strtol (cpus, &end, 10);
+        long last = first;
+        if ( end == cpus || first < 0 ) {
+            return EINVAL;
+        }
+        if ( *end == '-' ) {
+            cpus = end + 1;
+            last = strtol (cpus, &end, 10);
+            if ( end == cpus || last < first ) {
+                return EINVAL;
+            }
+        }
+        if ( last >= CPU_SETSIZE ) {
+            return EINVAL;
+        }
+        for ( ; first <= last; first++ ) {
+            CPU_SET (first, set);
+        }
+        if ( *end == ',' ) {
+            ++end;
+        } else if ( *end ) {
+            return EINVAL;
+        }
+        cpus = end;
+    }
+    return CPU_COUNT (set) ? 0 : EINVAL;
+}
+
+/**
+ * Touch stack pages URB thread may grow into
+ */
+static void __attribute__((noinline)) RealtimePrefaultStack (void) {
+        volatile uint8_t stack [REALTIME_STACK];
+
+    memset ((uint8_t *)stack, 0, sizeof(stack));
+}
+
+/**
+ * Keep heap pages and fault them in
+ * 
+ * @return - 0 or ENOMEM
+ */
+static int RealtimePrefaultHeap (void) {
+        uint8_t *heap;
+
+    mallopt (M_TRIM_THRESHOLD, -1);         // freed memory is never given back
+    mallopt (M_MMAP_MAX, 0);                // nor is allocated by mmap
+    heap = (uint8_t *)malloc (REALTIME_HEAP);
+    if ( heap == NULL ) {
+        return ENOMEM;
+    }
+    memset (heap, 0, REALTIME_HEAP);        // fault it in
+    free (heap);                            // and leave it in the heap
+    return 0;
+}
+
+/**
+ * Switch calling (URB) thread into low latency mode. To be called when
+ * keys are loaded and other threads are started, before ports are served.
+ * 
+ * @param cpus - CPU list to pin the thread to or NULL to leave affinity
+ * @param priority - SCHED_FIFO priority or 0 to leave scheduling policy
+ * @return - 0 or error code of the first step that has failed
+ */
+int RealtimeStart (const char *cpus, int priority) {
+        int     rc = 0, err;
+        cpu_set_t set;
+        struct sched_param param;
+
+    if ( mlockall (MCL_CURRENT | MCL_FUTURE) == -1 ) {
+        rc = errno;
+        Log (LOG_WARNING, "Memory is not locked: %s.\n", strerror(rc));
+    }
+    if ( (err = RealtimePrefaultHeap ()) ) {
+        Log (LOG_WARNING, "Heap is not prefaulted: %s.\n", strerror(err));
+        rc = rc ? rc : err;
+    }
+    RealtimePrefaultStack ();
+    if ( cpus != NULL ) {
+        if ( (err = RealtimeParseCpus (cpus, &set)) ) {
+            Log (LOG_WARNING, "Wrong CPU list '%s'.\n", cpus);
+        } else if ( (err = pthread_setaffinity_np (pthread_self (), sizeof(set), &set)) ) {
+            Log (LOG_WARNING, "URB thread is not pinned to CPU %s: %s.\n", cpus, strerror(err));
+        }
+        rc = rc ? rc : err;
+    }
+    if ( priority > 0 ) {
+        if ( priority < sched_get_priority_min (SCHED_FIFO) ) {
+            priority = sched_get_priority_min (SCHED_FIFO);
+        } else if ( priority > sched_get_priority_max (SCHED_FIFO) ) {
+            priority = sched_get_priority_max (SCHED_FIFO);
+        }
+        memset (&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        if ( (err = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param)) ) {
+            Log (LOG_WARNING, "URB thread is not SCHED_FIFO: %s.\n", strerror(err));
+            rc = rc ? rc : err;
+        }
+    }
+    if ( !rc ) {
+        Log (LOG_INFO, "URB thread runs in realtime mode: CPU %s, SCHED_FIFO priority %d.\n",
+                cpus != NULL ? cpus : "any", priority);
+    }
+    return rc;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Realtime.h
+ * Abstract:
+ *      Low latency mode of URB thread: CPU affinity, SCHED_FIFO, locked
+ *      and prefaulted memory.
+ * Notes:
+ * Revision History:
+ */
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#define REALTIME_PRIORITY   50              // SCHED_FIFO priority, below kernel irq threads
+#define REALTIME_HEAP       (4 << 20)       // heap prefaulted for URB buffers and reloaded keys
+#define REALTIME_STACK      (256 << 10)     // stack prefaulted for URB thread
+
+int RealtimeStart (const char *cpus, int priority);
+
+#endif  // REALTIME_H
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Rtc.c
+ * Abstract:
+ *      Clocks of time keys: offset of key clock from host clock set by
+ *      client is saved next to the key file and restored on attach.
+ * Notes:
+ *      Key clock is host time cached by the serving loop plus offset of
+ *      the port session, reading it costs no syscall. URB thread only
+ *      marks the new offset in the time hook, key reload thread writes it
+ *      on its next poll, so setting the clock costs client no file I/O.
+ *      File is decimal offset in seconds, replaced by rename. Ports of
+ *      the same key file share the file, last written offset wins.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <linux/limits.h>
+#include "USBKeyEmu.h"
+#include "Rtc.h"
+#include "Log.h"
+
+typedef struct _RTC_PORT {
+    atomic_llong    offset;             // last offset of port session
+    atomic_bool     dirty;              // offset isn't saved yet
+    char            fileName [PATH_MAX+8];  // offset file, empty - port has no key file
+} RTC_PORT, *PRTC_PORT;
+
+_Atomic(int64_t)        rtcClock = 0;
+static RTC_PORT         rtcPorts [MAX_HASPKEYS];
+static pthread_mutex_t  rtcLock = PTHREAD_MUTEX_INITIALIZER;   // offset files
+
+/**
+ * Key clock has been set by client. Called by URB thread.
+ *
+ * @param context - port
+ * @param pSession - key session state
+ */
+static void RtcWrite (void *context, struct _KEY_SESSION *pSession) {
+        PRTC_PORT pPort = context;
+
+    atomic_store_explicit (&pPort->offset, pSession->timeOffset, memory_order_relaxed);
+    atomic_store_explicit (&pPort->dirty, true, memory_order_release);
+}
+
+/**
+ * Write offset of port into its file unless it is saved. rtcLock is held.
+ *
+ * @param pPort - port
+ */
+static void RtcSave (PRTC_PORT pPort) {
+        char    tmpName [PATH_MAX+16];
+        int     result = 0;
+
+    if ( !pPort->fileName [0] || !atomic_exchange_explicit (&pPort->dirty, false, memory_order_acquire) ) {
+        return;
+    }
+    long long offset = atomic_load_explicit (&pPort->offset, memory_order_relaxed);
+    snprintf (tmpName, sizeof(tmpName), "%s.tmp", pPort->fileName);
+    FILE *f = fopen (tmpName, "w");
+    if ( f == NULL ) {
+        result = errno;
+    } else {
+        if ( fprintf (f, "%lld\n", offset) < 0 || fflush (f) != 0 || fsync (fileno (f)) < 0 ) {
+            result = errno;
+        }
+        if ( fclose (f) != 0 && !result ) {
+            result = errno;
+        }
+        if ( !result && rename (tmpName, pPort->fileName) < 0 ) {
+            result = errno;
+        }
+        if ( result ) {
+            unlink (tmpName);
+        }
+    }
+    if ( result ) {
+        Log (LOG_WARNING, "Key clock offset %lld s is not saved into %s: %s.\n", offset, pPort->fileName, strerror(result));
+    }
+}
+
+/**
+ * Key clock of port
+ *
+ * @param pKey - port
+ * @return - key clock or NULL if port number is out of range
+ */
+static PRTC_PORT RtcPort (PUSBHASP pKey) {
+
+    if ( pKey->port < 1 || pKey->port > MAX_HASPKEYS ) {
+        return NULL;
+    }
+    return &rtcPorts [pKey->port-1];
+}
+
+/**
+ * Restore key clock of port from offset file of its key file and start
+ * saving offsets set by client. Port must not be served by URB thread.
+ *
+ * @param pKey - port
+ */
+void RtcOpen (PUSBHASP pKey) {
+        PRTC_PORT pPort = RtcPort (pKey);
+        long long offset = 0;
+
+    pKey->session.timeOffset = 0;
+    pKey->session.hostClock = &rtcClock;
+    if ( pPort == NULL ) {
+        Log (LOG_ERR, "Key clock of port %d is not saved, no such port.\n", pKey->port);
+        return;
+    }
+    pthread_mutex_lock (&rtcLock);
+    snprintf (pPort->fileName, sizeof(pPort->fileName), "%s" RTC_SUFFIX, pKey->keyfileName);
+    FILE *f = fopen (pPort->fileName, "r");
+    if ( f != NULL ) {
+        if ( fscanf (f, "%lld", &offset) != 1 ) {
+            Log (LOG_WARNING, "Bad key clock offset file %s, host clock is used.\n", pPort->fileName);
+            offset = 0;
+        } else if ( offset ) {
+            Log (LOG_INFO, "Key clock of port %d is %+lld s off host clock.\n", pKey->port, offset);
+        }
+        fclose (f);
+    }
+    atomic_store (&pPort->offset, offset);
+    atomic_store (&pPort->dirty, false);
+    pthread_mutex_unlock (&rtcLock);
+    RtcTick ();
+    pKey->session.timeOffset = offset;
+    pKey->session.timeHook = RtcWrite;
+    pKey->session.timeContext = pPort;
+}
+
+/**
+ * Save key clock of port and stop saving it. URB thread must not serve
+ * the port any more.
+ *
+ * @param pKey - port
+ */
+void RtcClose (PUSBHASP pKey) {
+        PRTC_PORT pPort = RtcPort (pKey);
+
+    if ( pPort != NULL ) {
+        pthread_mutex_lock (&rtcLock);
+        RtcSave (pPort);
+        pPort->fileName [0] = 0;
+        pthread_mutex_unlock (&rtcLock);
+    }
+    pKey->session.timeHook = NULL;
+    pKey->session.timeContext = NULL;
+}
+
+/**
+ * Set key clock of port passed by the emulator taken over. Port must not
+ * be served by URB thread.
+ *
+ * @param pKey - port
+ * @param offset - seconds key clock is ahead of host clock
+ */
+void RtcRestore (PUSBHASP pKey, int64_t offset) {
+        PRTC_PORT pPort = RtcPort (pKey);
+
+    if ( offset != pKey->session.timeOffset ) {
+        pKey->session.timeOffset = offset;
+        if ( pPort != NULL ) {
+            RtcWrite (pPort, &pKey->session);
+        }
+    }
+}
+
+/**
+ * Key clock offset of port for sessions served apart from URB thread
+ *
+ * @param pKey - port
+ * @return - seconds key clock is ahead of host clock
+ */
+int64_t RtcOffset (PUSBHASP pKey) {
+        PRTC_PORT pPort = RtcPort (pKey);
+
+    return pPort != NULL ? atomic_load_explicit (&pPort->offset, memory_order_relaxed) : 0;
+}
+
+/**
+ * Save offsets set by clients since last call. Called by key reload thread.
+ */
+void RtcFlush (void) {
+
+    for ( int i = 0; i < MAX_HASPKEYS; i++ ) {
+        if ( atomic_load_explicit (&rtcPorts [i].dirty, memory_order_relaxed) ) {
+            pthread_mutex_lock (&rtcLock);
+            RtcSave (&rtcPorts [i]);
+            pthread_mutex_unlock (&rtcLock);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Rtc.h
+ * Abstract:
+ *      Clocks of time keys: offset of key clock from host clock set by
+ *      client is saved next to the key file and restored on attach.
+ * Notes:
+ * Revision History:
+ */
+#ifndef RTC_H
+#define RTC_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define RTC_SUFFIX          ".rtc"          // offset file is key file name with suffix
+
+extern _Atomic(int64_t) rtcClock;           // host time, s, cached by serving loops
+
+/**
+ * Cache host time for key clocks. Called once per loop iteration, coarse
+ * clock is read by vDSO without syscall.
+ */
+static inline void RtcTick (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+    atomic_store_explicit (&rtcClock, ts.tv_sec, memory_order_relaxed);
+}
+
+struct _USB_HASP;
+
+void    RtcOpen (struct _USB_HASP *pKey);
+void    RtcClose (struct _USB_HASP *pKey);
+void    RtcRestore (struct _USB_HASP *pKey, int64_t offset);
+int64_t RtcOffset (struct _USB_HASP *pKey);
+void    RtcFlush (void);
+
+#endif  // RTC_H
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Sched.c
+ * Abstract:
+ *      URB scheduling of vhci ports: URBs fetched from the controller are
+ *      queued per port and served deficit round robin by port weights, so
+ *      a client flooding one key doesn't delay the other keys.
+ * Notes:
+ *      vhci_hcd hands out work of all ports in one FIFO. URB thread drains
+ *      it into per port rings and serves one URB of the port at the head of
+ *      the round at a time. Port gets weight URBs (its quantum, every URB
+ *      costs 1) per turn, a port whose ring runs empty leaves the round and
+ *      loses its deficit. Port stat work isn't queued, it is handled as soon
+ *      as it is fetched. URB canceled by host while queued is taken out of
+ *      its ring and never served. Everything here is used by URB thread only.
+ * Revision History:
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include "USBKeyEmu.h"
+#include "Sched.h"
+
+typedef struct _SCHED_PORT {
+    unsigned    head, tail;                 // ring of queued URBs
+    int         weight;                     // quantum, URBs per turn
+    int         deficit;                    // URBs left in this turn
+    bool        turn;                       // quantum of this turn is given
+    SCHED_URB   urbs [SCHED_DEPTH];
+} SCHED_PORT, *PSCHED_PORT;
+
+static SCHED_PORT   schedPorts [MAX_HASPKEYS];
+static int          schedWeights [MAX_HASPKEYS] = { [0 ... MAX_HASPKEYS-1] = 1 };
+static int          schedRound [MAX_HASPKEYS];  // ring of ports with queued URBs
+static unsigned     schedFirst, schedActive;
+static unsigned     schedQueued;
+
+/**
+ * Set port weights from list like 4,1,1
+ *
+ * @param list - weights of ports from port 1, missing ones are 1
+ * @return - 0 in case of success or EINVAL
+ */
+int SchedWeights (const char *list) {
+        int     weights [MAX_HASPKEYS];
+        char    *end;
+        int     i;
+
+    for ( i = 0; i < MAX_HASPKEYS; i++ ) {
+        weights [i] = 1;
+    }
+    for ( i = 0; *list && i < MAX_HASPKEYS; i++ ) {
+        long weight = strtol (list, &end, 10);
+        if ( end == list || weight < 1 || weight > SCHED_MAX_WEIGHT || (*end && *end != ',') ) {
+            return EINVAL;
+        }
+        weights [i] = weight;
+        list = *end ? end+1 : end;
+    }
+    if ( *list ) {
+        return EINVAL;
+    }
+    memcpy (schedWeights, weights, sizeof(schedWeights));
+    return 0;
+}
+
+/**
+ * Empty queues of ports
+ */
+void SchedInit (void) {
+
+    memset (schedPorts, 0, sizeof(schedPorts));
+    for ( int i = 0; i < MAX_HASPKEYS; i++ ) {
+        schedPorts [i].weight = schedWeights [i];
+    }
+    schedFirst = schedActive = schedQueued = 0;
+}
+
+/**
+ * Number of queued URBs
+ *
+ * @return - URBs not served yet
+ */
+unsigned SchedQueued (void) {
+
+    return schedQueued;
+}
+
+/**
+ * Queue URB of port
+ *
+ * @param pindex - port index
+ * @return - entry to fill or NULL if queue of port is full
+ */
+PSCHED_URB SchedPut (int pindex) {
+        PSCHED_PORT pPort = &schedPorts [pindex];
+
+    if ( pPort->tail - pPort->head == SCHED_DEPTH ) {
+        return NULL;
+    }
+    if ( pPort->tail == pPort->head ) {     // port joins the round
+        schedRound [(schedFirst + schedActive++) % MAX_HASPKEYS] = pindex;
+    }
+    schedQueued++;
+    return &pPort->urbs [pPort->tail++ & (SCHED_DEPTH-1)];
+}
+
+/**
+ * URB to serve next. It stays queued till SchedDone.
+ *
+ * @param pindex - [out] port index
+ * @return - URB or NULL if nothing is queued
+ */
+PSCHED_URB SchedNext (int *pindex) {
+
+    while ( schedActive ) {
+        PSCHED_PORT pPort = &schedPorts [schedRound [schedFirst]];
+        if ( !pPort->turn ) {               // port is at the head of the round
+            pPort->deficit += pPort->weight;
+            pPort->turn = true;
+        }
+        if ( pPort->deficit > 0 ) {
+            *pindex = schedRound [schedFirst];
+            return &pPort->urbs [pPort->head & (SCHED_DEPTH-1)];
+        }
+        pPort->turn = false;                // quantum is used, next port
+        schedRound [(schedFirst + schedActive) % MAX_HASPKEYS] = schedRound [schedFirst];
+        schedFirst = (schedFirst + 1) % MAX_HASPKEYS;
+    }
+    return NULL;
+}
+
+/**
+ * URB returned by SchedNext has been served
+ *
+ * @param pindex - port index
+ */
+void SchedDone (int pindex) {
+        PSCHED_PORT pPort = &schedPorts [pindex];
+
+    pPort->head++;
+    pPort->deficit--;
+    schedQueued--;
+    if ( pPort->head == pPort->tail ) {     // port leaves the round, it is at its head
+        pPort->deficit = 0;
+        pPort->turn = false;
+        schedFirst = (schedFirst + 1) % MAX_HASPKEYS;
+        schedActive--;
+    }
+}
+
+/**
+ * Take queued URB canceled by host out of its queue
+ *
+ * @param handle - URB handle of cancel work
+ * @param pindex - [out] port index
+ * @param urb - [out] URB taken out, its buffers are the caller's to free
+ * @return - true if URB was queued
+ */
+bool SchedCancel (uint64_t handle, int *pindex, struct usb_vhci_urb *urb) {
+
+    for ( int i = 0; i < MAX_HASPKEYS; i++ ) {
+        PSCHED_PORT pPort = &schedPorts [i];
+        for ( unsigned pos = pPort->head; pos != pPort->tail; pos++ ) {
+            if ( pPort->urbs [pos & (SCHED_DEPTH-1)].urb.handle != handle ) {
+                continue;
+            }
+            memcpy (urb, &pPort->urbs [pos & (SCHED_DEPTH-1)].urb, sizeof(*urb));
+            for ( ; pos+1 != pPort->tail; pos++ ) { // later URBs of port keep their order
+                pPort->urbs [pos & (SCHED_DEPTH-1)] = pPort->urbs [(pos+1) & (SCHED_DEPTH-1)];
+            }
+            pPort->tail--;
+            schedQueued--;
+            if ( pPort->head == pPort->tail ) { // port leaves the round
+                unsigned active = 0;
+                for ( unsigned j = 0; j < schedActive; j++ ) {
+                    int port = schedRound [(schedFirst + j) % MAX_HASPKEYS];
+                    if ( port != i ) {
+                        schedRound [(schedFirst + active++) % MAX_HASPKEYS] = port;
+                    }
+                }
+                schedActive = active;
+                pPort->deficit = 0;
+                pPort->turn = false;
+            }
+            *pindex = i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Sched.h
+ * Abstract:
+ *      URB scheduling of vhci ports: URBs fetched from the controller are
+ *      queued per port and served deficit round robin by port weights, so
+ *      a client flooding one key doesn't delay the other keys.
+ * Notes:
+ * Revision History:
+ */
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb_vhci.h>
+
+#define SCHED_DEPTH         64              // URBs queued per port, power of 2
+#define SCHED_DRAIN         16              // URBs fetched at most before one is served
+#define SCHED_MAX_WEIGHT    64              // URBs of port per round
+
+typedef struct _SCHED_URB {
+    struct usb_vhci_urb urb;
+    uint64_t    fetchTime;                  // LatencyNow of fetch
+} SCHED_URB, *PSCHED_URB;
+
+int        SchedWeights (const char *list);
+void       SchedInit (void);
+unsigned   SchedQueued (void);
+PSCHED_URB SchedPut (int pindex);
+PSCHED_URB SchedNext (int *pindex);
+void       SchedDone (int pindex);
+bool       SchedCancel (uint64_t handle, int *pindex, struct usb_vhci_urb *urb);
+
+#endif  // SCHED_H
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Seats.c
+ * Abstract:
+ *      License seat accounting of net keys: seat counters and leases of
+ *      clients expired by hierarchical timer wheel.
+ * Notes:
+ *      Seat counter is taken with compare and swap, so it may be read and
+ *      taken by any thread without locks. The wheel has levels of 64 slots,
+ *      slot of level N is 64^N ticks long. Lease is put into the level its
+ *      expiry is in, and cascades one level down whenever the lower level
+ *      wraps, so arming, refreshing and cancelling a lease is O(1) and
+ *      every lease is touched at most once per level till it expires. The
+ *      wheel is not locked, it belongs to one thread.
+ * Revision History:
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "Seats.h"
+
+/**
+ * Take a seat
+ *
+ * @param pUsed - seats taken
+ * @param max - seats of key, SEATS_UNLIMITED
+ * @return - true if the seat is taken
+ */
+bool SeatAcquire (atomic_uint *pUsed, uint32_t max) {
+
+    unsigned used = atomic_load_explicit (pUsed, memory_order_relaxed);
+    do {
+        if ( used >= max ) {
+            return false;
+        }
+    } while ( !atomic_compare_exchange_weak_explicit (pUsed, &used, used+1, memory_order_acq_rel, memory_order_relaxed) );
+    return true;
+}
+
+/**
+ * Give a seat back
+ *
+ * @param pUsed - seats taken
+ */
+void SeatRelease (atomic_uint *pUsed) {
+
+    atomic_fetch_sub_explicit (pUsed, 1, memory_order_acq_rel);
+}
+
+/**
+ * Current tick of lease wheels
+ *
+ * @return - monotonic time in SEATS_TICK units
+ */
+uint64_t SeatsTick (void) {
+        struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / SEATS_TICK;
+}
+
+/**
+ * Prepare empty wheel
+ *
+ * @param pWheel - wheel
+ * @param tick - current tick
+ */
+void LeaseWheelInit (PLEASE_WHEEL pWheel, uint64_t tick) {
+
+    pWheel->tick = tick;
+    pWheel->armed = 0;
+    for ( int level = 0; level < SEATS_WHEEL_LEVELS; level++ ) {
+        for ( int slot = 0; slot < SEATS_WHEEL_SLOTS; slot++ ) {
+            PLEASE pHead = &pWheel->slots [level][slot];
+            pHead->next = pHead->prev = pHead;
+        }
+    }
+}
+
+/**
+ * Link lease into slot of its expiry
+ *
+ * @param pWheel - wheel
+ * @param pLease - lease not linked
+ */
+static void LeaseLink (PLEASE_WHEEL pWheel, PLEASE pLease) {
+        int     level;
+
+    uint64_t delta = pLease->expires - pWheel->tick;
+    for ( level = 0; level < SEATS_WHEEL_LEVELS-1; level++ ) {
+        if ( delta < (uint64_t)1 << (SEATS_WHEEL_BITS * (level+1)) ) {
+            break;
+        }
+    }
+    PLEASE pHead = &pWheel->slots [level][(pLease->expires >> (SEATS_WHEEL_BITS * level)) & (SEATS_WHEEL_SLOTS-1)];
+    pLease->next = pHead->next;
+    pLease->prev = pHead;
+    pHead->next->prev = pLease;
+    pHead->next = pLease;
+}
+
+/**
+ * Arm lease or move armed one to the new expiry
+ *
+ * @param pWheel - wheel
+ * @param pLease - lease
+ * @param expires - tick the lease expires at
+ */
+void LeaseArm (PLEASE_WHEEL pWheel, PLEASE pLease, uint64_t expires) {
+
+    LeaseCancel (pWheel, pLease);
+    uint64_t last = pWheel->tick + ((uint64_t)1 << (SEATS_WHEEL_BITS * SEATS_WHEEL_LEVELS)) - 1;
+    if ( expires <= pWheel->tick ) {
+        expires = pWheel->tick+1;           // expires with the next tick
+    } else if ( expires > last ) {
+        expires = last;
+    }
+    pLease->expires = expires;
+    LeaseLink (pWheel, pLease);
+    pWheel->armed++;
+}
+
+/**
+ * Remove lease from wheel, does nothing if it is not armed
+ *
+ * @param pWheel - wheel
+ * @param pLease - lease
+ */
+void LeaseCancel (PLEASE_WHEEL pWheel, PLEASE pLease) {
+
+    if ( pLease->prev != NULL ) {
+        pLease->prev->next = pLease->next;
+        pLease->next->prev = pLease->prev;
+        pLease->next = pLease->prev = NULL;
+        pWheel->armed--;
+    }
+}
+
+/**
+ * Move leases of slot to lower levels
+ *
+ * @param pWheel - wheel
+ * @param level - level of slot
+ * @param slot - slot
+ */
+static void LeaseCascade (PLEASE_WHEEL pWheel, int level, int slot) {
+
+    PLEASE pHead = &pWheel->slots [level][slot];
+    PLEASE pLease = pHead->next;
+    pHead->next = pHead->prev = pHead;
+    while ( pLease != pHead ) {
+        PLEASE pNext = pLease->next;
+        LeaseLink (pWheel, pLease);
+        pLease = pNext;
+    }
+}
+
+/**
+ * Expire leases up to tick. Expired lease is unlinked before callback,
+ * callback may arm or cancel any lease.
+ *
+ * @param pWheel - wheel
+ * @param tick - current tick
+ * @param expired - callback of expired lease
+ * @param context - callback context
+ * @return - number of expired leases
+ */
+int LeaseAdvance (PLEASE_WHEEL pWheel, uint64_t tick, LEASE_EXPIRED expired, void *context) {
+        int     count = 0;
+
+    while ( pWheel->tick < tick ) {
+        if ( pWheel->armed == 0 ) {         // nothing to cascade or expire
+            pWheel->tick = tick;
+            break;
+        }
+        pWheel->tick++;
+        int wrapped = 0;                    // levels whose lower level has wrapped
+        while ( wrapped < SEATS_WHEEL_LEVELS-1 &&
+                !(pWheel->tick & (((uint64_t)1 << (SEATS_WHEEL_BITS * (wrapped+1))) - 1)) ) {
+            wrapped++;
+        }
+        for ( int level = wrapped; level > 0; level-- ) {
+                                            // higher first, its leases may go to lower slot of this tick
+            LeaseCascade (pWheel, level, (pWheel->tick >> (SEATS_WHEEL_BITS * level)) & (SEATS_WHEEL_SLOTS-1));
+        }
+        PLEASE pHead = &pWheel->slots [0][pWheel->tick & (SEATS_WHEEL_SLOTS-1)];
+        while ( pHead->next != pHead ) {
+            PLEASE pLease = pHead->next;
+            LeaseCancel (pWheel, pLease);
+            count++;
+            expired (pLease, context);
+        }
+    }
+    return count;
+}
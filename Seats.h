@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Seats.h
+ * Abstract:
+ *      License seat accounting of net keys: seat counters and leases of
+ *      clients expired by hierarchical timer wheel.
+ * Notes:
+ * Revision History:
+ */
+#ifndef SEATS_H
+#define SEATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SEATS_TICK          100             // ms per timer wheel tick
+#define SEATS_LEASE         60000           // ms idle lease of client lives
+#define SEATS_WHEEL_BITS    6
+#define SEATS_WHEEL_SLOTS   (1 << SEATS_WHEEL_BITS)
+#define SEATS_WHEEL_LEVELS  4               // 64^4 ticks, 19 days
+#define SEATS_UNLIMITED     UINT32_MAX
+
+//
+// Lease of a client, embedded into client session. Armed lease is linked
+// into a slot of the wheel.
+//
+typedef struct _LEASE {
+    struct _LEASE   *next;
+    struct _LEASE   *prev;          // NULL when lease is not armed
+    uint64_t        expires;        // tick
+} LEASE, *PLEASE;
+
+typedef struct _LEASE_WHEEL {
+    uint64_t        tick;           // last expired tick
+    uint64_t        armed;          // leases in wheel
+    LEASE           slots [SEATS_WHEEL_LEVELS][SEATS_WHEEL_SLOTS];  // list heads
+} LEASE_WHEEL, *PLEASE_WHEEL;
+
+typedef void (*LEASE_EXPIRED) (PLEASE pLease, void *context);
+
+bool SeatAcquire (atomic_uint *pUsed, uint32_t max);
+void SeatRelease (atomic_uint *pUsed);
+uint64_t SeatsTick (void);
+void LeaseWheelInit (PLEASE_WHEEL pWheel, uint64_t tick);
+void LeaseArm (PLEASE_WHEEL pWheel, PLEASE pLease, uint64_t expires);
+void LeaseCancel (PLEASE_WHEEL pWheel, PLEASE pLease);
+int  LeaseAdvance (PLEASE_WHEEL pWheel, uint64_t tick, LEASE_EXPIRED expired, void *context);
+
+#endif  // SEATS_H
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     ShmKey.c
+ * Abstract:
+ *      Shared memory key server: local clients send KEY_REQUESTs straight
+ *      to the emulator through rings in a POSIX shared memory object and
+ *      get KEY_RESPONSEs of EmulateKey, without USB stack on the way.
+ * Notes:
+ *      One thread serves all rings. It sleeps on the doorbell only when no
+ *      ring has requests, after it has set sleeping, so a busy client
+ *      costs no syscalls but its own wakeups. Key images are read the way
+ *      URB thread reads them: the thread is RCU reader, offline while it
+ *      sleeps. Request is copied before EmulateKey, client can't change it
+ *      under the chiper.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "USBKeyEmu.h"
+#include "ShmKey.h"
+#include "Rcu.h"
+#include "Rtc.h"
+#include "Log.h"
+
+#define SHMKEY_IDLE         100             // ms to sleep on doorbell, "stop" semaphore is checked
+
+typedef struct _SHMKEY_CLIENT {
+    unsigned    generation;         // of the session
+    PUSBHASP    pKey;               // port of ring, NULL - bad port
+    bool        bound;              // session is bound to key image
+    KEY_SESSION session;
+} SHMKEY_CLIENT, *PSHMKEY_CLIENT;
+
+static PSHMKEY_PAGE     shmPage = NULL;
+static char             shmName [NAME_MAX];
+static PUSBHASP         shmPorts;
+static int              shmNumPorts;
+static sem_t            *shmMutex;
+static pthread_t        shmThread;
+static bool             shmStarted = false;
+static unsigned long long shmRequests = 0;
+static SHMKEY_CLIENT    shmClients [SHMKEY_RINGS];
+
+/**
+ * Start new session of ring
+ *
+ * @param pClient - server state of ring
+ * @param pRing - ring
+ * @param generation - generation of ring
+ */
+static void ShmKeySession (PSHMKEY_CLIENT pClient, PSHMKEY_RING pRing, unsigned generation) {
+
+    KeySessionFree (&pClient->session);
+    memset (&pClient->session, 0, sizeof(pClient->session));
+    pClient->bound = false;
+    pClient->generation = generation;
+    int port = atomic_load_explicit (&pRing->port, memory_order_relaxed);
+    pClient->pKey = port >= 1 && port <= shmNumPorts ? &shmPorts [port-1] : NULL;
+    if ( pClient->pKey != NULL ) {
+        pClient->session.timeOffset = RtcOffset (pClient->pKey);
+        pClient->session.hostClock = &rtcClock;
+    }
+}
+
+/**
+ * Answer requests of ring
+ *
+ * @param ring - ring index
+ * @return - number of answered requests
+ */
+static unsigned ShmKeyRing (int ring) {
+        PSHMKEY_RING pRing = &shmPage->rings [ring];
+        PSHMKEY_CLIENT pClient = &shmClients [ring];
+        PKEYDATA pKeyData = NULL;
+        unsigned count;
+
+    unsigned head = atomic_load_explicit (&pRing->head, memory_order_acquire);
+    unsigned done = atomic_load_explicit (&pRing->done, memory_order_relaxed);
+    if ( head == done ) {
+        return 0;
+    }
+    unsigned generation = atomic_load_explicit (&pRing->generation, memory_order_acquire);
+    if ( generation != pClient->generation ) {
+        ShmKeySession (pClient, pRing, generation);
+    }
+    if ( pClient->pKey != NULL ) {          // key image is valid till next quiescent state
+        pKeyData = atomic_load_explicit (&pClient->pKey->pKeyData, memory_order_acquire);
+    }
+    if ( pKeyData != NULL && !pClient->bound ) {
+        KeySessionInit (&pClient->session, pKeyData);
+        pClient->bound = true;
+    }
+    for ( count = 0; done != head && count < SHMKEY_DEPTH; count++ ) {
+        PSHMKEY_ENTRY pEntry = &pRing->entries [done & (SHMKEY_DEPTH-1)];
+        uint32_t length = 0;                // STALL, no key on port
+        if ( pKeyData != NULL ) {
+            KEY_REQUEST request = pEntry->request;
+            length = request.param3 < sizeof(KEY_RESPONSE) ? request.param3 : sizeof(KEY_RESPONSE);
+            EmulateKey (pKeyData, &pClient->session, &request, &length, &pEntry->response);
+        }
+        pEntry->length = length;
+        atomic_store_explicit (&pRing->done, ++done, memory_order_release);
+        atomic_thread_fence (memory_order_seq_cst);     // done is seen by client checking waiting after this
+        if ( atomic_load_explicit (&pRing->waiting, memory_order_relaxed) ) {
+            ShmKeyWake (&pRing->done);
+        }
+    }
+    shmRequests += count;
+    return count;
+}
+
+/**
+ * Check whether any ring has requests
+ *
+ * @return - true if there are requests
+ */
+static bool ShmKeyPending (void) {
+
+    for ( int i = 0; i < SHMKEY_RINGS; i++ ) {
+        PSHMKEY_RING pRing = &shmPage->rings [i];
+        if ( atomic_load_explicit (&pRing->head, memory_order_relaxed) !=
+             atomic_load_explicit (&pRing->done, memory_order_relaxed) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Free rings of clients which have exited without giving them back
+ */
+static void ShmKeyReap (void) {
+
+    for ( int i = 0; i < SHMKEY_RINGS; i++ ) {
+        PSHMKEY_RING pRing = &shmPage->rings [i];
+        int owner = atomic_load_explicit (&pRing->owner, memory_order_relaxed);
+        if ( owner != 0 && kill (owner, 0) < 0 && errno == ESRCH &&
+             atomic_compare_exchange_strong (&pRing->owner, &owner, 0) ) {
+            Log (LOG_INFO, "Shared memory key ring %d of exited process %d has been freed.\n", i, owner);
+        }
+    }
+}
+
+/**
+ * Shared memory key server thread
+ *
+ * @param arg - not used
+ * @return - NULL
+ */
+static void *ShmKeyThread (void *arg) {
+        int     value = 0;
+        int     reader;
+
+    reader = RcuRegisterThread ();          // key images are read without locks
+    while ( !value ) {
+        unsigned count = 0;
+        for ( int i = 0; i < SHMKEY_RINGS; i++ ) {
+            count += ShmKeyRing (i);
+            RcuQuiescentState (reader);     // no key image references are held here
+        }
+        RtcTick ();
+        if ( count == 0 ) {
+            atomic_store (&shmPage->sleeping, 1);
+            unsigned doorbell = atomic_load (&shmPage->doorbell);
+            if ( !ShmKeyPending () ) {      // request submitted from now on rings the doorbell
+                RcuThreadOffline (reader);  // no key image references while waiting
+                ShmKeyWait (&shmPage->doorbell, doorbell, SHMKEY_IDLE);
+                RcuThreadOnline (reader);
+                if ( atomic_load (&shmPage->doorbell) == doorbell ) {
+                    ShmKeyReap ();
+                }
+            }
+            atomic_store (&shmPage->sleeping, 0);
+        }
+        sem_getvalue (shmMutex, &value);
+    }
+    for ( int i = 0; i < SHMKEY_RINGS; i++ ) {
+        KeySessionFree (&shmClients [i].session);
+    }
+    RcuUnregisterThread (reader);
+    return NULL;
+}
+
+/**
+ * Create shared memory object of rings and start serving it
+ *
+ * @param name - shared memory object name
+ * @param haspKeys - ports
+ * @param numPorts - number of ports
+ * @param pmutex - threads "stop" semaphore
+ * @return - 0 in case of success or errno code
+ */
+int StartShmKey (const char *name, struct _USB_HASP *haspKeys, int numPorts, sem_t *pmutex) {
+        int     result = 0;
+
+    shmPorts = haspKeys;
+    shmNumPorts = numPorts;
+    shmMutex = pmutex;
+    shm_unlink (name);                      // clients of previous emulator must take new rings
+    int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if ( fd < 0 ) {
+        return errno;
+    }
+    if ( ftruncate (fd, sizeof(SHMKEY_PAGE)) < 0 ||
+         (shmPage = mmap (NULL, sizeof(SHMKEY_PAGE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+        result = errno;
+        shmPage = NULL;
+    }
+    close (fd);
+    strncpy (shmName, name, sizeof(shmName)-1);
+    if ( !result ) {
+        memset (shmClients, 0, sizeof(shmClients));
+        shmPage->version = SHMKEY_VERSION;
+        shmPage->size = sizeof(SHMKEY_PAGE);
+        shmPage->numRings = SHMKEY_RINGS;
+        atomic_store_explicit (&shmPage->pid, getpid (), memory_order_relaxed);
+        atomic_thread_fence (memory_order_release);
+        shmPage->magic = SHMKEY_MAGIC;      // clients check magic last
+        result = pthread_create (&shmThread, NULL, ShmKeyThread, NULL);
+    }
+    if ( result ) {
+        StopShmKey ();
+        return result;
+    }
+    shmStarted = true;
+    Log (LOG_INFO, "Shared memory key server serves %d rings of %s.\n", SHMKEY_RINGS, name);
+    return 0;
+}
+
+/**
+ * Wait for shared memory key server thread to finish and remove its
+ * object. "Stop" semaphore must be posted.
+ */
+void StopShmKey (void) {
+
+    if ( shmStarted ) {
+        pthread_join (shmThread, NULL);
+        shmStarted = false;
+        Log (LOG_INFO, "Shared memory key server served %llu requests.\n", shmRequests);
+    }
+    if ( shmPage != NULL ) {
+        munmap (shmPage, sizeof(SHMKEY_PAGE));
+        shmPage = NULL;
+    }
+    if ( shmName [0] ) {
+        shm_unlink (shmName);
+        shmName [0] = 0;
+    }
+}
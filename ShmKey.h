@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     ShmKey.h
+ * Abstract:
+ *      Shared memory key server: local clients send KEY_REQUESTs straight
+ *      to the emulator through rings in a POSIX shared memory object and
+ *      get KEY_RESPONSEs of EmulateKey, without USB stack on the way.
+ * Notes:
+ *      Object has SHMKEY_RINGS rings, client takes a free ring by compare
+ *      and swap of owner from 0 to its pid, sets port of key, increments
+ *      generation (new key session) and gives the ring back by storing 0
+ *      into owner. Ring is single producer, single consumer: client writes
+ *      entry head % SHMKEY_DEPTH, increments head and the doorbell and
+ *      wakes the server with FUTEX_WAKE if sleeping is set. Server answers
+ *      requests in order in the entries of requests, increments done and
+ *      wakes the client if waiting is set. Client must not submit entry
+ *      done + SHMKEY_DEPTH. Response length 0 is a STALL of USB: there is
+ *      no key on the port. Rings of dead clients are freed by the server.
+ *
+ *      Ring session is a session of its own, like one more USB client of
+ *      the key, key memory writes stay in the session and aren't journaled.
+ *      Key clock starts at the clock of the port, clock set by client stays
+ *      in the session too.
+ * Revision History:
+ */
+#ifndef SHMKEY_H
+#define SHMKEY_H
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "HaspEmu.h"
+
+#define SHMKEY_NAME         "/usbhasp-keys" // e.g. shared memory object
+#define SHMKEY_MAGIC        0x52534848      // "HHSR"
+#define SHMKEY_VERSION      1
+#define SHMKEY_RINGS        16              // clients at once
+#define SHMKEY_DEPTH        16              // requests in flight per ring, power of 2
+
+typedef struct _SHMKEY_ENTRY {
+    KEY_REQUEST     request;
+    uint32_t        length;             // bytes of response, 0 - STALL
+    KEY_RESPONSE    response;
+} __attribute__((aligned(64))) SHMKEY_ENTRY, *PSHMKEY_ENTRY;
+
+typedef struct _SHMKEY_RING {
+    atomic_int      owner;              // pid of client, 0 - free
+    atomic_int      port;               // port of key, set before generation
+    atomic_uint     generation;         // new key session
+    atomic_uint     head __attribute__((aligned(64)));  // requests submitted, written by client
+    atomic_uint     waiting;            // client sleeps on done
+    atomic_uint     done __attribute__((aligned(64)));  // requests answered, written by server
+    SHMKEY_ENTRY    entries [SHMKEY_DEPTH];
+} SHMKEY_RING, *PSHMKEY_RING;
+
+typedef struct _SHMKEY_PAGE {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        size;               // object size
+    uint32_t        numRings;
+    atomic_int      pid;                // emulator process
+    atomic_uint     doorbell __attribute__((aligned(64)));  // requests submitted to any ring
+    atomic_uint     sleeping;           // server sleeps on doorbell
+    SHMKEY_RING     rings [SHMKEY_RINGS];
+} SHMKEY_PAGE, *PSHMKEY_PAGE;
+
+/**
+ * Sleep while futex word of shared object has value
+ *
+ * @param word - futex word
+ * @param value - value seen
+ * @param ms - timeout, ms
+ */
+static inline void ShmKeyWait (atomic_uint *word, unsigned value, int ms) {
+        struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+
+    syscall (SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+/**
+ * Wake sleepers of futex word of shared object
+ *
+ * @param word - futex word
+ */
+static inline void ShmKeyWake (atomic_uint *word) {
+
+    syscall (SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+struct _USB_HASP;
+
+int  StartShmKey (const char *name, struct _USB_HASP *haspKeys, int numPorts, sem_t *pmutex);
+void StopShmKey (void);
+
+#endif  // SHMKEY_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Stats.c
+ * Abstract:
+ *      Emulator statistics page shared with external viewers (usbhasp-top).
+ * Notes:
+ *      If shared memory object can't be created statistics are kept in
+ *      private memory, so counting code never checks the page.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "Stats.h"
+#include "Log.h"
+
+static STATS_PAGE   privatePage;
+static PSTATS_PAGE  pStats = &privatePage;
+static char         statsName [NAME_MAX];
+static ino_t        statsIno;           // object is removed only if the name is still ours
+
+/**
+ * Create statistics page
+ *
+ * @param name - shared memory object name, NULL for private page
+ * @param numPorts - number of ports
+ * @return - statistics page
+ */
+PSTATS_PAGE StatsOpen (const char *name, int numPorts) {
+        PSTATS_PAGE pPage = NULL;
+        struct stat st;
+
+    if ( name != NULL ) {
+        shm_unlink (name);              // never truncate the page of emulator being taken over
+        int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if ( fd < 0 ) {
+            Log (LOG_WARNING, "Unable to create statistics page %s: %s.\n", name, strerror(errno));
+        } else if ( ftruncate (fd, sizeof(STATS_PAGE)) < 0 ||
+                    (pPage = mmap (NULL, sizeof(STATS_PAGE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+            Log (LOG_WARNING, "Unable to map statistics page %s: %s.\n", name, strerror(errno));
+            pPage = NULL;
+            shm_unlink (name);
+        } else {
+            strncpy (statsName, name, sizeof(statsName)-1);
+            statsIno = fstat (fd, &st) == 0 ? st.st_ino : 0;
+        }
+        if ( fd >= 0 ) {
+            close (fd);
+        }
+    }
+    if ( pPage == NULL ) {
+        pPage = &privatePage;
+    }
+    pPage->version = STATS_VERSION;
+    pPage->size = sizeof(STATS_PAGE);
+    atomic_store_explicit (&pPage->numPorts, numPorts < STATS_MAX_PORTS ? numPorts : STATS_MAX_PORTS, memory_order_relaxed);
+    atomic_store_explicit (&pPage->pid, getpid (), memory_order_relaxed);
+    atomic_store_explicit (&pPage->startTime, time (NULL), memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    pPage->magic = STATS_MAGIC;     // viewers check magic last
+    pStats = pPage;
+    return pPage;
+}
+
+/**
+ * Remove statistics page unless the emulator which has taken over has
+ * created its own. Counting threads must be stopped.
+ */
+void StatsClose (void) {
+        struct stat st;
+
+    if ( pStats != &privatePage ) {
+        munmap (pStats, sizeof(STATS_PAGE));
+        int fd = shm_open (statsName, O_RDONLY | O_CLOEXEC, 0);
+        if ( fd >= 0 ) {
+            if ( fstat (fd, &st) == 0 && st.st_ino == statsIno ) {
+                shm_unlink (statsName);
+            }
+            close (fd);
+        }
+        statsName [0] = '\0';
+        pStats = &privatePage;
+    }
+}
+
+/**
+ * Counters of port
+ *
+ * @param port - port number, 1 based
+ * @return - port counters. Ports out of range share counters of unknown port.
+ */
+PSTATS_PORT StatsPort (int port) {
+
+    if ( port < 1 || port > STATS_MAX_PORTS ) {
+        return &pStats->unbound;
+    }
+    return &pStats->ports [port-1];
+}
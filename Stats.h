@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Stats.h
+ * Abstract:
+ *      Emulator statistics page shared with external viewers (usbhasp-top).
+ * Notes:
+ *      Page is a POSIX shared memory object. Counters of a port are written
+ *      by the only thread serving the port with relaxed loads and stores,
+ *      so counting costs neither syscalls nor locked instructions. Net key
+ *      seats are written by network key server thread (see Seats.h), resets,
+ *      port state and enumeration times by control plane thread of vhci
+ *      ports (see PortState.h). Viewers
+ *      map the page read only and compute rates from samples.
+ * Revision History:
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define STATS_NAME          "/usbhasp"      // default shared memory object
+#define STATS_MAGIC         0x54535348      // "HSST"
+#define STATS_VERSION       3
+#define STATS_MAX_PORTS     32
+#define STATS_ENUM_STEPS    4               // connect, reset, address, first request
+
+typedef struct _STATS_PORT {
+    atomic_ullong   urbs;               // processed URBs
+    atomic_ullong   haspUrbs;           // HASP function requests
+    atomic_ullong   usbUrbs;            // standard USB requests
+    atomic_ullong   cancels;            // cancelled URBs
+    atomic_ullong   stalls;             // URBs given back stalled
+    atomic_ullong   fetchErrors;        // usb_vhci_fetch_data failures
+    atomic_ullong   givebackErrors;     // usb_vhci_giveback failures
+    atomic_ullong   portStats;          // port state changes
+    atomic_ullong   resets;             // port resets
+    atomic_ullong   keyOpens;           // successful CHECK_PASS
+    atomic_uint     seatsUsed;          // net key seats taken
+    atomic_uint     seatsMax;           // net key seats, 0 - not a net key
+    atomic_ullong   seatDenials;        // net logins refused, no free seat
+    atomic_ullong   leaseExpiries;      // net clients logged out being idle
+    atomic_uint     status;             // last port status
+    atomic_int      addr;               // device address
+    atomic_uint     portState;          // PORT_STATE of vhci port
+    atomic_ullong   enumerations;       // first HASP requests after SET_ADDRESS
+    atomic_uint     enumTimes [STATS_ENUM_STEPS];   // us from the previous step of last enumeration, 0 - not seen
+    atomic_ullong   fn [256];           // HASP requests by majorFnCode
+} __attribute__((aligned(64))) STATS_PORT, *PSTATS_PORT;
+
+typedef struct _STATS_PAGE {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        size;               // page size
+    atomic_int      numPorts;
+    atomic_int      pid;                // emulator process
+    atomic_llong    startTime;          // emulator start, seconds since epoch
+    STATS_PORT      unbound;            // work of unknown port: cancels, bad addresses
+    STATS_PORT      ports [STATS_MAX_PORTS];
+} STATS_PAGE, *PSTATS_PAGE;
+
+/**
+ * Increment counter. Must be called by the thread owning the counter only.
+ *
+ * @param counter - counter
+ */
+static inline void StatsInc (atomic_ullong *counter) {
+
+    atomic_store_explicit (counter, atomic_load_explicit (counter, memory_order_relaxed)+1, memory_order_relaxed);
+}
+
+PSTATS_PAGE StatsOpen (const char *name, int numPorts);
+void StatsClose (void);
+PSTATS_PORT StatsPort (int port);
+
+#endif  // STATS_H
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Trace.c
+ * Abstract:
+ *      URB trace in pcap format (LINKTYPE_USB_LINUX_MMAPPED), readable
+ *      by Wireshark and tcpdump.
+ * Notes:
+ *      Every URB is recorded twice like usbmon does: submit with setup
+ *      packet and OUT data at fetch time, complete with status and IN data
+ *      (raw key response) at giveback time. HASP requests are not
+ *      encrypted, majorFnCode and parameters are bRequest, wValue, wIndex
+ *      and wLength of setup packet. Device address identifies the port,
+ *      it is logged when set.
+ *      Trace file is mapped into memory and written by URB thread with
+ *      plain stores, no syscalls per URB. Full file is renamed into
+ *      file.1 and a new one is started, so the last 2 files keep trace
+ *      history. Trace is switched on and off by URB thread in TracePoll,
+ *      requests may come from signal handler.
+ * Revision History:
+ */
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "Trace.h"
+#include "Log.h"
+
+#define PCAP_MAGIC_NS               0xa1b23c4d      // nanosecond timestamps
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+#define TRACE_SNAPLEN               (0x10000+sizeof(USBMON_PACKET))
+
+typedef struct _PCAP_HEADER {
+    uint32_t        magic;
+    uint16_t        versionMajor;
+    uint16_t        versionMinor;
+    int32_t         thisZone;
+    uint32_t        sigFigs;
+    uint32_t        snapLen;
+    uint32_t        linkType;
+} PCAP_HEADER;
+
+typedef struct _PCAP_RECORD {
+    uint32_t        sec;
+    uint32_t        nsec;
+    uint32_t        inclLen;
+    uint32_t        origLen;
+} PCAP_RECORD;
+
+typedef struct _USBMON_PACKET {     // struct usbmon_packet of Linux usbmon binary API
+    uint64_t        id;             // URB handle
+    uint8_t         type;           // 'S' submit, 'C' complete
+    uint8_t         xferType;       // 0 ISO, 1 interrupt, 2 control, 3 bulk
+    uint8_t         epnum;          // endpoint, 0x80 for IN
+    uint8_t         devnum;
+    uint16_t        busnum;
+    char            flagSetup;      // 0 if setup is valid
+    char            flagData;       // 0 if data follows
+    int64_t         tsSec;
+    int32_t         tsUsec;
+    int32_t         status;         // -errno
+    uint32_t        length;
+    uint32_t        lenCap;         // data bytes following the header
+    uint8_t         setup [8];
+    int32_t         interval;
+    int32_t         startFrame;
+    uint32_t        xferFlags;
+    uint32_t        ndesc;
+} USBMON_PACKET;
+
+bool                            traceActive;
+static volatile sig_atomic_t    traceWanted;
+static char                     traceFile [PATH_MAX] = TRACE_FILE;
+static size_t                   traceSize = (size_t)TRACE_SIZE << 20;
+static int                      traceBus;
+static int                      traceFd = -1;
+static uint8_t                  *traceMap;
+static size_t                   traceUsed;
+static int64_t                  traceClockOffset;   // CLOCK_REALTIME - CLOCK_MONOTONIC, ns
+
+/**
+ * Set trace parameters
+ *
+ * @param file - trace file name, NULL for default
+ * @param size - trace file size, bytes, 0 for default
+ * @param bus - USB bus number of vhci device
+ */
+void TraceInit (const char *file, size_t size, int bus) {
+
+    if ( file != NULL ) {
+        strncpy (traceFile, file, sizeof(traceFile)-1);
+    }
+    if ( size >= sizeof(PCAP_HEADER) + sizeof(PCAP_RECORD) + TRACE_SNAPLEN ) {
+        traceSize = size;
+    }
+    traceBus = bus;
+}
+
+/**
+ * Ask to switch trace on or off. Safe to call from signal handler.
+ *
+ * @param on - true to trace URBs
+ */
+void TraceRequest (bool on) {
+
+    traceWanted = on;
+}
+
+/**
+ * Ask to switch trace over. Safe to call from signal handler.
+ */
+void TraceToggle (void) {
+
+    traceWanted = !traceWanted;
+}
+
+/**
+ * Create trace file and map it
+ *
+ * @return - 0 in case of success or errno code
+ */
+static int TraceOpen (void) {
+        struct timespec real, mono;
+
+    traceFd = open (traceFile, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if ( traceFd < 0 ) {
+        return errno;
+    }
+    if ( ftruncate (traceFd, traceSize) < 0 ||
+         (traceMap = mmap (NULL, traceSize, PROT_READ | PROT_WRITE, MAP_SHARED, traceFd, 0)) == MAP_FAILED ) {
+        int result = errno;
+        traceMap = NULL;
+        close (traceFd);
+        traceFd = -1;
+        unlink (traceFile);
+        return result;
+    }
+    PCAP_HEADER *pHeader = (PCAP_HEADER *)traceMap;
+    pHeader->magic = PCAP_MAGIC_NS;
+    pHeader->versionMajor = 2;
+    pHeader->versionMinor = 4;
+    pHeader->thisZone = 0;
+    pHeader->sigFigs = 0;
+    pHeader->snapLen = TRACE_SNAPLEN;
+    pHeader->linkType = LINKTYPE_USB_LINUX_MMAPPED;
+    traceUsed = sizeof(PCAP_HEADER);
+    clock_gettime (CLOCK_REALTIME, &real);
+    clock_gettime (CLOCK_MONOTONIC, &mono);
+    traceClockOffset = (real.tv_sec - mono.tv_sec) * 1000000000ll + (real.tv_nsec - mono.tv_nsec);
+    traceActive = true;
+    return 0;
+}
+
+/**
+ * Cut trace file to recorded size and close it
+ */
+static void TraceFinish (void) {
+
+    if ( traceMap != NULL ) {
+        munmap (traceMap, traceSize);
+        traceMap = NULL;
+    }
+    if ( traceFd >= 0 ) {
+        if ( ftruncate (traceFd, traceUsed) < 0 ) {
+            Log (LOG_WARNING, "Unable to truncate trace %s: %s.\n", traceFile, strerror(errno));
+        }
+        close (traceFd);
+        traceFd = -1;
+    }
+    traceActive = false;
+}
+
+/**
+ * Start the next trace file, the full one is kept as file.1
+ */
+static void TraceRotate (void) {
+        char    name [PATH_MAX+2];
+
+    TraceFinish ();
+    snprintf (name, sizeof(name), "%s.1", traceFile);
+    if ( rename (traceFile, name) < 0 ) {
+        Log (LOG_WARNING, "Unable to rename trace %s: %s.\n", traceFile, strerror(errno));
+    }
+    int result = TraceOpen ();
+    if ( result ) {
+        Log (LOG_ERR, "Unable to continue trace %s: %s. Trace is off.\n", traceFile, strerror(result));
+        traceWanted = false;
+    }
+}
+
+/**
+ * Switch trace on or off as requested. Called by URB thread between URBs.
+ */
+void TracePoll (void) {
+
+    bool wanted = traceWanted;
+    if ( wanted == traceActive ) {
+        return;
+    }
+    if ( wanted ) {
+        int result = TraceOpen ();
+        if ( result ) {
+            Log (LOG_ERR, "Unable to start trace %s: %s.\n", traceFile, strerror(result));
+            traceWanted = false;
+        } else {
+            Log (LOG_INFO, "URB trace into %s started.\n", traceFile);
+        }
+    } else {
+        TraceFinish ();
+        Log (LOG_INFO, "URB trace into %s stopped.\n", traceFile);
+    }
+}
+
+/**
+ * usbmon status of URB
+ *
+ * @param status - vhci status
+ * @return - -errno
+ */
+static int32_t TraceStatus (int32_t status) {
+
+    switch (status) {
+    case USB_VHCI_STATUS_SUCCESS:
+        return 0;
+    case USB_VHCI_STATUS_PENDING:
+        return -EINPROGRESS;
+    case USB_VHCI_STATUS_STALL:
+        return -EPIPE;
+    default:
+        return -EPROTO;
+    }
+}
+
+/**
+ * Record URB. Called by URB thread when trace is active.
+ *
+ * @param urb - URB
+ * @param complete - false at fetch, true at giveback
+ * @param ns - CLOCK_MONOTONIC time, ns
+ */
+void TraceUrb (struct usb_vhci_urb *urb, bool complete, uint64_t ns) {
+        PCAP_RECORD record;
+        USBMON_PACKET packet;
+
+    bool control = usb_vhci_is_control (urb->type);
+    bool in = control ? urb->bmRequestType & 0x80 : usb_vhci_is_in (urb->epadr);
+    uint32_t length = complete ? urb->buffer_actual : urb->buffer_length;
+    uint32_t dataLen = urb->buffer != NULL && in == complete ? length : 0;
+    size_t recordLen = sizeof(PCAP_RECORD) + sizeof(USBMON_PACKET) + dataLen;
+    if ( traceUsed + recordLen > traceSize ) {
+        TraceRotate ();
+        if ( !traceActive ) {
+            return;
+        }
+    }
+    uint64_t real = ns + traceClockOffset;
+    record.sec = (uint32_t)(real / 1000000000u);
+    record.nsec = (uint32_t)(real % 1000000000u);
+    record.inclLen = record.origLen = sizeof(USBMON_PACKET) + dataLen;
+    packet.id = urb->handle;
+    packet.type = complete ? 'C' : 'S';
+    packet.xferType = urb->type;
+    packet.epnum = (urb->epadr & 0x7f) | (in ? 0x80 : 0);
+    packet.devnum = urb->devadr;
+    packet.busnum = traceBus;
+    packet.flagSetup = control && !complete ? 0 : '-';
+    packet.flagData = dataLen ? 0 : (in ? '<' : '>');
+    packet.tsSec = record.sec;
+    packet.tsUsec = record.nsec / 1000;
+    packet.status = complete ? TraceStatus (urb->status) : -EINPROGRESS;
+    packet.length = length;
+    packet.lenCap = dataLen;
+    packet.setup [0] = urb->bmRequestType;    // setup packet is little endian
+    packet.setup [1] = urb->bRequest;
+    packet.setup [2] = (uint8_t)urb->wValue;
+    packet.setup [3] = urb->wValue >> 8;
+    packet.setup [4] = (uint8_t)urb->wIndex;
+    packet.setup [5] = urb->wIndex >> 8;
+    packet.setup [6] = (uint8_t)urb->wLength;
+    packet.setup [7] = urb->wLength >> 8;
+    packet.interval = urb->interval;
+    packet.startFrame = 0;
+    packet.xferFlags = urb->flags;
+    packet.ndesc = 0;
+    uint8_t *ptr = traceMap + traceUsed;    // records are not aligned
+    memcpy (ptr, &record, sizeof(record));
+    memcpy (ptr + sizeof(record), &packet, sizeof(packet));
+    if ( dataLen ) {
+        memcpy (ptr + sizeof(record) + sizeof(packet), urb->buffer, dataLen);
+    }
+    traceUsed += recordLen;
+}
+
+/**
+ * Stop trace. URB thread must be stopped.
+ */
+void TraceClose (void) {
+
+    if ( traceActive ) {
+        TraceFinish ();
+    }
+    traceWanted = false;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2017 Sam88651.
+ *
+ * Module Name:
+ *     Trace.h
+ * Abstract:
+ *      URB trace in pcap format (LINKTYPE_USB_LINUX_MMAPPED), readable
+ *      by Wireshark and tcpdump.
+ * Notes:
+ * Revision History:
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb_vhci.h>
+
+#define TRACE_FILE          "/tmp/usbhasp.pcap"
+#define TRACE_SIZE          64      // default trace file size, MB
+
+extern bool traceActive;            // owned by URB thread
+
+void TraceInit (const char *file, size_t size, int bus);
+void TraceRequest (bool on);
+void TraceToggle (void);
+void TracePoll (void);
+void TraceUrb (struct usb_vhci_urb *urb, bool complete, uint64_t ns);
+void TraceClose (void);
+
+#endif  // TRACE_H
@@ -20,13 +20,24 @@
 #include <syslog.h>
 #include <libusb_vhci.h>
 #include "USBKeyEmu.h"
+#include "Rcu.h"
+#include "Latency.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Rtc.h"
+#include "Sched.h"
+#include "PortState.h"
+#include "Log.h"
+#include "Probe.h"
+#include "Handoff.h"
 
 /**
- * General USB devices URB request manager
+ * General USB devices URB request manager. Serves control requests of
+ * raw_gadget backend too.
  * 
  * @param urb
  */
-static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
+void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
         int c;
         
     if ( !usb_vhci_is_control (urb->type) )	{
@@ -34,7 +45,7 @@ static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
     }
     if ( urb->epadr & 0x7f ) {
 #if DEBUG > 2
-        syslog (LOG_DEBUG, "DEVICE STALLED\n");
+        Log (LOG_DEBUG, "DEVICE STALLED\n");
 #endif        
 	urb->status = USB_VHCI_STATUS_STALL;
 	return;
@@ -43,24 +54,24 @@ static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
     uint8_t r = urb->bRequest;
     if ( rt == 0x00 && r == URB_RQ_SET_CONFIGURATION ) {
 #if DEBUG > 2
-        syslog (LOG_DEBUG, "SET_CONFIGURATION\n");
+        Log (LOG_DEBUG, "SET_CONFIGURATION\n");
 #endif        
         urb->status = USB_VHCI_STATUS_SUCCESS;
     } else if ( rt == 0x00 && r == URB_RQ_SET_INTERFACE ) {
 #if DEBUG > 2        
-        syslog (LOG_DEBUG, "SET_INTERFACE\n");
+        Log (LOG_DEBUG, "SET_INTERFACE\n");
 #endif        
         urb->status = USB_VHCI_STATUS_SUCCESS;
     } else if ( rt == 0x80 && r == URB_RQ_GET_DESCRIPTOR ) {
 #if DEBUG > 2
-        syslog (LOG_DEBUG, "GET_DESCRIPTOR\n");
+        Log (LOG_DEBUG, "GET_DESCRIPTOR\n");
 #endif        
         int l = urb->wLength;
         uint8_t *buffer = urb->buffer;
         switch(urb->wValue >> 8) {
         case 1:
 #if DEBUG > 2
-            syslog (LOG_DEBUG, "DEVICE_DESCRIPTOR\n");
+            Log (LOG_DEBUG, "DEVICE_DESCRIPTOR\n");
 #endif        
             if ( pusbDevice->devDesc != NULL ) {
                 if ( pusbDevice->devDesc[0] < l ) {
@@ -73,7 +84,7 @@ static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
             break;
         case 2:
 #if DEBUG > 2
-            syslog (LOG_DEBUG, "CONFIGURATION_DESCRIPTOR\n");
+            Log (LOG_DEBUG, "CONFIGURATION_DESCRIPTOR\n");
 #endif       
             if ( pusbDevice->confDesc != NULL ) {
                 if ( pusbDevice->confDesc[2] < l ) {
@@ -86,7 +97,7 @@ static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
             break;
         case 3:
 #if DEBUG > 2
-            syslog (LOG_DEBUG, "STRING_DESCRIPTOR\n");
+            Log (LOG_DEBUG, "STRING_DESCRIPTOR\n");
 #endif            
             switch(urb->wValue & 0xff) {
             case 0:
@@ -120,7 +131,7 @@ static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
             break;
         default:
 #if DEBUG > 2
-            syslog (LOG_DEBUG, "DEVICE STALL\n");
+            Log (LOG_DEBUG, "DEVICE STALL\n");
 #endif            
             urb->status = USB_VHCI_STATUS_STALL;
             break;
@@ -130,189 +141,316 @@ static void ProcessUrb (PUSBHASP pusbDevice, struct usb_vhci_urb *urb) {
         // IO request to USB hardware
         // 
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "urb->bRequest 0x%hhx, urb->wValue 0x%hx, urb->wIndex 0x%hx, urb->wLength 0x%hx\n", 
+        Log (LOG_DEBUG, "urb->bRequest 0x%hhx, urb->wValue 0x%hx, urb->wIndex 0x%hx, urb->wLength 0x%hx\n", 
                 urb->bRequest, urb->wValue, urb->wIndex, urb->wLength);
-        syslog (LOG_DEBUG, "HASP FUNCTION - ");
+        Log (LOG_DEBUG, "HASP FUNCTION - ");
 #endif        
         KEY_REQUEST request;
         request.majorFnCode = urb->bRequest; // Requested fn number (type of KEY_FN_LIST)
         request.param1 = urb->wValue;        // Key parameters
         request.param2 = urb->wIndex;
         request.param3 = urb->wLength;
-        EmulateKey (&pusbDevice->keyData,(PKEY_REQUEST)&request, &urb->buffer_length, (PKEY_RESPONSE)urb->buffer);
+                                            // Key image is valid till next quiescent state
+        PKEYDATA pKeyData = atomic_load_explicit (&pusbDevice->pKeyData, memory_order_acquire);
+        if ( pKeyData == NULL ) {           // key has been detached, port is being disconnected
+            urb->status = USB_VHCI_STATUS_STALL;
+            return;
+        }
+        uint8_t wasOpened = pusbDevice->session.isKeyOpened;
+        PROBE5 (hasp__request, pusbDevice->port, request.majorFnCode, request.param1, request.param2, request.param3);
+        EmulateKey (pKeyData, &pusbDevice->session, (PKEY_REQUEST)&request, &urb->buffer_length, (PKEY_RESPONSE)urb->buffer);
+        PROBE4 (hasp__response, pusbDevice->port, urb->bRequest, urb->buffer_length ? urb->buffer [0] : 0, urb->buffer_length);
+        if ( !wasOpened && pusbDevice->session.isKeyOpened ) {
+            StatsInc (&StatsPort (pusbDevice->port)->keyOpens);
+        }
         urb->buffer_actual = urb->buffer_length;
         urb->status = USB_VHCI_STATUS_SUCCESS;
     } else {
 #if DEBUG > 2
-        syslog (LOG_DEBUG, "DEVICE STALL\n");
+        Log (LOG_DEBUG, "DEVICE STALL\n");
 #endif        
         urb->status = USB_VHCI_STATUS_STALL;
     }
 }
 
 /**
- * HASP keys requests manager
+ * Port stat work: follow device address and hand the work over to control
+ * plane (see PortState.c), which connects the device on power and completes
+ * reset and resume
+ *
+ * @param haspKeys - ports
+ * @param numKeys - number of ports
+ * @param pStat - port stat work
+ * @param fetchTime - time of fetch
+ */
+static void UsbPortStat (USB_HASP haspKeys[], int numKeys, struct usb_vhci_port_stat *pStat, uint64_t fetchTime) {
+        uint16_t status, change;
+        uint8_t index;
+        int pindex;
+        PSTATS_PORT pStats;
+
+    status = pStat->status;
+    change = pStat->change;
+    index = pStat->index;
+    if ( index > numKeys || index < 1 ) {
+        Log (LOG_ERR, "Wrong port number %hhu\n", index);
+        StatsInc (&StatsPort (0)->portStats);
+        return;
+    }
+    pindex = index-1;
+    pStats = StatsPort (haspKeys [pindex].port);
+    struct usb_vhci_port_stat prev;
+    memcpy (&prev, &haspKeys [pindex].stat, sizeof(prev));
+    memcpy (&haspKeys [pindex].stat, pStat, sizeof(haspKeys [pindex].stat));
+    StatsInc (&pStats->portStats);
+    atomic_store_explicit (&pStats->status, status, memory_order_relaxed);
+    PROBE5 (port__stat, haspKeys [pindex].port, prev.status, status, change, pStat->flags);
+    if ( change & USB_VHCI_PORT_STAT_C_CONNECTION ) {
+                        // CONNECTION state changed -> invalidating address
+        haspKeys [pindex].addr = 0xff;
+    }
+    if ( change & USB_VHCI_PORT_STAT_C_RESET && ~status & USB_VHCI_PORT_STAT_RESET && status & USB_VHCI_PORT_STAT_ENABLE ) {
+                        // RESET successfull -> use default address
+        haspKeys [pindex].addr = 0;
+    }
+    atomic_store_explicit (&pStats->addr, haspKeys [pindex].addr, memory_order_relaxed);
+    PortStatePost (pindex, pStat, fetchTime);
+}
+
+/**
+ * Route fetched URB to its port and fetch its data
+ *
+ * @param fd - controller
+ * @param haspKeys - ports
+ * @param numKeys - number of ports
+ * @param urb - URB of process URB work
+ * @param res - usb_vhci_fetch_work result, 1 - URB has data to fetch
+ * @param fetchTime - time of fetch
+ * @return - port index or -1 if URB is not for a device of the ports
+ */
+static int UsbFetchUrb (int fd, USB_HASP haspKeys[], int numKeys, struct usb_vhci_urb *urb, int res, uint64_t fetchTime) {
+        int pindex;
+        PSTATS_PORT pStats;
+
+    PROBE5 (urb__fetch, urb->devadr, urb->bmRequestType, urb->bRequest, urb->wLength, urb->handle);
+    pindex = -1;
+    for ( int i = 0; i < numKeys; i++ ) {
+        if ( haspKeys[i].addr == urb->devadr ) {
+            pindex = i;
+            break;
+        }
+    }                
+    PROBE3 (urb__route, pindex < 0 ? 0 : haspKeys [pindex].port, urb->devadr, urb->bRequest);
+    if ( pindex < 0 || pindex >= numKeys ) {
+        Log (LOG_ERR, "Wrong device address %hhu\n", urb->devadr);
+        StatsInc (&StatsPort (0)->urbs);
+        return -1;
+    }
+    pStats = StatsPort (haspKeys [pindex].port);
+#if DEBUG > 2
+    Log (LOG_DEBUG, "Got process urb work for port %d\n", haspKeys [pindex].port);
+#endif                    
+    urb->buffer = NULL;
+    urb->iso_packets = NULL;
+    if ( urb->buffer_length ) {
+        urb->buffer = (uint8_t *)malloc(urb->buffer_length);
+    }
+    if ( urb->packet_count ) {
+        urb->iso_packets = (struct usb_vhci_iso_packet *)malloc(urb->packet_count * sizeof(struct usb_vhci_iso_packet));
+    }
+    if ( res ) {            // usb_vhci_fetch_work has returned a value != 0
+        res = usb_vhci_fetch_data (fd, urb);
+        if ( res == -1 ) {
+            if ( errno != ECANCELED ) {
+                Log (LOG_ERR, "USB (usb_vhci_fetch_data) port %d failed: %s.\n", haspKeys [pindex].port, strerror(errno));
+                StatsInc (&pStats->fetchErrors);
+            } else {
+                StatsInc (&pStats->cancels);
+            }
+            if ( urb->buffer != NULL ) {
+                free (urb->buffer);
+                urb->buffer = NULL;
+            }
+            if ( urb->iso_packets != NULL ) {
+                free (urb->iso_packets);
+                urb->iso_packets = NULL;
+            }
+        }
+    }
+    if ( traceActive ) {
+        TraceUrb (urb, false, fetchTime);
+    }
+    return pindex;
+}
+
+/**
+ * Process URB and give it back
+ *
+ * @param fd - controller
+ * @param pKey - port of URB
+ * @param urb - URB with fetched data
+ * @param fetchTime - time of fetch
+ */
+static void UsbServeUrb (int fd, PUSBHASP pKey, struct usb_vhci_urb *urb, uint64_t fetchTime) {
+        PSTATS_PORT pStats = StatsPort (pKey->port);
+
+                            // SET_ADDRESS?
+    if ( usb_vhci_is_control (urb->type) && !(urb->epadr & 0x7f) &&
+            !urb->bmRequestType && urb->bRequest == 5 ) {
+        if ( urb->wValue > 0x7f ) {
+            urb->status = USB_VHCI_STATUS_STALL;
+        } else {
+            urb->status = USB_VHCI_STATUS_SUCCESS;
+            pKey->addr = (uint8_t)urb->wValue;
+            atomic_store_explicit (&pStats->addr, pKey->addr, memory_order_relaxed);
+            Log (LOG_INFO, "Set device on port %d address = %d\n", pKey->port, pKey->addr);
+            PortStateEvent (pKey->port-1, PORT_EV_ADDRESS, fetchTime);
+        }
+    } else {                // any other than SET_ADDRESS?
+        PROBE5 (process__entry, pKey->port, urb->devadr, urb->bmRequestType, urb->bRequest, urb->wLength);
+        ProcessUrb (pKey, urb);
+        PROBE5 (process__return, pKey->port, urb->devadr, urb->bRequest, urb->status, urb->buffer_actual);
+    }
+    if ( usb_vhci_giveback (fd, urb) == -1 ) {
+        Log (LOG_ERR, "USB (usb_vhci_giveback), port %d failed: %s.\n", pKey->port, strerror(errno));
+        StatsInc (&pStats->givebackErrors);
+    }
+    StatsInc (&pStats->urbs);
+    if ( urb->status == USB_VHCI_STATUS_STALL ) {
+        StatsInc (&pStats->stalls);
+    }
+    if ( urb->bmRequestType == 0xc0 ) {
+        StatsInc (&pStats->haspUrbs);
+        StatsInc (&pStats->fn [urb->bRequest]);
+        PortStateEvent (pKey->port-1, PORT_EV_REQUEST, fetchTime);
+    } else {
+        StatsInc (&pStats->usbUrbs);
+    }
+    uint64_t doneTime = LatencyNow ();
+    if ( traceActive ) {
+        TraceUrb (urb, true, doneTime);
+    }
+    int fn = urb->bmRequestType == 0xc0 ? urb->bRequest : LATENCY_FN_USB;
+    LatencyRecord (pKey->port, fn, doneTime - fetchTime);
+    LatencyExchange (pKey->port, fn, fetchTime, doneTime);
+    PROBE6 (urb__done, pKey->port, urb->devadr, fn, urb->status, urb->buffer_actual, doneTime - fetchTime);
+    if ( urb->buffer != NULL ) {
+        free (urb->buffer);
+        urb->buffer = NULL;
+    }
+    if ( urb->iso_packets != NULL ) {
+        free (urb->iso_packets);
+        urb->iso_packets = NULL;
+    }
+}
+
+/**
+ * Serve the next queued URB
+ *
+ * @param fd - controller
+ * @param haspKeys - ports
+ */
+static void UsbServeNext (int fd, USB_HASP haspKeys[]) {
+        int pindex;
+
+    PSCHED_URB pUrb = SchedNext (&pindex);
+    if ( pUrb != NULL ) {
+        UsbServeUrb (fd, &haspKeys [pindex], &pUrb->urb, pUrb->fetchTime);
+        SchedDone (pindex);
+    }
+}
+
+/**
+ * Cancel work: URB still queued is dropped without being served, host has
+ * forgotten it
+ *
+ * @param haspKeys - ports
+ * @param handle - URB handle
+ */
+static void UsbCancelUrb (USB_HASP haspKeys[], uint64_t handle) {
+        struct usb_vhci_urb urb;
+        int pindex;
+
+    if ( !SchedCancel (handle, &pindex, &urb) ) {   // served already or not for me
+        StatsInc (&StatsPort (0)->cancels);
+        return;
+    }
+    StatsInc (&StatsPort (haspKeys [pindex].port)->cancels);
+    if ( urb.buffer != NULL ) {
+        free (urb.buffer);
+    }
+    if ( urb.iso_packets != NULL ) {
+        free (urb.iso_packets);
+    }
+}
+
+/**
+ * HASP keys requests manager. Work of the controller is drained into
+ * queues of ports (see Sched.c), port stat work is handled at once.
  * 
  * @param arg
  */
 void UsbDevice (int fd, USB_HASP haspKeys[], int numKeys, sem_t *pmutex) {
         int value = 0;
         int pindex;
+        int reader;
+        int drained = 0;
         struct usb_vhci_work w;
     
     if ( fd < 0 ) {
-        syslog (LOG_ERR, "USB (UsbDevice) bad file descriptor: %d.\n", fd);
+        Log (LOG_ERR, "USB (UsbDevice) bad file descriptor: %d.\n", fd);
         return;
     }
+    SchedInit ();
+    reader = RcuRegisterThread ();          // key images are read without locks
     while ( !value ) {
-        int res = usb_vhci_fetch_work (fd, &w);
+        RcuQuiescentState (reader);         // no key image references are held here
+        if ( !SchedQueued () && PortStateIdle () && HandoffPark (reader) ) {
+            break;                          // controller is served by new emulator
+        }
+        LatencyPoll ();
+        TracePoll ();
+        RtcTick ();                         // key clocks of URBs fetched now
+                                            // don't wait for work while URBs are queued
+        int res = SchedQueued () ? usb_vhci_fetch_work_timeout (fd, &w, 0) : usb_vhci_fetch_work (fd, &w);
+        uint64_t fetchTime = LatencyNow ();
         if ( res == -1 ) {
             if ( errno != ETIMEDOUT && errno != EINTR && errno != ENODATA ) {
-                syslog (LOG_ERR, "USB (usb_vhci_fetch_work) failed: %s.\n", strerror(errno));
-                continue;
+                Log (LOG_ERR, "USB (usb_vhci_fetch_work) failed: %s.\n", strerror(errno));
             }
         } else {
-            uint16_t status, change;
-            uint8_t flags, index;
             switch(w.type) {
             case USB_VHCI_WORK_TYPE_PORT_STAT:
-                status = w.work.port_stat.status;
-                change = w.work.port_stat.change;
-                flags = w.work.port_stat.flags;
-                index = w.work.port_stat.index;
-#if DEBUG > 2
-                syslog (LOG_DEBUG, "Got port %hhu stat work. Status: 0x%04hx, change: 0x%04hx, flags: 0x%02hhx\n", index, status, change, flags);
-#endif                    
-                if ( index > numKeys || index < 1 ) {
-                    syslog (LOG_ERR, "Wrong port number %hhu\n", index);
-                    continue;
-                }
-                pindex = index-1;
-                struct usb_vhci_port_stat prev;
-                memcpy (&prev, &haspKeys [pindex].stat, sizeof(prev));
-                memcpy (&haspKeys [pindex].stat, &w.work.port_stat, sizeof(haspKeys [pindex].stat));
-                if ( change & USB_VHCI_PORT_STAT_C_CONNECTION ) {
-                                    // CONNECTION state changed -> invalidating address
-                    haspKeys [pindex].addr = 0xff;
-                }
-                if ( change & USB_VHCI_PORT_STAT_C_RESET && ~status & USB_VHCI_PORT_STAT_RESET && status & USB_VHCI_PORT_STAT_ENABLE ) {
-                                    // RESET successfull -> use default address
-                    haspKeys [pindex].addr = 0;
-                }
-                if ( prev.status & USB_VHCI_PORT_STAT_POWER && ~status & USB_VHCI_PORT_STAT_POWER ) {
-                    syslog (LOG_INFO, "Port %d is powered off.\n", haspKeys [pindex].port);
-                }
-                if ( ~prev.status & USB_VHCI_PORT_STAT_POWER && status & USB_VHCI_PORT_STAT_POWER ) {
-                    syslog (LOG_INFO, "Port %d is powered on -> connecting device. ", haspKeys [pindex].port);
-                    if ( usb_vhci_port_connect (fd, haspKeys [pindex].port, USB_VHCI_DATA_RATE_FULL) == -1 ) {
-                        syslog (LOG_ERR, "USB (usb_vhci_port_connect), port %d failed: %s.\n", haspKeys [pindex].port, strerror(errno));
-                        break;
-                    } else {
-                        syslog (LOG_INFO, "Port %d connected.\n", haspKeys [pindex].port);
-                    }
-                }
-                if ( ~prev.status & USB_VHCI_PORT_STAT_RESET && status & USB_VHCI_PORT_STAT_RESET ) {
-                                    // Port is resetting
-                    if ( status & USB_VHCI_PORT_STAT_CONNECTION ) {
-                                    // completing reset
-                        if ( usb_vhci_port_reset_done (fd, haspKeys [pindex].port, 1) == -1 ) {
-                            syslog (LOG_ERR, "USB (usb_vhci_port_reset_done) port %d failed: %s.\n", haspKeys [pindex].port, strerror(errno));
-                            break;
-                        }
-                    }
-                }
-                if ( ~prev.flags & USB_VHCI_PORT_STAT_FLAG_RESUMING && flags & USB_VHCI_PORT_STAT_FLAG_RESUMING ) {
-                                    // Port is resuming
-                    if ( status & USB_VHCI_PORT_STAT_CONNECTION ) {
-                                    // completing resume
-                        if ( usb_vhci_port_resumed (fd, haspKeys [pindex].port) == -1) {
-                            syslog (LOG_ERR, "USB (usb_vhci_port_resumed), port %d failed: %s.\n", haspKeys [pindex].port, strerror(errno));
-                            break;
-                        }
-                    }
-                }
-                if ( ~prev.status & USB_VHCI_PORT_STAT_SUSPEND && status & USB_VHCI_PORT_STAT_SUSPEND ) {
-                                    // Port is suspended
-                    syslog (LOG_INFO, "Port %d is suspended.\n", haspKeys [pindex].port);
-                }
-                if ( prev.status & USB_VHCI_PORT_STAT_ENABLE && ~status & USB_VHCI_PORT_STAT_ENABLE ) {
-                                    // Port is disabled
-                    syslog (LOG_INFO, "Port %d is disabled.\n", haspKeys [pindex].port);
-                }
+                UsbPortStat (haspKeys, numKeys, &w.work.port_stat, fetchTime);
                 break;
             case USB_VHCI_WORK_TYPE_PROCESS_URB:
-                for ( int i = 0; i < numKeys; i++ ) {
-                    if ( haspKeys[i].addr == w.work.urb.devadr ) {
-                        pindex = i;
-                        break;
-                    }
-                }                
-                if ( pindex < 0 || pindex >= numKeys ) {
-                    syslog (LOG_ERR, "Wrong device address %hhu\n", w.work.urb.devadr);
-                    break;                    
-                }
-#if DEBUG > 2
-                syslog (LOG_DEBUG, "Got process urb work for port %d\n", haspKeys [pindex].port);
-#endif                    
-                w.work.urb.buffer = NULL;
-                w.work.urb.iso_packets = NULL;
-                if ( w.work.urb.devadr != haspKeys [pindex].addr ) { // not for me
+                pindex = UsbFetchUrb (fd, haspKeys, numKeys, &w.work.urb, res, fetchTime);
+                if ( pindex < 0 ) {     // not for me
                     break;
                 }
-                if ( w.work.urb.buffer_length ) {
-                    w.work.urb.buffer = (uint8_t *)malloc(w.work.urb.buffer_length);
-                }
-                if ( w.work.urb.packet_count ) {
-                    w.work.urb.iso_packets = (struct usb_vhci_iso_packet *)malloc(w.work.urb.packet_count * sizeof(struct usb_vhci_iso_packet));
-                }
-                if ( res ) {            // usb_vhci_fetch_work has returned a value != 0
-                    res = usb_vhci_fetch_data (fd, &w.work.urb);
-                    if ( res == -1 ) {
-                        if ( errno != ECANCELED ) {
-                            syslog (LOG_ERR, "USB (usb_vhci_fetch_data) port %d failed: %s.\n", haspKeys [pindex].port, strerror(errno));
-                        }
-                        if ( w.work.urb.buffer != NULL ) {
-                            free (w.work.urb.buffer);
-                            w.work.urb.buffer = NULL;
-                        }
-                        if ( w.work.urb.iso_packets != NULL ) {
-                            free (w.work.urb.iso_packets);
-                            w.work.urb.iso_packets = NULL;
-                        }
-                    }
-                }
-                                        // SET_ADDRESS?
-                if ( usb_vhci_is_control (w.work.urb.type) && !(w.work.urb.epadr & 0x7f) &&
-                        !w.work.urb.bmRequestType && w.work.urb.bRequest == 5 ) {
-                    if ( w.work.urb.wValue > 0x7f ) {
-                        w.work.urb.status = USB_VHCI_STATUS_STALL;
-                    } else {
-                        w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
-                        haspKeys [pindex].addr = (uint8_t)w.work.urb.wValue;
-                        syslog (LOG_INFO, "Set device on port %d address = %d\n", haspKeys [pindex].port, haspKeys [pindex].addr);
-                    }
-                } else {                // any other than SET_ADDRESS?
-                    ProcessUrb (&haspKeys [pindex], &w.work.urb);
-                }
-                if ( usb_vhci_giveback (fd, &w.work.urb) == -1 ) {
-                    syslog (LOG_ERR, "USB (usb_vhci_giveback), port %d failed: %s.\n", haspKeys [pindex].port, strerror(errno));
-                }
-                if ( w.work.urb.buffer != NULL ) {
-                    free (w.work.urb.buffer);
-                    w.work.urb.buffer = NULL;
-                }
-                if ( w.work.urb.iso_packets != NULL ) {
-                    free (w.work.urb.iso_packets);
-                    w.work.urb.iso_packets = NULL;
+                PSCHED_URB pUrb;
+                while ( (pUrb = SchedPut (pindex)) == NULL ) {
+                    UsbServeNext (fd, haspKeys);    // queue of port is full, it gets a turn
                 }
+                memcpy (&pUrb->urb, &w.work.urb, sizeof(pUrb->urb));
+                pUrb->fetchTime = fetchTime;
                 break;
             case USB_VHCI_WORK_TYPE_CANCEL_URB: // Got cancel urb work
+                UsbCancelUrb (haspKeys, w.work.handle);
                 break;
             default:
-                syslog (LOG_ERR, "Got invalid work for port, type %d\n", w.type);
+                Log (LOG_ERR, "Got invalid work for port, type %d\n", w.type);
                 break;
             }
         }
+        if ( res == -1 || ++drained == SCHED_DRAIN ) {
+            UsbServeNext (fd, haspKeys);    // controller is drained or a batch is fetched
+            drained = 0;
+        }
         sem_getvalue (pmutex, &value); 
     }
+    while ( SchedQueued () ) {              // clients get answers of fetched URBs
+        UsbServeNext (fd, haspKeys);
+    }
+    RcuUnregisterThread (reader);
 }
@@ -21,6 +21,20 @@
 #include <sys/stat.h>
 #include <syslog.h>
 #include "USBKeyEmu.h"
+#include "KeyFile.h"
+#include "Journal.h"
+#include "Latency.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Log.h"
+#include "Control.h"
+#include "Realtime.h"
+#include "Handoff.h"
+#include "RawGadget.h"
+#include "NetKey.h"
+#include "ShmKey.h"
+#include "Sched.h"
+#include "PortState.h"
 
 static const uint8_t devDesc [MAX_DEVDESC] = {
 	18,     // descriptor length
@@ -91,6 +105,10 @@ void SignalHandler (int signo) {
         signo == SIGABRT || signo == SIGTERM || signo == SIGSTOP) {
         syslog (LOG_INFO, "Received signal to stop.\n");
         sem_post (&mutex);
+    } else if ( signo == SIGUSR1 ) {
+        LatencyRequestReport ();
+    } else if ( signo == SIGUSR2 ) {
+        TraceToggle ();
     }
 }
 
@@ -103,17 +121,17 @@ static void Daemonize(void)
                 
     pid = fork();                   // Fork off the parent process
     if (pid < 0) {                  // An error occurred
-        syslog (LOG_ERR, "Unable to fork off parent process.\n");
+        Log (LOG_ERR, "Unable to fork off parent process.\n");
         exit (EXIT_FAILURE);
     } else if (pid > 0) {           // Success: Let the parent terminate
         exit (EXIT_SUCCESS);
     } if (setsid() < 0) {           // On success: The child process becomes session leader
-        syslog (LOG_ERR, "Unable to setsid.\n");
+        Log (LOG_ERR, "Unable to setsid.\n");
         exit (EXIT_FAILURE);
     }
     pid = fork();                   // Fork off for the second time
     if (pid < 0) {                  // An error occurred
-        syslog (LOG_ERR, "Unable to fork for the second time.\n");
+        Log (LOG_ERR, "Unable to fork for the second time.\n");
         exit (EXIT_FAILURE);
     } if (pid > 0) {                // Success: Let the parent terminate
         exit (EXIT_SUCCESS);
@@ -132,7 +150,7 @@ static void Daemonize(void)
  * @return 
  */
 int main (int argc, char *argv[]) {
-        int     numKeys, i;
+        int     numKeys, numPorts = 0, i;
         char    *bus_id;
         int32_t usb_bus_num;
         int32_t id;
@@ -140,76 +158,261 @@ int main (int argc, char *argv[]) {
         int     opt;
         int     rc;
         bool    daemonize = false;
+        bool    journal = false;
+        int     journalInterval = JOURNAL_INTERVAL;
+        int     journalBatch = JOURNAL_BATCH;
+        char    *statsName = STATS_NAME;
+        char    *logName = NULL;
+        char    *traceName = NULL;
+        size_t  traceSize = TRACE_SIZE;
+        uint32_t seed = 0;
+        char    *controlName = NULL;
+        char    *cpus = NULL;
+        char    *takeoverName = NULL;
+        char    *gadgetName = NULL;
+        char    *netName = NULL;
+        char    *shmName = NULL;
+        int     priority = 0;
 
     numKeys = 0;
-    while ((opt=getopt(argc,argv, "?hd")) != -1) {
+    while ((opt=getopt(argc,argv, "?hdji:b:s:l:L:t:T:r:c:p:R:A:U:G:N:M:W:")) != -1) {
         switch (opt) {
         case 'd':
             daemonize = true;
             break;
+        case 'j':
+            journal = true;
+            break;
+        case 'i':
+            journalInterval = atoi (optarg);
+            break;
+        case 'b':
+            journalBatch = atoi (optarg);
+            break;
+        case 's':
+            statsName = optarg;
+            break;
+        case 'l':
+            LogSetLevel (atoi (optarg));
+            break;
+        case 'L':
+            logName = optarg;
+            break;
+        case 't':
+            traceName = optarg;
+            break;
+        case 'T':
+            traceSize = atoi (optarg);
+            break;
+        case 'r':
+            seed = strtoul (optarg, NULL, 0);
+            break;
+        case 'c':
+            controlName = optarg;
+            break;
+        case 'p':
+            numPorts = atoi (optarg);
+            if ( numPorts > MAX_HASPKEYS ) {
+                numPorts = MAX_HASPKEYS;
+            }
+            break;
+        case 'R':
+            priority = atoi (optarg);
+            break;
+        case 'A':
+            cpus = optarg;
+            if ( priority == 0 ) {
+                priority = REALTIME_PRIORITY;
+            }
+            break;
+        case 'U':
+            takeoverName = optarg;
+            break;
+        case 'G':
+            gadgetName = optarg;
+            break;
+        case 'N':
+            netName = optarg;
+            break;
+        case 'M':
+            shmName = optarg;
+            break;
+        case 'W':
+            if ( SchedWeights (optarg) ) {
+                fprintf (stderr,"Bad port weights %s.\n", optarg);
+                return -1;
+            }
+            break;
         default:
         case '?':
         case 'h':
-            fprintf (stderr,"Usage: #%s [-d] keyfile1.json ... keyfile%d.json\n", argv[0], MAX_HASPKEYS);
+            fprintf (stderr,"Usage: #%s [-d] [-j [-i msec] [-b records]] [-s name] [-l level] [-L logfile] [-t tracefile [-T MB]] [-r seed] [-c socket [-p ports]] [-R priority [-A cpus]] [-U socket | -G udc] [-N [address:]port] [-M name] [-W weights] keyfile1.json ... keyfile%d.json\n", argv[0], MAX_HASPKEYS);
+            fprintf (stderr,"  -d  daemonize\n");
+            fprintf (stderr,"  -j  journal key memory writes into keyfile.journal\n");
+            fprintf (stderr,"  -i  journal group commit interval, ms (default %d)\n", JOURNAL_INTERVAL);
+            fprintf (stderr,"  -b  journal records to commit before interval expires (default %d)\n", JOURNAL_BATCH);
+            fprintf (stderr,"  -s  statistics shared memory name for usbhasp-top (default %s)\n", STATS_NAME);
+            fprintf (stderr,"  -l  log level, syslog priority 0..7 (default %d)\n", atomic_load (&logLevel));
+            fprintf (stderr,"  -L  log into file instead of syslog\n");
+            fprintf (stderr,"  -t  trace URBs into pcap file from start, SIGUSR2 switches trace (default %s)\n", TRACE_FILE);
+            fprintf (stderr,"  -T  trace file size, MB (default %d)\n", TRACE_SIZE);
+            fprintf (stderr,"  -r  seed of key responses randomness, makes traces replayable by usbhasp-replay\n");
+            fprintf (stderr,"  -c  control socket to attach and detach keys at runtime (e.g. %s)\n", CONTROL_SOCKET);
+            fprintf (stderr,"  -p  number of ports including free ones for attached keys (max %d)\n", MAX_HASPKEYS);
+            fprintf (stderr,"  -R  realtime mode: lock and prefault memory, URB thread SCHED_FIFO priority (e.g. %d)\n", REALTIME_PRIORITY);
+            fprintf (stderr,"  -A  pin URB thread to CPU list like 2 or 2,3 or 0-1 (implies -R %d)\n", REALTIME_PRIORITY);
+            fprintf (stderr,"  -U  take over controller and clients of emulator with control socket (e.g. %s)\n", CONTROL_SOCKET);
+            fprintf (stderr,"  -G  emulate keys as raw_gadget devices of UDC instead of vhci_hcd ports (e.g. %s)\n", RAW_GADGET_UDC);
+            fprintf (stderr,"  -N  serve net keys to network clients on UDP and TCP port (e.g. %d)\n", NETKEY_PORT);
+            fprintf (stderr,"  -M  serve keys to local clients through shared memory rings (e.g. %s)\n", SHMKEY_NAME);
+            fprintf (stderr,"  -W  URB weights of vhci_hcd ports from port 1 like 4,1,1 (default 1, max %d)\n", SCHED_MAX_WEIGHT);
             return -1;
         }
     }
+    if ( gadgetName != NULL && takeoverName != NULL ) {
+        fprintf (stderr,"Only vhci_hcd controller can be taken over, -U and -G are exclusive.\n");
+        return -1;
+    }
     // Prepare log file    
     openlog ("usbhasp", LOG_CONS | LOG_PID | LOG_NDELAY | (daemonize?0:LOG_PERROR), LOG_LOCAL1);
+    // Prepare ports, key clocks and journals of loaded keys go by port number
+    for ( i = 0; i < MAX_HASPKEYS; i++ ) {  // controller taken over may have more ports
+                                            // contains the address of our device connected
+                                            // to the port (the device is not yet connected)
+        haspKeys [i].addr = 0xFF;           // address not set yet
+                                            // contains the status of the port
+        memset (&haspKeys [i].stat, 0, sizeof(haspKeys [i].stat));
+        haspKeys [i].port = i+1;
+        memcpy (&haspKeys [i].devDesc, devDesc, sizeof(haspKeys [i].devDesc));
+        memcpy (&haspKeys [i].confDesc, confDesc, sizeof(haspKeys [i].confDesc));
+        memcpy (&haspKeys [i].strDesc, strDesc, sizeof(haspKeys [i].strDesc));
+        haspKeys [i].deviceName = deviceName;
+    }
     // Load keys    
     for ( numKeys = 0, i = optind; i < argc && numKeys < MAX_HASPKEYS; i++ ) {
-        int result = LoadKey (argv[i], &haspKeys[numKeys].keyData);
+        int result = PortAttach (&haspKeys [numKeys], argv[i], journal && takeoverName == NULL, seed);
         if ( result > 0 ) {
-            syslog (LOG_ERR, "Error %s loading keyfile %s.\n", strerror(result), argv[i]);
+            Log (LOG_ERR, "Error %s loading keyfile %s.\n", strerror(result), argv[i]);
         } else if ( result < 0 ) {
-            syslog (LOG_ERR, "Error parsing key file %s\n", argv[i]);
+            Log (LOG_ERR, "Error parsing key file %s\n", argv[i]);
         } else {                            // key has been loaded
-        syslog (LOG_INFO, "Loaded key %d: '%s', Created: %s\n", numKeys, haspKeys [numKeys].keyData.name, 
-                                                       haspKeys [numKeys].keyData.created);
-                                            // contains the address of our device connected
-                                            // to the port (the device is not yet connected)
-        haspKeys [numKeys].addr = 0xFF;     // address not set yet
-                                            // contains the status of the port
-        memset (&haspKeys [numKeys].stat, 0, sizeof(haspKeys [numKeys].stat));
-        haspKeys [numKeys].port = numKeys+1;
-        memcpy (&haspKeys [numKeys].devDesc, devDesc, sizeof(haspKeys [numKeys].devDesc));
-        memcpy (&haspKeys [numKeys].confDesc, confDesc, sizeof(haspKeys [numKeys].confDesc));
-        memcpy (&haspKeys [numKeys].strDesc, strDesc, sizeof(haspKeys [numKeys].strDesc));
-        haspKeys [numKeys].deviceName = deviceName;
-        strncpy (haspKeys [numKeys].keyfileName, argv[i], sizeof(haspKeys [numKeys].keyfileName));
-        haspKeys [numKeys].keyfileName [sizeof(haspKeys [numKeys].keyfileName)-1] = '\0';
-        ++numKeys;
+            PKEYDATA pKeyData = atomic_load (&haspKeys [numKeys].pKeyData);
+            Log (LOG_INFO, "Loaded key %d: '%s', Created: %s\n", numKeys, pKeyData->name, pKeyData->created);
+            ++numKeys;
         }
     }
+    if ( controlName == NULL || numPorts < numKeys ) {
+        numPorts = numKeys;                 // free ports are of use for control socket only
+    }
     sem_init (&mutex, 0, 0);
     if ( signal (SIGINT, SignalHandler) == SIG_ERR ) {
-        syslog(LOG_ERR, "Can't catch SIGINT\n");
+        Log (LOG_ERR, "Can't catch SIGINT\n");
         rc =  errno;
     } else {
-        if ( numKeys > 0 ) {
+        if ( signal (SIGUSR1, SignalHandler) == SIG_ERR ) {
+            Log (LOG_WARNING, "Can't catch SIGUSR1, latency report is not available.\n");
+        }
+        if ( signal (SIGUSR2, SignalHandler) == SIG_ERR ) {
+            Log (LOG_WARNING, "Can't catch SIGUSR2, URB trace can't be switched.\n");
+        }
+        if ( numPorts > 0 || takeoverName != NULL ) {
             bus_id = NULL;
-            fd = usb_vhci_open (numKeys, &id, &usb_bus_num, &bus_id);
-            if ( fd < 0 ) {
-                syslog (LOG_ERR, "Unable to create USB device. Is vhci_hcd driver loaded?\n");
+            if ( gadgetName != NULL ) {         // no vhci controller, UDCs enumerate gadgets
+                fd = -1;
+                bus_id = gadgetName;
+                usb_bus_num = 0;
+                if ( (rc = RawGadgetOpen (gadgetName, numPorts)) ) {
+                    Log (LOG_ERR, "Unable to create USB gadgets on %s: %s. Are raw_gadget and dummy_hcd drivers loaded?\n", gadgetName, strerror(rc));
+                } else {
+                    Log (LOG_INFO, "USB gadgets created on %s\n", gadgetName);
+                }
+            } else if ( takeoverName != NULL ) {    // the running emulator stops serving here
+                fd = HandoffReceive (takeoverName, haspKeys, &numPorts, &usb_bus_num, &bus_id);
+                if ( fd < 0 ) {
+                    Log (LOG_ERR, "Unable to take over USB device from %s: %s.\n", takeoverName, strerror(errno));
+                }
+            } else {
+                fd = usb_vhci_open (numPorts, &id, &usb_bus_num, &bus_id);
+                if ( fd < 0 ) {
+                    Log (LOG_ERR, "Unable to create USB device. Is vhci_hcd driver loaded?\n");
+                } else {
+                    Log (LOG_INFO, "USB device created %s (bus# %d)\n", bus_id, usb_bus_num);
+                }
+            }
+            if ( gadgetName != NULL ? rc != 0 : fd < 0 ) {
                 rc = -1;
             } else {
-                syslog (LOG_INFO, "USB device created %s (bus# %d)\n", bus_id, usb_bus_num);
+                HandoffSetBus (usb_bus_num, bus_id);
 
                 if ( daemonize ) {
                     Daemonize();
                 }
-                UsbDevice (fd, haspKeys, numKeys, &mutex);
+                if ( (rc = LogStart (logName)) ) {
+                    Log (LOG_WARNING, "Unable to start logger: %s. Logging synchronously.\n", strerror(rc));
+                }
+                StatsOpen (statsName, numPorts);
+                TraceInit (traceName, traceSize << 20, usb_bus_num);
+                TraceRequest (traceName != NULL);
+                if ( journal && (rc = StartJournal (journalInterval, journalBatch, &mutex)) ) {
+                    Log (LOG_ERR, "Key memory writes will not be journaled: %s.\n", strerror(rc));
+                }
+                rc = StartKeyReload (&mutex);
+                if ( rc ) {
+                    Log (LOG_WARNING, "Key files will not be reloaded: %s.\n", strerror(rc));
+                }
+                if ( controlName != NULL && (rc = StartControl (controlName, fd, haspKeys, numPorts, journal, seed, &mutex)) ) {
+                    Log (LOG_ERR, "Unable to create control socket %s: %s.\n", controlName, strerror(rc));
+                }
+                if ( netName != NULL && (rc = StartNetKey (netName, haspKeys, numPorts, &mutex)) ) {
+                    Log (LOG_ERR, "Unable to start network key server on %s: %s.\n", netName, strerror(rc));
+                }
+                if ( shmName != NULL && (rc = StartShmKey (shmName, haspKeys, numPorts, &mutex)) ) {
+                    Log (LOG_ERR, "Unable to start shared memory key server %s: %s.\n", shmName, strerror(rc));
+                }
+                if ( gadgetName == NULL && (rc = StartPortState (fd, haspKeys, numPorts, &mutex)) ) {
+                    Log (LOG_WARNING, "Ports will be controlled by URB thread: %s.\n", strerror(rc));
+                }
+                if ( priority > 0 && (rc = RealtimeStart (cpus, priority)) ) {
+                    Log (LOG_WARNING, "Realtime mode is not complete: %s.\n", strerror(rc));
+                }
+                if ( takeoverName != NULL ) {   // journals are closed by the emulator taken over
+                    for ( i = 0; journal && i < numPorts; i++ ) {
+                        PortJournalOpen (&haspKeys [i]);
+                    }
+                    HandoffResume (fd, haspKeys, numPorts);
+                }
+                if ( gadgetName != NULL ) {
+                    RawGadget (haspKeys, numPorts, &mutex);
+                } else {
+                    UsbDevice (fd, haspKeys, numPorts, &mutex);
+                }
+                StopPortState ();
+                StopShmKey ();
+                StopNetKey ();
+                StopControl ();
+                StopKeyReload ();
+                StopJournal ();
+                StatsClose ();
+                TraceClose ();
 
                 sem_destroy (&mutex);
-                usb_vhci_close (fd);
-                syslog (LOG_INFO, "USB device removed %s (bus# %d)\n", bus_id, usb_bus_num);
+                if ( gadgetName != NULL ) {
+                    RawGadgetClose ();
+                } else {
+                    usb_vhci_close (fd);
+                }
+                Log (LOG_INFO, "USB device %s %s (bus# %d)\n", HandoffDone () ? "handed over" : "removed", bus_id, usb_bus_num);
                 rc = EXIT_SUCCESS;
             }
         } else {
-            syslog(LOG_WARNING, "No keys loaded. Nothing to emulate.\n");
+            Log (LOG_WARNING, "No keys loaded. Nothing to emulate.\n");
             rc = -1;
         }
     }
+    for ( i = 0; i < numPorts; i++ ) {
+        PortDetach (&haspKeys [i]);
+    }
+    LogStop ();
     closelog ();
     return rc;
 }
@@ -15,10 +15,12 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <syslog.h>
-#include <libusb_vhci.h>
-#include "USBKeyEmu.h"
+#include "HaspEmu.h"
+#include "EncDecSim.h"
+#include "Probe.h"
 
 /**
  * Encode/decode response/request to key
@@ -59,17 +61,20 @@ static void _Chiper(uint8_t *bufPtr, uint32_t bufSize, uint16_t *key1Ptr, uint16
  * 
  * @param buf - pointer to a encoded/decoded data
  * @param size - size of encoded information
- * @param pKeyData - ptr to key data
+ * @param pKeyData - key image
+ * @param pSession - ptr to key session state
  */
-static void Chiper(void *buf, uint32_t size, PKEYDATA pKeyData) {
+static void Chiper(void *buf, uint32_t size, PCKEYDATA pKeyData, PKEYSESSION pSession) {
 #ifdef DEBUG    
-    syslog (LOG_DEBUG, "Chiper inChiperKey1=0x%hX, inChiperKey2=0x%hX, length=0x%X\n",
-                            pKeyData->chiperKey1, pKeyData->chiperKey2, size);
+    KeyLog (pKeyData, LOG_DEBUG, "Chiper inChiperKey1=0x%hX, inChiperKey2=0x%hX, length=0x%X\n",
+                            pSession->chiperKey1, pSession->chiperKey2, size);
 #endif    
-    _Chiper(buf, size, &pKeyData->chiperKey1, &pKeyData->chiperKey2);
+    PROBE3 (chiper__entry, size, pSession->chiperKey1, pSession->chiperKey2);
+    _Chiper(buf, size, &pSession->chiperKey1, &pSession->chiperKey2);
+    PROBE3 (chiper__return, size, pSession->chiperKey1, pSession->chiperKey2);
 #ifdef DEBUG    
-    syslog (LOG_DEBUG, "Chiper outChiperKey1=0x%hX, outChiperKey2=0x%hX\n",
-                            pKeyData->chiperKey1, pKeyData->chiperKey2);
+    KeyLog (pKeyData, LOG_DEBUG, "Chiper outChiperKey1=0x%hX, outChiperKey2=0x%hX\n",
+                            pSession->chiperKey1, pSession->chiperKey2);
 #endif    
 }
 
@@ -116,7 +121,7 @@ static uint32_t CheckEncodedStatus(uint8_t adjustedReqCode, uint8_t setupKeysRes
  * @param pKeyData
  * @return 
  */
-static int32_t GetMemorySize(PKEYDATA pKeyData) {
+static int32_t GetMemorySize(PCKEYDATA pKeyData) {
 
     if ( pKeyData->memoryType == 1 )
         return 0x80;
@@ -126,6 +131,331 @@ static int32_t GetMemorySize(PKEYDATA pKeyData) {
         return 0xFD0;           // memoryType == 0x21
 }
 
+/**
+ * Memory size of key the client can address
+ * 
+ * @param pKeyData - key image
+ * @return - key memory size in bytes
+ */
+int32_t KeyMemorySize (PCKEYDATA pKeyData) {
+    
+    return GetMemorySize (pKeyData);
+}
+
+/**
+ * Bind session to key image
+ * 
+ * @param pSession - key session state
+ * @param pKeyData - key image
+ */
+void KeySessionInit (PKEYSESSION pSession, PCKEYDATA pKeyData) {
+    
+    pSession->keyEpoch = pKeyData->sessionEpoch;
+    pSession->memoryHash = pKeyData->memoryHash;
+}
+
+/**
+ * Make encodedStatus randomness of session reproducible. Responses of
+ * session depend on seed and requests only then.
+ * 
+ * @param pSession - key session state
+ * @param seed - seed, 0 to seed by clock
+ */
+void KeySessionSeed (PKEYSESSION pSession, uint32_t seed) {
+    
+    pSession->randomSeed = seed;
+    pSession->random = 0;
+}
+
+/**
+ * Open session with password the way CHECK_PASS does for a client talking
+ * through the chiper. Used by clients served without USB (network key).
+ * 
+ * @param pKeyData - key image
+ * @param pSession - key session state
+ * @param password - key password
+ * @return - key memory size in bytes or 0 if password is wrong
+ */
+int32_t KeyLogin (PCKEYDATA pKeyData, PKEYSESSION pSession, uint32_t password) {
+    
+    KeySessionInit (pSession, pKeyData);
+    if ( password != pKeyData->password ) {
+        pSession->isKeyOpened = 0;
+        return 0;
+    }
+    pSession->isInitDone = 1;
+    pSession->isKeyOpened = 1;
+    return GetMemorySize (pKeyData);
+}
+
+/**
+ * Hash dword with key transform, as HASH_DWORD does without the chiper
+ * 
+ * @param pKeyData - key image
+ * @param value - value to hash, replaced by the hash
+ */
+void KeyHashDword (PCKEYDATA pKeyData, uint32_t *value) {
+        KEY_INFO keyInfo;
+                                                    // Transform state is scratch, keep key image intact
+    memcpy (&keyInfo, pKeyData->edStruct, sizeof(keyInfo));
+    PROBE0 (transform__entry);
+    Transform (value, &keyInfo);
+    PROBE0 (transform__return);
+}
+
+/**
+ * Encode/decode data the way the key does. Client mirrors chiper keys of
+ * the session: SET_CHIPER_KEYS sets them to its param1 and 0xA0CB, every
+ * successful request sets high byte of key2 to encodedStatus.
+ * 
+ * @param chiperKey1 - ptr to chiper key1
+ * @param chiperKey2 - ptr to chiper key2
+ * @param buf - pointer to a encoded/decoded data
+ * @param size - size of encoded information
+ */
+void KeyChiper (uint16_t *chiperKey1, uint16_t *chiperKey2, void *buf, uint32_t size) {
+    
+    _Chiper ((uint8_t *)buf, size, chiperKey1, chiperKey2);
+}
+
+/**
+ * Restart encodedStatus randomness. Called when client sets chiper keys,
+ * so that a replayed client session gets the same randomness.
+ * 
+ * @param pSession - key session state
+ * @param chiperKey - chiper key given by client
+ */
+static void KeyRandomInit (PKEYSESSION pSession, uint16_t chiperKey) {
+        uint32_t x = pSession->randomSeed;
+        struct timespec ts;
+    
+    if ( x == 0 ) {
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        x = (uint32_t)ts.tv_nsec ^ (uint32_t)ts.tv_sec;
+    }
+    x ^= chiperKey * 0x9E3779B1u;                  // spread seed bits
+    x = (x ^ (x >> 16)) * 0x85EBCA6Bu;
+    x = (x ^ (x >> 13)) * 0xC2B2AE35u;
+    x ^= x >> 16;
+    pSession->random = x ? x : 0x6D2B79F5u;        // xorshift state must not be 0
+}
+
+/**
+ * Next random value of session (xorshift32)
+ * 
+ * @param pSession - key session state
+ * @return - random value
+ */
+static uint32_t KeyRandom (PKEYSESSION pSession) {
+    
+    if ( pSession->random == 0 ) {
+        KeyRandomInit (pSession, 0);
+    }
+    uint32_t x = pSession->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pSession->random = x;
+    return x;
+}
+
+/**
+ * Free private memory pages of session
+ * 
+ * @param pSession - key session state
+ */
+void KeySessionFree (PKEYSESSION pSession) {
+    
+    for ( int i = 0; i < KEY_MEMORY_PAGES; i++ ) {
+        free (pSession->pages [i]);
+        pSession->pages [i] = NULL;
+    }
+}
+
+/**
+ * Read key memory as seen by session. Bytes out of memory are read as zeros.
+ * 
+ * @param pKeyData - key image
+ * @param pSession - key session state
+ * @param offset - memory offset
+ * @param buf - output buffer
+ * @param length - bytes to read
+ */
+void KeyMemoryRead (PCKEYDATA pKeyData, PKEYSESSION pSession, uint16_t offset, void *buf, uint16_t length) {
+        uint8_t *p = (uint8_t *)buf;
+
+    while ( length > 0 ) {
+        if ( offset >= KEY_MEMORY_SIZE ) {
+            memset (p, 0, length);
+            return;
+        }
+        uint16_t page = offset / KEY_PAGE_SIZE;
+        uint16_t n = KEY_PAGE_SIZE - offset % KEY_PAGE_SIZE;
+        if ( n > KEY_MEMORY_SIZE - offset ) {
+            n = KEY_MEMORY_SIZE - offset;
+        }
+        if ( n > length ) {
+            n = length;
+        }
+        if ( pSession->pages [page] != NULL ) {
+            memcpy (p, pSession->pages [page] + offset % KEY_PAGE_SIZE, n);
+        } else {
+            memcpy (p, pKeyData->memory + offset, n);
+        }
+        p += n; offset += n; length -= n;
+    }
+}
+
+/**
+ * Write key memory of session. Memory page is copied from key image on 
+ * the first write which changes it.
+ * 
+ * @param pKeyData - key image
+ * @param pSession - key session state
+ * @param offset - memory offset
+ * @param buf - data to write
+ * @param length - bytes to write
+ * @return - 0 in case of success or errno code
+ */
+int KeyMemoryWrite (PCKEYDATA pKeyData, PKEYSESSION pSession, uint16_t offset, const void *buf, uint16_t length) {
+        const uint8_t *p = (const uint8_t *)buf;
+
+    if ( offset >= KEY_MEMORY_SIZE || length > KEY_MEMORY_SIZE - offset ) {
+        return EINVAL;
+    }
+    while ( length > 0 ) {
+        uint16_t page = offset / KEY_PAGE_SIZE;
+        uint16_t n = KEY_PAGE_SIZE - offset % KEY_PAGE_SIZE;
+        if ( n > length ) {
+            n = length;
+        }
+        if ( pSession->pages [page] == NULL ) {
+            if ( !memcmp (pKeyData->memory + offset, p, n) ) {
+                p += n; offset += n; length -= n;
+                continue;                           // nothing is changed
+            }
+            uint16_t pageStart = page * KEY_PAGE_SIZE;
+            uint16_t pageSize = KEY_MEMORY_SIZE - pageStart < KEY_PAGE_SIZE ? KEY_MEMORY_SIZE - pageStart : KEY_PAGE_SIZE;
+            pSession->pages [page] = malloc (KEY_PAGE_SIZE);
+            if ( pSession->pages [page] == NULL ) {
+                return ENOMEM;
+            }
+            memcpy (pSession->pages [page], pKeyData->memory + pageStart, pageSize);
+        }
+        memcpy (pSession->pages [page] + offset % KEY_PAGE_SIZE, p, n);
+        p += n; offset += n; length -= n;
+    }
+    return 0;
+}
+
+static int CompareFeature (const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int CompareFile (const void *a, const void *b) {
+
+    return (int)*(const uint16_t *)a - (int)((const KEY_SRM_FILE *)b)->id;
+}
+
+/**
+ * Find feature of SRM key
+ * 
+ * @param pKeyData - key image
+ * @param feature - feature id
+ * @return - true if key has the feature
+ */
+static bool KeyFeatureFind (PCKEYDATA pKeyData, uint32_t feature) {
+    
+    return pKeyData->pSrm != NULL &&
+           bsearch (&feature, pKeyData->pSrm->features, pKeyData->pSrm->numFeatures, sizeof(uint32_t), CompareFeature) != NULL;
+}
+
+/**
+ * Find file of SRM key FAT
+ * 
+ * @param pKeyData - key image
+ * @param file - file id
+ * @return - FAT entry or NULL
+ */
+static PKEY_SRM_FILE KeyFileFind (PCKEYDATA pKeyData, uint16_t file) {
+    
+    if ( pKeyData->pSrm == NULL ) {
+        return NULL;
+    }
+    return bsearch (&file, pKeyData->pSrm->files, pKeyData->pSrm->numFiles, sizeof(KEY_SRM_FILE), CompareFile);
+}
+
+/**
+ * Find feature among features logged in by session
+ * 
+ * @param pSession - key session state
+ * @param feature - feature id
+ * @return - index in logins or -1
+ */
+static int KeyLoginFind (PKEYSESSION pSession, uint32_t feature) {
+    
+    for ( int i = 0; i < pSession->numLogins; i++ ) {
+        if ( pSession->logins [i] == feature ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Host time the key clock runs from. Caller caches it once per loop
+ * iteration, else coarse clock is read, which vDSO serves without syscall.
+ * 
+ * @param pSession - key session state
+ * @return - seconds since 1970
+ */
+static int64_t KeyHostTime (PKEYSESSION pSession) {
+        struct timespec ts;
+    
+    if ( pSession->hostClock != NULL ) {
+        int64_t now = atomic_load_explicit (pSession->hostClock, memory_order_relaxed);
+        if ( now ) {
+            return now;
+        }
+    }
+    clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Set key clock to the time given by PREPARE_CHANGE_TIME and
+ * COMPLETE_WRITE_TIME. Clock is changed by single store of the offset,
+ * time read between the two requests is the old one.
+ * 
+ * @param pSession - key session state
+ * @param month - month, 1...12
+ * @param year - year of century, 0...99
+ * @return - 0 in case of success or EINVAL
+ */
+static int KeySetTime (PKEYSESSION pSession, uint8_t month, uint8_t year) {
+        struct tm tm;
+    
+    memset (&tm, 0, sizeof(tm));
+    tm.tm_sec = pSession->timeSet [0];
+    tm.tm_min = pSession->timeSet [1];
+    tm.tm_hour = pSession->timeSet [2];
+    tm.tm_mday = pSession->timeSet [3];
+    tm.tm_mon = month-1;
+    tm.tm_year = year+100;
+    time_t t = timegm (&tm);                        // normalizes tm, e.g. February 30
+    if ( year > 99 || tm.tm_sec != pSession->timeSet [0] || tm.tm_min != pSession->timeSet [1] ||
+         tm.tm_hour != pSession->timeSet [2] || tm.tm_mday != pSession->timeSet [3] || tm.tm_mon != month-1 ) {
+        return EINVAL;
+    }
+    pSession->timeOffset = (int64_t)t - KeyHostTime (pSession);
+    if ( pSession->timeHook != NULL ) {
+        pSession->timeHook (pSession->timeContext, pSession);
+    }
+    return 0;
+}
+
 //
 // Borrowed from vusbsrm project for KEY_FN_READ_STRUCT request processing
 //
@@ -141,24 +471,38 @@ static const uint8_t FuncA1_Val3 [] = { 0x00, 0x01, 0xCC, 0x00, 0x00, 0x00, 0x00
  * Emulation of key main procedure (IOCTL_INTERNAL_USB_SUBMIT_URB handler)
  * 
  * @param pKeyData - ptr to key data
+ * @param pSession - ptr to key session state
  * @param request - ptr to request buffer
  * @param outBufLen - ptr to out buffer size variable
  * @param outBuf - ptr to out buffer
  */
-void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PKEY_RESPONSE outBuf) {
+void EmulateKey(PCKEYDATA pKeyData, PKEYSESSION pSession, PKEY_REQUEST request, uint32_t *outBufLen, PKEY_RESPONSE outBuf) {
         uint8_t encodeOutData, status, encodedStatus;
         uint32_t outDataLen;
         KEY_RESPONSE    keyResponse;
-        struct timeval  tv;
+        KEY_INFO        keyInfo;
     
-    gettimeofday(&tv,NULL);
+    if ( pSession->keyEpoch != pKeyData->sessionEpoch ) {
+                                                    // Key image has been replaced by incompatible one
+        pSession->isKeyOpened = 0;
+        pSession->blockFn = 0;                      // block may be out of memory of new image
+        pSession->numLogins = 0;
+        pSession->timePrepared = 0;
+        pSession->answerReady = 0;
+        pSession->keyEpoch = pKeyData->sessionEpoch;
+    }
+    if ( pSession->memoryHash != pKeyData->memoryHash ) {
+                                                    // Data of key file has been changed
+        KeySessionFree (pSession);
+        pSession->memoryHash = pKeyData->memoryHash;
+    }
     memset (&keyResponse, 0, sizeof(keyResponse));
     keyResponse.status = KEY_OPERATION_STATUS_ERROR;
     outDataLen = 0; encodeOutData = 0;
     switch (request->majorFnCode) {                 // HASP functions
     case KEY_FN_ECHO_REQUEST:
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_ECHO_REQUEST 0x%0hhx\n",request->majorFnCode);
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_ECHO_REQUEST 0x%0hhx\n",request->majorFnCode);
 #endif        
         keyResponse.status = KEY_OPERATION_STATUS_OK;
         keyResponse.data [2] = 0x00;
@@ -167,14 +511,19 @@ void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PK
         return;        
     case KEY_FN_SET_CHIPER_KEYS:
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_SET_CHIPER_KEYS\n");
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_SET_CHIPER_KEYS\n");
 #endif        
-        pKeyData->chiperKey1 = request->param1;
-        pKeyData->chiperKey2 = 0xA0CB;
-        pKeyData->encodedStatus = pKeyData->netMemory[0]+pKeyData->netMemory[1]+
+        pSession->chiperKey1 = request->param1;
+        pSession->chiperKey2 = 0xA0CB;
+        KeyRandomInit (pSession, request->param1);
+        pSession->encodedStatus = pKeyData->netMemory[0]+pKeyData->netMemory[1]+
                                 pKeyData->netMemory[2]+pKeyData->netMemory[3];
                                                     // Setup random encoded status begin value
-        pKeyData->isInitDone = 1;
+        pSession->isInitDone = 1;
+        pSession->blockFn = 0;
+        pSession->numLogins = 0;
+        pSession->timePrepared = 0;
+        pSession->answerReady = 0;
         keyResponse.status = KEY_OPERATION_STATUS_OK;// Make key response
         keyResponse.data [0] = 0x02;                // Time hasp or usual hasp
         if ( (pKeyData->netMemory [4] == 3) || (pKeyData->netMemory [4] == 5) ) {
@@ -192,13 +541,13 @@ void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PK
         encodeOutData = 1;                    
         break;
     case KEY_FN_CHECK_PASS:                         // Decode pass
-        Chiper(&request->param1, 4, pKeyData);
+        Chiper(&request->param1, 4, pKeyData, pSession);
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_CHECK_PASS pass=0x%08X, pKeyData->password=0x%X, pKeyData->isInitDone=0x%hhX\n",
-            *((uint32_t *)&request->param1), pKeyData->password, pKeyData->isInitDone);
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_CHECK_PASS pass=0x%08X, pKeyData->password=0x%X, pSession->isInitDone=0x%hhX\n",
+            *((uint32_t *)&request->param1), pKeyData->password, pSession->isInitDone);
 #endif                
                                                     // Compare pass
-        if (*((uint32_t *)&request->param1) == pKeyData->password && pKeyData->isInitDone == 1 ) {
+        if (*((uint32_t *)&request->param1) == pKeyData->password && pSession->isInitDone == 1 ) {
             keyResponse.status = KEY_OPERATION_STATUS_OK;
                                                     // data[0], data[1] - memory size
             keyResponse.data [0] = (uint8_t)((GetMemorySize(pKeyData)) & 0xFF);
@@ -206,13 +555,13 @@ void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PK
             keyResponse.data [2] = 0x10;
             outDataLen = 3;
             encodeOutData = 1;
-            pKeyData->isKeyOpened = 1;              // FN_OPEN_KEY
+            pSession->isKeyOpened = 1;              // FN_OPEN_KEY
         }
         break;
     case KEY_FN_READ_NETMEMORY_3WORDS:
-        Chiper(&request->param1, 2, pKeyData);
+        Chiper(&request->param1, 2, pKeyData, pSession);
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_READ_NETMEMORY_3WORDS, request->param1 - 0x%0hx\n", request->param1);
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_NETMEMORY_3WORDS, request->param1 - 0x%0hx\n", request->param1);
 #endif        
         // Typical data in NetMemory:
         // 12 1A 12 0F 03 00 70 00 02 FF 00 00 FF FF FF FF
@@ -225,46 +574,120 @@ void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PK
         // FF - key type (FF - local, FE - net, FD - time)
         // FF - ?
         // Analyse memory offset
-        if ( pKeyData->isKeyOpened && request->param1 >= 0 && request->param1 <= 7 ) {
+        if ( pSession->isKeyOpened && request->param1 >= 0 && request->param1 <= 7 ) {
             keyResponse.status = KEY_OPERATION_STATUS_OK;
-            memcpy (keyResponse.data, &pKeyData->netMemory[request->param1*2], sizeof(uint16_t)*3);
+            uint16_t n = sizeof(pKeyData->netMemory) - request->param1*2;
+            if ( n > sizeof(uint16_t)*3 ) {
+                n = sizeof(uint16_t)*3;
+            }
+            memcpy (keyResponse.data, &pKeyData->netMemory[request->param1*2], n);
+                                                    // last words are followed by key memory
+            KeyMemoryRead (pKeyData, pSession, 0, keyResponse.data+n, sizeof(uint16_t)*3-n);
             outDataLen = sizeof(uint16_t)*3;
             encodeOutData = 1;
         }
         break;
     case KEY_FN_READ_3WORDS:                        // Do read
-        Chiper(&request->param1, 2, pKeyData);
+        Chiper(&request->param1, 2, pKeyData, pSession);
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_READ_3WORDS, request->param1 - 0x%0hx\n", request->param1);
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_3WORDS, request->param1 - 0x%0hx\n", request->param1);
 #endif        
-        if ( pKeyData->isKeyOpened && request->param1>=0 && (request->param1*2)<GetMemorySize(pKeyData) ) {
+        if ( pSession->isKeyOpened && request->param1>=0 && (request->param1*2)<GetMemorySize(pKeyData) ) {
             keyResponse.status = KEY_OPERATION_STATUS_OK;
-            memcpy (keyResponse.data, &pKeyData->memory[request->param1*2], sizeof(uint16_t)*3);
+            KeyMemoryRead (pKeyData, pSession, request->param1*2, keyResponse.data, sizeof(uint16_t)*3);
             outDataLen = sizeof(uint16_t)*3;
             encodeOutData = 1;
         }
         break;
     case KEY_FN_WRITE_WORD:                         // Do write
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_WRITE_WORD\n");
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_WRITE_WORD\n");
 #endif        
         // Decode memory offset & value
-        Chiper(&request->param1, 4, pKeyData);
+        Chiper(&request->param1, 4, pKeyData, pSession);
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "offset=0x%hX data=0x%hX\n", request->param1, request->param2);
+        KeyLog (pKeyData, LOG_DEBUG, "offset=0x%hX data=0x%hX\n", request->param1, request->param2);
 #endif        
-        if ( pKeyData->isKeyOpened && request->param1>=0 && (request->param1*2)<GetMemorySize(pKeyData) ) {
+        if ( pSession->isKeyOpened && request->param1>=0 && (request->param1*2)<GetMemorySize(pKeyData) &&
+             !KeyMemoryWrite (pKeyData, pSession, request->param1*2, &request->param2, sizeof(uint16_t)) ) {
             keyResponse.status = KEY_OPERATION_STATUS_OK;
-            memcpy (&pKeyData->memory[request->param1*2], &request->param2, sizeof(uint16_t));
+            if ( pSession->writeHook != NULL ) {
+                pSession->writeHook (pSession->writeContext, pKeyData, pSession, request->param1*2, sizeof(uint16_t));
+            }
             outDataLen = 0;
             encodeOutData = 0;
         }
         break;
+    case KEY_FN_READ_26:                            // Start block read
+    case KEY_FN_WRITE_27:                           // Start block write
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_%s_%02X offset=0x%hX words=0x%hX\n", request->majorFnCode == KEY_FN_READ_26 ? "READ" : "WRITE",
+             request->majorFnCode, request->param1, request->param2);
+#endif        
+        pSession->blockFn = 0;                      // previous block transfer is over
+        if ( pSession->isKeyOpened ) {              // param1 - word offset, param2 - words
+            if ( request->param2 == 0 || request->param1*2 >= GetMemorySize(pKeyData) ||
+                 request->param2*2 > GetMemorySize(pKeyData) - request->param1*2 ) {
+                keyResponse.status = KEY_OPERATION_STATUS_INVALID_MEMORY_ADDRESS;
+            } else {
+                keyResponse.status = KEY_OPERATION_STATUS_OK;
+                pSession->blockOffset = request->param1*2;
+                pSession->blockEnd = pSession->blockOffset + request->param2*2;
+                pSession->blockFn = request->majorFnCode;
+            }
+        }
+        break;
+    case KEY_FN_READ_A6:                            // Next bytes of block read, as many as fit
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_A6 offset=0x%hX end=0x%hX\n", pSession->blockOffset, pSession->blockEnd);
+#endif        
+        if ( pSession->isKeyOpened && pSession->blockFn == KEY_FN_READ_26 ) {
+            uint32_t n = pSession->blockEnd - pSession->blockOffset;
+            uint32_t room = *outBufLen > sizeof(uint16_t) ? *outBufLen - sizeof(uint16_t) : 0;
+            if ( n > room ) {
+                n = room;
+            }
+            if ( n > sizeof(keyResponse.data) ) {
+                n = sizeof(keyResponse.data);
+            }
+            keyResponse.status = KEY_OPERATION_STATUS_OK;
+            KeyMemoryRead (pKeyData, pSession, pSession->blockOffset, keyResponse.data, (uint16_t)n);
+            pSession->blockOffset += n;
+            if ( pSession->blockOffset == pSession->blockEnd ) {
+                pSession->blockFn = 0;
+            }
+            outDataLen = n;
+            encodeOutData = 1;
+        }
+        break;
+    case KEY_FN_WRITE_A7:                           // Next 4 bytes of block write
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_WRITE_A7 offset=0x%hX end=0x%hX\n", pSession->blockOffset, pSession->blockEnd);
+#endif        
+        if ( pSession->isKeyOpened && pSession->blockFn == KEY_FN_WRITE_27 ) {
+            uint16_t n = pSession->blockEnd - pSession->blockOffset;
+            if ( n > sizeof(uint16_t)*2 ) {
+                n = sizeof(uint16_t)*2;
+            }
+            if ( !KeyMemoryWrite (pKeyData, pSession, pSession->blockOffset, &request->param1, n) ) {
+                keyResponse.status = KEY_OPERATION_STATUS_OK;
+                if ( pSession->writeHook != NULL ) {
+                    pSession->writeHook (pSession->writeContext, pKeyData, pSession, pSession->blockOffset, n);
+                }
+                pSession->blockOffset += n;
+                if ( pSession->blockOffset == pSession->blockEnd ) {
+                    pSession->blockFn = 0;
+                }
+            }
+        }
+        break;
     case KEY_FN_READ_ST:                            // Do read ST
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_READ_ST\n");
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_ST\n");
 #endif        
-        if ( pKeyData->isKeyOpened ) {
+        if ( pSession->isKeyOpened ) {
             int32_t i;
             keyResponse.status = KEY_OPERATION_STATUS_OK;
             for ( i = 7; i >= 0; i-- ) 
@@ -274,22 +697,161 @@ void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PK
         }
         break;
     case KEY_FN_HASH_DWORD:                         // Do hash dword
-        Chiper(&request->param1, 4, pKeyData);
+        Chiper(&request->param1, 4, pKeyData, pSession);
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_HASH_DWORD\n");
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_HASH_DWORD\n");
 #endif        
-        if ( pKeyData->isKeyOpened ) {
+        if ( pSession->isKeyOpened ) {
             keyResponse.status = KEY_OPERATION_STATUS_OK;
             memcpy (keyResponse.data, &request->param1, 4);
-            Transform ((uint32_t *)keyResponse.data, (KEY_INFO *)pKeyData->edStruct);
+                                                    // Transform state is scratch, keep key image intact
+            memcpy (&keyInfo, pKeyData->edStruct, sizeof(keyInfo));
+            PROBE0 (transform__entry);
+            Transform ((uint32_t *)keyResponse.data, &keyInfo);
+            PROBE0 (transform__return);
+            outDataLen = sizeof(uint32_t);
+            encodeOutData = 1;
+        }
+        break;
+    case KEY_FN_QUESTION:                           // Question, its answer is computed at once
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_QUESTION\n");
+#endif        
+        pSession->answerReady = 0;
+        if ( pSession->isKeyOpened ) {
+            pSession->answer = request->param1 | (uint32_t)request->param2 << 16;
+            KeyHashDword (pKeyData, &pSession->answer);
+            pSession->answerReady = 1;
+            keyResponse.status = KEY_OPERATION_STATUS_OK;
+        }
+        break;
+    case KEY_FN_ANSWER:                             // Answer prepared by QUESTION
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_ANSWER\n");
+#endif        
+        if ( pSession->isKeyOpened && pSession->answerReady ) {
+            keyResponse.status = KEY_OPERATION_STATUS_OK;
+            memcpy (keyResponse.data, &pSession->answer, sizeof(uint32_t));
             outDataLen = sizeof(uint32_t);
             encodeOutData = 1;
+            pSession->answerReady = 0;
+        }
+        break;
+    case KEY_FN_GET_TIME:                           // Read key clock
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_GET_TIME\n");
+#endif        
+        if ( pSession->isKeyOpened ) {
+            time_t now = KeyHostTime (pSession) + pSession->timeOffset;
+            struct tm tm;
+            if ( gmtime_r (&now, &tm) != NULL ) {
+                keyResponse.status = KEY_OPERATION_STATUS_OK;
+                keyResponse.data [0] = tm.tm_sec;
+                keyResponse.data [1] = tm.tm_min;
+                keyResponse.data [2] = tm.tm_hour;
+                keyResponse.data [3] = tm.tm_mday;
+                keyResponse.data [4] = tm.tm_mon+1;
+                keyResponse.data [5] = tm.tm_year%100;
+                outDataLen = 6;
+                encodeOutData = 1;
+            }
+        }
+        break;
+    case KEY_FN_READ_DATE_TIME:                     // Read key clock as seconds
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_DATE_TIME\n");
+#endif        
+        if ( pSession->isKeyOpened ) {
+            uint32_t now = (uint32_t)(KeyHostTime (pSession) + pSession->timeOffset);
+            keyResponse.status = KEY_OPERATION_STATUS_OK;
+            memcpy (keyResponse.data, &now, sizeof(now));
+            outDataLen = sizeof(now);
+            encodeOutData = 1;
+        }
+        break;
+    case KEY_FN_PREPARE_CHANGE_TIME:                // First half of clock write
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_PREPARE_CHANGE_TIME 0x%04hX 0x%04hX\n", request->param1, request->param2);
+#endif        
+        pSession->timePrepared = 0;
+        if ( pSession->isKeyOpened ) {
+            pSession->timeSet [0] = request->param1 & 0xFF;
+            pSession->timeSet [1] = request->param1 >> 8;
+            pSession->timeSet [2] = request->param2 & 0xFF;
+            pSession->timeSet [3] = request->param2 >> 8;
+            pSession->timePrepared = 1;
+            keyResponse.status = KEY_OPERATION_STATUS_OK;
+        }
+        break;
+    case KEY_FN_COMPLETE_WRITE_TIME:                // Second half of clock write, clock is set
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_COMPLETE_WRITE_TIME 0x%04hX\n", request->param1);
+#endif        
+        if ( pSession->isKeyOpened && pSession->timePrepared &&
+             !KeySetTime (pSession, request->param1 & 0xFF, request->param1 >> 8) ) {
+            keyResponse.status = KEY_OPERATION_STATUS_OK;
+        }
+        pSession->timePrepared = 0;
+        break;
+    case KEY_FN_LOGIN:                              // Log in to feature
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_LOGIN feature=0x%hX%04hX\n", request->param2, request->param1);
+#endif        
+        if ( pSession->isKeyOpened ) {
+            uint32_t feature = request->param1 | (uint32_t)request->param2 << 16;
+            if ( KeyFeatureFind (pKeyData, feature) &&
+                 (KeyLoginFind (pSession, feature) >= 0 || pSession->numLogins < KEY_MAX_LOGINS) ) {
+                if ( KeyLoginFind (pSession, feature) < 0 ) {
+                    pSession->logins [pSession->numLogins++] = feature;
+                }
+                keyResponse.status = KEY_OPERATION_STATUS_OK;
+            }
+        }
+        break;
+    case KEY_FN_LOGOUT:                             // Log out of feature
+        Chiper(&request->param1, 4, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_LOGOUT feature=0x%hX%04hX\n", request->param2, request->param1);
+#endif        
+        if ( pSession->isKeyOpened ) {
+            int i = KeyLoginFind (pSession, request->param1 | (uint32_t)request->param2 << 16);
+            if ( i >= 0 ) {
+                pSession->logins [i] = pSession->logins [--pSession->numLogins];
+                keyResponse.status = KEY_OPERATION_STATUS_OK;
+            }
+        }
+        break;
+    case KEY_FN_READ_FAT:                           // Where file is in key memory
+        Chiper(&request->param1, 2, pKeyData, pSession);
+#ifdef DEBUG        
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_FAT file=0x%hX\n", request->param1);
+#endif        
+        if ( pSession->isKeyOpened ) {
+            PKEY_SRM_FILE pFile = KeyFileFind (pKeyData, request->param1);
+            if ( pFile != NULL && KeyLoginFind (pSession, pFile->feature) >= 0 ) {
+                keyResponse.status = KEY_OPERATION_STATUS_OK;
+                memcpy (keyResponse.data, &pFile->offset, sizeof(uint16_t));
+                memcpy (keyResponse.data+sizeof(uint16_t), &pFile->size, sizeof(uint16_t));
+                outDataLen = sizeof(uint16_t)*2;
+                encodeOutData = 1;
+            }
         }
         break;
     case KEY_FN_READ_STRUCT:
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "KEY_FN_READ_STRUCT, request->param1 - 0x%0hx\n", request->param1);
+        KeyLog (pKeyData, LOG_DEBUG, "KEY_FN_READ_STRUCT, request->param1 - 0x%0hx\n", request->param1);
 #endif        
+        if ( pKeyData->pSrm != NULL && request->param1 < KEY_SRM_STRUCTS && pKeyData->pSrm->structSize [request->param1] ) {
+                                                    // table of key file
+            *outBufLen = pKeyData->pSrm->structSize [request->param1] < *outBufLen ?
+                         pKeyData->pSrm->structSize [request->param1] : *outBufLen;
+            memcpy (outBuf, pKeyData->pSrm->structs [request->param1], *outBufLen);
+            return;
+        }
         switch(request->param1) {
         case 0:
             memcpy (&keyResponse.data, &FuncA1_Val0[0], 3);
@@ -319,42 +881,42 @@ void EmulateKey(PKEYDATA pKeyData, PKEY_REQUEST request, uint32_t *outBufLen, PK
         return;
     default:
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "UNKOWN KEY_FN\n");
+        KeyLog (pKeyData, LOG_DEBUG, "UNKOWN KEY_FN\n");
 #endif        
         break;
     }
 #ifdef DEBUG    
-    syslog (LOG_DEBUG, "Create encodedStatus\n");
+    KeyLog (pKeyData, LOG_DEBUG, "Create encodedStatus\n");
 #endif    
                                                     // Randomize encodedStatus
-    pKeyData->encodedStatus ^= tv.tv_usec & 0xFFFF;
+    pSession->encodedStatus ^= (uint8_t)KeyRandom (pSession);
     // If status in range KEY_OPERATION_STATUS_OK...KEY_OPERATION_STATUS_LAST
     if ( keyResponse.status >= KEY_OPERATION_STATUS_OK && keyResponse.status <= KEY_OPERATION_STATUS_LAST ) {
             // Then create encoded status
         do {
-            keyResponse.encodedStatus=++pKeyData->encodedStatus;
+            keyResponse.encodedStatus=++pSession->encodedStatus;
         } while (CheckEncodedStatus ((uint8_t)(request->majorFnCode&0x7F), 0x02, (uint8_t *)&keyResponse.status)==0);
     }
     status = keyResponse.status;                    // Store encoded status
     encodedStatus = keyResponse.encodedStatus;
 #ifdef DEBUG    
-    syslog (LOG_DEBUG, "Encoded status: %hhX\n", encodedStatus);
+    KeyLog (pKeyData, LOG_DEBUG, "Encoded status: %hhX\n", encodedStatus);
 #endif    
-    Chiper (&keyResponse.status, 2, pKeyData);      // Crypt status & encoded status 
+    Chiper (&keyResponse.status, 2, pKeyData, pSession);      // Crypt status & encoded status 
     if ( encodeOutData ) {                          // Crypt output data
-        Chiper (&keyResponse.data, outDataLen, pKeyData);
+        Chiper (&keyResponse.data, outDataLen, pKeyData, pSession);
     }
     if ( status == 0 ) {                            // Shuffle encoding keys + Ching
-        pKeyData->chiperKey2 = (pKeyData->chiperKey2 & 0xFF) | (encodedStatus << 8);
+        pSession->chiperKey2 = (pSession->chiperKey2 & 0xFF) | (encodedStatus << 8);
 #ifdef DEBUG        
-        syslog (LOG_DEBUG, "Shuffle keys: chiperKey1=%hX, chiperKey2=%hX,\n",
-                    pKeyData->chiperKey1, pKeyData->chiperKey2);
+        KeyLog (pKeyData, LOG_DEBUG, "Shuffle keys: chiperKey1=%hX, chiperKey2=%hX,\n",
+                    pSession->chiperKey1, pSession->chiperKey2);
 #endif        
     }
                                                     // Set out data size
     *outBufLen = (sizeof(uint16_t) + outDataLen) < *outBufLen ? sizeof(uint16_t) + outDataLen : *outBufLen;
 #ifdef DEBUG    
-    syslog (LOG_DEBUG, "Out data size: %X\n", *outBufLen);
+    KeyLog (pKeyData, LOG_DEBUG, "Out data size: %X\n", *outBufLen);
 #endif    
     memcpy (outBuf, &keyResponse, *outBufLen);      // Copy data into output buffer
 }
@@ -35,11 +35,26 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
-	${OBJECTDIR}/EncDecSim.o \
-	${OBJECTDIR}/LoadKey.o \
+	${OBJECTDIR}/Control.o \
+	${OBJECTDIR}/Handoff.o \
+	${OBJECTDIR}/Journal.o \
+	${OBJECTDIR}/KeyFile.o \
+	${OBJECTDIR}/KeyReload.o \
+	${OBJECTDIR}/Latency.o \
+	${OBJECTDIR}/Log.o \
+	${OBJECTDIR}/NetKey.o \
+	${OBJECTDIR}/PortState.o \
+	${OBJECTDIR}/RawGadget.o \
+	${OBJECTDIR}/Rcu.o \
+	${OBJECTDIR}/Realtime.o \
+	${OBJECTDIR}/Rtc.o \
+	${OBJECTDIR}/Sched.o \
+	${OBJECTDIR}/Seats.o \
+	${OBJECTDIR}/ShmKey.o \
+	${OBJECTDIR}/Stats.o \
+	${OBJECTDIR}/Trace.o \
 	${OBJECTDIR}/USBDevice.o \
-	${OBJECTDIR}/USBHasp.o \
-	${OBJECTDIR}/USBKeyEmu.o
+	${OBJECTDIR}/USBHasp.o
 
 
 # C Compiler Flags
@@ -56,25 +71,108 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=-L/usr/local/lib -ljansson -lusb_vhci -lpthread
+LDLIBSOPTIONS=-L/usr/local/lib dist/Release/libhaspemu.a -ljansson -lusb_vhci -lpthread -lrt
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
 	"${MAKE}"  -f nbproject/Makefile-${CND_CONF}.mk ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/usbhasp
 
+${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/usbhasp: dist/Release/libhaspemu.a
+
 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/usbhasp: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
 	${LINK.c} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/usbhasp ${OBJECTFILES} ${LDLIBSOPTIONS} -s
 
-${OBJECTDIR}/EncDecSim.o: EncDecSim.c
+${OBJECTDIR}/Control.o: Control.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Control.o Control.c
+
+${OBJECTDIR}/Handoff.o: Handoff.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Handoff.o Handoff.c
+
+
+${OBJECTDIR}/Journal.o: Journal.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Journal.o Journal.c
+
+${OBJECTDIR}/KeyFile.o: KeyFile.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/KeyFile.o KeyFile.c
+
+${OBJECTDIR}/KeyReload.o: KeyReload.c
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/EncDecSim.o EncDecSim.c
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/KeyReload.o KeyReload.c
 
-${OBJECTDIR}/LoadKey.o: LoadKey.c
+${OBJECTDIR}/Latency.o: Latency.c
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/LoadKey.o LoadKey.c
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Latency.o Latency.c
+
+${OBJECTDIR}/Log.o: Log.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Log.o Log.c
+
+${OBJECTDIR}/NetKey.o: NetKey.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/NetKey.o NetKey.c
+
+${OBJECTDIR}/PortState.o: PortState.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/PortState.o PortState.c
+
+${OBJECTDIR}/RawGadget.o: RawGadget.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/RawGadget.o RawGadget.c
+
+${OBJECTDIR}/Rcu.o: Rcu.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Rcu.o Rcu.c
+
+${OBJECTDIR}/Realtime.o: Realtime.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Realtime.o Realtime.c
+
+${OBJECTDIR}/Rtc.o: Rtc.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Rtc.o Rtc.c
+
+${OBJECTDIR}/Sched.o: Sched.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Sched.o Sched.c
+
+${OBJECTDIR}/Seats.o: Seats.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Seats.o Seats.c
+
+${OBJECTDIR}/ShmKey.o: ShmKey.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ShmKey.o ShmKey.c
+
+${OBJECTDIR}/Stats.o: Stats.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Stats.o Stats.c
+
+${OBJECTDIR}/Trace.o: Trace.c
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Trace.o Trace.c
 
 ${OBJECTDIR}/USBDevice.o: USBDevice.c
 	${MKDIR} -p ${OBJECTDIR}
@@ -86,11 +184,6 @@ ${OBJECTDIR}/USBHasp.o: USBHasp.c
 	${RM} "$@.d"
 	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/USBHasp.o USBHasp.c
 
-${OBJECTDIR}/USBKeyEmu.o: USBKeyEmu.c
-	${MKDIR} -p ${OBJECTDIR}
-	${RM} "$@.d"
-	$(COMPILE.c) -O2 -s -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/USBKeyEmu.o USBKeyEmu.c
-
 # Subprojects
 .build-subprojects:
 